@@ -0,0 +1,26 @@
+##*****************************************************************************
+## $Id$
+##*****************************************************************************
+#  AUTHOR:
+#   Mark Grondona <mgrondona@llnl.gov>
+#
+#  SYNOPSIS:
+#    AC_SYNC_BUILTINS
+#
+#  DESCRIPTION:
+#    Check whether the compiler provides the __sync atomic builtins
+#    (__sync_bool_compare_and_swap, __sync_add_and_fetch).
+##*****************************************************************************
+
+AC_DEFUN([AC_SYNC_BUILTINS],
+[AC_CACHE_CHECK([for __sync atomic builtins], ac_cv_sync_builtins,
+[
+  AC_LINK_IFELSE([AC_LANG_PROGRAM([[]], [[long x = 0; void *p = 0;
+   __sync_add_and_fetch (&x, 1);
+   return !__sync_bool_compare_and_swap (&p, (void *) 0, (void *) &x)]])],[ac_cv_sync_builtins=yes],[ac_cv_sync_builtins=no])
+])
+
+if test "$ac_cv_sync_builtins" = "yes"; then
+  AC_DEFINE([HAVE_SYNC_BUILTINS], [1], [Define if compiler has __sync atomic builtins])
+fi
+])
@@ -0,0 +1,45 @@
+##*****************************************************************************
+## $Id$
+##*****************************************************************************
+#  AUTHOR:
+#    Jim Garlick <garlick@llnl.gov>
+#
+#  SYNOPSIS:
+#    AC_ZLIB
+#
+#  DESCRIPTION:
+#    Adds support for --without-zlib. Compression of pdcp transfers
+#    (pdcp -G) is built if zlib is found. Exports ZLIB_LIBS if found.
+#
+#  WARNINGS:
+#    This macro must be placed after AC_PROG_CC or equivalent.
+##*****************************************************************************
+
+AC_DEFUN([AC_ZLIB],
+[
+  AC_MSG_CHECKING([for whether to include zlib compression support])
+  AC_ARG_WITH([zlib],
+    AS_HELP_STRING([--without-zlib],[do not compress pdcp transfers with zlib]),
+      [ case "$withval" in
+        yes) ac_with_zlib=yes ;;
+        no)  ac_with_zlib=no ;;
+        *)   AC_MSG_RESULT([doh!])
+             AC_MSG_ERROR([bad value "$withval" for --with-zlib]) ;;
+      esac
+    ]
+  )
+  AC_MSG_RESULT([${ac_with_zlib=yes}])
+  if test "$ac_with_zlib" = "yes"; then
+      AC_CHECK_HEADER([zlib.h], [], [ac_with_zlib=no])
+  fi
+  if test "$ac_with_zlib" = "yes"; then
+      savedLIBS="$LIBS"
+      AC_CHECK_LIB([z], [deflate], [ZLIB_LIBS="-lz"], [ac_with_zlib=no])
+      LIBS="$savedLIBS"
+  fi
+  if test "$ac_with_zlib" = "yes"; then
+      AC_DEFINE([HAVE_LIBZ], [1],
+                [Define if you are compiling with zlib.])
+  fi
+  AC_SUBST(ZLIB_LIBS)
+])
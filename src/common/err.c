@@ -45,6 +45,7 @@
 #include "xstring.h"
 #include "xmalloc.h"
 #include "macros.h"
+#include "err.h"
 
 static char *prog = NULL;
 static char *host = NULL;
@@ -54,6 +55,11 @@ static char *host = NULL;
  */
 static bool keep_host_domain = false;
 
+/*
+ * Optional function used to write stdout and stderr messages
+ */
+static err_output_f output_fn = NULL;
+
 /*
  * Call this before calling err() or errx().  Sets hostname and program name
  * for %H, %p, and %P.
@@ -76,6 +82,48 @@ void err_no_strip_domain ()
     keep_host_domain = true;
 }
 
+/*
+ * Hand formatted messages for stdout and stderr to `f' instead of
+ *  writing them with stdio. `f' takes ownership of the message buffer.
+ *  Pass NULL to go back to stdio.
+ */
+void err_set_output (err_output_f f)
+{
+    output_fn = f;
+}
+
+/*
+ * Return the length of `hostname' as it is printed by %S, i.e. without
+ *  the domain unless err_no_strip_domain() was called. Callers printing
+ *  many messages for the same host can compute this once.
+ */
+int err_hostname_len(const char *hostname)
+{
+    const char *q;
+
+    if (  !isdigit(*hostname)
+       && !keep_host_domain
+       && (q = strchr(hostname, '.')))
+        return (q - hostname);
+    return (strlen(hostname));
+}
+
+/*
+ * Write message `buf', allocated with Malloc(), to `stream' and free it.
+ *  This is the output path of err() and out(), available to callers
+ *  that format their own messages.
+ */
+void err_puts(FILE * stream, char *buf)
+{
+    if (output_fn && (stream == stdout || stream == stderr)) {
+        output_fn(stream, buf); /* takes ownership of buf */
+        return;
+    }
+
+    fputs(buf, stream);         /* print it */
+    Free((void **) &buf);       /* clean up */
+}
+
 /*
  * Free heap storage allocated by err_init()
  */
@@ -114,11 +162,9 @@ static void _verr(FILE * stream, char *format, va_list ap)
             if (*format == 's') {       /* %s - string */
                 xstrcat(&buf, va_arg(ap, char *));
             } else if (*format == 'S') {        /* %S - string, trunc */
-                snprintf(tmpstr, sizeof(tmpstr), "%s", va_arg(ap, char *));
-                if (  !isdigit(*tmpstr)
-                   && !keep_host_domain
-                   && (q = strchr(tmpstr, '.')))
-                    *q = '\0';
+                q = va_arg(ap, char *);
+                snprintf(tmpstr, sizeof(tmpstr), "%.*s",
+                         err_hostname_len(q), q);
                 xstrcat(&buf, tmpstr);
             } else if (*format == 'z') {        /* %z - same as %.3d */
                 snprintf(tmpstr, sizeof(tmpstr), "%.3d", va_arg(ap, int));
@@ -150,8 +196,8 @@ static void _verr(FILE * stream, char *format, va_list ap)
         format++;
     }
 
-    fputs(buf, stream);         /* print it */
-    Free((void **) &buf);       /* clean up */
+    if (buf != NULL)
+        err_puts(stream, buf);
 }
 
 void err(char *format, ...)
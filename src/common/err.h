@@ -30,12 +30,17 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+typedef void (*err_output_f) (FILE *, char *);
+
 void err_init(char *);
 void err_no_strip_domain();
 void err(char *, ...);
 void out(char *, ...);
 void errx(char *, ...);
 void errf(FILE *, char *, va_list);
+void err_set_output(err_output_f);
+int err_hostname_len(const char *);
+void err_puts(FILE *, char *);
 void err_cleanup(void);
 
 #endif
@@ -70,6 +70,21 @@ fd_set_nonblocking (int fd)
 }
 
 
+int
+fd_set_blocking (int fd)
+{
+    int fval;
+
+    assert (fd >= 0);
+
+    if ((fval = fcntl (fd, F_GETFL, 0)) < 0)
+        return (-1);
+    if (fcntl (fd, F_SETFL, fval & ~O_NONBLOCK) < 0)
+        return (-1);
+    return (0);
+}
+
+
 int
 fd_get_read_lock (int fd)
 {
@@ -49,6 +49,12 @@ int fd_set_nonblocking (int fd);
  *  Returns 0 on success, or -1 on error.
  */
 
+int fd_set_blocking (int fd);
+/*
+ *  Sets the file descriptor [fd] for blocking I/O.
+ *  Returns 0 on success, or -1 on error.
+ */
+
 int fd_get_read_lock (int fd);
 /*
  *  Obtain a read lock on the file specified by [fd].
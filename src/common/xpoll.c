@@ -66,7 +66,8 @@ _poll(struct xpollfd *xfds, unsigned int nfds, int timeout) {
             pfds[i].events |= POLLOUT;
     }
 
-    if ((rv = poll(pfds, nfds, timeout)) < 0) {
+    /* xpoll() timeout is in seconds, poll() in milliseconds */
+    if ((rv = poll(pfds, nfds, timeout > 0 ? timeout * 1000 : timeout)) < 0) {
         Free((void **)&pfds);
         return -1;
     }
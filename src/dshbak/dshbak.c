@@ -0,0 +1,979 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * dshbak - format output from pdsh
+ *
+ * Reads lines of the form "host: output" (from stdin or the files given
+ *  as arguments) in a single pass, and prints the output of each host
+ *  under a header naming the host, optionally coalescing hosts with
+ *  identical output (-c), or writes the output of each host to a file
+ *  in a directory (-d).
+ *
+ * Output is not stored per host. Each distinct sequence of lines is a
+ *  path in a tree of lines shared by all hosts, and a host only points
+ *  at the node for its last line. A new line from a host moves it to a
+ *  child node, found through a hash table keyed on the parent node and
+ *  the line contents. Hosts with identical output therefore end up on
+ *  the same node, so coalescing needs no comparisons, and memory grows
+ *  only with the amount of distinct output. Once more than DSHBAK_MEM_MAX
+ *  bytes of line data are held in memory, further lines are spilled to
+ *  an unlinked temporary file.
+ */
+
+#if     HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if	HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#if	HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "src/common/err.h"
+#include "src/common/xmalloc.h"
+#include "src/common/xstring.h"
+#include "src/common/macros.h"
+#include "src/common/list.h"
+
+#define DSHBAK_ARGS         "chfd:"
+#define DSHBAK_MEM_MAX      (64 * 1024 * 1024) /* line data kept in memory */
+#define DSHBAK_READ_SIZE    (64 * 1024)        /* input read size */
+#define DSHBAK_WRITERS      8                  /* -d writer threads */
+#define DSHBAK_MINHASH      1024               /* initial hash table size */
+
+#define DSHBAK_DIV          "----------------\n"
+
+#define FNV_OFFSET          ((uint64_t) 14695981039346656037ULL)
+#define FNV_PRIME           ((uint64_t) 1099511628211ULL)
+
+#define DSHBAK_USAGE "\
+Usage: %s [OPTION]...\n\
+ -h       Display this help message\n\
+ -c       Coalesce identical output from hosts\n\
+ -d DIR   Send output to files in DIR, one file per host\n\
+ -f       With -d, force creation of DIR\n"
+
+/*
+ *  One line of output: a node in the tree of distinct outputs.
+ */
+struct line {
+    struct line     *next;      /* hash chain                            */
+    struct line     *parent;    /* previous line of output, or NULL      */
+    uint64_t         hash;      /* hash of all output up to this line    */
+    int              depth;     /* number of lines up to this line       */
+    int              len;       /* length of line, including newline     */
+    off_t            offset;    /* offset in spill file, if spilled      */
+    void            *group;     /* -c: group of hosts ending on this line */
+    bool             spilled;   /* data is in spill file                 */
+    char             data[];    /* line data, unless spilled             */
+};
+
+struct host {
+    struct host     *next;      /* hash chain                            */
+    char            *tag;       /* hostname from input                   */
+    int              taglen;
+    uint64_t         hash;      /* hash of tag                           */
+    struct line     *last;      /* last line of output                   */
+};
+
+struct group {
+    struct group    *next;
+    struct line     *last;      /* output of this group                  */
+    List             tags;      /* hosts in this group                   */
+};
+
+/*
+ *  Per-thread buffers for printing output
+ */
+struct outbuf {
+    struct line    **lines;     /* lines of one output, first to last    */
+    int              nlines;
+    char            *buf;       /* buffer for reading spilled lines      */
+    int              size;
+};
+
+/*
+ *  Simple chained hash table with power-of-two number of buckets
+ */
+struct table {
+    void           **buckets;
+    int              size;
+    int              count;
+};
+
+static struct table hosts_table;
+static struct table lines_table;
+
+static int spill_fd = -1;           /* unlinked temporary file          */
+static off_t spill_offset = 0;      /* end of spill file                */
+static long mem_used = 0;           /* bytes of line data in memory     */
+
+static char *outdir = NULL;         /* -d DIR                           */
+static struct host **hosts = NULL;  /* hosts, sorted, for -d writers    */
+static int nhosts = 0;
+static int next_host = 0;           /* next host for -d writers         */
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t _hash (uint64_t hash, const char *data, int len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return (hash);
+}
+
+/*
+ *  Grow table `t' if needed. `hashf' returns the hash and `nextp' the
+ *   address of the next pointer of an entry.
+ */
+static void _table_grow (struct table *t, uint64_t (*hashf) (void *),
+                         void ** (*nextp) (void *))
+{
+    void **buckets;
+    int size, i;
+
+    if (t->count < t->size)
+        return;
+
+    size = t->size ? t->size * 2 : DSHBAK_MINHASH;
+    buckets = Malloc (size * sizeof (void *));
+    memset (buckets, 0, size * sizeof (void *));
+
+    for (i = 0; i < t->size; i++) {
+        void *e = t->buckets[i];
+        while (e) {
+            void *next = *nextp (e);
+            void **b = &buckets[hashf (e) & (size - 1)];
+            *nextp (e) = *b;
+            *b = e;
+            e = next;
+        }
+    }
+    if (t->buckets)
+        Free ((void **) &t->buckets);
+    t->buckets = buckets;
+    t->size = size;
+}
+
+static uint64_t _host_hash (void *e)
+{
+    return (((struct host *) e)->hash);
+}
+
+static void **_host_next (void *e)
+{
+    return ((void **) &((struct host *) e)->next);
+}
+
+static uint64_t _line_hash (void *e)
+{
+    return (((struct line *) e)->hash);
+}
+
+static void **_line_next (void *e)
+{
+    return ((void **) &((struct line *) e)->next);
+}
+
+static struct host *_host_lookup (const char *tag, int taglen)
+{
+    uint64_t hash = _hash (FNV_OFFSET, tag, taglen);
+    struct host *h;
+    void **b;
+
+    _table_grow (&hosts_table, _host_hash, _host_next);
+
+    b = &hosts_table.buckets[hash & (hosts_table.size - 1)];
+    for (h = *b; h; h = h->next) {
+        if ((h->hash == hash) && (h->taglen == taglen)
+            && (memcmp (h->tag, tag, taglen) == 0))
+            return (h);
+    }
+
+    h = Malloc (sizeof (*h));
+    h->tag = Malloc (taglen + 1);
+    memcpy (h->tag, tag, taglen);
+    h->tag[taglen] = '\0';
+    h->taglen = taglen;
+    h->hash = hash;
+    h->last = NULL;
+    h->next = *b;
+    *b = h;
+    hosts_table.count++;
+
+    return (h);
+}
+
+/*
+ *  Return data for line `l', reading it into `ob' if it was spilled.
+ */
+static char *_line_data (struct line *l, struct outbuf *ob)
+{
+    if (!l->spilled)
+        return (l->data);
+
+    if (l->len > ob->size) {
+        if (ob->buf)
+            Realloc ((void **) &ob->buf, l->len);
+        else
+            ob->buf = Malloc (l->len);
+        ob->size = l->len;
+    }
+    if (pread (spill_fd, ob->buf, l->len, l->offset) != l->len)
+        errx ("%P: Fatal: Failed to read temporary file: %m\n");
+    return (ob->buf);
+}
+
+static void _spill (struct line *l, const char *data)
+{
+    if (spill_fd < 0) {
+        FILE *fp = tmpfile ();
+        if (fp == NULL)
+            errx ("%P: Fatal: Failed to create temporary file: %m\n");
+        spill_fd = dup (fileno (fp));
+        fclose (fp);
+    }
+    if (pwrite (spill_fd, data, l->len, spill_offset) != l->len)
+        errx ("%P: Fatal: Failed to write temporary file: %m\n");
+    l->offset = spill_offset;
+    l->spilled = true;
+    spill_offset += l->len;
+}
+
+/*
+ *  Return the child of `parent' (the next line of output) for line
+ *   `data' of length `len', creating it if it does not exist.
+ */
+static struct line *_line_next_child (struct line *parent,
+                                      const char *data, int len)
+{
+    static struct outbuf ob = { NULL, 0, NULL, 0 };
+    uint64_t hash = _hash (parent ? parent->hash : FNV_OFFSET, data, len);
+    struct line *l;
+    void **b;
+
+    _table_grow (&lines_table, _line_hash, _line_next);
+
+    b = &lines_table.buckets[hash & (lines_table.size - 1)];
+    for (l = *b; l; l = l->next) {
+        if ((l->hash == hash) && (l->parent == parent) && (l->len == len)
+            && (memcmp (_line_data (l, &ob), data, len) == 0))
+            return (l);
+    }
+
+    if (mem_used + len > DSHBAK_MEM_MAX) {
+        l = Malloc (sizeof (*l));
+        l->len = len;
+        _spill (l, data);
+    }
+    else {
+        l = Malloc (sizeof (*l) + len);
+        l->len = len;
+        memcpy (l->data, data, len);
+        l->spilled = false;
+        mem_used += len;
+    }
+    l->parent = parent;
+    l->hash = hash;
+    l->depth = parent ? parent->depth + 1 : 1;
+    l->group = NULL;
+    l->next = *b;
+    *b = l;
+    lines_table.count++;
+
+    return (l);
+}
+
+/*
+ *  Process one line of input (including its newline). Lines that
+ *   are not of the form "host: output" are ignored.
+ */
+static void _process_line (const char *p, int len)
+{
+    const char *end = p + len;
+    const char *tag, *q;
+    int taglen;
+
+    while ((p < end) && isspace ((unsigned char) *p))
+        p++;
+    if (p == end)
+        return;
+
+    /*
+     *  The tag is the shortest run of non-space characters followed
+     *   by optional whitespace and a colon.
+     */
+    tag = p;
+    for (q = p + 1; q < end; q++) {
+        if (*q == ':')
+            break;
+        if (isspace ((unsigned char) *q)) {
+            taglen = q - tag;
+            while ((q < end) && isspace ((unsigned char) *q))
+                q++;
+            if ((q == end) || (*q != ':'))
+                return;
+            goto found;
+        }
+    }
+    if (q == end)
+        return;
+    taglen = q - tag;
+found:
+    q++;                        /* skip colon */
+    if ((q < end) && (*q == ' '))
+        q++;                    /* and one space */
+    if (q == end)
+        return;
+
+    {
+        struct host *h = _host_lookup (tag, taglen);
+        h->last = _line_next_child (h->last, q, end - q);
+    }
+}
+
+/*
+ *  Read all lines from `fd'. A final line without a newline is ignored.
+ */
+static void _process_input (int fd)
+{
+    char *buf = Malloc (DSHBAK_READ_SIZE);
+    int size = DSHBAK_READ_SIZE;
+    int used = 0;
+    int scanned = 0;
+    ssize_t n;
+
+    for (;;) {
+        char *p = buf, *nl;
+
+        if (used == size) {
+            size *= 2;
+            Realloc ((void **) &buf, size);
+        }
+        if ((n = read (fd, buf + used, size - used)) < 0) {
+            if (errno == EINTR)
+                continue;
+            errx ("%P: Fatal: read: %m\n");
+        }
+        if (n == 0)
+            break;
+        used += n;
+
+        while ((nl = memchr (p + scanned, '\n', used - (p - buf) - scanned))) {
+            _process_line (p, nl - p + 1);
+            p = nl + 1;
+            scanned = 0;
+        }
+        scanned = used - (p - buf);
+
+        /* move partial line to start of buffer */
+        if (p != buf) {
+            memmove (buf, p, used - (p - buf));
+            used -= p - buf;
+        }
+    }
+
+    Free ((void **) &buf);
+}
+
+/*
+ *  Write the output ending in line `last' to `fp'.
+ */
+static int _write_output (FILE *fp, struct line *last, struct outbuf *ob)
+{
+    struct line *l;
+    int i;
+
+    if (last->depth > ob->nlines) {
+        if (ob->lines)
+            Realloc ((void **) &ob->lines, last->depth * sizeof (l));
+        else
+            ob->lines = Malloc (last->depth * sizeof (l));
+        ob->nlines = last->depth;
+    }
+    for (l = last, i = last->depth - 1; l; l = l->parent, i--)
+        ob->lines[i] = l;
+
+    for (i = 0; i < last->depth; i++) {
+        l = ob->lines[i];
+        if (fwrite (_line_data (l, ob), 1, l->len, fp) != l->len)
+            return (-1);
+    }
+    return (0);
+}
+
+/*
+ *  Return trailing digits of `s' (of length `len') as in the perl
+ *   pattern /(\d*)$/, and their length in `np'.
+ */
+static const char *_trailing_digits (const char *s, int len, int *np)
+{
+    const char *p = s + len;
+
+    while ((p > s) && isdigit ((unsigned char) p[-1]))
+        p--;
+    *np = (s + len) - p;
+    return (p);
+}
+
+/*
+ *  Compare numeric values of digit strings `a' and `b'.
+ */
+static int _numcmp (const char *a, int alen, const char *b, int blen)
+{
+    int rc;
+
+    while ((alen > 0) && (*a == '0'))
+        a++, alen--;
+    while ((blen > 0) && (*b == '0'))
+        b++, blen--;
+    if (alen != blen)
+        return (alen - blen);
+    if ((rc = memcmp (a, b, alen)))
+        return (rc);
+    return (0);
+}
+
+/*
+ *  Order hostnames by the number in their last group of digits (with
+ *   no digits counting as 0), then alphabetically.
+ */
+static int _sortn (const char *a, const char *b)
+{
+    int alen, blen, rc;
+    const char *da = _trailing_digits (a, strlen (a), &alen);
+    const char *db = _trailing_digits (b, strlen (b), &blen);
+
+    if ((rc = _numcmp (da, alen, db, blen)))
+        return (rc);
+    return (strcmp (a, b));
+}
+
+static int _cmp_hosts (const void *x, const void *y)
+{
+    const struct host *h1 = *(struct host **) x;
+    const struct host *h2 = *(struct host **) y;
+
+    return (_sortn (h1->tag, h2->tag));
+}
+
+/*
+ *  Hosts for _compress(), with the trailing non-digit suffix split off
+ */
+struct cname {
+    char            *name;      /* hostname without suffix              */
+    int              len;
+    int              index;     /* position in sorted hostnames         */
+    int              suffix;    /* index of suffix                      */
+};
+
+/*
+ *  Range of numbers "lo" or "lo-hi" in _compress_suffix()
+ */
+struct range {
+    const char      *lo;        /* first number, as in hostname         */
+    int              lolen;
+    const char      *hi;        /* last number, or NULL if a singleton  */
+    int              hilen;
+};
+
+/*
+ *  One prefix (hostname without trailing digits) in _compress_suffix()
+ */
+struct prefix {
+    const char      *name;      /* points into first hostname           */
+    int              len;
+    struct range    *ranges;
+    int              nranges;
+    int              size;      /* allocated ranges                     */
+    struct {
+        unsigned long long num; /* last number with this zero padding   */
+        int          range;     /* index of range it was added to, or -1 */
+    } last[20];                 /* by zero-padded width                 */
+};
+
+/*
+ *  Growable string for host ranges, which may be long
+ */
+struct strbuf {
+    char            *buf;
+    int              len;
+    int              size;
+};
+
+static void _strbuf_append (struct strbuf *sb, const char *s, int len)
+{
+    if (sb->len + len + 1 > sb->size) {
+        while (sb->len + len + 1 > sb->size)
+            sb->size = sb->size ? sb->size * 2 : 256;
+        if (sb->buf)
+            Realloc ((void **) &sb->buf, sb->size);
+        else
+            sb->buf = Malloc (sb->size);
+    }
+    memcpy (sb->buf + sb->len, s, len);
+    sb->len += len;
+    sb->buf[sb->len] = '\0';
+}
+
+static int _cmp_cnames (const void *x, const void *y)
+{
+    const struct cname *c1 = x;
+    const struct cname *c2 = y;
+    int alen, blen, rc;
+    const char *da = _trailing_digits (c1->name, c1->len, &alen);
+    const char *db = _trailing_digits (c2->name, c2->len, &blen);
+
+    if ((rc = _numcmp (da, alen, db, blen)))
+        return (rc);
+    return (c1->index - c2->index);
+}
+
+static int _cmp_prefixes (const void *x, const void *y)
+{
+    const struct prefix *p1 = *(struct prefix **) x;
+    const struct prefix *p2 = *(struct prefix **) y;
+    int rc = memcmp (p1->name, p2->name, MIN (p1->len, p2->len));
+
+    if (rc == 0)
+        rc = p1->len - p2->len;
+    return (rc);
+}
+
+/*
+ *  Zero-padded width of number `n': its length if it has leading
+ *   zeros (and is not "0" itself), else 1.
+ */
+static int _zeropadwidth (const char *n, int len)
+{
+    if ((len > 1) && (n[0] == '0'))
+        return (len);
+    return (1);
+}
+
+/*
+ *  Compress hostnames with the same suffix into ranges, appending the
+ *   result to `sb'. Same algorithm as the perl dshbak, which differs
+ *   from hostlist_ranged_string() in how zero padding is handled.
+ */
+static void _compress_suffix (struct strbuf *sb, struct cname *names, int n,
+                              const char *suffix)
+{
+    struct prefix **prefixes = Malloc (n * sizeof (*prefixes));
+    struct prefix *p = NULL;
+    struct range *r;
+    int np = 0;
+    int j, k;
+
+    qsort (names, n, sizeof (*names), _cmp_cnames);
+
+    for (j = 0; j < n; j++) {
+        int dlen, zp, range = -1;
+        const char *d = _trailing_digits (names[j].name, names[j].len, &dlen);
+        int plen = d - names[j].name;
+        unsigned long long num = strtoull (d, NULL, 10);
+
+        if (!p || (p->len != plen) || memcmp (p->name, names[j].name, plen)) {
+            for (k = np - 1; k >= 0; k--) {
+                p = prefixes[k];
+                if ((p->len == plen) && !memcmp (p->name, names[j].name, plen))
+                    break;
+            }
+            if (k < 0) {
+                p = prefixes[np++] = Malloc (sizeof (*p));
+                p->name = names[j].name;
+                p->len = plen;
+                p->ranges = NULL;
+                p->nranges = p->size = 0;
+                for (k = 0; k < 20; k++)
+                    p->last[k].range = -1;
+            }
+        }
+
+        /*
+         *  Extend the range ending in num - 1 with compatible zero
+         *   padding (e.g. "9" and "09" are compatible with "10", but
+         *   "009" is not) if there is one, else start a new range.
+         */
+        zp = _zeropadwidth (d, dlen);
+        if ((dlen > 0) && (dlen < 20) && (num > 0)) {
+            if ((p->last[zp].range >= 0) && (p->last[zp].num == num - 1))
+                range = p->last[zp].range;
+            else if ((zp == 1) && (p->last[dlen].range >= 0)
+                     && (p->last[dlen].num == num - 1))
+                range = p->last[dlen].range;
+        }
+        if (range >= 0) {
+            p->ranges[range].hi = d;
+            p->ranges[range].hilen = dlen;
+        }
+        else {
+            if (p->nranges == p->size) {
+                p->size = p->size ? p->size * 2 : 8;
+                if (p->ranges)
+                    Realloc ((void **) &p->ranges,
+                             p->size * sizeof (struct range));
+                else
+                    p->ranges = Malloc (p->size * sizeof (struct range));
+            }
+            range = p->nranges++;
+            p->ranges[range].lo = d;
+            p->ranges[range].lolen = dlen;
+            p->ranges[range].hi = NULL;
+        }
+        if ((dlen > 0) && (dlen < 20)) {
+            p->last[zp].num = num;
+            p->last[zp].range = range;
+        }
+    }
+
+    qsort (prefixes, np, sizeof (*prefixes), _cmp_prefixes);
+
+    for (k = 0; k < np; k++) {
+        p = prefixes[k];
+        if (sb->len)
+            _strbuf_append (sb, ",", 1);
+        _strbuf_append (sb, p->name, p->len);
+        if ((p->nranges > 1) || p->ranges[0].hi)
+            _strbuf_append (sb, "[", 1);
+        for (j = 0; j < p->nranges; j++) {
+            r = &p->ranges[j];
+            if (j)
+                _strbuf_append (sb, ",", 1);
+            _strbuf_append (sb, r->lo, r->lolen);
+            if (r->hi) {
+                _strbuf_append (sb, "-", 1);
+                _strbuf_append (sb, r->hi, r->hilen);
+            }
+        }
+        if ((p->nranges > 1) || p->ranges[0].hi)
+            _strbuf_append (sb, "]", 1);
+        _strbuf_append (sb, suffix, strlen (suffix));
+
+        Free ((void **) &p->ranges);
+        Free ((void **) &p);
+    }
+
+    Free ((void **) &prefixes);
+}
+
+/*
+ *  Compress hostnames `tags' (sorted with _sortn) into host ranges,
+ *   handling each distinct suffix of non-digits separately.
+ */
+static char *_compress (List tags)
+{
+    int ntags = list_count (tags);
+    struct cname *names = Malloc (ntags * sizeof (*names));
+    struct cname *sorted = Malloc (ntags * sizeof (*sorted));
+    const char **suffixes = Malloc (ntags * sizeof (char *));
+    int *count = Malloc (ntags * sizeof (int));
+    struct strbuf sb = { NULL, 0, 0 };
+    ListIterator i = list_iterator_create (tags);
+    int nsuffixes = 0;
+    char *tag;
+    int j, k;
+
+    /*
+     *  Split off suffixes, numbering them in order of first appearance
+     */
+    for (j = 0; (tag = list_next (i)); j++) {
+        int len = strlen (tag);
+        const char *sfx = tag + len;
+
+        while ((sfx > tag) && !isdigit ((unsigned char) sfx[-1]))
+            sfx--;
+        for (k = nsuffixes - 1; k >= 0; k--)
+            if (!strcmp (suffixes[k], sfx))
+                break;
+        if (k < 0) {
+            k = nsuffixes++;
+            suffixes[k] = sfx;
+            count[k] = 0;
+        }
+        names[j].name = tag;
+        names[j].len = sfx - tag;
+        names[j].index = j;
+        names[j].suffix = k;
+        count[k]++;
+    }
+    list_iterator_destroy (i);
+
+    /*
+     *  Group hostnames by suffix, keeping their order
+     */
+    for (k = 0, j = 0; k < nsuffixes; k++) {
+        int n = count[k];
+        count[k] = j;
+        j += n;
+    }
+    for (j = 0; j < ntags; j++)
+        sorted[count[names[j].suffix]++] = names[j];
+
+    for (k = 0, j = 0; k < nsuffixes; k++) {
+        _compress_suffix (&sb, sorted + j, count[k] - j, suffixes[k]);
+        j = count[k];
+    }
+
+    Free ((void **) &names);
+    Free ((void **) &sorted);
+    Free ((void **) &suffixes);
+    Free ((void **) &count);
+
+    return (sb.buf);
+}
+
+static void _print_header (const char *tags)
+{
+    fputs (DSHBAK_DIV, stdout);
+    fputs (tags, stdout);
+    fputc ('\n', stdout);
+    fputs (DSHBAK_DIV, stdout);
+}
+
+static void _output_normal (void)
+{
+    struct outbuf ob = { NULL, 0, NULL, 0 };
+    int j;
+
+    for (j = 0; j < nhosts; j++) {
+        _print_header (hosts[j]->tag);
+        _write_output (stdout, hosts[j]->last, &ob);
+    }
+}
+
+/*
+ *  Print identical output only once, tagged with the list of hosts
+ *   producing it. Groups are printed in order of their first host.
+ */
+static void _output_coalesced (void)
+{
+    struct outbuf ob = { NULL, 0, NULL, 0 };
+    struct group *groups = NULL;
+    struct group **tail = &groups;
+    struct group *g;
+    int j;
+
+    for (j = 0; j < nhosts; j++) {
+        struct line *last = hosts[j]->last;
+        if ((g = last->group) == NULL) {
+            g = Malloc (sizeof (*g));
+            g->last = last;
+            g->tags = list_create (NULL);
+            g->next = NULL;
+            last->group = g;
+            *tail = g;
+            tail = &g->next;
+        }
+        list_append (g->tags, hosts[j]->tag);
+    }
+
+    while ((g = groups)) {
+        char *str = _compress (g->tags);
+        _print_header (str);
+        _write_output (stdout, g->last, &ob);
+        Free ((void **) &str);
+        groups = g->next;
+        list_destroy (g->tags);
+        Free ((void **) &g);
+    }
+}
+
+static void *_writer (void *arg)
+{
+    struct outbuf ob = { NULL, 0, NULL, 0 };
+    char *file = NULL;
+    struct host *h;
+    FILE *fp;
+
+    for (;;) {
+        pthread_mutex_lock (&writer_mutex);
+        h = (next_host < nhosts) ? hosts[next_host++] : NULL;
+        pthread_mutex_unlock (&writer_mutex);
+
+        if (h == NULL)
+            break;
+
+        xstrcpy (&file, outdir);
+        xstrcat (&file, "/");
+        xstrcat (&file, h->tag);
+
+        if (!(fp = fopen (file, "w")))
+            errx ("%P: Fatal: Failed to open output file '%s': %m\n", file);
+        if ((_write_output (fp, h->last, &ob) < 0) || (fclose (fp) != 0))
+            errx ("%P: Fatal: Failed to write output file '%s': %m\n", file);
+    }
+
+    if (file)
+        Free ((void **) &file);
+    if (ob.lines)
+        Free ((void **) &ob.lines);
+    if (ob.buf)
+        Free ((void **) &ob.buf);
+    return (NULL);
+}
+
+/*
+ *  Put each host output into separate files in `outdir', written
+ *   by several threads in parallel.
+ */
+static void _output_per_file (void)
+{
+    pthread_t threads[DSHBAK_WRITERS];
+    int n = MIN (nhosts, DSHBAK_WRITERS);
+    int j, rv;
+
+    for (j = 0; j < n; j++) {
+        if ((rv = pthread_create (&threads[j], NULL, _writer, NULL)))
+            errx ("%P: Fatal: pthread_create: %s\n", strerror (rv));
+    }
+    for (j = 0; j < n; j++)
+        pthread_join (threads[j], NULL);
+}
+
+/*
+ *  Create directory `dir' and any missing parents, like mkdir -p.
+ */
+static int _mkpath (char *dir)
+{
+    char *p = dir;
+
+    while (*p == '/')
+        p++;
+    while ((p = strchr (p, '/'))) {
+        *p = '\0';
+        if ((mkdir (dir, 0777) < 0) && (errno != EEXIST)) {
+            *p = '/';
+            return (-1);
+        }
+        *p++ = '/';
+    }
+    if ((mkdir (dir, 0777) < 0) && (errno != EEXIST))
+        return (-1);
+    return (0);
+}
+
+static bool _is_dir (const char *dir)
+{
+    struct stat st;
+    return ((stat (dir, &st) == 0) && S_ISDIR (st.st_mode));
+}
+
+static void _usage (char *prog, int rc)
+{
+    fprintf (stderr, DSHBAK_USAGE, prog);
+    exit (rc);
+}
+
+int main (int argc, char *argv[])
+{
+    char *prog = xbasename (argv[0]);
+    bool coalesce = false;
+    bool force = false;
+    struct host *h;
+    int c, j;
+
+    err_init (prog);
+
+    while ((c = getopt (argc, argv, DSHBAK_ARGS)) != EOF) {
+        switch (c) {
+        case 'c':
+            coalesce = true;
+            break;
+        case 'd':
+            outdir = optarg;
+            break;
+        case 'f':
+            force = true;
+            break;
+        case 'h':
+            _usage (prog, 0);
+            break;
+        default:
+            _usage (prog, 1);
+        }
+    }
+
+    if (coalesce && outdir)
+        errx ("%P: Fatal: Do not specify both -c and -d\n");
+    if (outdir) {
+        if (force && !_is_dir (outdir) && (_mkpath (outdir) < 0))
+            errx ("%P: Fatal: Failed to create %s: %m\n", outdir);
+        if (!_is_dir (outdir))
+            errx ("%P: Fatal: Output directory %s does not exist\n", outdir);
+    }
+    if (force && !outdir)
+        errx ("%P: Fatal: Option -f may only be used with -d\n");
+
+    if (optind == argc)
+        _process_input (STDIN_FILENO);
+    for (j = optind; j < argc; j++) {
+        FILE *fp = strcmp (argv[j], "-") ? fopen (argv[j], "r") : stdin;
+        if (fp == NULL) {
+            err ("%P: Can't open %s: %m\n", argv[j]);
+            continue;
+        }
+        _process_input (fileno (fp));
+        if (fp != stdin)
+            fclose (fp);
+    }
+
+    hosts = Malloc ((hosts_table.count + 1) * sizeof (*hosts));
+    for (j = 0; j < hosts_table.size; j++)
+        for (h = hosts_table.buckets[j]; h; h = h->next)
+            hosts[nhosts++] = h;
+    qsort (hosts, nhosts, sizeof (*hosts), _cmp_hosts);
+
+    if (outdir)
+        _output_per_file ();
+    else if (coalesce)
+        _output_coalesced ();
+    else
+        _output_normal ();
+
+    if (fflush (stdout) != 0)
+        errx ("%P: Fatal: write: %m\n");
+
+    exit (0);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
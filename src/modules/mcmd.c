@@ -119,6 +119,7 @@ static char sccsid[] = "@(#)mcmd.c      Based from: 8.3 (Berkeley) 3/26/94";
 #include "src/common/err.h"
 #include "src/common/fd.h"
 #include "src/common/xpoll.h"
+#include "src/common/xmalloc.h"
 #include "src/pdsh/mod.h"
 
 #define MRSH_PROTOCOL_VERSION    "2.1"
@@ -132,15 +133,12 @@ static char sccsid[] = "@(#)mcmd.c      Based from: 8.3 (Berkeley) 3/26/94";
 #define MRSH_LOCALHOST_KEY      "LHOST"
 #define MRSH_LOCALHOST_KEYLEN   5
 
-#ifdef HAVE_PTHREAD
-#define SET_PTHREAD()           pthread_sigmask(SIG_BLOCK, &blockme, &oldset)
-#define RESTORE_PTHREAD()       pthread_sigmask(SIG_SETMASK, &oldset, NULL)
-#define EXIT_PTHREAD()          RESTORE_PTHREAD(); \
-                                return -1
-#else
-#define SET_PTHREAD()
-#define RESTORE_PTHREAD()
-#define EXIT_PTHREAD()          return -1
+/*
+ * Connections may be driven from any pdsh thread, so use MSG_NOSIGNAL
+ *  rather than a per-thread signal mask to avoid SIGPIPE where possible.
+ */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0
 #endif
 
 #if STATIC_MODULES
@@ -152,7 +150,10 @@ int pdsh_module_priority = DEFAULT_MODULE_PRIORITY;
 
 static int mcmd_init(opt_t *);
 static int mcmd_signal(int, void *, int);
-static int mcmd(char *, char *, char *, char *, char *, int, int *, void **);
+static int mcmd_start(char *, char *, char *, char *, char *, int, bool,
+                      struct rcmd_nbconn *);
+static int mcmd_continue(struct rcmd_nbconn *);
+static int mcmd_finish(struct rcmd_nbconn *, int *, void **);
 
 /* random num for all jobs in this group */
 static unsigned int randy = -1;
@@ -171,9 +172,13 @@ struct pdsh_module_operations mcmd_module_ops = {
  *  Export rcmd module operations
  */
 struct pdsh_rcmd_operations mcmd_rcmd_ops = {
-    (RcmdInitF)    mcmd_init,
-    (RcmdSigF)     mcmd_signal,
-    (RcmdF)        mcmd,
+    (RcmdInitF)     mcmd_init,
+    (RcmdSigF)      mcmd_signal,
+    (RcmdF)         NULL,
+    (RcmdDestroyF)  NULL,
+    (RcmdStartF)    mcmd_start,
+    (RcmdContinueF) mcmd_continue,
+    (RcmdFinishF)   mcmd_finish,
 };
 
 /*
@@ -291,14 +296,6 @@ encode_localhost_string (const char *host, char *str, int maxlen)
  * Derived from the mcmd() libc call, with modified interface.
  * This version is MT-safe.  Errors are displayed in pdsh-compat format.
  * Connection can time out.
- *      ahost (IN)              target hostname
- *      addr (IN)               4 byte internet address
- *      locuser (IN)            local username
- *      remuser (IN)            remote username
- *      cmd (IN)                remote command to execute under shell
- *      rank (IN)               not used
- *      fd2p (IN)               if non NULL, return stderr file descriptor here
- *      int (RETURN)            -1 on error, socket for I/O on success
  *
  * Originally by Mike Haskell for mrsh, modified slightly to work with pdsh by:
  * - making mcmd always thread safe
@@ -306,98 +303,169 @@ encode_localhost_string (const char *host, char *str, int maxlen)
  * - passing in address as addr intead of calling gethostbyname
  * - using default mshell port instead of calling getservbyname
  *
+ * The connection is now driven as a non-blocking state machine through
+ *  mcmd_start(), mcmd_continue() and mcmd_finish(), so that pdsh may run
+ *  many handshakes concurrently. (munge_encode() still blocks briefly
+ *  while talking to the local munged.)
  */
-static int
-mcmd(char *ahost, char *addr, char *locuser, char *remuser, char *cmd,
-        int rank, int *fd2p, void **argp)
+typedef enum {
+    MCMD_CONNECTING,            /* waiting for connect to complete       */
+    MCMD_CONNECTED,             /* set up stderr and send munge blob     */
+    MCMD_SEND,                  /* writing obuf, then go to `next'       */
+    MCMD_ACCEPT,                /* waiting for stderr connection         */
+    MCMD_VERIFY,                /* reading verification number on stderr */
+    MCMD_VERIFY_ERR,            /* reading error after bad verification  */
+    MCMD_RESPONSE,              /* waiting for status byte from mrshd    */
+    MCMD_ERRMSG,                /* reading error string from mrshd       */
+    MCMD_DONE
+} mcmd_state_t;
+
+struct mcmd_conn {
+    mcmd_state_t  state;
+    mcmd_state_t  next;         /* state after MCMD_SEND completes       */
+    char *        host;
+    char          addr[IP_ADDR_LEN];
+    char *        remuser;
+    char *        cmd;
+    bool          want_err;     /* stderr channel requested              */
+    int           s;            /* stdin/stdout socket                   */
+    int           s2;           /* listening socket for stderr           */
+    int           s3;           /* stderr socket                         */
+
+    char *        obuf;         /* pending output for MCMD_SEND          */
+    int           olen;
+    int           ooff;
+
+    unsigned int  rand;         /* verification number from server       */
+    char          buf[LINEBUFSIZE];
+    int           len;
+};
+
+static void mcmd_conn_destroy(struct mcmd_conn *c)
+{
+    if (c->s >= 0)
+        close(c->s);
+    if (c->s2 >= 0)
+        close(c->s2);
+    if (c->s3 >= 0)
+        close(c->s3);
+    Free((void **) &c->obuf);
+    Free((void **) &c->remuser);
+    Free((void **) &c->cmd);
+    Free((void **) &c->host);
+    Free((void **) &c);
+}
+
+static void mcmd_goto(struct rcmd_nbconn *nb, mcmd_state_t state)
+{
+    ((struct mcmd_conn *) nb->data)->state = state;
+    nb->revents[0] = nb->revents[1] = 0;
+}
+
+static int mcmd_wait(struct rcmd_nbconn *nb, int fd0, int ev0,
+                     int fd1, int ev1)
 {
+    nb->fd[0] = fd0;
+    nb->events[0] = ev0;
+    nb->fd[1] = fd1;
+    nb->events[1] = ev1;
+    nb->timeout = -1;
+    return (RCMD_NB_WAIT);
+}
+
+/*
+ * Queue `len' bytes of `buf' to be written to the mrshd socket, then
+ *  continue in state `next.'
+ */
+static void mcmd_send(struct rcmd_nbconn *nb, const char *buf, int len,
+                      mcmd_state_t next)
+{
+    struct mcmd_conn *c = nb->data;
+
+    Free((void **) &c->obuf);
+    c->obuf = Malloc(len);
+    memcpy(c->obuf, buf, len);
+    c->olen = len;
+    c->ooff = 0;
+    c->next = next;
+    mcmd_goto(nb, MCMD_SEND);
+}
+
+/*
+ * Read up to `n' bytes from `fd' into c->buf (appending at c->len),
+ *  stopping after a newline if `line' is set.
+ *  Returns 1 when done (n bytes, newline, or EOF), 0 if the read
+ *  would block, and -1 on error.
+ */
+static int mcmd_read_buf(struct mcmd_conn *c, int fd, int n, bool line)
+{
+    char ch;
+    int rv;
+
+    while (c->len < n) {
+        if ((rv = read(fd, &ch, 1)) < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return (0);
+            return (-1);
+        }
+        if (rv == 0)
+            return (1);
+        c->buf[c->len++] = ch;
+        if (line && ch == '\n')
+            return (1);
+    }
+    return (1);
+}
+
+/*
+ * Set up the stderr listening socket and the munge encoded request,
+ *  and queue it for sending to the server.
+ */
+static int mcmd_send_request(struct rcmd_nbconn *nb)
+{
+    struct mcmd_conn *c = nb->data;
     struct sockaddr m_socket;
     struct sockaddr_in *getp;
-    struct sockaddr_in sin, from;
-    struct sockaddr_storage ss;
     struct in_addr m_in;
-    unsigned int rand, randl;
     unsigned char *hptr;
-    int s, s2, rv, mcount, lport;
-    char c;
+    int rv, mcount, lport;
     char num[6] = {0};
     char *mptr;
     char *mbuf;
-    char *tmbuf;
     char *m;
     char *mpvers;
+    char *obuf;
+    int olen;
     char num_seq[12] = {0};
     socklen_t len;
-    sigset_t blockme;
-    sigset_t oldset;
     char haddrdot[MAXHOSTNAMELEN + MRSH_LOCALHOST_KEYLEN + 1] = {0};
     munge_ctx_t ctx;
-    struct xpollfd xpfds[2];
-
-    memset (xpfds, 0, sizeof (xpfds));
-    memset (&sin, 0, sizeof (sin));
-
-    sigemptyset(&blockme);
-    sigaddset(&blockme, SIGURG);
-    sigaddset(&blockme, SIGPIPE);
-    SET_PTHREAD();
 
     /* Convert randy to decimal string, 0 if we dont' want stderr */
-    if (fd2p != NULL)
+    if (c->want_err)
         snprintf(num_seq, sizeof(num_seq),"%d",randy);
     else
         snprintf(num_seq, sizeof(num_seq),"%d",0);
 
-    /*
-     * Start setup of the stdin/stdout socket...
-     */
     lport = 0;
-    len = sizeof(struct sockaddr_in);
-
-    if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        err("%p: %S: mcmd: socket call stdout failed: %m\n", ahost);
-        EXIT_PTHREAD();
-    }
-
-    memset (&ss, '\0', sizeof(ss));
-    ss.ss_family = AF_INET;
-
-    if (bind(s, (struct sockaddr *)&ss, len) < 0) {
-        err("%p: %S: mcmd: bind failed: %m\n", ahost);
-        goto bad;
-    }
-
-    sin.sin_family = AF_INET;
-
-    memcpy(&sin.sin_addr.s_addr, addr, IP_ADDR_LEN);
-
-    sin.sin_port = htons(MRSH_PORT);
-    if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
-        err("%p: %S: mcmd: connect failed: %m\n", ahost);
-        goto bad;
-    }
-
-    lport = 0;
-    s2 = -1;
-    if (fd2p != NULL) {
+    if (c->want_err) {
         /*
          * Start the socket setup for the stderr.
          */
         struct sockaddr_in sin2;
 
-        if ((s2 = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-            err("%p: %S: mcmd: socket call for stderr failed: %m\n", ahost);
-            goto bad;
+        if ((c->s2 = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            err("%p: %S: mcmd: socket call for stderr failed: %m\n", c->host);
+            return (-1);
         }
 
         memset (&sin2, 0, sizeof(sin2));
         sin2.sin_family = AF_INET;
         sin2.sin_addr.s_addr = htonl(INADDR_ANY);
         sin2.sin_port = 0;
-        if (bind(s2,(struct sockaddr *)&sin2, sizeof(sin2)) < 0) {
-            err("%p: %S: mcmd: bind failed: %m\n", ahost);
-            close(s2);
-            goto bad;
+        if (bind(c->s2,(struct sockaddr *)&sin2, sizeof(sin2)) < 0) {
+            err("%p: %S: mcmd: bind failed: %m\n", c->host);
+            return (-1);
         }
 
         len = sizeof(struct sockaddr);
@@ -408,19 +476,17 @@ mcmd(char *ahost, char *addr, char *locuser, char *remuser, char *cmd,
          */
 
         /* getsockname is thread safe */
-        if (getsockname(s2,&m_socket,&len) < 0) {
-            err("%p: %S: mcmd: getsockname failed: %m\n", ahost);
-            close(s2);
-            goto bad;
+        if (getsockname(c->s2,&m_socket,&len) < 0) {
+            err("%p: %S: mcmd: getsockname failed: %m\n", c->host);
+            return (-1);
         }
 
         getp = (struct sockaddr_in *)&m_socket;
         lport = ntohs(getp->sin_port);
 
-        if (listen(s2, 5) < 0) {
-            err("%p: %S: mcmd: listen() failed: %m\n", ahost);
-            close(s2);
-            goto bad;
+        if (listen(c->s2, 5) < 0) {
+            err("%p: %S: mcmd: listen() failed: %m\n", c->host);
+            return (-1);
         }
     }
 
@@ -431,11 +497,11 @@ mcmd(char *ahost, char *addr, char *locuser, char *remuser, char *cmd,
      * Use special keyed string if target is localhost, otherwise,
      *  encode the IP addr string.
      */
-    if (!encode_localhost_string (ahost, haddrdot, sizeof (haddrdot))) {
+    if (!encode_localhost_string (c->host, haddrdot, sizeof (haddrdot))) {
         /* inet_ntoa is not thread safe, so we use the following,
          * which is more or less ripped from glibc
          */
-        memcpy(&m_in.s_addr, addr, IP_ADDR_LEN);
+        memcpy(&m_in.s_addr, c->addr, IP_ADDR_LEN);
         hptr = (unsigned char *)&m_in;
         sprintf(haddrdot, "%u.%u.%u.%u", hptr[0], hptr[1], hptr[2], hptr[3]);
     }
@@ -472,25 +538,19 @@ mcmd(char *ahost, char *addr, char *locuser, char *remuser, char *cmd,
 
     mpvers = MRSH_PROTOCOL_VERSION;
 
-    mcount = ((strlen(remuser)+1) + (strlen(mpvers)+1) +
+    mcount = ((strlen(c->remuser)+1) + (strlen(mpvers)+1) +
               (strlen(haddrdot)+1) + (strlen(num)+1) +
-              (strlen(num_seq)+1) + strlen(cmd)+2);
-
-    tmbuf = mbuf = malloc(mcount);
-    if (tmbuf == NULL) {
-        err("%p: %S: mcmd: Error from malloc\n", ahost);
-        close(s2);
-        goto bad;
-    }
+              (strlen(num_seq)+1) + strlen(c->cmd)+2);
 
     /*
      * The following memset() call takes the extra trailing null as
      * part of its count as well.
      */
+    mbuf = Malloc(mcount);
     memset(mbuf,0,mcount);
 
-    mptr = strcpy(mbuf, remuser);
-    mptr += strlen(remuser)+1;
+    mptr = strcpy(mbuf, c->remuser);
+    mptr += strlen(c->remuser)+1;
     mptr = strcpy(mptr, mpvers);
     mptr += strlen(mpvers)+1;
     mptr = strcpy(mptr, haddrdot);
@@ -499,179 +559,304 @@ mcmd(char *ahost, char *addr, char *locuser, char *remuser, char *cmd,
     mptr += strlen(num)+1;
     mptr = strcpy(mptr, num_seq);
     mptr += strlen(num_seq)+1;
-    mptr = strcpy(mptr, cmd);
+    mptr = strcpy(mptr, c->cmd);
 
     ctx = munge_ctx_create();
 
     if ((rv = munge_encode(&m,ctx,mbuf,mcount)) != EMUNGE_SUCCESS) {
-        err("%p: %S: mcmd: munge_encode: %s\n", ahost, munge_ctx_strerror(ctx));
+        err("%p: %S: mcmd: munge_encode: %s\n", c->host,
+            munge_ctx_strerror(ctx));
         munge_ctx_destroy(ctx);
-        if (s2 >= 0)
-            close(s2);
-        free(tmbuf);
-        goto bad;
+        Free((void **) &mbuf);
+        return (-1);
     }
 
     munge_ctx_destroy(ctx);
+    Free((void **) &mbuf);
 
     mcount = (strlen(m)+1);
 
     /*
-     * Write stderr port in the clear in case we can't decode for
+     * Send stderr port in the clear in case we can't decode for
      * some reason (i.e. bad credentials).  May be 0 if user
-     * doesn't want stderr
+     * doesn't want stderr.  This is followed by the munge_encoded blob.
      */
-    if (fd2p != NULL) {
-        rv = fd_write_n(s, num, strlen(num)+1);
-        if (rv != (strlen(num) + 1)) {
-            free(m);
-            free(tmbuf);
-            if (errno == EPIPE)
-                err("%p: %S: mcmd: Lost connection (EPIPE): %m", ahost);
+    if (!c->want_err)
+        num[0] = '\0';
+    olen = strlen(num) + 1 + mcount;
+    obuf = Malloc(olen);
+    memcpy(obuf, num, strlen(num) + 1);
+    memcpy(obuf + strlen(num) + 1, m, mcount);
+    free(m);
+
+    mcmd_send(nb, obuf, olen, c->want_err ? MCMD_ACCEPT : MCMD_RESPONSE);
+    Free((void **) &obuf);
+
+    return (0);
+}
+
+static int mcmd_run(struct rcmd_nbconn *nb)
+{
+    struct mcmd_conn *c = nb->data;
+    struct sockaddr_in from;
+    socklen_t len;
+    unsigned int randl;
+    int rv;
+
+    for (;;) {
+        switch (c->state) {
+        case MCMD_CONNECTING:
+            len = sizeof(rv);
+            if (getsockopt(c->s, SOL_SOCKET, SO_ERROR, &rv, &len) < 0)
+                rv = errno;
+            if (rv != 0) {
+                errno = rv;
+                err("%p: %S: mcmd: connect failed: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            }
+            mcmd_goto(nb, MCMD_CONNECTED);
+            break;
+
+        case MCMD_CONNECTED:
+            if (mcmd_send_request(nb) < 0)
+                return (RCMD_NB_ERROR);
+            break;
+
+        case MCMD_SEND:
+            while (c->ooff < c->olen) {
+                rv = send(c->s, c->obuf + c->ooff, c->olen - c->ooff,
+                          MSG_NOSIGNAL);
+                if (rv < 0) {
+                    if (errno == EAGAIN || errno == EINTR)
+                        return (mcmd_wait(nb, c->s, XPOLLWRITE, -1, 0));
+                    if (errno == EPIPE)
+                        err("%p: %S: mcmd: Lost connection (EPIPE): %m\n",
+                            c->host);
+                    else
+                        err("%p: %S: mcmd: Write to socket failed: %m\n",
+                            c->host);
+                    return (RCMD_NB_ERROR);
+                }
+                c->ooff += rv;
+            }
+            mcmd_goto(nb, c->next);
+            break;
+
+        case MCMD_ACCEPT:
+            /*
+             * Wait for stderr connection from daemon.
+             */
+            if (nb->revents[0]) {
+                err("%p: %S: mcmd: xpoll: protocol failure in circuit setup\n",
+                     c->host);
+                return (RCMD_NB_ERROR);
+            }
+            if (!(nb->revents[1] & (XPOLLREAD|XPOLLERR)))
+                return (mcmd_wait(nb, c->s, XPOLLREAD, c->s2, XPOLLREAD));
+
+            len = sizeof(from); /* arg to accept */
+            if ((c->s3 = accept(c->s2, (struct sockaddr *)&from, &len)) < 0) {
+                err("%p: %S: mcmd: accept (stderr) failed: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            }
+
+            if (from.sin_family != AF_INET) {
+                err("%p: %S: mcmd: bad family type: %d\n", c->host,
+                    from.sin_family);
+                return (RCMD_NB_ERROR);
+            }
+
+            close(c->s2);
+            c->s2 = -1;
+            fd_set_nonblocking(c->s3);
+
+            /*
+             * The following fixes a race condition between the daemon
+             * and the client.  The daemon is waiting for a null to
+             * proceed.  We do this to make sure that we have our
+             * socket is up prior to the daemon running the command.
+             */
+            c->len = 0;
+            mcmd_send(nb, "", 1, MCMD_VERIFY);
+            break;
+
+        case MCMD_VERIFY:
+            /*
+             * Read from our stderr.  The server should have placed our
+             * random number we generated onto this socket.
+             */
+            if ((rv = mcmd_read_buf(c, c->s3, sizeof(c->rand), false)) == 0)
+                return (mcmd_wait(nb, c->s3, XPOLLREAD, -1, 0));
+            if (rv < 0 || c->len != sizeof(c->rand)) {
+                err("%p: %S: mcmd: Bad read of expected verification "
+                    "number off of stderr socket: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            }
+
+            memcpy(&c->rand, c->buf, sizeof(c->rand));
+            randl = ntohl(c->rand);
+            if (randl != randy) {
+                mcmd_goto(nb, MCMD_VERIFY_ERR);
+                break;
+            }
+            c->len = 0;
+            mcmd_goto(nb, MCMD_RESPONSE);
+            break;
+
+        case MCMD_VERIFY_ERR:
+            rv = mcmd_read_buf(c, c->s3, sizeof(c->buf) - 1, true);
+            if (rv == 0)
+                return (mcmd_wait(nb, c->s3, XPOLLREAD, -1, 0));
+            c->buf[c->len] = '\0';
+            if (rv < 0)
+                err("%p: %S: mcmd: Read error from remote host: %m\n",
+                    c->host);
             else
-                err("%p: %S: mcmd: Write of stderr port failed: %m\n", ahost);
-            close(s2);
-            goto bad;
-        }
-    } else {
-        if (write(s, "", 1) != 1) {
-            err ("%p: %S: mcmd: write NUL stderr port: %m\n", ahost);
-            goto bad;
+                err("%p: %S: mcmd: Error: %s\n", c->host, c->buf);
+            return (RCMD_NB_ERROR);
+
+        case MCMD_RESPONSE:
+            if ((rv = mcmd_read_buf(c, c->s, 1, false)) == 0)
+                return (mcmd_wait(nb, c->s, XPOLLREAD, -1, 0));
+            if (rv < 0) {
+                err("%p: %S: mcmd: read: protocol failure: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            }
+            if (c->len != 1) {
+                err("%p: %S: mcmd: read: protocol failure: invalid response\n",
+                    c->host);
+                return (RCMD_NB_ERROR);
+            }
+            if (c->buf[0] == '\0') {
+                mcmd_goto(nb, MCMD_DONE);
+                break;
+            }
+            /* retrieve error string from remote server */
+            c->len = 0;
+            mcmd_goto(nb, MCMD_ERRMSG);
+            break;
+
+        case MCMD_ERRMSG:
+            rv = mcmd_read_buf(c, c->s, sizeof(c->buf) - 1, true);
+            if (rv == 0)
+                return (mcmd_wait(nb, c->s, XPOLLREAD, -1, 0));
+            c->buf[c->len] = '\0';
+            if (rv < 0 || c->len == 0)
+                err("%p: %S: mcmd: Error from remote host\n", c->host);
+            else
+                err("%p: %S: mcmd: Error: %s\n", c->host, c->buf);
+            return (RCMD_NB_ERROR);
+
+        case MCMD_DONE:
+            nb->fd[0] = nb->fd[1] = -1;
+            return (RCMD_NB_DONE);
         }
-        lport = 0;
     }
+    /* NOTREACHED */
+    return (RCMD_NB_ERROR);
+}
+
+/*
+ * Begin an mrsh connection.
+ *      ahost (IN)              target hostname
+ *      addr (IN)               4 byte internet address
+ *      locuser (IN)            local username
+ *      remuser (IN)            remote username
+ *      cmd (IN)                remote command to execute under shell
+ *      rank (IN)               not used
+ *      want_err (IN)           if true, set up a stderr connection
+ *      nb (IN/OUT)             non-blocking connection state
+ */
+static int
+mcmd_start(char *ahost, char *addr, char *locuser, char *remuser, char *cmd,
+        int rank, bool want_err, struct rcmd_nbconn *nb)
+{
+    struct mcmd_conn *c = Malloc(sizeof(*c));
+    struct sockaddr_in sin;
+    struct sockaddr_storage ss;
+
+    memset(c, 0, sizeof(*c));
+    c->state = MCMD_CONNECTING;
+    c->host = Strdup(ahost);
+    memcpy(c->addr, addr, IP_ADDR_LEN);
+    c->remuser = Strdup(remuser);
+    c->cmd = Strdup(cmd);
+    c->want_err = want_err;
+    c->s = c->s2 = c->s3 = -1;
+    nb->data = c;
 
     /*
-     * Write the munge_encoded blob to the socket.
+     * Start setup of the stdin/stdout socket...
      */
-    rv = fd_write_n(s, m, mcount);
-    if (rv != mcount) {
-        free(m);
-        free(tmbuf);
-        if (errno == EPIPE)
-            err("%p: %S: mcmd: Lost connection: %m\n", ahost);
-        else
-            err("%p: %S: mcmd: Write to socket failed: %m\n", ahost);
-        close(s2);
-        goto bad;
+    if ((c->s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        err("%p: %S: mcmd: socket call stdout failed: %m\n", ahost);
+        return (RCMD_NB_ERROR);
     }
 
-    free(m);
-    free(tmbuf);
+    memset (&ss, '\0', sizeof(ss));
+    ss.ss_family = AF_INET;
 
-    if (fd2p != NULL) {
-        /*
-         * Wait for stderr connection from daemon.
-         */
-        int s3;
-
-        errno = 0;
-        xpfds[0].fd = s;
-        xpfds[1].fd = s2;
-        xpfds[0].events = xpfds[1].events = XPOLLREAD;
-        if (  ((rv = xpoll(xpfds, 2, -1)) < 0)
-            || rv != 1
-            || (xpfds[0].revents > 0)) {
-            if (errno != 0)
-                err("%p: %S: mcmd: xpoll (setting up stderr): %m\n", ahost);
-            else
-                err("%p: %S: mcmd: xpoll: protocol failure in circuit setup\n",
-                     ahost);
-            (void) close(s2);
-            goto bad;
-        }
+    if (bind(c->s, (struct sockaddr *)&ss, sizeof(struct sockaddr_in)) < 0) {
+        err("%p: %S: mcmd: bind failed: %m\n", ahost);
+        return (RCMD_NB_ERROR);
+    }
 
-        errno = 0;
-        len = sizeof(from); /* arg to accept */
+    fd_set_nonblocking(c->s);
 
-        if ((s3 = accept(s2, (struct sockaddr *)&from, &len)) < 0) {
-            err("%p: %S: mcmd: accept (stderr) failed: %m\n", ahost);
-            close(s2);
-            goto bad;
-        }
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    memcpy(&sin.sin_addr.s_addr, addr, IP_ADDR_LEN);
+    sin.sin_port = htons(MRSH_PORT);
 
-        if (from.sin_family != AF_INET) {
-            err("%p: %S: mcmd: bad family type: %d\n", ahost, from.sin_family);
-            goto bad2;
+    if (connect(c->s, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+        if (errno != EINPROGRESS) {
+            err("%p: %S: mcmd: connect failed: %m\n", ahost);
+            return (RCMD_NB_ERROR);
         }
+        return (mcmd_wait(nb, c->s, XPOLLWRITE, -1, 0));
+    }
 
-        close(s2);
+    mcmd_goto(nb, MCMD_CONNECTED);
+    return (mcmd_run(nb));
+}
 
-        /*
-         * The following fixes a race condition between the daemon
-         * and the client.  The daemon is waiting for a null to
-         * proceed.  We do this to make sure that we have our
-         * socket is up prior to the daemon running the command.
-         */
-        if (write(s,"",1) < 0) {
-            err("%p: %S: mcmd: Could not communicate to daemon to proceed: %m\n", ahost);
-            close(s3);
-            goto bad;
-        }
+static int
+mcmd_continue(struct rcmd_nbconn *nb)
+{
+    return (mcmd_run(nb));
+}
 
-        /*
-         * Read from our stderr.  The server should have placed our
-         * random number we generated onto this socket.
-         */
-        rv = fd_read_n(s3, &rand, sizeof(rand));
-        if (rv != (ssize_t) (sizeof(rand))) {
-            err("%p: %S: mcmd: Bad read of expected verification "
-                    "number off of stderr socket: %m\n", ahost);
-            close(s3);
-            goto bad;
-        }
+/*
+ * Return socket for stdin/stdout (and stderr in *fd2p) of a completed
+ *  connection, or -1 if the connection failed or was abandoned.
+ */
+static int
+mcmd_finish(struct rcmd_nbconn *nb, int *fd2p, void **argp)
+{
+    struct mcmd_conn *c = nb->data;
+    int s = -1;
 
-        randl = ntohl(rand);
-        if (randl != randy) {
-            char tmpbuf[LINEBUFSIZE] = {0};
-            char *tptr = &tmpbuf[0];
+    if (c == NULL)
+        return (-1);
 
-            memcpy(tptr,(char *) &rand,sizeof(rand));
-            tptr += sizeof(rand);
-            if (fd_read_line (s3, tptr, LINEBUFSIZE - sizeof(rand)) < 0)
-                err("%p: %S: mcmd: Read error from remote host: %m\n", ahost);
-            else
-                err("%p: %S: mcmd: Error: %s\n", ahost, &tmpbuf[0]);
-            close(s3);
-            goto bad;
+    if (c->state == MCMD_DONE) {
+        s = c->s;
+        c->s = -1;
+        fd_set_blocking(s);
+        if (fd2p) {
+            /*
+             * Set the stderr file descriptor for the user...
+             */
+            *fd2p = c->s3;
+            c->s3 = -1;
+            fd_set_blocking(*fd2p);
         }
-
-        /*
-         * Set the stderr file descriptor for the user...
-         */
-        *fd2p = s3;
-    }
-
-    if ((rv = read(s, &c, 1)) < 0) {
-        err("%p: %S: mcmd: read: protocol failure: %m\n", ahost);
-        goto bad2;
-    }
-
-    if (rv != 1) {
-        err("%p: %S: mcmd: read: protocol failure: invalid response\n", ahost);
-        goto bad2;
     }
 
-    if (c != '\0') {
-        /* retrieve error string from remote server */
-        char tmpbuf[LINEBUFSIZE];
-
-        if (fd_read_line (s, &tmpbuf[0], LINEBUFSIZE) < 0)
-            err("%p: %S: mcmd: Error from remote host\n", ahost);
-        else
-            err("%p: %S: mcmd: Error: %s\n", ahost, tmpbuf);
-        goto bad2;
-    }
-    RESTORE_PTHREAD();
+    mcmd_conn_destroy(c);
+    nb->data = NULL;
 
     return (s);
-
-bad2:
-    if (lport)
-        close(*fd2p);
-bad:
-    close(s);
-    EXIT_PTHREAD();
 }
 
 /*
@@ -107,6 +107,8 @@ static char sccsid[] = "@(#)rcmd.c	8.3 (Berkeley) 3/26/94";
 #include "src/common/err.h"
 #include "src/common/list.h"
 #include "src/common/xpoll.h"
+#include "src/common/xmalloc.h"
+#include "src/common/fd.h"
 #include "src/pdsh/dsh.h"
 #include "src/pdsh/mod.h"
 #include "src/pdsh/privsep.h"
@@ -122,7 +124,10 @@ int pdsh_module_priority = DEFAULT_MODULE_PRIORITY;
 
 static int xrcmd_init(opt_t *);
 static int xrcmd_signal(int, void *, int);
-static int xrcmd(char *, char *, char *, char *, char *, int, int *, void **);
+static int xrcmd_start(char *, char *, char *, char *, char *, int, bool,
+                       struct rcmd_nbconn *);
+static int xrcmd_continue(struct rcmd_nbconn *);
+static int xrcmd_finish(struct rcmd_nbconn *, int *, void **);
 
 /*
  * Export pdsh module operations structure
@@ -138,9 +143,13 @@ struct pdsh_module_operations xrcmd_module_ops = {
  *  Export rcmd module operations
  */
 struct pdsh_rcmd_operations xrcmd_rcmd_ops = {
-    (RcmdInitF)  xrcmd_init,
-    (RcmdSigF)   xrcmd_signal,
-    (RcmdF)      xrcmd,
+    (RcmdInitF)     xrcmd_init,
+    (RcmdSigF)      xrcmd_signal,
+    (RcmdF)         NULL,
+    (RcmdDestroyF)  NULL,
+    (RcmdStartF)    xrcmd_start,
+    (RcmdContinueF) xrcmd_continue,
+    (RcmdFinishF)   xrcmd_finish,
 };
 
 /*
@@ -193,163 +202,368 @@ static int xrcmd_signal(int efd, void *arg, int signum)
 }
 
 /*
- * The rcmd call itself.
+ * The rcmd call itself is implemented as a non-blocking state machine,
+ *  driven by pdsh through xrcmd_start(), xrcmd_continue() and
+ *  xrcmd_finish(). The states follow the original BSD rcmd() sequence.
+ */
+typedef enum {
+    XRCMD_SOCKET,               /* get reserved port and start connect   */
+    XRCMD_CONNECTING,           /* waiting for connect to complete       */
+    XRCMD_CONNECTED,            /* connected, set up stderr if requested */
+    XRCMD_SEND,                 /* writing obuf, then go to `next'       */
+    XRCMD_ACCEPT,               /* waiting for stderr connection         */
+    XRCMD_RESPONSE,             /* waiting for status byte from rshd     */
+    XRCMD_ERRMSG,               /* reading error string from rshd        */
+    XRCMD_DONE
+} xrcmd_state_t;
+
+struct xrcmd_conn {
+    xrcmd_state_t state;
+    xrcmd_state_t next;         /* state after XRCMD_SEND completes      */
+    char *        host;
+    char          addr[IP_ADDR_LEN];
+    bool          want_err;     /* stderr channel requested              */
+    int           s;            /* stdin/stdout socket                   */
+    int           s2;           /* listening socket for stderr           */
+    int           s3;           /* stderr socket                         */
+    int           lport;
+    int           timo;         /* ECONNREFUSED retry backoff (secs)     */
+
+    char *        obuf;         /* pending output for XRCMD_SEND         */
+    int           olen;
+    int           ooff;
+    const char *  owhat;        /* description of output for errors      */
+
+    char *        cmdbuf;       /* locuser\0remuser\0cmd\0               */
+    int           cmdlen;
+
+    char          errbuf[LINEBUFSIZE];
+    int           errlen;
+};
+
+static struct xrcmd_conn *
+xrcmd_conn_create(char *ahost, char *addr, char *locuser, char *remuser,
+                  char *cmd, bool want_err)
+{
+    struct xrcmd_conn *c = Malloc(sizeof(*c));
+    int l1 = strlen(locuser) + 1;
+    int l2 = strlen(remuser) + 1;
+    int l3 = strlen(cmd) + 1;
+
+    memset(c, 0, sizeof(*c));
+    c->state = XRCMD_SOCKET;
+    c->host = Strdup(ahost);
+    memcpy(c->addr, addr, IP_ADDR_LEN);
+    c->want_err = want_err;
+    c->s = c->s2 = c->s3 = -1;
+    c->lport = IPPORT_RESERVED - 1;
+    c->timo = 1;
+
+    c->cmdlen = l1 + l2 + l3;
+    c->cmdbuf = Malloc(c->cmdlen + 1);
+    memcpy(c->cmdbuf, locuser, l1);
+    memcpy(c->cmdbuf + l1, remuser, l2);
+    memcpy(c->cmdbuf + l1 + l2, cmd, l3);
+
+    return (c);
+}
+
+static void xrcmd_conn_destroy(struct xrcmd_conn *c)
+{
+    if (c->s >= 0)
+        close(c->s);
+    if (c->s2 >= 0)
+        close(c->s2);
+    if (c->s3 >= 0)
+        close(c->s3);
+    Free((void **) &c->obuf);
+    Free((void **) &c->cmdbuf);
+    Free((void **) &c->host);
+    Free((void **) &c);
+}
+
+static void xrcmd_goto(struct rcmd_nbconn *nb, xrcmd_state_t state)
+{
+    ((struct xrcmd_conn *) nb->data)->state = state;
+    nb->revents[0] = nb->revents[1] = 0;
+}
+
+static int xrcmd_wait(struct rcmd_nbconn *nb, int fd0, int ev0,
+                      int fd1, int ev1, int timeout)
+{
+    nb->fd[0] = fd0;
+    nb->events[0] = ev0;
+    nb->fd[1] = fd1;
+    nb->events[1] = ev1;
+    nb->timeout = timeout;
+    return (RCMD_NB_WAIT);
+}
+
+/*
+ * Queue `len' bytes of `buf' to be written to the rshd socket, then
+ *  continue in state `next.'
+ */
+static void xrcmd_send(struct rcmd_nbconn *nb, const char *buf, int len,
+                       const char *what, xrcmd_state_t next)
+{
+    struct xrcmd_conn *c = nb->data;
+
+    Free((void **) &c->obuf);
+    c->obuf = Malloc(len);
+    memcpy(c->obuf, buf, len);
+    c->olen = len;
+    c->ooff = 0;
+    c->owhat = what;
+    c->next = next;
+    xrcmd_goto(nb, XRCMD_SEND);
+}
+
+/*
+ * Handle a failed connect() with errno set.
+ *  Returns 1 if another attempt should be made (possibly after
+ *  waiting c->timo seconds), or -1 if the connect failed.
+ */
+static int xrcmd_connect_failed(struct xrcmd_conn *c, int *delay)
+{
+    (void) close(c->s);
+    c->s = -1;
+    *delay = 0;
+
+    if (errno == EADDRINUSE) {
+        c->lport--;
+        return (1);
+    }
+    if (errno == ECONNREFUSED && c->timo <= 16) {
+        *delay = c->timo;
+        c->timo *= 2;
+        return (1);
+    }
+    err("%p: %S: connect: %m\n", c->host);
+    return (-1);
+}
+
+static int xrcmd_run(struct rcmd_nbconn *nb)
+{
+    struct xrcmd_conn *c = nb->data;
+    struct sockaddr_in sin, from;
+    socklen_t len;
+    int rv, delay;
+    char ch;
+
+    for (;;) {
+        switch (c->state) {
+        case XRCMD_SOCKET:
+            c->s = privsep_rresvport(&c->lport);
+            if (c->s < 0) {
+                if (errno == EAGAIN)
+                    err("%p: %S: rcmd: socket: all ports in use\n", c->host);
+                else
+                    err("%p: %S: rcmd: socket: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            }
+            fcntl(c->s, F_SETOWN, getpid());
+            fd_set_nonblocking(c->s);
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            memcpy(&sin.sin_addr, c->addr, IP_ADDR_LEN);
+            sin.sin_port = htons(RSH_PORT);
+            if (connect(c->s, (struct sockaddr *) &sin, sizeof(sin)) >= 0) {
+                xrcmd_goto(nb, XRCMD_CONNECTED);
+                break;
+            }
+            if (errno == EINPROGRESS) {
+                xrcmd_goto(nb, XRCMD_CONNECTING);
+                return (xrcmd_wait(nb, c->s, XPOLLWRITE, -1, 0, -1));
+            }
+            if (xrcmd_connect_failed(c, &delay) < 0)
+                return (RCMD_NB_ERROR);
+            if (delay)
+                return (xrcmd_wait(nb, -1, 0, -1, 0, delay * 1000));
+            break;
+
+        case XRCMD_CONNECTING:
+            len = sizeof(rv);
+            if (getsockopt(c->s, SOL_SOCKET, SO_ERROR, &rv, &len) < 0)
+                rv = errno;
+            if (rv == 0) {
+                xrcmd_goto(nb, XRCMD_CONNECTED);
+                break;
+            }
+            errno = rv;
+            if (xrcmd_connect_failed(c, &delay) < 0)
+                return (RCMD_NB_ERROR);
+            xrcmd_goto(nb, XRCMD_SOCKET);
+            if (delay)
+                return (xrcmd_wait(nb, -1, 0, -1, 0, delay * 1000));
+            break;
+
+        case XRCMD_CONNECTED:
+            c->lport--;
+            if (!c->want_err) {
+                /* empty stderr port string followed by user and cmd */
+                char *buf = Malloc(c->cmdlen + 1);
+
+                buf[0] = '\0';
+                memcpy(buf + 1, c->cmdbuf, c->cmdlen);
+                xrcmd_send(nb, buf, c->cmdlen + 1, "write (user,cmd)",
+                           XRCMD_RESPONSE);
+                Free((void **) &buf);
+                c->lport = 0;
+            } else {
+                char num[8];
+
+                if ((c->s2 = privsep_rresvport(&c->lport)) < 0)
+                    return (RCMD_NB_ERROR);
+                listen(c->s2, 1);
+                snprintf(num, sizeof(num), "%d", c->lport);
+                xrcmd_send(nb, num, strlen(num) + 1,
+                           "rcmd: write (setting up stderr)", XRCMD_ACCEPT);
+            }
+            break;
+
+        case XRCMD_SEND:
+            while (c->ooff < c->olen) {
+                rv = write(c->s, c->obuf + c->ooff, c->olen - c->ooff);
+                if (rv < 0) {
+                    if (errno == EAGAIN || errno == EINTR)
+                        return (xrcmd_wait(nb, c->s, XPOLLWRITE, -1, 0, -1));
+                    err("%p: %S: %s: %m\n", c->host, c->owhat);
+                    return (RCMD_NB_ERROR);
+                }
+                c->ooff += rv;
+            }
+            xrcmd_goto(nb, c->next);
+            break;
+
+        case XRCMD_ACCEPT:
+            if (nb->revents[0]) {
+                err("%p: %S: rcmd: xpoll: protocol failure in circuit setup\n",
+                    c->host);
+                return (RCMD_NB_ERROR);
+            }
+            if (!(nb->revents[1] & (XPOLLREAD|XPOLLERR)))
+                return (xrcmd_wait(nb, c->s, XPOLLREAD,
+                                   c->s2, XPOLLREAD, -1));
+
+            len = sizeof(from);
+            c->s3 = accept(c->s2, (struct sockaddr *) &from, &len);
+            (void) close(c->s2);
+            c->s2 = -1;
+            if (c->s3 < 0) {
+                err("%p: %S: rcmd: accept: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            }
+            from.sin_port = ntohs((u_short) from.sin_port);
+            if (from.sin_family != AF_INET ||
+                from.sin_port >= IPPORT_RESERVED ||
+                from.sin_port < IPPORT_RESERVED / 2) {
+                err("%p: %S: socket: protocol failure in circuit setup\n",
+                    c->host);
+                return (RCMD_NB_ERROR);
+            }
+            xrcmd_send(nb, c->cmdbuf, c->cmdlen, "write (user,cmd)",
+                       XRCMD_RESPONSE);
+            break;
+
+        case XRCMD_RESPONSE:
+            if ((rv = read(c->s, &ch, 1)) < 0) {
+                if (errno == EAGAIN || errno == EINTR)
+                    return (xrcmd_wait(nb, c->s, XPOLLREAD, -1, 0, -1));
+                err("%p: %S: read: protocol failure: %m\n", c->host);
+                return (RCMD_NB_ERROR);
+            } else if (rv != 1) {
+                err("%p: %S: read: protocol failure: %s\n",
+                    c->host, "invalid response");
+                return (RCMD_NB_ERROR);
+            }
+            if (ch == 0) {
+                xrcmd_goto(nb, XRCMD_DONE);
+                break;
+            }
+            /* retrieve error string from remote server */
+            c->errlen = 0;
+            xrcmd_goto(nb, XRCMD_ERRMSG);
+            break;
+
+        case XRCMD_ERRMSG:
+            while (c->errlen < (int) sizeof(c->errbuf) - 2) {
+                if ((rv = read(c->s, &ch, 1)) < 0) {
+                    if (errno == EAGAIN || errno == EINTR)
+                        return (xrcmd_wait(nb, c->s, XPOLLREAD, -1, 0, -1));
+                    break;
+                }
+                if (rv == 0)
+                    break;
+                c->errbuf[c->errlen++] = ch;
+                if (ch == '\n')
+                    break;
+            }
+            if ((c->errlen == 0) || (c->errbuf[c->errlen - 1] != '\n'))
+                c->errbuf[c->errlen++] = '\n';
+            c->errbuf[c->errlen] = '\0';
+            err("%S: %s", c->host, c->errbuf);
+            return (RCMD_NB_ERROR);
+
+        case XRCMD_DONE:
+            nb->fd[0] = nb->fd[1] = -1;
+            return (RCMD_NB_DONE);
+        }
+    }
+    /* NOTREACHED */
+    return (RCMD_NB_ERROR);
+}
+
+/*
+ * Begin an rcmd connection.
  * 	ahost (IN)	remote hostname
  *	addr (IN)	4 byte internet address
  *	locuser (IN)	local username
  *	remuser (IN)	remote username
  *	cmd (IN)	command to execute
  *	rank (IN)	MPI rank for this process
- *	fd2p (IN/OUT)	if non-NULL, open stderr backchannel on this fd
- *	s (RETURN)	socket for stdout/sdin or -1 on failure
+ *	want_err (IN)	if true, open stderr backchannel
+ *	nb (IN/OUT)	non-blocking connection state
  */
 static int
-xrcmd(char *ahost, char *addr, char *locuser, char *remuser,
-      char *cmd, int rank, int *fd2p, void **arg)
+xrcmd_start(char *ahost, char *addr, char *locuser, char *remuser,
+            char *cmd, int rank, bool want_err, struct rcmd_nbconn *nb)
 {
-    struct sockaddr_in sin, from;
-    sigset_t oldset, blockme;
-    pid_t pid;
-    int s, lport, timo, rv;
-    char c;
-    struct xpollfd xpfds[2];
-
-    memset (xpfds, 0, sizeof (xpfds));
-
-    pid = getpid();
-
-    sigemptyset(&blockme);
-    sigaddset(&blockme, SIGURG);
-    pthread_sigmask(SIG_BLOCK, &blockme, &oldset);
-    for (timo = 1, lport = IPPORT_RESERVED - 1;;) {
-        s = privsep_rresvport(&lport);
-        if (s < 0) {
-            if (errno == EAGAIN)
-                err("%p: %S: rcmd: socket: all ports in use\n", ahost);
-            else
-                err("%p: %S: rcmd: socket: %m\n", ahost);
-            pthread_sigmask(SIG_SETMASK, &oldset, NULL);
-            return (-1);
-        }
-        fcntl(s, F_SETOWN, pid);
-        memset (&sin, 0, sizeof (sin));
-        sin.sin_family = AF_INET;
-        memcpy(&sin.sin_addr, addr, IP_ADDR_LEN);
-        sin.sin_port = htons(RSH_PORT);
-        rv = connect(s, (struct sockaddr *) &sin, sizeof(sin));
-        if (rv >= 0)
-            break;
-        (void) close(s);
-        if (errno == EADDRINUSE) {
-            lport--;
-            continue;
-        }
-        if (errno == ECONNREFUSED && timo <= 16) {
-            (void) sleep(timo);
-            timo *= 2;
-            continue;
-        }
-        if (errno == EINTR)
-            err("%p: %S: connect: timed out\n", ahost);
-        else
-            err("%p: %S: connect: %m\n", ahost);
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    nb->data = xrcmd_conn_create(ahost, addr, locuser, remuser, cmd, want_err);
+    return (xrcmd_run(nb));
+}
+
+static int xrcmd_continue(struct rcmd_nbconn *nb)
+{
+    return (xrcmd_run(nb));
+}
+
+/*
+ * Return socket for stdout/stdin (and stderr in *fd2p) of a completed
+ *  connection, or -1 if the connection failed or was abandoned.
+ */
+static int xrcmd_finish(struct rcmd_nbconn *nb, int *fd2p, void **arg)
+{
+    struct xrcmd_conn *c = nb->data;
+    int s = -1;
+
+    if (c == NULL)
         return (-1);
-    }
-    lport--;
-    if (fd2p == 0) {
-        if (write(s, "", 1) != 1) {
-            err ("%p: %S: write: %m\n", ahost);
-            goto bad;
-        }
-        lport = 0;
-    } else {
-        char num[8];
-        int s2 = privsep_rresvport(&lport), s3;
-        socklen_t len = sizeof(from);   /* arg to accept */
-
-        if (s2 < 0)
-            goto bad;
-        listen(s2, 1);
-        snprintf(num, sizeof(num), "%d", lport);
-        if (write(s, num, strlen(num) + 1) != strlen(num) + 1) {
-            err("%p: %S: rcmd: write (setting up stderr): %m\n", ahost);
-            (void) close(s2);
-            goto bad;
-        }
-        errno = 0;
-        xpfds[0].fd = s;
-        xpfds[1].fd = s2;
-        xpfds[0].events = xpfds[1].events = XPOLLREAD;
-        if (((rv = xpoll(xpfds, 2, -1)) < 0) || rv != 1 || (xpfds[0].revents > 0)) {
-          if (errno != 0)
-            err("%p: %S: rcmd: xpoll (setting up stderr): %m\n", ahost);
-          else
-            err("%p: %S: rcmd: xpoll: protocol failure in circuit setup\n", ahost);
-          (void) close(s2);
-          goto bad;
-        }
-        s3 = accept(s2, (struct sockaddr *) &from, &len);
-        (void) close(s2);
-        if (s3 < 0) {
-            err("%p: %S: rcmd: accept: %m\n", ahost);
-            lport = 0;
-            goto bad;
-        }
-        *fd2p = s3;
-        from.sin_port = ntohs((u_short) from.sin_port);
-        if (from.sin_family != AF_INET ||
-            from.sin_port >= IPPORT_RESERVED ||
-            from.sin_port < IPPORT_RESERVED / 2) {
-            err("%p: %S: socket: protocol failure in circuit setup\n",
-                ahost);
-            goto bad2;
-        }
-    }
-    if (write(s, locuser, strlen(locuser) + 1) < 0
-       || write(s, remuser, strlen(remuser) + 1) < 0
-       || write(s, cmd, strlen(cmd) + 1) < 0) {
-        err("%p: %S: write (user,cmd): %m\n", ahost);
-        goto bad2;
-    }
-    rv = read(s, &c, 1);
-    if (rv < 0) {
-        if (errno == EINTR)
-            err("%p: %S: read: protocol failure: %s\n",
-                ahost, "timed out");
-        else
-            err("%p: %S: read: protocol failure: %m\n", ahost);
-        goto bad2;
-    } else if (rv != 1) {
-        err("%p: %S: read: protocol failure: %s\n",
-            ahost, "invalid response");
-        goto bad2;
-    }
-    if (c != 0) {
-        /* retrieve error string from remote server */
-        char tmpbuf[LINEBUFSIZE];
-        char *p = tmpbuf;
-
-        while (read(s, &c, 1) == 1) {
-            *p++ = c;
-            if (c == '\n')
-                break;
+
+    if (c->state == XRCMD_DONE) {
+        s = c->s;
+        c->s = -1;
+        fd_set_blocking(s);
+        if (fd2p) {
+            *fd2p = c->s3;
+            c->s3 = -1;
+            fd_set_blocking(*fd2p);
         }
-        if (c != '\n')
-            *p++ = '\n';
-        *p++ = '\0';
-        err("%S: %s", ahost, tmpbuf);
-        goto bad2;
     }
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    xrcmd_conn_destroy(c);
+    nb->data = NULL;
+
     return (s);
-  bad2:
-    if (lport)
-        (void) close(*fd2p);
-  bad:
-    (void) close(s);
-    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
-    return (-1);
 }
 
 /*
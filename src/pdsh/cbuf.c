@@ -113,6 +113,20 @@ struct cbuf {
     unsigned char      *data;           /* ptr to circular buffer of data    */
 };
 
+struct cbuf_pool {
+
+#ifdef WITH_PTHREADS
+    pthread_mutex_t     mutex;          /* mutex to protect access to pool   */
+#endif /* WITH_PTHREADS */
+
+    int                 minsize;        /* min bytes of data for pool cbufs  */
+    int                 maxsize;        /* max bytes of data for pool cbufs  */
+    int                 maxfree;        /* max num cbufs kept for reuse      */
+    cbuf_t             *free;           /* stack of cbufs kept for reuse     */
+    cbuf_pool_stats_t   stats;          /* pool statistics (stats.nfree is   */
+                                        /*   the top of the free stack)      */
+};
+
 typedef int (*cbuf_iof) (void *cbuf_data, void *arg, int len);
 
 
@@ -700,6 +714,43 @@ cbuf_peek_line (cbuf_t src, char *dstbuf, int len, int lines)
 }
 
 
+int
+cbuf_peek_line_iov (cbuf_t src, struct iovec *iov, int lines, int *nlines)
+{
+    int n, m;
+
+    assert(src != NULL);
+
+    if ((iov == NULL) || (lines < -1)) {
+        errno = EINVAL;
+        return(-1);
+    }
+    iov[0].iov_len = iov[1].iov_len = 0;
+    if (nlines) {
+        *nlines = 0;
+    }
+    if (lines == 0) {
+        return(0);
+    }
+    cbuf_mutex_lock(src);
+    assert(cbuf_is_valid(src));
+    n = cbuf_find_unread_line(src, src->used, &lines);
+    if (n > 0) {
+        m = MIN(n, (src->size + 1) - src->i_out);
+        iov[0].iov_base = &src->data[src->i_out];
+        iov[0].iov_len = m;
+        iov[1].iov_base = src->data;
+        iov[1].iov_len = n - m;
+        if (nlines) {
+            *nlines = lines;
+        }
+    }
+    assert(cbuf_is_valid(src));
+    cbuf_mutex_unlock(src);
+    return(n);
+}
+
+
 int
 cbuf_read_line (cbuf_t src, char *dstbuf, int len, int lines)
 {
@@ -1110,6 +1161,129 @@ cbuf_move (cbuf_t src, cbuf_t dst, int len, int *ndropped)
 }
 
 
+cbuf_pool_t
+cbuf_pool_create (int minsize, int maxsize, int maxfree)
+{
+    cbuf_pool_t pool;
+
+    if ((minsize <= 0) || (maxfree < 0)) {
+        errno = EINVAL;
+        return(NULL);
+    }
+    if (!(pool = malloc(sizeof(struct cbuf_pool)))) {
+        errno = ENOMEM;
+        return(lsd_nomem_error(__FILE__, __LINE__, "cbuf pool struct"));
+    }
+    if (!(pool->free = malloc((maxfree + 1) * sizeof(cbuf_t)))) {
+        free(pool);
+        errno = ENOMEM;
+        return(lsd_nomem_error(__FILE__, __LINE__, "cbuf pool free list"));
+    }
+    cbuf_mutex_init(pool);
+    pool->minsize = minsize;
+    pool->maxsize = maxsize;
+    pool->maxfree = maxfree;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    return(pool);
+}
+
+
+void
+cbuf_pool_destroy (cbuf_pool_t pool)
+{
+    assert(pool != NULL);
+    cbuf_mutex_lock(pool);
+    while (pool->stats.nfree > 0) {
+        cbuf_destroy(pool->free[--pool->stats.nfree]);
+    }
+    free(pool->free);
+    cbuf_mutex_unlock(pool);
+    cbuf_mutex_destroy(pool);
+    free(pool);
+    return;
+}
+
+
+cbuf_t
+cbuf_pool_get (cbuf_pool_t pool)
+{
+    cbuf_t cb = NULL;
+    int size = 0;
+
+    assert(pool != NULL);
+    cbuf_mutex_lock(pool);
+    if (pool->stats.nfree > 0) {
+        cb = pool->free[--pool->stats.nfree];
+    }
+    cbuf_mutex_unlock(pool);
+
+    /*  Size is only zero for a newly created cbuf.
+     */
+    if (cb != NULL) {
+        size = cbuf_size(cb);
+    }
+    else if (!(cb = cbuf_create(pool->minsize, pool->maxsize))) {
+        return(NULL);
+    }
+
+    cbuf_mutex_lock(pool);
+    if (size > 0) {
+        pool->stats.reused++;
+        pool->stats.free_bytes -= size;
+    }
+    else {
+        pool->stats.created++;
+    }
+    pool->stats.inuse++;
+    pool->stats.inuse_max = MAX(pool->stats.inuse_max, pool->stats.inuse);
+    cbuf_mutex_unlock(pool);
+    return(cb);
+}
+
+
+void
+cbuf_pool_put (cbuf_pool_t pool, cbuf_t cb)
+{
+    int size;
+
+    assert(pool != NULL);
+    assert(cb != NULL);
+
+    cbuf_flush(cb);
+    cbuf_opt_set(cb, CBUF_OPT_OVERWRITE, CBUF_WRAP_MANY);
+    size = cbuf_size(cb);
+
+    cbuf_mutex_lock(pool);
+    pool->stats.inuse--;
+    if (pool->stats.nfree < pool->maxfree) {
+        pool->free[pool->stats.nfree++] = cb;
+        pool->stats.free_bytes += size;
+        cb = NULL;
+    }
+    else {
+        pool->stats.destroyed++;
+    }
+    cbuf_mutex_unlock(pool);
+
+    if (cb != NULL) {
+        cbuf_destroy(cb);
+    }
+    return;
+}
+
+
+void
+cbuf_pool_get_stats (cbuf_pool_t pool, cbuf_pool_stats_t *stats)
+{
+    assert(pool != NULL);
+    assert(stats != NULL);
+    cbuf_mutex_lock(pool);
+    *stats = pool->stats;
+    cbuf_mutex_unlock(pool);
+    return;
+}
+
+
 static int
 cbuf_find_replay_line (cbuf_t cb, int chars, int *nlines, int *nl)
 {
@@ -1218,6 +1392,8 @@ cbuf_find_unread_line (cbuf_t cb, int chars, int *nlines)
  */
     int i, n, m, l;
     int lines;
+    int len;
+    unsigned char *p, *q, *end;
 
     assert(cb != NULL);
     assert(nlines != NULL);
@@ -1234,26 +1410,27 @@ cbuf_find_unread_line (cbuf_t cb, int chars, int *nlines)
     if (cb->used == 0) {
         return(0);                      /* no unread data available */
     }
-    if (lines > 0) {
-        chars = -1;                     /* chars parm not used if lines > 0 */
+    len = cb->used;
+    if ((lines <= -1) && (chars < len)) {
+        len = chars;                    /* chars parm only used if lines < 0 */
     }
+    /*  Scan each contiguous region of unread data with memchr(),
+     *    as there are at most two (before and after the wraparound).
+     */
     i = cb->i_out;
-    while (i != cb->i_in) {
-        ++n;
-        if (chars > 0) {
-            --chars;
-        }
-        if (cb->data[i] == '\n') {
+    while ((n < len) && (lines != 0)) {
+        p = &cb->data[i];
+        end = p + MIN(len - n, (cb->size + 1) - i);
+        while ((lines != 0) && (q = memchr(p, '\n', end - p))) {
             if (lines > 0) {
                 --lines;
             }
-            m = n;
+            m = n + (q - &cb->data[i]) + 1;
             ++l;
+            p = q + 1;
         }
-        if ((chars == 0) || (lines == 0)) {
-            break;
-        }
-        i = (i + 1) % (cb->size + 1);
+        n += end - &cb->data[i];
+        i = (i + (end - &cb->data[i])) % (cb->size + 1);
     }
     if (lines > 0) {
         return(0);                      /* all or none, and not enough found */
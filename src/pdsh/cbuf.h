@@ -26,6 +26,8 @@
 #ifndef LSD_CBUF_H
 #define LSD_CBUF_H
 
+#include <sys/uio.h>                    /* struct iovec */
+
 
 /***********
  *  Notes  *
@@ -58,6 +60,12 @@
  *  This macro may be redefined to invoke another routine instead.
  *
  *  If WITH_PTHREADS is defined, these routines will be thread-safe.
+ *
+ *  A cbuf pool hands out cbufs of a fixed [minsize] and [maxsize] and
+ *  keeps up to [maxfree] of those returned to it for reuse, so that a
+ *  program cycling through many short-lived cbufs reuses the (possibly
+ *  already grown) data buffers of earlier ones instead of allocating and
+ *  growing new ones.
  */
 
 
@@ -67,6 +75,18 @@
 
 typedef struct cbuf * cbuf_t;           /* circular-buffer opaque data type  */
 
+typedef struct cbuf_pool * cbuf_pool_t; /* cbuf pool opaque data type        */
+
+typedef struct {                        /* cbuf pool statistics              */
+    int created;                        /* -num cbufs created by pool        */
+    int reused;                         /* -num gets satisfied by free list  */
+    int destroyed;                      /* -num puts destroyed (list full)   */
+    int inuse;                          /* -num cbufs currently handed out   */
+    int inuse_max;                      /* -max cbufs handed out at once     */
+    int nfree;                          /* -num cbufs on free list           */
+    long free_bytes;                    /* -data bytes held by free list     */
+} cbuf_pool_stats_t;
+
 typedef enum {                          /* cbuf option names                 */
     CBUF_OPT_OVERWRITE
 } cbuf_opt_t;
@@ -218,6 +238,23 @@ int cbuf_peek_line (cbuf_t src, char *dstbuf, int len, int lines);
  *    Returns -1 on error (with errno set).
  */
 
+int cbuf_peek_line_iov (cbuf_t src, struct iovec *iov, int lines,
+                        int *nlines);
+/*
+ *  Points [iov] at the specified [lines] of unread data in [src] without
+ *    copying or consuming it.  If [lines] is -1, points at all complete
+ *    lines available.  Since the data may wrap around the end of the
+ *    buffer, [iov] must have room for two entries; the second has an
+ *    iov_len of 0 if the data is contiguous.  Sets [nlines] (if not NULL)
+ *    to the number of lines found.
+ *  The data is only valid until the next call that writes to or resizes
+ *    [src], so the caller must serialize access to the cbuf.  The "peek"
+ *    can be committed to the cbuf via a call to cbuf_drop().
+ *  Returns the number of bytes in the line(s) on success.
+ *    Returns 0 if the number of lines is not available (ie, all or none).
+ *    Returns -1 on error (with errno set).
+ */
+
 int cbuf_read_line (cbuf_t src, char *dstbuf, int len, int lines);
 /*
  *  Reads the specified [lines] of data from the [src] cbuf into [dstbuf].
@@ -315,5 +352,40 @@ int cbuf_move (cbuf_t src, cbuf_t dst, int len, int *ndropped);
  *    Sets [ndropped] (if not NULL) to the number of [dst] bytes overwritten.
  */
 
+cbuf_pool_t cbuf_pool_create (int minsize, int maxsize, int maxfree);
+/*
+ *  Creates and returns a new pool of cbufs created with [minsize] and
+ *    [maxsize] as for cbuf_create(), or lsd_nomem_error() on failure.
+ *    Up to [maxfree] cbufs returned to the pool are kept for reuse.
+ *  Abandoning a pool without calling cbuf_pool_destroy() will cause
+ *    a memory leak.
+ */
+
+void cbuf_pool_destroy (cbuf_pool_t pool);
+/*
+ *  Destroys the pool [pool] and all cbufs on its free list.
+ *  Cbufs still handed out by the pool must be destroyed with cbuf_destroy().
+ */
+
+cbuf_t cbuf_pool_get (cbuf_pool_t pool);
+/*
+ *  Returns an empty cbuf from [pool], reusing a cbuf from its free list
+ *    if possible, or lsd_nomem_error() on failure.
+ *  The cbuf has the default overwrite option behavior, but may already
+ *    be larger than the pool's [minsize].
+ */
+
+void cbuf_pool_put (cbuf_pool_t pool, cbuf_t cb);
+/*
+ *  Returns the cbuf [cb] obtained from cbuf_pool_get() to [pool].
+ *    Any data remaining in [cb] is flushed.  If the pool's free list
+ *    is full, [cb] is destroyed.
+ */
+
+void cbuf_pool_get_stats (cbuf_pool_t pool, cbuf_pool_stats_t *stats);
+/*
+ *  Copies the current statistics for [pool] into [stats].
+ */
+
 
 #endif /* !LSD_CBUF_H */
@@ -0,0 +1,252 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Coalesced output (see coalesce.h).
+ *
+ * Groups are kept in a hash table keyed by a 64-bit FNV-1a hash of the
+ *  output, which each host buffer computes as output is appended. On a
+ *  hash match, the contents are compared to rule out collisions.
+ */
+
+#if     HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if	HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "src/common/hostlist.h"
+#include "src/common/err.h"
+#include "src/common/xmalloc.h"
+#include "src/common/macros.h"
+#include "coalesce.h"
+
+#define FNV_OFFSET      ((uint64_t) 14695981039346656037ULL)
+#define FNV_PRIME       ((uint64_t) 1099511628211ULL)
+
+#define COALESCE_MINBUF     1024    /* initial host buffer size  */
+#define COALESCE_MINHASH    64      /* initial hash table size   */
+
+struct coalesce_buf {
+    char            *data;
+    int              len;
+    int              size;
+    uint64_t         hash;
+};
+
+struct coalesce_group {
+    struct coalesce_group *next;    /* next group in hash chain */
+    uint64_t         hash;
+    char            *data;          /* the one copy of this output */
+    int              len;
+    hostlist_t       hl;            /* hosts producing this output */
+    int              order;         /* lowest order of hosts in group */
+};
+
+static pthread_mutex_t coalesce_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct coalesce_group **groups = NULL;
+static int ngroups = 0;
+static int nbuckets = 0;
+
+coalesce_buf_t coalesce_buf_create (void)
+{
+    coalesce_buf_t cb = Malloc (sizeof (*cb));
+
+    cb->data = NULL;
+    cb->len = cb->size = 0;
+    cb->hash = FNV_OFFSET;
+    return (cb);
+}
+
+void coalesce_buf_append (coalesce_buf_t cb, const char *data, int len)
+{
+    const unsigned char *p = (const unsigned char *) data;
+    uint64_t hash = cb->hash;
+    int i;
+
+    if (cb->len + len > cb->size) {
+        int size = MAX (cb->size, COALESCE_MINBUF);
+        while (size < cb->len + len)
+            size *= 2;
+        if (cb->data)
+            Realloc ((void **) &cb->data, size);
+        else
+            cb->data = Malloc (size);
+        cb->size = size;
+    }
+    memcpy (cb->data + cb->len, data, len);
+    cb->len += len;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    cb->hash = hash;
+}
+
+static void _coalesce_buf_destroy (coalesce_buf_t cb)
+{
+    if (cb->data)
+        Free ((void **) &cb->data);
+    Free ((void **) &cb);
+}
+
+static void _grow_table (void)
+{
+    int n = nbuckets ? nbuckets * 2 : COALESCE_MINHASH;
+    struct coalesce_group **tbl = Malloc (n * sizeof (*tbl));
+    int i;
+
+    memset (tbl, 0, n * sizeof (*tbl));
+    for (i = 0; i < nbuckets; i++) {
+        struct coalesce_group *g = groups[i];
+        while (g) {
+            struct coalesce_group *next = g->next;
+            g->next = tbl[g->hash & (n - 1)];
+            tbl[g->hash & (n - 1)] = g;
+            g = next;
+        }
+    }
+    if (groups)
+        Free ((void **) &groups);
+    groups = tbl;
+    nbuckets = n;
+}
+
+void coalesce_add (coalesce_buf_t cb, const char *host, int order)
+{
+    struct coalesce_group *g;
+
+    if (cb->len == 0) {
+        _coalesce_buf_destroy (cb);
+        return;
+    }
+
+    pthread_mutex_lock (&coalesce_mutex);
+
+    if (ngroups >= nbuckets)
+        _grow_table ();
+
+    for (g = groups[cb->hash & (nbuckets - 1)]; g; g = g->next) {
+        if ((g->hash == cb->hash) && (g->len == cb->len)
+            && (memcmp (g->data, cb->data, cb->len) == 0))
+            break;
+    }
+
+    if (g == NULL) {
+        g = Malloc (sizeof (*g));
+        g->hash = cb->hash;
+        g->data = cb->data;         /* group takes over output */
+        g->len = cb->len;
+        g->hl = hostlist_create (NULL);
+        g->order = order;
+        g->next = groups[g->hash & (nbuckets - 1)];
+        groups[g->hash & (nbuckets - 1)] = g;
+        ngroups++;
+        cb->data = NULL;
+    }
+    else if (order < g->order)
+        g->order = order;
+
+    hostlist_push_host (g->hl, host);
+
+    pthread_mutex_unlock (&coalesce_mutex);
+
+    _coalesce_buf_destroy (cb);
+}
+
+static int _cmp_order (const void *x, const void *y)
+{
+    const struct coalesce_group *g1 = *(struct coalesce_group **) x;
+    const struct coalesce_group *g2 = *(struct coalesce_group **) y;
+
+    return (g1->order - g2->order);
+}
+
+static void _print_group (struct coalesce_group *g)
+{
+    static const char div[] = "----------------\n";
+    size_t size = 1024;
+    char *hosts = Malloc (size);
+
+    hostlist_sort (g->hl);
+    while (hostlist_ranged_string (g->hl, size, hosts) < 0) {
+        size *= 2;
+        Realloc ((void **) &hosts, size);
+    }
+
+    fputs (div, stdout);
+    fputs (hosts, stdout);
+    fputc ('\n', stdout);
+    fputs (div, stdout);
+    fwrite (g->data, 1, g->len, stdout);
+    if (g->data[g->len - 1] != '\n')
+        fputc ('\n', stdout);
+
+    Free ((void **) &hosts);
+}
+
+void coalesce_print (void)
+{
+    struct coalesce_group **list;
+    struct coalesce_group *g;
+    int i, n = 0;
+
+    pthread_mutex_lock (&coalesce_mutex);
+
+    if (ngroups > 0) {
+        list = Malloc (ngroups * sizeof (*list));
+        for (i = 0; i < nbuckets; i++)
+            for (g = groups[i]; g; g = g->next)
+                list[n++] = g;
+
+        qsort (list, n, sizeof (*list), _cmp_order);
+
+        for (i = 0; i < n; i++) {
+            _print_group (list[i]);
+            hostlist_destroy (list[i]->hl);
+            Free ((void **) &list[i]->data);
+            Free ((void **) &list[i]);
+        }
+        fflush (stdout);
+        Free ((void **) &list);
+    }
+
+    if (groups)
+        Free ((void **) &groups);
+    ngroups = nbuckets = 0;
+
+    pthread_mutex_unlock (&coalesce_mutex);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
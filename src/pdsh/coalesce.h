@@ -0,0 +1,73 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+#ifndef _COALESCE_INCLUDED
+#define _COALESCE_INCLUDED
+
+/*
+ *  Coalesced output (pdsh -B). Instead of printing each host's stdout
+ *   as it arrives, the output is collected per host and, when the host
+ *   is done, grouped with the output of other hosts by content. Only one
+ *   copy of each distinct output is kept. coalesce_print() then prints
+ *   each distinct output once, under a dshbak(1) style header listing
+ *   the hosts that produced it:
+ *
+ *     ----------------
+ *     host[1-3,5]
+ *     ----------------
+ *     output...
+ */
+
+typedef struct coalesce_buf * coalesce_buf_t;
+
+/*
+ *  Create an empty output buffer for one host.
+ */
+coalesce_buf_t coalesce_buf_create (void);
+
+/*
+ *  Append `len' bytes of output to buffer `cb'. The buffer keeps a
+ *   running hash of its contents, so grouping does not rescan it.
+ */
+void coalesce_buf_append (coalesce_buf_t cb, const char *data, int len);
+
+/*
+ *  Add complete output `cb' of host `host' to the matching group, or
+ *   start a new group. The buffer is consumed. Groups are printed in
+ *   order of the lowest `order' of their hosts. Hosts with no output
+ *   are ignored. May be called from multiple threads.
+ */
+void coalesce_add (coalesce_buf_t cb, const char *host, int order);
+
+/*
+ *  Print all groups to stdout and free them.
+ */
+void coalesce_print (void);
+
+#endif /* !_COALESCE_INCLUDED */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -35,9 +35,9 @@
  * which causes the main thread to start another rsh/krsh/etc. thread to take
  * its place.
  *
- * We rely on implicit stdio locking to enable us to write lines to
- * stdout/stderr from multiple threads concurrently without getting the lines
- * all mixed up.
+ * While hosts are running, lines written to stdout/stderr with out() and
+ * err() are queued to a single writer thread (see outq.h), which writes
+ * each line whole, so lines from multiple threads never get mixed up.
  *
  * A special watchdog thread sends SIGLARM to any threads that have been in
  * the DSH_RCMD state (usually connect() in rcmd/k4cmd/etc.) for more than
@@ -54,6 +54,10 @@
  * these structures is declared globally so signal handlers can access.
  * The array is initialized by dsh() below, and the rsh() function for each
  * thread is passed the element corresponding to one connection.
+ *
+ * Alternatively (PDSH_ENGINE=event), hosts are serviced by a small, fixed
+ * pool of connector and reactor threads rather than a thread per host.
+ * See "Event engine" below.
  */
 
 #if     HAVE_CONFIG_H
@@ -64,8 +68,12 @@
 #include <pthread.h>
 #endif
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
+#if	HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <sys/time.h>
 #if	HAVE_UNISTD_H
 #include <unistd.h>
@@ -81,6 +89,7 @@
 #endif
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
 #include <netdb.h>              /* gethostbyname */
 #include <sys/resource.h>       /* get/setrlimit */
 
@@ -116,6 +125,7 @@
 #include "pcp_server.h"
 #include "wcoll.h"
 #include "rcmd.h"
+#include "outq.h"
 
 static int debug = 0;
 
@@ -130,19 +140,32 @@ static pthread_cond_t threadcount_cond = PTHREAD_COND_INITIALIZER;
 static int threadcount = 0;
 
 /*
- * This array is initialized in dsh().  It contains an entry for every
- * potentially active thread, though only the fanout number will be active
- * at once.  It is out here in global land so the signal handler for ^C can
- * report which hosts are blocked.
+ * This array is initialized in dsh().  It contains a record for every
+ * host, though only the fanout number will be active (have a thd_t) at
+ * once.  It is out here in global land so the signal handler for ^C can
+ * report which hosts are blocked. The active state pointer and state
+ * of each record are protected by thd_mutex.
  */
-static thd_t *t;
+static hostrec_t *hosts;
 static pthread_mutex_t thd_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Output buffers of finished hosts are returned to this pool for reuse
+ *  by hosts entering the fanout window. Created in dsh().
+ */
+static cbuf_pool_t cbuf_pool = NULL;
+
 /*
  * Timeout values, initialized in dsh(), used in _wdog().
  */
 static int connect_timeout, command_timeout;
 
+/*
+ * True if hosts are serviced by the event engine (PDSH_ENGINE=event)
+ *  instead of one thread per host.
+ */
+static bool event_engine = false;
+
 /*
  * Terminate on a single SIGINT (batch mode)
  */
@@ -151,11 +174,12 @@ static int sigint_terminates = 0;
 /*
  *  Buffered output prototypes:
  */
-typedef void (* out_f) (const char *, ...);
-static int _do_output (int fd, cbuf_t cb, out_f outf, bool read_rc, thd_t *t);
+static int _do_output (int fd, cbuf_t cb, FILE *stream, bool read_rc, thd_t *t);
 static int _handle_rcmd_stderr (thd_t *t);
 static int _handle_rcmd_stdout (thd_t *t);
-static void _flush_output (cbuf_t cb, out_f outf, thd_t *t);
+static void _flush_output (cbuf_t cb, FILE *stream, thd_t *t);
+
+static int _dsh_attr_init (pthread_attr_t *attrp, int stacksize);
 
 /*
  * Emulate signal() but with BSD semantics (i.e. don't restore signal to
@@ -193,23 +217,27 @@ static void _list_slowthreads(void)
 {
     int i;
     time_t ttl;
+    thd_t *th;
 
     dsh_mutex_lock(&thd_mutex);
 
-    for (i = 0; t[i].host != NULL; i++) {
+    for (i = 0; hosts[i].host != NULL; i++) {
+
+        /* only active hosts can be in DSH_RCMD or DSH_READING */
+        th = hosts[i].thd;
 
-        switch (t[i].state) {
+        switch (th ? th->state : hosts[i].state) {
         case DSH_READING:
-            err("%p: %S: command in progress", t[i].host);
-            ttl = t[i].connect + command_timeout - time(NULL);
+            err("%p: %S: command in progress", th->host);
+            ttl = th->connect + command_timeout - time(NULL);
             if (debug && command_timeout)
                 err(" (timeout in %d secs)\n", ttl);
             else
                 err("\n");
             break;
         case DSH_RCMD:
-            ttl = t[i].start + connect_timeout - time(NULL);
-            err("%p: %S: connecting", t[i].host, ttl);
+            ttl = th->start + connect_timeout - time(NULL);
+            err("%p: %S: connecting", th->host, ttl);
             if (debug && connect_timeout)
                 err(" (timeout in %d secs)\n", ttl);
             else
@@ -217,19 +245,19 @@ static void _list_slowthreads(void)
             break;
         case DSH_NEW:
             if (debug)
-                err("%p: %S: [new]\n", t[i].host);
+                err("%p: %S: [new]\n", hosts[i].host);
             break;
         case DSH_FAILED:
             if (debug)
-                err("%p: %S: [failed]\n", t[i].host);
+                err("%p: %S: [failed]\n", hosts[i].host);
             break;
         case DSH_DONE:
             if (debug)
-                err("%p: %S: [done]\n", t[i].host);
+                err("%p: %S: [done]\n", hosts[i].host);
             break;
         case DSH_CANCELED:
             if (debug)
-                err("%p: %S: [canceled]\n", t[i].host);
+                err("%p: %S: [canceled]\n", hosts[i].host);
             break;
         }
     }
@@ -262,89 +290,335 @@ static void _fwd_signal(int signum)
     int i;
 
     dsh_mutex_lock(&thd_mutex);
-    for (i = 0; t[i].host != NULL; i++) {
-        if (t[i].state == DSH_READING)
-            rcmd_signal(t[i].rcmd, signum);
+    for (i = 0; hosts[i].host != NULL; i++) {
+        thd_t *th = hosts[i].thd;
+        if (th && (th->state == DSH_READING))
+            rcmd_signal(th->rcmd, signum);
     }
     dsh_mutex_unlock(&thd_mutex);
 
 }
 
-static int _thd_connect_timeout (thd_t *th)
+/*
+ * Watchdog timers.
+ *
+ * A host's connect or command deadline is armed with _thd_set_deadline()
+ *  when it enters DSH_RCMD or DSH_READING. Deadlines are kept in a binary
+ *  min-heap, and the watchdog thread sleeps until the earliest one expires
+ *  rather than periodically scanning every host. Entries are not removed
+ *  when a host changes state; instead an expired entry is ignored if the
+ *  host is no longer active, no longer in the state for which it was
+ *  armed, or has had a new deadline set since. Entries refer to hosts
+ *  by nodeid since a host's thd_t is freed when the host finishes.
+ *
+ * The connect timeout of a pdcp -n stream connection of a host is armed
+ *  the same way, with the index of its slot in th->pcp_streams.
+ */
+struct wdog_timer {
+    struct timeval when;        /* absolute expiration time             */
+    int            nodeid;      /* host to which timer applies          */
+    state_t        state;       /* state of host when timer was armed   */
+    struct timeval deadline;    /* host deadline when timer was armed   */
+    int            stream;      /* -n stream slot of host, or -1        */
+};
+
+static pthread_mutex_t wdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wdog_cond = PTHREAD_COND_INITIALIZER;
+static struct wdog_timer *wdog_heap = NULL;
+static int wdog_count = 0;
+static int wdog_size = 0;
+static bool wdog_shutdown = false;
+
+static bool _event_engine_expire (thd_t *th);
+static void _event_engine_release (thd_t *th);
+
+static void _wdog_heap_push (struct wdog_timer *wt)
 {
-    if ((connect_timeout > 0) && (th->start != ((time_t) -1))) {
-        if (th->start + connect_timeout < time (NULL))
-            return (1);
+    int i;
+
+    if (wdog_heap == NULL) {
+        wdog_size = 64;
+        wdog_heap = Malloc (wdog_size * sizeof (*wt));
     }
-    return (0);
+    else if (wdog_count == wdog_size) {
+        wdog_size *= 2;
+        Realloc ((void **) &wdog_heap, wdog_size * sizeof (*wt));
+    }
+
+    /* sift up */
+    for (i = wdog_count++; i > 0; i = (i - 1) / 2) {
+        struct wdog_timer *parent = &wdog_heap[(i - 1) / 2];
+        if (!timercmp (&wt->when, &parent->when, <))
+            break;
+        wdog_heap[i] = *parent;
+    }
+    wdog_heap[i] = *wt;
 }
 
-static int _thd_command_timeout (thd_t *th)
+static void _wdog_heap_pop (struct wdog_timer *wt)
 {
-    if ((command_timeout > 0) && (th->connect != ((time_t) -1))) {
-        if (th->connect + command_timeout < time (NULL))
-            return (1);
+    struct wdog_timer *last;
+    int i, child;
+
+    *wt = wdog_heap[0];
+    last = &wdog_heap[--wdog_count];
+
+    /* sift down */
+    for (i = 0; (child = 2 * i + 1) < wdog_count; i = child) {
+        if ((child + 1 < wdog_count)
+            && timercmp (&wdog_heap[child + 1].when, &wdog_heap[child].when, <))
+            child++;
+        if (!timercmp (&wdog_heap[child].when, &last->when, <))
+            break;
+        wdog_heap[i] = wdog_heap[child];
     }
-    return (0);
+    wdog_heap[i] = *last;
+}
+
+static void _wdog_push (struct wdog_timer *wt)
+{
+    dsh_mutex_lock (&wdog_mutex);
+    _wdog_heap_push (wt);
+    if (wdog_heap[0].nodeid == wt->nodeid)  /* new earliest deadline */
+        pthread_cond_signal (&wdog_cond);
+    dsh_mutex_unlock (&wdog_mutex);
+}
+
+static void _wdog_arm (thd_t *th, state_t state, struct timeval *when)
+{
+    struct wdog_timer wt;
+
+    wt.when = *when;
+    wt.nodeid = th->nodeid;
+    wt.state = state;
+    wt.deadline = th->deadline;
+    wt.stream = -1;
+    _wdog_push (&wt);
+}
+
+static void _wdog_arm_stream (thd_t *th, int i, struct timeval *when)
+{
+    struct wdog_timer wt;
+
+    wt.when = *when;
+    wt.nodeid = th->nodeid;
+    wt.state = th->state;
+    wt.deadline = th->pcp_streams[i].deadline;
+    wt.stream = i;
+    _wdog_push (&wt);
 }
 
 /*
- * Watchdog thread.  Send SIGALRM to
- *   - threads in connecting state for too long
- *   - threads in connected state for too long (if selected on command line)
- * Sleep for two seconds between polls
+ * Set deadline for host `th' in its current state to `timeout' secs
+ *  from now, or clear it if timeout is 0.
  */
-static void *_wdog(void *args)
+static void _thd_set_deadline (thd_t *th, int timeout)
+{
+    timerclear (&th->deadline);
+    if (timeout <= 0)
+        return;
+
+    gettimeofday (&th->deadline, NULL);
+    th->deadline.tv_sec += timeout;
+    _wdog_arm (th, th->state, &th->deadline);
+}
+
+/*
+ * Return 1 if the connect or command deadline of `th' has passed.
+ */
+static int _thd_timeout_expired (thd_t *th)
+{
+    struct timeval now;
+
+    if (!timerisset (&th->deadline))
+        return (0);
+    gettimeofday (&now, NULL);
+    return (!timercmp (&now, &th->deadline, <));
+}
+
+/*
+ * Handle the expired connect timeout `wt' of a pdcp -n stream connection
+ *  of host `th' like that of a host: interrupt the connect with SIGALRM,
+ *  every WDOG_RETRY secs until it is done. Called with thd_mutex held.
+ */
+static void _wdog_expire_stream (thd_t *th, struct wdog_timer *wt)
+{
+    pcp_stream_conn_t *sc = &th->pcp_streams[wt->stream];
+
+    if (!sc->active || sc->rcmd
+        || (sc->deadline.tv_sec != wt->deadline.tv_sec)
+        || (sc->deadline.tv_usec != wt->deadline.tv_usec))
+        return;
+
+    pthread_kill (sc->thread, SIGALRM);
+
+    gettimeofday (&wt->when, NULL);
+    wt->when.tv_sec += WDOG_RETRY;
+    _wdog_arm_stream (th, wt->stream, &wt->when);
+}
+
+/*
+ * Interrupt the pdcp -n stream connections of host `th', which timed out:
+ *  SIGALRM stops a connect, and shutdown() any transfer, even one that
+ *  would retry after EINTR. Called with thd_mutex held.
+ */
+static void _pcp_streams_interrupt (thd_t *th)
 {
     int i;
 
-    for (;;) {
+    for (i = 0; i < PCP_MAX_STREAMS; i++) {
+        pcp_stream_conn_t *sc = &th->pcp_streams[i];
+        if (!sc->active)
+            continue;
+        sc->expired = true;
+        pthread_kill (sc->thread, SIGALRM);
+        if (sc->rcmd && (sc->rcmd->fd >= 0))
+            shutdown (sc->rcmd->fd, SHUT_RDWR);
+    }
+}
 
-        if (t == NULL) /* We're done */
-            return NULL;
+/*
+ * Handle expired watchdog timer `wt'. Hosts serviced by the event
+ *  engine reactors are handed back to their reactor. Otherwise, send
+ *  SIGALRM to the host's thread to interrupt connect() or xpoll(), and
+ *  repeat every WDOG_RETRY secs in case the signal arrived while the
+ *  thread was not blocked.
+ */
+static void _wdog_expire (struct wdog_timer *wt)
+{
+    thd_t *th;
 
-        for (i = 0; t[i].host != NULL; i++) {
-            switch (t[i].state) {
-            case DSH_RCMD:
-                if (_thd_connect_timeout (&t[i]))
-                        pthread_kill(t[i].thread, SIGALRM);
-                break;
-            case DSH_READING:
-                if (_thd_command_timeout (&t[i]))
-                        pthread_kill(t[i].thread, SIGALRM);
-                break;
-            case DSH_NEW:
-            case DSH_DONE:
-            case DSH_FAILED:
-            case DSH_CANCELED:
-                break;
-            }
+    /*
+     *  Hold thd_mutex so that the host cannot finish and be
+     *   released while we hand it off or signal its thread.
+     */
+    dsh_mutex_lock (&thd_mutex);
+    th = hosts[wt->nodeid].thd;
+
+    if ((th == NULL) || (th->state != wt->state)) {
+        dsh_mutex_unlock (&thd_mutex);
+        return;
+    }
+
+    if (wt->stream >= 0) {
+        _wdog_expire_stream (th, wt);
+        dsh_mutex_unlock (&thd_mutex);
+        return;
+    }
+
+    if ((th->deadline.tv_sec != wt->deadline.tv_sec)
+        || (th->deadline.tv_usec != wt->deadline.tv_usec)) {
+        dsh_mutex_unlock (&thd_mutex);
+        return;
+    }
+
+    if (event_engine && _event_engine_expire (th)) {
+        dsh_mutex_unlock (&thd_mutex);
+        return;
+    }
+
+    _pcp_streams_interrupt (th);
+    pthread_kill (th->thread, SIGALRM);
+
+    gettimeofday (&wt->when, NULL);
+    wt->when.tv_sec += WDOG_RETRY;
+    _wdog_arm (th, wt->state, &wt->when);
+    dsh_mutex_unlock (&thd_mutex);
+}
+
+/*
+ * Watchdog thread. Sleep until the earliest host deadline, then handle
+ *  all expired timers.
+ */
+static void *_wdog(void *args)
+{
+    struct wdog_timer wt;
+    struct timeval now;
+    struct timespec ts;
+
+    dsh_mutex_lock (&wdog_mutex);
+    while (!wdog_shutdown) {
+        if (wdog_count == 0) {
+            pthread_cond_wait (&wdog_cond, &wdog_mutex);
+            continue;
+        }
+
+        gettimeofday (&now, NULL);
+        if (timercmp (&now, &wdog_heap[0].when, <)) {
+            ts.tv_sec = wdog_heap[0].when.tv_sec;
+            ts.tv_nsec = wdog_heap[0].when.tv_usec * 1000;
+            pthread_cond_timedwait (&wdog_cond, &wdog_mutex, &ts);
+            continue;
         }
-        sleep (WDOG_POLL);
+
+        _wdog_heap_pop (&wt);
+        dsh_mutex_unlock (&wdog_mutex);
+        _wdog_expire (&wt);
+        dsh_mutex_lock (&wdog_mutex);
     }
+    dsh_mutex_unlock (&wdog_mutex);
+
     return NULL;
 }
 
+static void _wdog_start (pthread_t *tp)
+{
+    pthread_attr_t attr;
+    int rv;
+
+    wdog_shutdown = false;
+    wdog_count = 0;
+
+    _dsh_attr_init (&attr, DSH_THREAD_STACKSIZE);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_JOINABLE);
+    if ((rv = pthread_create (tp, &attr, _wdog, NULL)))
+        errx ("%p: pthread_create: %s\n", strerror (rv));
+    pthread_attr_destroy (&attr);
+}
+
+static void _wdog_stop (pthread_t thread)
+{
+    dsh_mutex_lock (&wdog_mutex);
+    wdog_shutdown = true;
+    pthread_cond_signal (&wdog_cond);
+    dsh_mutex_unlock (&wdog_mutex);
+
+    pthread_join (thread, NULL);
+    Free ((void **) &wdog_heap);
+    wdog_size = wdog_count = 0;
+}
+
 /*
- * Return the h_addr of a hostname, exiting if there is a lookup failure.
+ * Return the h_addr of a hostname.
  *	name (IN)	hostname
  *	addr (OUT)	pointer to location where address will be written
+ *	RETURN		0 on success, -1 if the lookup failed
  */
-static void _gethost(char *name, char *addr)
+static int _resolve(char *name, char *addr)
 {
     struct hostent *hp;
 
     if (!(hp = gethostbyname(name)))
-            errx("%p: gethostbyname(\"%S\") failed\n", name);
+        return (-1);
     /* assert(hp->h_addrtype == AF_INET); */
     assert(IP_ADDR_LEN == hp->h_length);
     memcpy(addr, hp->h_addr_list[0], IP_ADDR_LEN);
+    return (0);
 }
 
 /*
- *  Update thread state to connecting, unless the thread
- *   has been canceled, in which case close fds if they are open
- *   and return DSH_CANCELED.
+ * Return the h_addr of a hostname, exiting if there is a lookup failure.
+ */
+static void _gethost(char *name, char *addr)
+{
+    if (_resolve(name, addr) < 0)
+            errx("%p: gethostbyname(\"%S\") failed\n", name);
+}
+
+/*
+ *  Update thread state to connected (DSH_READING) and start the command
+ *   timer, unless the thread has been canceled, in which case close fds
+ *   if they are open and return DSH_CANCELED.
  */
 static state_t _update_connect_state (thd_t *a)
 {
@@ -354,6 +628,8 @@ static state_t _update_connect_state (thd_t *a)
         a->state = DSH_READING;
     dsh_mutex_unlock(&thd_mutex);
 
+    _thd_set_deadline (a, (a->state == DSH_READING) ? command_timeout : 0);
+
     if (a->state == DSH_CANCELED) {
         if (a->rcmd->fd >= 0)
             close (a->rcmd->fd);
@@ -364,6 +640,119 @@ static state_t _update_connect_state (thd_t *a)
     return (a->state);
 }
 
+/*
+ * Allocate active state for host record `i' as it enters the fanout
+ *  window. Returns NULL, and marks the host DSH_CANCELED, if the host
+ *  was canceled or no rcmd module is available for it.
+ */
+static thd_t *_thd_create (opt_t *opt, List pcp_infiles, int i)
+{
+    thd_t *th = Malloc (sizeof (thd_t));
+    bool canceled;
+
+    memset (th, 0, sizeof (thd_t));
+    th->host = hosts[i].host;
+    th->luser = opt->luser;        /* general */
+    th->ruser = opt->ruser;
+    th->state = DSH_NEW;
+    timerclear (&th->deadline);
+    th->labels = opt->labels;
+    th->labellen = err_hostname_len (th->host);
+    th->nodeid = i;
+    th->cmd = hosts[i].cmd ? hosts[i].cmd : opt->cmd;
+    th->dsh_sopt = opt->separate_stderr;  /* dsh-specific */
+    th->rc = 0;
+    th->pcp_infiles = pcp_infiles;        /* pcp-specific */
+    th->pcp_outfile = opt->outfile_name;
+    th->pcp_popt = opt->preserve;
+    th->pcp_ropt = opt->recursive;
+    th->pcp_yopt = opt->target_is_directory;
+    th->pcp_Popt = opt->reverse_copy;
+    th->pcp_Zopt = opt->pcp_client;
+    th->pcp_relay = (hosts[i].cmd != NULL);
+    th->pcp_Dopt = opt->archive;
+    th->pcp_Gopt = opt->compress;
+    th->pcp_Uopt = opt->update;
+    th->pcp_nopt = opt->streams;
+    th->pcp_sopt = opt->sync;
+    th->pcp_lost = false;
+    th->pcp_progname = opt->progname;
+    th->outfile_name = opt->outfile_name;
+    th->kill_on_fail = opt->kill_on_fail;
+
+    if (!(th->rcmd = rcmd_create (th->host))) {
+        Free ((void **) &th);
+        dsh_mutex_lock (&thd_mutex);
+        hosts[i].state = DSH_CANCELED;
+        dsh_mutex_unlock (&thd_mutex);
+        return (NULL);
+    }
+
+#if	!HAVE_MTSAFE_GETHOSTBYNAME
+    /* if MT-safe, do it in parallel in rsh/rcp threads */
+    /* gethostbyname_r is not very portable so skip it */
+    if (th->rcmd->opts->resolve_hosts)
+        _gethost(th->host, th->addr);
+#endif
+
+    th->outbuf = cbuf_pool_get (cbuf_pool);
+    th->errbuf = cbuf_pool_get (cbuf_pool);
+
+    dsh_mutex_lock (&thd_mutex);
+    if (!(canceled = (hosts[i].state == DSH_CANCELED)))
+        hosts[i].thd = th;
+    dsh_mutex_unlock (&thd_mutex);
+
+    if (canceled) {             /* canceled (^C^Z) meanwhile */
+        rcmd_info_destroy (th->rcmd);
+        cbuf_pool_put (cbuf_pool, th->outbuf);
+        cbuf_pool_put (cbuf_pool, th->errbuf);
+        Free ((void **) &th);
+    }
+    else if (opt->coalesce)
+        th->cobuf = coalesce_buf_create ();
+
+    return (th);
+}
+
+/*
+ * Save the state, return code and timings of finished host `th' in its
+ *  host record, and free its active state.
+ */
+static void _thd_release (thd_t *th)
+{
+    hostrec_t *h = &hosts[th->nodeid];
+
+    dsh_mutex_lock (&thd_mutex);
+    h->state = th->state;
+    h->rc = th->rc;
+    h->start = th->start;
+    h->connect = th->connect;
+    h->finish = th->finish;
+    h->thd = NULL;
+    dsh_mutex_unlock (&thd_mutex);
+
+    if (event_engine)
+        _event_engine_release (th);
+
+    /*
+     *  The rcmd info of a host that finished is freed by rcmd_destroy()
+     *   in _rcp_thread() or _rsh_finish(), which clear th->rcmd. Free it
+     *   here for a host that was released without going through them,
+     *   e.g. one canceled while waiting to connect.
+     */
+    if (th->rcmd)
+        rcmd_info_destroy (th->rcmd);
+    if (th->cobuf) {
+        char host[MAXHOSTNAMELEN];
+        snprintf (host, sizeof (host), "%.*s", th->labellen, th->host);
+        coalesce_add (th->cobuf, host, th->nodeid);
+    }
+    cbuf_pool_put (cbuf_pool, th->outbuf);
+    cbuf_pool_put (cbuf_pool, th->errbuf);
+    Free ((void **) &th);
+}
+
 static int _pcp_server (thd_t *th)
 {
     struct pcp_server svr[1];
@@ -373,13 +762,108 @@ static int _pcp_server (thd_t *th)
     svr->preserve =      th->pcp_popt;
     svr->target_is_dir = th->pcp_yopt;
     svr->outfile =       th->outfile_name;
+    svr->received =      NULL;
+    svr->chain =         false;
+    svr->sync =          th->pcp_sopt;
+    svr->fwdfd =         -1;
 
     return (pcp_server (svr));
 }
 
+/*
+ * pdcp -n: open another connection to the pdcp server on the host of
+ *  th, for pcp_client() to send part of a large file over.
+ *  Returns the connection, or NULL on failure.
+ */
+static void *_pcp_stream_open (void *arg, int *fdp)
+{
+    thd_t *th = arg;
+    pcp_stream_conn_t *sc = NULL;
+    struct rcmd_info *rcmd;
+    int i;
+
+    /*
+     *  Take a slot, where the watchdog finds the connection to interrupt
+     *   it on a connect timeout, or once the host times out.
+     */
+    dsh_mutex_lock (&thd_mutex);
+    if ((th->state == DSH_READING) && !_thd_timeout_expired (th)) {
+        for (i = 0; (i < PCP_MAX_STREAMS) && !sc; i++) {
+            if (!th->pcp_streams[i].active)
+                sc = &th->pcp_streams[i];
+        }
+    }
+    if (sc) {
+        sc->active = true;
+        sc->thread = pthread_self ();
+        sc->rcmd = NULL;
+        sc->expired = false;
+        timerclear (&sc->deadline);
+        if (connect_timeout > 0) {
+            gettimeofday (&sc->deadline, NULL);
+            sc->deadline.tv_sec += connect_timeout;
+            _wdog_arm_stream (th, sc - th->pcp_streams, &sc->deadline);
+        }
+    }
+    dsh_mutex_unlock (&thd_mutex);
+    if (!sc)
+        return (NULL);
+
+    if (!(rcmd = rcmd_create (th->host)))
+        goto fail;
+    if (rcmd_connect (rcmd, th->host, th->addr, th->luser, th->ruser,
+                      th->cmd, th->nodeid, th->dsh_sopt) < 0
+        || rcmd->fd < 0) {
+        rcmd_destroy (rcmd);
+        goto fail;
+    }
+
+    dsh_mutex_lock (&thd_mutex);
+    sc->rcmd = rcmd;
+    if (_thd_timeout_expired (th)) {    /* the watchdog was too early */
+        sc->expired = true;
+        shutdown (rcmd->fd, SHUT_RDWR);
+    }
+    dsh_mutex_unlock (&thd_mutex);
+
+    *fdp = rcmd->fd;
+    return (sc);
+
+  fail:
+    dsh_mutex_lock (&thd_mutex);
+    sc->active = false;
+    dsh_mutex_unlock (&thd_mutex);
+    return (NULL);
+}
+
+static void _pcp_stream_close (void *handle)
+{
+    pcp_stream_conn_t *sc = handle;
+    struct rcmd_info *rcmd;
+    bool expired;
+
+    dsh_mutex_lock (&thd_mutex);
+    rcmd = sc->rcmd;
+    expired = sc->expired;
+    sc->rcmd = NULL;
+    sc->active = false;
+    dsh_mutex_unlock (&thd_mutex);
+
+    if (expired)
+        rcmd_signal (rcmd, SIGTERM);
+
+    close (rcmd->fd);
+    if (rcmd->efd >= 0)
+        close (rcmd->efd);
+    rcmd_destroy (rcmd);
+}
+
 static int _pcp_client (thd_t *th)
 {
     struct pcp_client pcp[1];
+    int rv;
+
+    memset (pcp, 0, sizeof (pcp));
 
     pcp->infd =       th->rcmd->fd;
     pcp->outfd =      pcp->infd;
@@ -388,8 +872,17 @@ static int _pcp_client (thd_t *th)
     pcp->pcp_client = th->pcp_Zopt;
     pcp->host =       th->host;
     pcp->infiles =    th->pcp_infiles;
-
-    return (pcp_client (pcp));
+    pcp->archive =    th->pcp_Dopt;
+    pcp->compress =   th->pcp_Gopt;
+    pcp->update =     th->pcp_Uopt;
+    pcp->streams =    th->pcp_nopt;
+    pcp->stream_open =  _pcp_stream_open;
+    pcp->stream_close = _pcp_stream_close;
+    pcp->stream_arg =   th;
+
+    rv = pcp_client (pcp);
+    th->pcp_lost = pcp->lost;
+    return (rv);
 }
 
 static int _parallel_copy (thd_t *th)
@@ -432,11 +925,23 @@ static int _parallel_copy (thd_t *th)
          */
         while (_handle_rcmd_stderr (th) > 0)
             ;
-        _flush_output (th->errbuf, (out_f) err, th);
+        _flush_output (th->errbuf, stderr, th);
 
+    } else if (th->pcp_relay && (th->rcmd->efd >= 0)) {
+        /*
+         *  A relay host copies the files on to its subtree once we
+         *   close the connection, and reports any errors on stderr
+         *   until it is done.
+         */
+        close(th->rcmd->fd);
+        th->rcmd->fd = -1;
+        while (_handle_rcmd_stderr (th) > 0)
+            ;
+        _flush_output (th->errbuf, stderr, th);
     }
 
-    close(th->rcmd->fd);
+    if (th->rcmd->fd >= 0)
+        close(th->rcmd->fd);
     if (th->dsh_sopt)
         close(th->rcmd->efd);
 
@@ -451,9 +956,15 @@ static void *_rcp_thread(void *args)
 {
     thd_t *a = (thd_t *) args;
     int result = DSH_DONE;      /* the desired outcome */
-    int rc;
+    int rc, retries = 0;
     char *rcpycmd = NULL;
 
+    /*  Target of SIGALRM from _wdog() */
+    a->thread = pthread_self ();
+
+    /*  A lost connection must fail the copy, not kill pdcp */
+    _xsignal (SIGPIPE, SIG_IGN);
+
 #if	HAVE_MTSAFE_GETHOSTBYNAME
     if (a->rcmd->opts->resolve_hosts)
         _gethost(a->host, a->addr);
@@ -462,6 +973,7 @@ static void *_rcp_thread(void *args)
     dsh_mutex_lock(&thd_mutex);
     a->state = DSH_RCMD;
     dsh_mutex_unlock(&thd_mutex);
+    _thd_set_deadline (a, connect_timeout);
 
     /* For reverse copy, the host needs to be appended to the end of the command */
     if (a->pcp_Popt) {
@@ -470,17 +982,40 @@ static void *_rcp_thread(void *args)
         xstrcat(&rcpycmd, a->host);
     }
 
-    rcmd_connect (a->rcmd, a->host, a->addr, a->luser, a->ruser,
-                  (rcpycmd) ? rcpycmd : a->cmd, a->nodeid, a->dsh_sopt);
+    while (1) {
+        rcmd_connect (a->rcmd, a->host, a->addr, a->luser, a->ruser,
+                      (rcpycmd) ? rcpycmd : a->cmd, a->nodeid, a->dsh_sopt);
+
+        if (a->rcmd->fd == -1)
+            result = DSH_FAILED;
+        else if (_update_connect_state(a) != DSH_CANCELED)
+            _parallel_copy(a);
+
+        /*
+         *  If the connection was lost in the middle of the copy, connect
+         *   again and copy what is missing, a few times at most.
+         */
+        if (!a->pcp_lost || (retries == PCP_RETRIES)
+            || (a->state == DSH_CANCELED) || _thd_timeout_expired (a))
+            break;
+        err ("%p: %S: connection lost, retrying\n", a->host);
+        rcmd_destroy (a->rcmd);
+        sleep (1 << retries++);
+
+        dsh_mutex_lock(&thd_mutex);
+        a->state = DSH_RCMD;
+        dsh_mutex_unlock(&thd_mutex);
+        _thd_set_deadline (a, connect_timeout);
+        if (!(a->rcmd = rcmd_create (a->host))) {
+            result = DSH_FAILED;
+            break;
+        }
+        a->pcp_lost = false;
+    }
 
     if (rcpycmd)
         Free((void **) &rcpycmd);
 
-    if (a->rcmd->fd == -1)
-        result = DSH_FAILED;
-    else if (_update_connect_state(a) != DSH_CANCELED)
-        _parallel_copy(a);
-
     /* update status */
     dsh_mutex_lock(&thd_mutex);
     a->state = result;
@@ -488,9 +1023,12 @@ static void *_rcp_thread(void *args)
     dsh_mutex_unlock(&thd_mutex);
 
     rc = rcmd_destroy (a->rcmd);
+    a->rcmd = NULL;
     if ((a->rc == 0) && (rc > 0))
         a->rc = rc;
 
+    _thd_release (a);
+
     /* Signal dsh() so another thread can replace us */
     dsh_mutex_lock(&threadcount_mutex);
     threadcount--;
@@ -519,54 +1057,98 @@ static int _extract_rc(char *buf)
     return ret;
 }
 
-static void _flush_lines (cbuf_t cb, out_f outf, bool read_rc, thd_t *th)
+/*
+ *  Allocate a message for `n' bytes of output from host `th', prefixed
+ *   with the "host: " label if `label' is true. Returns the message and
+ *   sets `datap' to where the output data should be copied.
+ */
+static char *_msg_create (thd_t *th, bool label, int n, char **datap)
 {
-    char c;
-    int n;
+    int len = label ? th->labellen + 2 : 0;
+    char *msg = Malloc (len + n + 1);
+
+    if (label) {
+        memcpy (msg, th->host, th->labellen);
+        memcpy (msg + th->labellen, ": ", 2);
+    }
+    *datap = msg + len;
+    return (msg);
+}
+
+static void _flush_lines (cbuf_t cb, FILE *stream, bool read_rc, thd_t *th)
+{
+    struct iovec iov[2];
+    bool coalesce = (th->cobuf != NULL) && (stream == stdout);
+    int labellen = (th->labels && !coalesce) ? th->labellen + 2 : 0;
+    int i, n, lines;
+    char *msg, *p, *line = NULL;
 
     /*
-     *  Use cbuf_peek_line with a single character buffer in order to
-     *   get the buffer size needed for the next line (if any).
+     *  Get all complete lines in the buffer in place, without copying.
      */
-    while ((n = cbuf_peek_line (cb, &c, 1, 1))) {
-        char *buf;
-
-        if (n < 0) {
-            err ("%p: %S: Failed to peek line: %m\n", th->host);
-            break;
-        }
+    if ((n = cbuf_peek_line_iov (cb, iov, -1, &lines)) <= 0) {
+        if (n < 0)
+            err ("%p: %S: Failed to peek lines: %m\n", th->host);
+        return;
+    }
 
-        /*
-         *  Allocate enough space for line plus NUL character,
-         *   then actually read line data into buffer:
-         */
-        buf = Malloc (n + 1);
-        if ((n = cbuf_read (cb, buf, n))) {
-            if (n < 0) {
-                err ("%p: %S: Failed to read line from buffer: %m\n", th->host);
-                break;
+    /*
+     *  Copy the lines into a single message, each prefixed with the
+     *   host label. The message is written with a single call, so lines
+     *   of output from different hosts are never interleaved. A line may
+     *   continue from the first iovec into the second (wraparound).
+     */
+    msg = p = Malloc (n + lines * labellen + 1);
+    for (i = 0; i < 2; i++) {
+        char *data = iov[i].iov_base;
+        char *end = data + iov[i].iov_len;
+
+        while (data < end) {
+            char *nl = memchr (data, '\n', end - data);
+            int len = (nl ? nl + 1 : end) - data;
+
+            if (line == NULL) {
+                if (labellen) {
+                    memcpy (p, th->host, th->labellen);
+                    memcpy (p + th->labellen, ": ", 2);
+                }
+                line = p += labellen;
             }
-            if (read_rc)
-                th->rc = _extract_rc (buf);
-            if (strlen (buf) > 0) {
+            memcpy (p, data, len);
+            p += len;
+            data += len;
+
+            if (nl) {
                 /*
-                 *  We are careful to use a single call to write the line
-                 *   to the output stream to avoid interleaved lines of
-                 *   output.
+                 *  Complete line: strip the return code if requested,
+                 *   and drop the line (and its label) if it is empty.
+                 *   strlen() also cuts the line at any embedded NUL.
                  */
-                if (th->labels)
-                    outf ("%S: %s", th->host, buf);
+                *p = '\0';
+                if (read_rc)
+                    th->rc = _extract_rc (line);
+                if ((len = strlen (line)) > 0)
+                    p = line + len;
                 else
-                    outf ("%s", buf);
-                fflush (NULL);
+                    p = line - labellen;
+                line = NULL;
             }
         }
-        Free ((void **)&buf);
     }
+    *p = '\0';
+    cbuf_drop (cb, n);
 
+    if (coalesce) {
+        coalesce_buf_append (th->cobuf, msg, p - msg);
+        Free ((void **) &msg);
+    }
+    else if (p > msg)
+        err_puts (stream, msg);
+    else
+        Free ((void **) &msg);
 }
 
-static int _do_output (int fd, cbuf_t cb, out_f outf, bool read_rc, thd_t *t)
+static int _do_output (int fd, cbuf_t cb, FILE *stream, bool read_rc, thd_t *t)
 {
     int rc;
     int dropped = 0;
@@ -578,27 +1160,36 @@ static int _do_output (int fd, cbuf_t cb, out_f outf, bool read_rc, thd_t *t)
         return (-1);
     }
 
-    _flush_lines (cb, outf, read_rc, t);
+    _flush_lines (cb, stream, read_rc, t);
 
     return (rc);
 }
 
-static void _flush_output (cbuf_t cb, out_f outf, thd_t *th)
+static void _flush_output (cbuf_t cb, FILE *stream, thd_t *th)
 {
     int n;
     bool labeled = false;
-    char buf[8192];
+    char *msg, *buf;
 
-    _flush_lines (cb, outf, false, t);
+    _flush_lines (cb, stream, false, th);
 
     /* In case no newline at end of buffer, grab the rest of data */
-    while ((n = cbuf_read (cb, buf, sizeof (buf) - 1)) > 0) {
-        buf[n] = '\0';
-        if (th->labels && !labeled) {
-            outf ("%S: ", th->host);
-            labeled = true;
+    while ((n = cbuf_used (cb)) > 0) {
+        if (th->cobuf && (stream == stdout)) {
+            char tmp[8192];
+            if ((n = cbuf_read (cb, tmp, MIN (n, sizeof (tmp)))) <= 0)
+                break;
+            coalesce_buf_append (th->cobuf, tmp, n);
+            continue;
+        }
+        msg = _msg_create (th, th->labels && !labeled, n, &buf);
+        if ((n = cbuf_read (cb, buf, n)) <= 0) {
+            Free ((void **) &msg);
+            break;
         }
-        outf ("%s", buf);
+        buf[n] = '\0';
+        err_puts (stream, msg);
+        labeled = true;
     }
 
     return;
@@ -621,7 +1212,7 @@ static int _die_if_signalled (thd_t *th)
 
 static int _handle_rcmd_stdout (thd_t *th)
 {
-    int rc = _do_output (th->rcmd->fd, th->outbuf, (out_f) out, true, th);
+    int rc = _do_output (th->rcmd->fd, th->outbuf, stdout, true, th);
 
     if (rc <= 0) {
         close (th->rcmd->fd);
@@ -633,7 +1224,7 @@ static int _handle_rcmd_stdout (thd_t *th)
 
 static int _handle_rcmd_stderr (thd_t *th)
 {
-    int rc = _do_output (th->rcmd->efd, th->errbuf, (out_f) err, false, th);
+    int rc = _do_output (th->rcmd->efd, th->errbuf, stderr, false, th);
 
     if (rc <= 0) {
         close (th->rcmd->efd);
@@ -644,45 +1235,131 @@ static int _handle_rcmd_stderr (thd_t *th)
 }
 
 /*
- * Rsh thread.  One per remote connection.
- * Arguments are pointer to thd_t entry defined above.
+ * Signal dsh() that a host has completed so another may take its place.
  */
-static void *_rsh_thread(void *args)
+static void _release_slot (void)
 {
-    thd_t *a = (thd_t *) args;
-    int rv;
-    int result = DSH_DONE;      /* the desired outcome */
-    struct xpollfd xpfds[2];
-    int nfds = 1;
-
-    a->start = time(NULL);
-
-#if	HAVE_MTSAFE_GETHOSTBYNAME
+    dsh_mutex_lock(&threadcount_mutex);
+    threadcount--;
+    pthread_cond_signal(&threadcount_cond);
+    dsh_mutex_unlock(&threadcount_mutex);
+}
+
+/*
+ * Mark host `a' as connecting (DSH_RCMD) and start its connect timer.
+ */
+static void _rsh_connect_begin (thd_t *a)
+{
+    a->start = time(NULL);
+
+#if	HAVE_MTSAFE_GETHOSTBYNAME
     if (a->rcmd->opts->resolve_hosts)
         _gethost(a->host, a->addr);
 #endif
-    _xsignal (SIGPIPE, SIG_IGN);
 
-    /* establish the connection */
     dsh_mutex_lock(&thd_mutex);
     a->state = DSH_RCMD;
     dsh_mutex_unlock(&thd_mutex);
+    _thd_set_deadline (a, connect_timeout);
+}
 
+/*
+ * Update state of host `a' once its rcmd connect has completed or failed.
+ *  Returns DSH_FAILED if the connect failed, DSH_CANCELED if the host was
+ *  canceled while connecting, and DSH_READING otherwise. On DSH_READING,
+ *  the stdout (and stderr if -s) fds have been set nonblocking.
+ */
+static state_t _rsh_connect_end (thd_t *a)
+{
+    if (a->rcmd->fd == -1)
+        return (DSH_FAILED);    /* connect failed */
+
+    if (_update_connect_state(a) == DSH_CANCELED)
+        return (DSH_CANCELED);
+
+    fd_set_nonblocking (a->rcmd->fd);
+    if (a->dsh_sopt)            /* separate stderr */
+        fd_set_nonblocking (a->rcmd->efd);
+
+    return (DSH_READING);
+}
+
+/*
+ * Establish the rcmd connection for host `a', updating thread state
+ *  along the way. Return value is as for _rsh_connect_end().
+ */
+static state_t _rsh_connect (thd_t *a)
+{
+    _rsh_connect_begin (a);
+
+    /* establish the connection */
     rcmd_connect (a->rcmd, a->host, a->addr, a->luser, a->ruser,
                   a->cmd, a->nodeid, a->dsh_sopt);
 
-    if (a->rcmd->fd == -1) {
-        result = DSH_FAILED;    /* connect failed */
-    } else if (_update_connect_state(a) != DSH_CANCELED) {
+    return (_rsh_connect_end (a));
+}
 
-        fd_set_nonblocking (a->rcmd->fd);
+/*
+ * Final processing for a dsh host: record the final state `result',
+ *  flush any pending output, reap the rcmd connection, release the
+ *  host's active state, and signal dsh() so another host can take this
+ *  one's place. `a' is freed on return.
+ */
+static void _rsh_finish (thd_t *a, state_t result)
+{
+    int rv;
+
+    /* update status */
+    dsh_mutex_lock(&thd_mutex);
+    a->state = result;
+    a->finish = time(NULL);
+    dsh_mutex_unlock(&thd_mutex);
+
+    /* flush any pending output */
+    _flush_output (a->outbuf, stdout, a);
+    _flush_output (a->errbuf, stderr, a);
+
+    rv = rcmd_destroy (a->rcmd);
+    a->rcmd = NULL;
+    if ((a->rc == 0) && (rv > 0))
+        a->rc = rv;
+
+    /* if a single qshell thread fails, terminate whole job */
+    if (a->kill_on_fail && ((a->state == DSH_FAILED) || (a->rc > 0))) {
+        _fwd_signal(SIGTERM);
+        errx("%p: terminating all processes\n");
+    }
+
+    _thd_release (a);
+    _release_slot ();
+}
+
+/*
+ * Rsh thread.  One per remote connection.
+ * Arguments are pointer to thd_t entry defined above.
+ */
+static void *_rsh_thread(void *args)
+{
+    thd_t *a = (thd_t *) args;
+    int rv;
+    state_t result = DSH_DONE;  /* the desired outcome */
+    struct xpollfd xpfds[2];
+    int nfds = 1;
+
+    /*  Target of SIGALRM from _wdog() */
+    a->thread = pthread_self ();
+
+    _xsignal (SIGPIPE, SIG_IGN);
+
+    if ((rv = _rsh_connect (a)) == DSH_FAILED) {
+        result = DSH_FAILED;    /* connect failed */
+    } else if (rv != DSH_CANCELED) {
 
         memset (xpfds, 0, sizeof (xpfds));
 
         /* prep for poll call */
         xpfds[0].fd = a->rcmd->fd;
         if (a->dsh_sopt) {      /* separate stderr */
-            fd_set_nonblocking (a->rcmd->efd);
             xpfds[1].fd = a->rcmd->efd;
             nfds++;
         }
@@ -704,7 +1381,7 @@ static void *_rsh_thread(void *args)
             if (rv == -1) {
                 if (errno != EINTR)
                     err("%p: %S: xpoll: %m\n", a->host);
-                else if (_thd_command_timeout (a))
+                else if (_thd_timeout_expired (a))
                     err("%p: %S: command timeout\n", a->host);
                 else
                     continue; /* interrupted by spurious signal */
@@ -738,31 +1415,7 @@ static void *_rsh_thread(void *args)
         }
     }
 
-    /* update status */
-    dsh_mutex_lock(&thd_mutex);
-    a->state = result;
-    a->finish = time(NULL);
-    dsh_mutex_unlock(&thd_mutex);
-
-    /* flush any pending output */
-    _flush_output (a->outbuf, (out_f) out, a);
-    _flush_output (a->errbuf, (out_f) err, a);
-
-    rv = rcmd_destroy (a->rcmd);
-    if ((a->rc == 0) && (rv > 0))
-        a->rc = rv;
-
-    /* if a single qshell thread fails, terminate whole job */
-    if (a->kill_on_fail && ((a->state == DSH_FAILED) || (a->rc > 0))) {
-        _fwd_signal(SIGTERM);
-        errx("%p: terminating all processes\n");
-    }
-
-    /* Signal dsh() so another thread can replace us */
-    dsh_mutex_lock(&threadcount_mutex);
-    threadcount--;
-    pthread_cond_signal(&threadcount_cond);
-    dsh_mutex_unlock(&threadcount_mutex);
+    _rsh_finish (a, result);
     return NULL;
 }
 
@@ -777,25 +1430,28 @@ static void _dump_debug_stats(int rshcount)
     time_t cmdTot = 0, cmdMin = TIME_T_YEAR, cmdMax = 0;
     int failed = 0;
     int canceled = 0;
+    cbuf_pool_stats_t pst;
     int n;
 
     for (n = 0; n < rshcount; n++) {
-        if (t[n].state == DSH_FAILED) {
+        hostrec_t *h = &hosts[n];
+
+        if (h->state == DSH_FAILED) {
             failed++;
             continue;
         }
-        if (t[n].state == DSH_CANCELED) {
+        if (h->state == DSH_CANCELED) {
             canceled++;
             continue;
         }
-        assert(t[n].start && t[n].connect && t[n].finish);
-
-        conTot += t[n].connect - t[n].start;
-        cmdTot += t[n].finish - t[n].connect;
-        conMin = MIN(conMin, t[n].connect - t[n].start);
-        conMax = MAX(conMax, t[n].connect - t[n].start);
-        cmdMin = MIN(cmdMin, t[n].finish - t[n].connect);
-        cmdMax = MAX(cmdMax, t[n].finish - t[n].connect);
+        assert(h->start && h->connect && h->finish);
+
+        conTot += h->connect - h->start;
+        cmdTot += h->finish - h->connect;
+        conMin = MIN(conMin, h->connect - h->start);
+        conMax = MAX(conMax, h->connect - h->start);
+        cmdMin = MIN(cmdMin, h->finish - h->connect);
+        cmdMax = MAX(cmdMax, h->finish - h->connect);
     }
     if (rshcount > failed) {
         err("Connect time:  Avg: %d sec, Min: %d sec,  Max: %d sec\n",
@@ -809,6 +1465,12 @@ static void _dump_debug_stats(int rshcount)
     err("Failures:      %d\n", failed);
     if (canceled)
         err("Canceled:      %d\n", canceled);
+
+    cbuf_pool_get_stats (cbuf_pool, &pst);
+    err("Buffers:       %d created, %d reused, %d destroyed, %d max in use\n",
+        pst.created, pst.reused, pst.destroyed, pst.inuse_max);
+    err("Buffer pool:   %d idle, %d KB\n", pst.nfree,
+        (int) (pst.free_bytes / 1024));
 }
 
 /*
@@ -860,43 +1522,730 @@ static void _increase_nofile_limit (opt_t *opt)
     return;
 }
 
-static int _thd_init (thd_t *th, opt_t *opt, List pcp_infiles, int i)
+/*
+ * Event engine (PDSH_ENGINE=event).
+ *
+ * Instead of one thread per host, a fixed number of reactor threads
+ *  multiplex stdout/stderr of all of their hosts with epoll(7) (or xpoll()
+ *  where epoll is unavailable), do the same output processing as
+ *  _rsh_thread(), and reap hosts via _rsh_finish() once both fds close.
+ *  dsh() still enforces fanout through threadcount, which in this mode
+ *  counts active hosts rather than active threads.
+ *
+ * Hosts using an rcmd module with non-blocking connect support (see
+ *  mod.h) are also connected by the reactors. For other modules, a small
+ *  pool of connector threads performs the blocking connect and then
+ *  hands the connected fds off to a reactor.
+ *
+ * Since a reactor thread cannot be interrupted on behalf of a single
+ *  host, the watchdog hands hosts serviced by a reactor back to it when
+ *  their command or connect timeout expires (see _event_engine_expire()).
+ *  The watchdog still interrupts connector threads stuck in DSH_RCMD.
+ *  Rcmd module timers are checked by the reactors themselves.
+ */
+struct reactor {
+    pthread_t       thread;
+    pthread_mutex_t mutex;      /* protects pending, expired, shutdown  */
+    List            pending;    /* hosts handed off by dsh/connectors   */
+    List            expired;    /* hosts whose deadline has passed      */
+    bool            shutdown;   /* exit once no more hosts are active   */
+    List            hosts;      /* connected hosts serviced by reactor  */
+    bool            reap;       /* fds closed since last _reactor_reap  */
+    List            connecting; /* hosts with non-blocking connect      */
+    List            ready;      /* connecting hosts with pending events */
+    int             wakefd[2];  /* self-pipe used to wake the reactor   */
+#if HAVE_SYS_EPOLL_H
+    int             epfd;       /* epoll instance for all host fds      */
+#endif
+};
+
+/*
+ *  Epoll event data is (nodeid << 2 | slot), or EV_WAKE for the
+ *   reactor's wakeup pipe. Slots are stdout, stderr, and the two fds
+ *   an rcmd module may wait on during a non-blocking connect.
+ */
+#define EV_STDOUT           0
+#define EV_STDERR           1
+#define EV_CONNECT          2
+#define EV_WAKE             ((uint64_t) -1)
+#define EV_KEY(th, slot)    ((((uint64_t) (th)->nodeid) << 2) | (slot))
+
+static struct reactor *reactors = NULL;
+static int nreactors = 0;
+
+static pthread_t *connectors = NULL;
+static int nconnectors = 0;
+
+static pthread_mutex_t connect_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connect_cond = PTHREAD_COND_INITIALIZER;
+static List connect_queue = NULL;
+static bool connect_shutdown = false;
+
+static void _reactor_wake (struct reactor *r)
 {
-    th->luser = opt->luser;        /* general */
-    th->ruser = opt->ruser;
-    th->state = DSH_NEW;
-    th->labels = opt->labels;
-    th->nodeid = i;
-    th->cmd = opt->cmd;
-    th->dsh_sopt = opt->separate_stderr;  /* dsh-specific */
-    th->rc = 0;
-    th->pcp_infiles = pcp_infiles;        /* pcp-specific */
-    th->pcp_outfile = opt->outfile_name;
-    th->pcp_popt = opt->preserve;
-    th->pcp_ropt = opt->recursive;
-    th->pcp_yopt = opt->target_is_directory;
-    th->pcp_Popt = opt->reverse_copy;
-    th->pcp_Zopt = opt->pcp_client;
-    th->pcp_progname = opt->progname;
-    th->outfile_name = opt->outfile_name;
-    th->kill_on_fail = opt->kill_on_fail;
-    th->outbuf = cbuf_create (64, 131072);
-    th->errbuf = cbuf_create (64, 131072);
+    char c = 0;
 
-    if (!(th->rcmd = rcmd_create (th->host))) {
-        th->state = DSH_CANCELED;
-        return (-1);
+    if ((write (r->wakefd[1], &c, 1) < 0) && (errno != EAGAIN))
+        err ("%p: reactor wakeup: %m\n");
+}
+
+static void _reactor_drain (struct reactor *r)
+{
+    char buf[64];
+
+    while (read (r->wakefd[0], buf, sizeof (buf)) > 0)
+        ;
+}
+
+static void _reactor_watch (struct reactor *r, thd_t *th, int fd, int slot,
+                            int events)
+{
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    memset (&ev, 0, sizeof (ev));
+    if (events & XPOLLREAD)
+        ev.events |= EPOLLIN;
+    if (events & XPOLLWRITE)
+        ev.events |= EPOLLOUT;
+    ev.data.u64 = EV_KEY (th, slot);
+
+    if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        errx ("%p: %S: epoll_ctl: %m\n", th->host);
+#endif
+}
+
+static void _reactor_unwatch (struct reactor *r, int fd)
+{
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event ev;      /* non-NULL for kernels before 2.6.9 */
+
+    epoll_ctl (r->epfd, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
+/*
+ *  Stop watching and close the fd pointed to by `fdp'. The fd is
+ *   explicitly removed from the epoll set since forked rcmd children
+ *   may briefly share the underlying file description.
+ */
+static void _reactor_close (struct reactor *r, int *fdp)
+{
+    if (*fdp < 0)
+        return;
+
+    _reactor_unwatch (r, *fdp);
+    close (*fdp);
+    *fdp = -1;
+    r->reap = true;
+}
+
+static void _reactor_read (struct reactor *r, thd_t *th, int is_err)
+{
+    if (is_err && (th->rcmd->efd >= 0)) {
+        if (_do_output (th->rcmd->efd, th->errbuf, stderr, false, th) <= 0)
+            _reactor_close (r, &th->rcmd->efd);
+    }
+    else if (!is_err && (th->rcmd->fd >= 0)) {
+        if (_do_output (th->rcmd->fd, th->outbuf, stdout, true, th) <= 0)
+            _reactor_close (r, &th->rcmd->fd);
     }
 
-#if	!HAVE_MTSAFE_GETHOSTBYNAME
-    /* if MT-safe, do it in parallel in rsh/rcp threads */
-    /* gethostbyname_r is not very portable so skip it */
-    if (th->rcmd->opts->resolve_hosts)
-        _gethost(th->host, th->addr);
+    /* kill parallel job if kill_on_fail and one task was signaled */
+    if (th->kill_on_fail)
+        _die_if_signalled (th);
+}
+
+/*
+ *  Start servicing output of connected host `th'.
+ */
+static void _reactor_host_add (struct reactor *r, thd_t *th)
+{
+    _reactor_watch (r, th, th->rcmd->fd, EV_STDOUT, XPOLLREAD);
+    if (th->rcmd->efd >= 0)
+        _reactor_watch (r, th, th->rcmd->efd, EV_STDERR, XPOLLREAD);
+    list_append (r->hosts, th);
+}
+
+/*
+ *  Watch (or stop watching) the fds an rcmd module is waiting on
+ *   for a non-blocking connect.
+ */
+static void _reactor_connect_watch (struct reactor *r, thd_t *th, bool watch)
+{
+    struct rcmd_nbconn *nb = &th->rcmd->nb;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (nb->fd[i] < 0)
+            continue;
+        if (watch)
+            _reactor_watch (r, th, nb->fd[i], EV_CONNECT + i, nb->events[i]);
+        else
+            _reactor_unwatch (r, nb->fd[i]);
+    }
+}
+
+/*
+ *  Process the result `rv' of starting or continuing a non-blocking
+ *   connect for host `th', which must not be on any reactor list.
+ */
+static void _reactor_connect_step (struct reactor *r, thd_t *th, int rv)
+{
+    if (rv == RCMD_NB_WAIT) {
+        _reactor_connect_watch (r, th, true);
+        list_append (r->connecting, th);
+        return;
+    }
+
+    rcmd_connect_finish (th->rcmd);
+
+    switch (_rsh_connect_end (th)) {
+    case DSH_READING:
+        _reactor_host_add (r, th);
+        break;
+    case DSH_FAILED:
+        _rsh_finish (th, DSH_FAILED);
+        break;
+    default:
+        _rsh_finish (th, DSH_DONE);
+        break;
+    }
+}
+
+static int _thd_match (void *x, void *key)
+{
+    return (x == key);
+}
+
+/*
+ *  Continue connecting host `th', which is on the connecting list.
+ */
+static void _reactor_connect_continue (struct reactor *r, thd_t *th)
+{
+    list_delete_all (r->connecting, (ListFindF) _thd_match, th);
+    _reactor_connect_watch (r, th, false);
+    _reactor_connect_step (r, th, rcmd_connect_continue (th->rcmd));
+}
+
+/*
+ *  Record events on connect slot `slot' of host `th'. Hosts are continued
+ *   only after the whole batch of events has been seen, since continuing
+ *   may close or replace fds for which events are still queued.
+ */
+static void _reactor_connect_event (struct reactor *r, thd_t *th, int slot,
+                                    int revents)
+{
+    struct rcmd_nbconn *nb = &th->rcmd->nb;
+
+    if ((th->state != DSH_RCMD) || (nb->fd[slot - EV_CONNECT] < 0))
+        return;
+    if (!nb->revents[0] && !nb->revents[1])
+        list_append (r->ready, th);
+    nb->revents[slot - EV_CONNECT] |= revents;
+}
+
+static void _reactor_event (struct reactor *r, thd_t *th, int slot,
+                            int revents)
+{
+    if (slot >= EV_CONNECT)
+        _reactor_connect_event (r, th, slot, revents);
+    else
+        _reactor_read (r, th, slot == EV_STDERR);
+}
+
+static void _reactor_continue_ready (struct reactor *r)
+{
+    thd_t *th;
+
+    while ((th = list_pop (r->ready)))
+        _reactor_connect_continue (r, th);
+}
+
+/*
+ *  Start connecting host `th'. Hosts handed off by connector threads
+ *   are already connected.
+ */
+static void _reactor_connect_start (struct reactor *r, thd_t *th)
+{
+    int rv;
+
+    if (th->state == DSH_READING) {
+        _reactor_host_add (r, th);
+        return;
+    }
+
+    /*
+     *  Host canceled (^C^Z) while waiting for the reactor
+     */
+    if (th->state == DSH_CANCELED) {
+        _thd_release (th);
+        _release_slot ();
+        return;
+    }
+
+    _rsh_connect_begin (th);
+    rv = rcmd_connect_start (th->rcmd, th->host, th->addr, th->luser,
+                             th->ruser, th->cmd, th->nodeid, th->dsh_sopt);
+    _reactor_connect_step (r, th, rv);
+}
+
+/*
+ *  Handle host `th' handed back by the watchdog. A connected host which
+ *   exceeded the command timeout is marked DSH_FAILED and its fds closed,
+ *   so it will be finished by _reactor_reap(). A host which exceeded the
+ *   connect timeout is finished immediately.
+ */
+static void _reactor_timeout (struct reactor *r, thd_t *th)
+{
+    if (!_thd_timeout_expired (th))
+        return;
+
+    if (th->state == DSH_READING) {
+        err("%p: %S: command timeout\n", th->host);
+        rcmd_signal (th->rcmd, SIGTERM);
+        _reactor_close (r, &th->rcmd->fd);
+        _reactor_close (r, &th->rcmd->efd);
+        dsh_mutex_lock (&thd_mutex);
+        th->state = DSH_FAILED;
+        dsh_mutex_unlock (&thd_mutex);
+    }
+    else if (th->state == DSH_RCMD) {
+        list_delete_all (r->connecting, (ListFindF) _thd_match, th);
+        _reactor_connect_watch (r, th, false);
+        err ("%p: %S: connect: timed out\n", th->host);
+        rcmd_connect_finish (th->rcmd);
+        _rsh_finish (th, DSH_FAILED);
+    }
+}
+
+/*
+ *  Start hosts handed to us by dsh() or connector threads, and handle
+ *   hosts handed back by the watchdog. Returns true if the reactor has
+ *   been asked to shut down.
+ */
+static bool _reactor_admit (struct reactor *r)
+{
+    List l = list_create (NULL);
+    List expired = list_create (NULL);
+    thd_t *th;
+    bool shutdown;
+
+    dsh_mutex_lock (&r->mutex);
+    while ((th = list_pop (r->pending)))
+        list_append (l, th);
+    while ((th = list_pop (r->expired)))
+        list_append (expired, th);
+    shutdown = r->shutdown;
+    dsh_mutex_unlock (&r->mutex);
+
+    /* start connects without holding r->mutex */
+    while ((th = list_pop (l)))
+        _reactor_connect_start (r, th);
+    list_destroy (l);
+
+    while ((th = list_pop (expired)))
+        _reactor_timeout (r, th);
+    list_destroy (expired);
+
+    return (shutdown);
+}
+
+#if HAVE_SYS_EPOLL_H
+static void _reactor_wait (struct reactor *r, int timeout)
+{
+    struct epoll_event ev[DSH_EVENT_BATCH];
+    thd_t *th;
+    int i, n;
+
+    if ((n = epoll_wait (r->epfd, ev, DSH_EVENT_BATCH, timeout)) < 0) {
+        if (errno != EINTR)
+            err ("%p: epoll_wait: %m\n");
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_t key = ev[i].data.u64;
+        int revents = 0;
+
+        if (key == EV_WAKE) {
+            _reactor_drain (r);
+            continue;
+        }
+
+        if (ev[i].events & EPOLLIN)
+            revents |= XPOLLREAD;
+        if (ev[i].events & EPOLLOUT)
+            revents |= XPOLLWRITE;
+        if (ev[i].events & (EPOLLERR|EPOLLHUP))
+            revents |= XPOLLERR;
+
+        /* host may have finished earlier in this batch */
+        if ((th = hosts[key >> 2].thd))
+            _reactor_event (r, th, (int) (key & 3), revents);
+    }
+
+    _reactor_continue_ready (r);
+}
+#else
+static void _reactor_wait (struct reactor *r, int timeout)
+{
+    int max = (2 * list_count (r->hosts))
+            + (2 * list_count (r->connecting)) + 1;
+    struct xpollfd *xpfds = Malloc (max * sizeof (struct xpollfd));
+    thd_t **owner = Malloc (max * sizeof (thd_t *));
+    int *slot = Malloc (max * sizeof (int));
+    ListIterator i;
+    thd_t *th;
+    int n = 1;
+    int k;
+
+    memset (xpfds, 0, max * sizeof (struct xpollfd));
+    xpfds[0].fd = r->wakefd[0];
+    xpfds[0].events = XPOLLREAD;
+
+    i = list_iterator_create (r->hosts);
+    while ((th = list_next (i))) {
+        if (th->rcmd->fd >= 0) {
+            owner[n] = th;
+            slot[n] = EV_STDOUT;
+            xpfds[n].fd = th->rcmd->fd;
+            xpfds[n++].events = XPOLLREAD;
+        }
+        if (th->rcmd->efd >= 0) {
+            owner[n] = th;
+            slot[n] = EV_STDERR;
+            xpfds[n].fd = th->rcmd->efd;
+            xpfds[n++].events = XPOLLREAD;
+        }
+    }
+    list_iterator_destroy (i);
+
+    i = list_iterator_create (r->connecting);
+    while ((th = list_next (i))) {
+        for (k = 0; k < 2; k++) {
+            if (th->rcmd->nb.fd[k] < 0)
+                continue;
+            owner[n] = th;
+            slot[n] = EV_CONNECT + k;
+            xpfds[n].fd = th->rcmd->nb.fd[k];
+            xpfds[n++].events = th->rcmd->nb.events[k];
+        }
+    }
+    list_iterator_destroy (i);
+
+    /* xpoll() timeout is in seconds */
+    if (xpoll (xpfds, n, (timeout < 0) ? -1 : (timeout + 999) / 1000) < 0) {
+        if (errno != EINTR)
+            err ("%p: xpoll: %m\n");
+        n = 0;
+    }
+
+    if ((n > 0) && (xpfds[0].revents & XPOLLREAD))
+        _reactor_drain (r);
+
+    for (k = 1; k < n; k++) {
+        if (xpfds[k].revents)
+            _reactor_event (r, owner[k], slot[k], xpfds[k].revents);
+    }
+
+    _reactor_continue_ready (r);
+
+    Free ((void **) &xpfds);
+    Free ((void **) &owner);
+    Free ((void **) &slot);
+}
+#endif /* HAVE_SYS_EPOLL_H */
+
+/*
+ *  Check non-blocking connects for expired rcmd module timers. Returns
+ *   the number of msecs until the next module timer expires, or -1 if
+ *   there is none.
+ */
+static int _reactor_reap_connecting (struct reactor *r)
+{
+    ListIterator i = list_iterator_create (r->connecting);
+    List expired = list_create (NULL);
+    struct timeval now;
+    int timeout = -1;
+    thd_t *th;
+
+    gettimeofday (&now, NULL);
+
+    while ((th = list_next (i))) {
+        struct timeval tv;
+        int ms;
+
+        if (!timerisset (&th->rcmd->nb_expire))
+            continue;
+
+        if (rcmd_connect_timer_expired (th->rcmd, &now)) {
+            list_append (expired, th);
+            continue;
+        }
+
+        timersub (&th->rcmd->nb_expire, &now, &tv);
+        ms = (tv.tv_sec * 1000) + ((tv.tv_usec + 999) / 1000);
+        if ((timeout < 0) || (ms < timeout))
+            timeout = ms;
+    }
+    list_iterator_destroy (i);
+
+    /*
+     *  Module timers expired: continue with no events. Any new
+     *   timer will be picked up on the next pass.
+     */
+    if (!list_is_empty (expired))
+        timeout = 0;
+    while ((th = list_pop (expired)))
+        _reactor_connect_continue (r, th);
+    list_destroy (expired);
+
+    return (timeout);
+}
+
+/*
+ *  Finish any hosts whose fds have all been closed. The host list is
+ *   only scanned if an fd was closed since the last call. Returns the
+ *   timeout for the next _reactor_wait().
+ */
+static int _reactor_reap (struct reactor *r)
+{
+    ListIterator i;
+    thd_t *th;
+
+    if (r->reap) {
+        i = list_iterator_create (r->hosts);
+        while ((th = list_next (i))) {
+            if ((th->rcmd->fd >= 0) || (th->rcmd->efd >= 0))
+                continue;
+            list_delete (i);
+            _rsh_finish (th, (th->state == DSH_FAILED) ? DSH_FAILED : DSH_DONE);
+        }
+        list_iterator_destroy (i);
+        r->reap = false;
+    }
+
+    return (_reactor_reap_connecting (r));
+}
+
+static void *_reactor_thread (void *arg)
+{
+    struct reactor *r = arg;
+
+    while (!_reactor_admit (r)
+           || !list_is_empty (r->hosts)
+           || !list_is_empty (r->connecting))
+        _reactor_wait (r, _reactor_reap (r));
+
+    return NULL;
+}
+
+static void _reactor_add (struct reactor *r, thd_t *th)
+{
+    dsh_mutex_lock (&r->mutex);
+    list_append (r->pending, th);
+    dsh_mutex_unlock (&r->mutex);
+    _reactor_wake (r);
+}
+
+/*
+ * Called by the watchdog, with thd_mutex held, when the deadline of
+ *  host `th' expires. Returns true if the host is serviced by a reactor,
+ *  in which case it is handed back to the reactor to handle the timeout.
+ */
+static bool _event_engine_expire (thd_t *th)
+{
+    struct reactor *r = &reactors[th->nodeid % nreactors];
+
+    if ((th->state != DSH_READING) && !rcmd_nonblocking (th->rcmd))
+        return (false);
+
+    dsh_mutex_lock (&r->mutex);
+    list_append (r->expired, th);
+    dsh_mutex_unlock (&r->mutex);
+    _reactor_wake (r);
+
+    return (true);
+}
+
+/*
+ * Forget host `th', which is about to be freed, if it was handed back
+ *  to its reactor by the watchdog but the reactor has not seen it yet.
+ */
+static void _event_engine_release (thd_t *th)
+{
+    struct reactor *r = &reactors[th->nodeid % nreactors];
+
+    dsh_mutex_lock (&r->mutex);
+    list_delete_all (r->expired, (ListFindF) _thd_match, th);
+    dsh_mutex_unlock (&r->mutex);
+}
+
+/*
+ * Connector thread. Connect to hosts queued by dsh() and hand them
+ *  off to a reactor.
+ */
+static void *_connect_thread (void *arg)
+{
+    thd_t *a;
+    state_t rv;
+
+    for (;;) {
+        dsh_mutex_lock (&connect_mutex);
+        while (!connect_shutdown && list_is_empty (connect_queue))
+            pthread_cond_wait (&connect_cond, &connect_mutex);
+        a = list_pop (connect_queue);
+        dsh_mutex_unlock (&connect_mutex);
+
+        if (a == NULL)
+            return NULL;
+
+        /*
+         *  Host canceled (^C^Z) while waiting for a connector
+         */
+        if (a->state == DSH_CANCELED) {
+            _thd_release (a);
+            _release_slot ();
+            continue;
+        }
+
+        /*  Target of SIGALRM from _wdog() while in DSH_RCMD state
+         */
+        a->thread = pthread_self ();
+
+        if ((rv = _rsh_connect (a)) == DSH_READING)
+            _reactor_add (&reactors[a->nodeid % nreactors], a);
+        else
+            _rsh_finish (a, (rv == DSH_FAILED) ? DSH_FAILED : DSH_DONE);
+    }
+    return NULL;
+}
+
+/*
+ * Queue host `th' for connection. Caller holds threadcount_mutex.
+ */
+static void _event_engine_submit (thd_t *th)
+{
+    /*  Reactors connect directly with non-blocking rcmd modules
+     */
+    if (rcmd_nonblocking (th->rcmd)) {
+        _reactor_add (&reactors[th->nodeid % nreactors], th);
+        return;
+    }
+
+    dsh_mutex_lock (&connect_mutex);
+    list_append (connect_queue, th);
+    pthread_cond_signal (&connect_cond);
+    dsh_mutex_unlock (&connect_mutex);
+}
+
+static void _event_thread_create (pthread_t *tp, void *(*f)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int rv;
+
+    _dsh_attr_init (&attr, DSH_THREAD_STACKSIZE);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_JOINABLE);
+    if ((rv = pthread_create (tp, &attr, f, arg)))
+        errx ("%p: pthread_create: %s\n", strerror (rv));
+    pthread_attr_destroy (&attr);
+}
+
+static void _event_engine_start (opt_t *opt)
+{
+    int i;
+
+    _xsignal (SIGPIPE, SIG_IGN);
+
+    nreactors = MIN (opt->fanout, DSH_EVENT_REACTORS);
+    nconnectors = MIN (opt->fanout, DSH_EVENT_CONNECTORS);
+
+    connect_queue = list_create (NULL);
+    connect_shutdown = false;
+
+    reactors = Malloc (nreactors * sizeof (struct reactor));
+    for (i = 0; i < nreactors; i++) {
+        struct reactor *r = &reactors[i];
+
+        if ((errno = pthread_mutex_init (&r->mutex, NULL)))
+            errx ("%p: pthread_mutex_init: %m\n");
+        r->pending = list_create (NULL);
+        r->expired = list_create (NULL);
+        r->reap = false;
+        r->hosts = list_create (NULL);
+        r->connecting = list_create (NULL);
+        r->ready = list_create (NULL);
+        r->shutdown = false;
+
+        if (pipe (r->wakefd) < 0)
+            errx ("%p: pipe: %m\n");
+        fd_set_nonblocking (r->wakefd[0]);
+        fd_set_nonblocking (r->wakefd[1]);
+        fd_set_close_on_exec (r->wakefd[0]);
+        fd_set_close_on_exec (r->wakefd[1]);
+
+#if HAVE_SYS_EPOLL_H
+        {
+            struct epoll_event ev;
+
+            if ((r->epfd = epoll_create (DSH_EVENT_BATCH)) < 0)
+                errx ("%p: epoll_create: %m\n");
+            fd_set_close_on_exec (r->epfd);
+
+            memset (&ev, 0, sizeof (ev));
+            ev.events = EPOLLIN;
+            ev.data.u64 = EV_WAKE;
+            if (epoll_ctl (r->epfd, EPOLL_CTL_ADD, r->wakefd[0], &ev) < 0)
+                errx ("%p: epoll_ctl: %m\n");
+        }
 #endif
+        _event_thread_create (&r->thread, _reactor_thread, r);
+    }
 
-    return (0);
+    connectors = Malloc (nconnectors * sizeof (pthread_t));
+    for (i = 0; i < nconnectors; i++)
+        _event_thread_create (&connectors[i], _connect_thread, NULL);
+}
+
+static void _event_engine_stop (void)
+{
+    int i;
 
+    dsh_mutex_lock (&connect_mutex);
+    connect_shutdown = true;
+    pthread_cond_broadcast (&connect_cond);
+    dsh_mutex_unlock (&connect_mutex);
+
+    for (i = 0; i < nconnectors; i++)
+        pthread_join (connectors[i], NULL);
+    Free ((void **) &connectors);
+    list_destroy (connect_queue);
+    connect_queue = NULL;
+
+    for (i = 0; i < nreactors; i++) {
+        struct reactor *r = &reactors[i];
+
+        dsh_mutex_lock (&r->mutex);
+        r->shutdown = true;
+        dsh_mutex_unlock (&r->mutex);
+        _reactor_wake (r);
+
+        pthread_join (r->thread, NULL);
+
+        list_destroy (r->pending);
+        list_destroy (r->expired);
+        list_destroy (r->hosts);
+        list_destroy (r->connecting);
+        list_destroy (r->ready);
+        close (r->wakefd[0]);
+        close (r->wakefd[1]);
+#if HAVE_SYS_EPOLL_H
+        close (r->epfd);
+#endif
+        pthread_mutex_destroy (&r->mutex);
+    }
+    Free ((void **) &reactors);
 }
 
 static int
@@ -905,16 +2254,21 @@ _cancel_pending_threads (void)
     int n = 0;
     int i;
 
-    if (t == NULL)
+    if (hosts == NULL)
         return (0);
 
     dsh_mutex_lock (&threadcount_mutex);
-    for (i = 0; t[i].host != NULL; i++) {
-        if ((t[i].state == DSH_NEW) || (t[i].state == DSH_RCMD)) {
-            t[i].state = DSH_CANCELED;
+    dsh_mutex_lock (&thd_mutex);
+    for (i = 0; hosts[i].host != NULL; i++) {
+        thd_t *th = hosts[i].thd;
+        state_t *sp = th ? &th->state : &hosts[i].state;
+
+        if ((*sp == DSH_NEW) || (*sp == DSH_RCMD)) {
+            *sp = DSH_CANCELED;
             ++n;
         }
     }
+    dsh_mutex_unlock (&thd_mutex);
     err ("%p: Canceled %d pending threads.\n", n);
     dsh_mutex_unlock (&threadcount_mutex);
 
@@ -928,7 +2282,7 @@ _cancel_pending_threads (void)
 static void
 _handle_sigint(time_t *last_intrp)
 {
-    if (!t) return;
+    if (!hosts) return;
 
     if (sigint_terminates) {
         _fwd_signal(SIGINT);
@@ -953,7 +2307,7 @@ _handle_sigint(time_t *last_intrp)
 static void
 _handle_sigtstp (time_t last_intr)
 {
-    if (!t)
+    if (!hosts)
         return;
     if (time (NULL) - last_intr > INTR_TIME)
         raise (SIGSTOP);
@@ -973,7 +2327,7 @@ _signals_thread (void *arg)
     sigaddset (&set, SIGINT);
     sigaddset (&set, SIGTSTP);
 
-    while (t != NULL) {
+    while (hosts != NULL) {
         if ((e = sigwait (&set, &signo)) != 0) {
             if (e == EINTR) continue;
             err ("sigwait: %s\n", strerror (e));
@@ -993,6 +2347,289 @@ _signals_thread (void *arg)
     return NULL;
 }
 
+/*
+ * Build the remote command that runs the pdcp server, which relays
+ *  or forwards the copy to the hosts in `relay' if not NULL.
+ */
+static char *_pcp_server_cmd (opt_t *opt, List pcp_infiles, hostlist_t relay)
+{
+    char *cmd = NULL;
+    char buf[64];
+
+    xstrcat(&cmd, opt->remote_program_path);
+    if (opt->recursive)
+        xstrcat(&cmd, " -r");
+    if (opt->preserve)
+        xstrcat(&cmd, " -p");
+    if (opt->sync)
+        xstrcat(&cmd, " -s");
+    /* outfile must be directory */
+    if ((pcp_infiles && list_count(pcp_infiles) > 1)
+        || opt->target_is_directory)
+        xstrcat(&cmd, " -y");
+    if (opt->chain)
+        xstrcat(&cmd, " -H");
+
+    if (relay) {
+        size_t size = 1024;
+        char *hosts = Malloc (size);
+
+        while (hostlist_ranged_string (relay, size, hosts) < 0)
+            Realloc ((void **) &hosts, (size *= 2));
+
+        if (opt->tree_width > 0) {
+            snprintf (buf, sizeof (buf), " -W %d -f %d",
+                      opt->tree_width, opt->tree_width);
+            xstrcat(&cmd, buf);
+        }
+        if (opt->archive)
+            xstrcat(&cmd, " -D");
+        if (opt->compress)
+            xstrcat(&cmd, " -G");
+        if (opt->update)
+            xstrcat(&cmd, " -U");
+        if (opt->streams > 1) {
+            snprintf (buf, sizeof (buf), " -n %d", opt->streams);
+            xstrcat(&cmd, buf);
+        }
+        snprintf (buf, sizeof (buf), " -t %d", opt->connect_timeout);
+        xstrcat(&cmd, buf);
+        if (opt->command_timeout > 0) {
+            snprintf (buf, sizeof (buf), " -u %d", opt->command_timeout);
+            xstrcat(&cmd, buf);
+        }
+        xstrcat(&cmd, " -R ");
+        xstrcat(&cmd, opt->rcmd_name);
+        if (strcmp (opt->ruser, opt->luser) != 0) {
+            xstrcat(&cmd, " -l ");
+            xstrcat(&cmd, opt->ruser);
+        }
+        xstrcat(&cmd, " -w '");
+        xstrcat(&cmd, hosts);
+        xstrcat(&cmd, "'");
+        Free ((void **) &hosts);
+    }
+
+    xstrcat(&cmd, " -z ");               /* invoke pcp server */
+    xstrcat(&cmd, opt->outfile_name);    /* outfile is remote target */
+
+    return (cmd);
+}
+
+/*
+ * pdcp -W: copy directly to the first `tree_width' hosts only, and have
+ *  each of them relay the files on to an equal share of the remaining
+ *  hosts (relaying further in turn), so that no host sends the files
+ *  to more than `tree_width' others. Returns the number of hosts to
+ *  copy to directly.
+ */
+static int _pcp_tree_setup (opt_t *opt, List pcp_infiles, int rshcount)
+{
+    int width = opt->tree_width;
+    int rest = rshcount - width;
+    int i, k;
+
+    if (rshcount <= width)
+        return (rshcount);
+
+    for (k = 0; k < width; k++) {
+        int first = width + (k * rest) / width;
+        int last = width + ((k + 1) * rest) / width;
+        hostlist_t hl;
+
+        if (first == last)
+            continue;
+        if (!(hl = hostlist_create (NULL)))
+            errx ("%p: hostlist_create failed\n");
+        for (i = first; i < last; i++)
+            hostlist_push_host (hl, hosts[i].host);
+        hosts[k].cmd = _pcp_server_cmd (opt, pcp_infiles, hl);
+        hostlist_destroy (hl);
+    }
+
+    for (i = width; i < rshcount; i++) {
+        free (hosts[i].host);
+        hosts[i].host = NULL;
+    }
+
+    return (width);
+}
+
+/*
+ * pdcp -H: copy only to the first host, which forwards the copy to the
+ *  next host while receiving it, and so on down the list. Returns the
+ *  number of hosts to copy to directly.
+ */
+static int _pcp_chain_setup (opt_t *opt, List pcp_infiles, int rshcount)
+{
+    hostlist_t hl = NULL;
+    int i;
+
+    if (rshcount > 1 && !(hl = hostlist_create (NULL)))
+        errx ("%p: hostlist_create failed\n");
+    for (i = 1; i < rshcount; i++) {
+        hostlist_push_host (hl, hosts[i].host);
+        free (hosts[i].host);
+        hosts[i].host = NULL;
+    }
+
+    /* the first host reports errors from the chain on stderr */
+    hosts[0].cmd = _pcp_server_cmd (opt, pcp_infiles, hl);
+    if (hl)
+        hostlist_destroy (hl);
+
+    return (1);
+}
+
+/*
+ * Connection to the next host of a pdcp -H chain, and the thread that
+ *  consumes its acknowledgements and passes its errors up the chain.
+ */
+static struct rcmd_info *chain_rcmd = NULL;
+static char *chain_host = NULL;
+static pthread_t chain_thread;
+
+static void _pcp_chain_errors (char *buf, size_t *lenp, bool eof)
+{
+    char *p, *q = buf;
+    char c;
+
+    while ((p = memchr (q, '\n', *lenp - (q - buf)))) {
+        c = *++p;
+        *p = '\0';
+        err ("%s", q);
+        *p = c;
+        q = p;
+    }
+    *lenp -= q - buf;
+    memmove (buf, q, *lenp);
+
+    if (*lenp > 0 && (eof || *lenp == BUFSIZ - 1)) {
+        buf[*lenp] = '\0';
+        err ("%s\n", buf);
+        *lenp = 0;
+    }
+}
+
+static void *_pcp_chain_drain (void *arg)
+{
+    struct pollfd pfd[2];
+    char ack[BUFSIZ];
+    char ebuf[BUFSIZ];
+    size_t elen = 0;
+    ssize_t n;
+
+    pfd[0].fd = chain_rcmd->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = chain_rcmd->efd;
+    pfd[1].events = POLLIN;
+
+    while (pfd[0].fd >= 0 || pfd[1].fd >= 0) {
+        if (poll (pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err ("%p: poll: %m\n");
+            break;
+        }
+        /*
+         *  Hosts in a chain never refuse a file, so only empty
+         *   acknowledgements arrive here. Errors come on stderr.
+         */
+        if (pfd[0].revents && read (pfd[0].fd, ack, sizeof (ack)) <= 0)
+            pfd[0].fd = -1;
+        if (pfd[1].revents) {
+            n = read (pfd[1].fd, ebuf + elen, BUFSIZ - 1 - elen);
+            if (n <= 0)
+                pfd[1].fd = -1;
+            else
+                elen += n;
+            _pcp_chain_errors (ebuf, &elen, n <= 0);
+        }
+    }
+    return (NULL);
+}
+
+/*
+ * pdcp -H server: connect to the next host in the chain, the first
+ *  reachable one in opt->wcoll, and run the pdcp server there with the
+ *  rest of the chain. Returns the fd to forward the copy to, or -1.
+ */
+int pcp_chain_start (opt_t *opt)
+{
+    hostlist_t rest;
+    char addr[IP_ADDR_LEN];
+    char *cmd;
+
+    if (rcmd_init (opt) < 0) {
+        err ("%p: unable to initialize an rcmd module\n");
+        return (-1);
+    }
+    _xsignal (SIGPIPE, SIG_IGN);
+
+    if (!(rest = hostlist_copy (opt->wcoll)))
+        errx ("%p: hostlist_copy failed\n");
+
+    while ((chain_host = hostlist_shift (rest))) {
+        cmd = _pcp_server_cmd (opt, NULL,
+                               hostlist_count (rest) > 0 ? rest : NULL);
+
+        if ((chain_rcmd = rcmd_create (chain_host))) {
+            if (chain_rcmd->opts->resolve_hosts
+                && _resolve (chain_host, addr) < 0)
+                err ("%p: gethostbyname(\"%S\") failed\n", chain_host);
+            else
+                rcmd_connect (chain_rcmd, chain_host, addr, opt->luser,
+                              opt->ruser, cmd, 0, true);
+            if (chain_rcmd->fd < 0) {
+                rcmd_destroy (chain_rcmd);
+                chain_rcmd = NULL;
+            }
+        }
+        Free ((void **) &cmd);
+
+        if (chain_rcmd)
+            break;
+
+        /* skip hosts that are down, the chain continues after them */
+        err ("%p: %S: skipping host in copy chain\n", chain_host);
+        free (chain_host);
+    }
+    hostlist_destroy (rest);
+
+    if (!chain_rcmd)
+        return (-1);
+
+    if (pthread_create (&chain_thread, NULL, _pcp_chain_drain, NULL))
+        errx ("%p: pthread_create: %m\n");
+
+    return (chain_rcmd->fd);
+}
+
+/*
+ * Finish forwarding the copy and wait for the rest of the chain.
+ *  Returns the exit code of the next host, or -1 if there is none.
+ */
+int pcp_chain_finish (void)
+{
+    int rc;
+
+    if (!chain_rcmd)
+        return (-1);
+
+    shutdown (chain_rcmd->fd, SHUT_WR);
+    pthread_join (chain_thread, NULL);
+
+    close (chain_rcmd->fd);
+    if (chain_rcmd->efd >= 0)
+        close (chain_rcmd->efd);
+    rc = rcmd_destroy (chain_rcmd);
+    chain_rcmd = NULL;
+    free (chain_host);
+    chain_host = NULL;
+
+    return (rc);
+}
+
 /*
  * Run command on a list of hosts, keeping 'fanout' number of connections
  * active concurrently.
@@ -1001,9 +2638,11 @@ int dsh(opt_t * opt)
 {
     int i, rc = 0;
     int rv, rshcount;
+    thd_t *th;
+    pthread_t thread_thd;
+    pthread_attr_t attr_thd;
     pthread_t thread_wdog;
     pthread_t thread_sig;
-    pthread_attr_t attr_wdog;
     pthread_attr_t attr_sig;
     List pcp_infiles = NULL;
     hostlist_iterator_t itr;
@@ -1054,25 +2693,20 @@ int dsh(opt_t * opt)
 
     /* build PCP command */
     if (pdsh_personality() == PCP && !opt->reverse_copy) {
-        char *cmd = NULL;
-
-        /* expand directories, if any, and verify access for all files */
-        if (!(pcp_infiles = pcp_expand_dirs(opt->infile_names))) {
+        /*
+         *  Expand directories, if any, and verify access for all files.
+         *   A -W relay passes on just the files it received.
+         */
+        if (opt->pcp_relay)
+            pcp_infiles = pcp_received_files(opt->infile_names,
+                                             opt->archive);
+        else
+            pcp_infiles = pcp_expand_dirs(opt->infile_names, opt->archive);
+        if (!pcp_infiles) {
             err("%p: unable to build file copy list\n");
             exit(1);
         }
-
-        xstrcat(&cmd, opt->remote_program_path);
-        if (opt->recursive)
-            xstrcat(&cmd, " -r");
-        if (opt->preserve)
-            xstrcat(&cmd, " -p");
-        if (list_count(pcp_infiles) > 1)     /* outfile must be directory */
-            xstrcat(&cmd, " -y");
-        xstrcat(&cmd, " -z ");               /* invoke pcp server */
-        xstrcat(&cmd, opt->outfile_name);    /* outfile is remote target */
-
-        opt->cmd = cmd;
+        opt->cmd = _pcp_server_cmd(opt, pcp_infiles, NULL);
     }
 
     if (pdsh_personality() == PCP && opt->reverse_copy) {
@@ -1086,6 +2720,8 @@ int dsh(opt_t * opt)
             xstrcat(&cmd, " -r");
         if (opt->preserve)
             xstrcat(&cmd, " -p");
+        if (opt->compress)
+            xstrcat(&cmd, " -G");
         xstrcat(&cmd, " -Z ");               /* invoke pcp client */
 
         i = list_iterator_create(opt->infile_names);
@@ -1103,24 +2739,30 @@ int dsh(opt_t * opt)
     if (opt->debug)
         debug = 1;
 
-    /* build thread array--terminated with t[i].host == NULL */
-    t = (thd_t *) Malloc(sizeof(thd_t) * (rshcount + 1));
+    /*
+     * build host record array--terminated with hosts[i].host == NULL.
+     *  Active state for each host is allocated by _thd_create() once
+     *  the host enters the fanout window.
+     */
+    hosts = (hostrec_t *) Malloc(sizeof(hostrec_t) * (rshcount + 1));
+    memset (hosts, 0, sizeof(hostrec_t) * (rshcount + 1));
 
     if (!(itr = hostlist_iterator_create(opt->wcoll)))
         errx("%p: hostlist_iterator_create failed\n");
     i = 0;
-    while ((t[i].host = hostlist_next(itr))) {
+    while ((hosts[i].host = hostlist_next(itr))) {
         char *d;
 
         assert(i < rshcount);
 
-        _thd_init (&t[i], opt, pcp_infiles, i);
+        hosts[i].thd = NULL;
+        hosts[i].state = DSH_NEW;
 
         /*
          * Require domain names in labels if hosts have
          *  different domains
          */
-        if (!domain_in_label && (d = strchr (t[i].host, '.'))) {
+        if (!domain_in_label && (d = strchr (hosts[i].host, '.'))) {
             if (domain == NULL)
                 domain = d;
             else if (strcmp (d, domain) != 0)
@@ -1135,17 +2777,38 @@ int dsh(opt_t * opt)
     if (domain_in_label)
         err_no_strip_domain ();
 
+    if (pdsh_personality() == PCP && opt->tree_width > 0)
+        rshcount = _pcp_tree_setup (opt, pcp_infiles, rshcount);
+    else if (pdsh_personality() == PCP && opt->chain)
+        rshcount = _pcp_chain_setup (opt, pcp_infiles, rshcount);
+
+    /* each active host holds an output and an error buffer */
+    cbuf_pool = cbuf_pool_create (DSH_CBUF_MINSIZE, DSH_CBUF_MAXSIZE,
+                                  2 * MIN (opt->fanout, rshcount));
+
+    /*
+     * queue output to a single writer thread while hosts are running.
+     *  pdcp can die of SIGPIPE while sending a file, which would lose
+     *  queued messages, so it keeps writing its messages directly.
+     */
+    if (pdsh_personality() == DSH)
+        outq_start ();
+
     /* set timeout values for _wdog() */
     connect_timeout = opt->connect_timeout;
     command_timeout = opt->command_timeout;
 
     /* start the watchdog thread */
-    _dsh_attr_init (&attr_wdog, DSH_THREAD_STACKSIZE);
-    rv = pthread_create(&thread_wdog, &attr_wdog, _wdog, (void *) t);
+    _wdog_start (&thread_wdog);
 
     /* start the signals thread */
     _dsh_attr_init (&attr_sig, DSH_THREAD_STACKSIZE);
-    rv = pthread_create(&thread_sig, &attr_sig, _signals_thread, (void *) t);
+    rv = pthread_create(&thread_sig, &attr_sig, _signals_thread, (void *) hosts);
+
+    /* event engine only supported for dsh; pdcp uses a thread per host */
+    event_engine = (opt->engine == ENGINE_EVENT) && (pdsh_personality() == DSH);
+    if (event_engine)
+        _event_engine_start (opt);
 
     /* start all the other threads (at most 'fanout' active at once) */
     for (i = 0; i < rshcount; i++) {
@@ -1159,7 +2822,7 @@ int dsh(opt_t * opt)
         /*
          *  Advance past any canceled threads
          */
-        while ((t[i].state == DSH_CANCELED) && (i < rshcount))
+        while ((i < rshcount) && (hosts[i].state == DSH_CANCELED))
             ++i;
         /*
          *  Abort if no more threads
@@ -1168,24 +2831,39 @@ int dsh(opt_t * opt)
             dsh_mutex_unlock(&threadcount_mutex);
             break;
         }
+        threadcount++;
+        dsh_mutex_unlock(&threadcount_mutex);
+
+        /* allocate host state outside threadcount_mutex (may resolve host) */
+        if (!(th = _thd_create (opt, pcp_infiles, i))) {
+            _release_slot ();
+            continue;
+        }
+
+        /* hand host off to event engine connector threads */
+        if (event_engine) {
+            _event_engine_submit (th);
+            continue;
+        }
 
-        /* create thread */
-        _dsh_attr_init (&t[i].attr, DSH_THREAD_STACKSIZE);
+        /*
+         * create thread. The thread may finish and free `th' before
+         *  pthread_create() returns, so it records its own thread id.
+         */
+        _dsh_attr_init (&attr_thd, DSH_THREAD_STACKSIZE);
 #ifdef 	PTHREAD_SCOPE_SYSTEM
         /* we want 1:1 threads if there is a choice */
-        pthread_attr_setscope(&t[i].attr, PTHREAD_SCOPE_SYSTEM);
+        pthread_attr_setscope(&attr_thd, PTHREAD_SCOPE_SYSTEM);
 #endif
-        rv = pthread_create(&t[i].thread, &t[i].attr,
+        rv = pthread_create(&thread_thd, &attr_thd,
                             pdsh_personality() == DSH
-                            ? _rsh_thread : _rcp_thread, (void *) &t[i]);
+                            ? _rsh_thread : _rcp_thread, (void *) th);
         if (rv != 0) {
             if (opt->kill_on_fail)
                 _fwd_signal(SIGTERM);
-            errx("%p: pthread_create %S: %S\n", t[i].host, strerror(rv));
+            errx("%p: pthread_create %S: %S\n", hosts[i].host, strerror(rv));
         }
-        threadcount++;
-
-        dsh_mutex_unlock(&threadcount_mutex);
+        pthread_attr_destroy (&attr_thd);
     }
 
     /* wait for termination of remaining threads */
@@ -1194,6 +2872,17 @@ int dsh(opt_t * opt)
         pthread_cond_wait(&threadcount_cond, &threadcount_mutex);
     dsh_mutex_unlock(&threadcount_mutex);
 
+    /* stop watchdog before reactors it may hand hosts to are freed */
+    _wdog_stop (thread_wdog);
+
+    if (event_engine)
+        _event_engine_stop ();
+
+    outq_stop ();
+
+    if (opt->coalesce)
+        coalesce_print ();
+
     if (debug)
         _dump_debug_stats(rshcount);
 
@@ -1205,25 +2894,26 @@ int dsh(opt_t * opt)
 
     /* if -S, our exit value is the largest of the return codes */
     if (opt->ret_remote_rc) {
-        for (i = 0; t[i].host != NULL; i++) {
-            if (t[i].state == DSH_FAILED)
+        for (i = 0; hosts[i].host != NULL; i++) {
+            if (hosts[i].state == DSH_FAILED)
                 rc = RC_FAILED;
-            if (t[i].rc > rc)
-                rc = t[i].rc;
+            if (hosts[i].rc > rc)
+                rc = hosts[i].rc;
         }
     }
 
     /*
      *  free hostnames allocated in hostlist_next()
-     *   and buffers allocated when initializing thread array
      */
-    for (i = 0; t[i].host != NULL; i++) {
-        free(t[i].host);
-        cbuf_destroy (t[i].outbuf);
-        cbuf_destroy (t[i].errbuf);
+    for (i = 0; hosts[i].host != NULL; i++) {
+        free(hosts[i].host);
+        if (hosts[i].cmd)
+            Free((void **) &hosts[i].cmd);
     }
 
-    Free((void **) &t);         /* cleanup */
+    Free((void **) &hosts);     /* cleanup */
+    cbuf_pool_destroy (cbuf_pool);
+    cbuf_pool = NULL;
 
     return rc;
 }
@@ -34,15 +34,25 @@
 #if HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
+#include <sys/time.h>
 
 #include "src/common/macros.h"
 #include "src/common/list.h"
 #include "src/pdsh/opt.h"
 #include "src/pdsh/cbuf.h"
 #include "src/pdsh/rcmd.h"
+#include "src/pdsh/coalesce.h"
 
 #define INTR_TIME		1       /* secs */
-#define WDOG_POLL 		2       /* secs */
+#define WDOG_RETRY 		1       /* secs between SIGALRMs on timeout */
+#define PCP_RETRIES		3       /* pdcp reconnects after a lost copy */
+
+#define DSH_CBUF_MINSIZE	64      /* initial host output buffer size */
+#define DSH_CBUF_MAXSIZE	131072  /* max host output buffer size */
+
+#define DSH_EVENT_REACTORS	4       /* reactor threads (PDSH_ENGINE=event) */
+#define DSH_EVENT_CONNECTORS	32      /* connect threads (PDSH_ENGINE=event) */
+#define DSH_EVENT_BATCH		256     /* max events per epoll_wait() */
 
 /* some handy SP constants */
 /* NOTE: degenerate case of one node per frame, nodes would be 1, 17, 33,... */
@@ -53,9 +63,20 @@
 typedef enum { DSH_NEW, DSH_RCMD, DSH_READING, DSH_DONE,
         DSH_FAILED, DSH_CANCELED } state_t;
 
+/*
+ *  pdcp -n: an extra connection to a host, registered so that the
+ *   watchdog can interrupt it.
+ */
+typedef struct pcp_stream_conn {
+    bool active;                /* slot in use */
+    pthread_t thread;           /* thread sending over the connection */
+    struct rcmd_info *rcmd;     /* connection, NULL while connecting */
+    struct timeval deadline;    /* connect timeout */
+    bool expired;               /* interrupted by the watchdog */
+} pcp_stream_conn_t;
+
 typedef struct thd {
     pthread_t thread;
-    pthread_attr_t attr;
     state_t state;              /* thread state */
     char *host;                 /* host name */
     char *luser;                /* local username */
@@ -64,6 +85,7 @@ typedef struct thd {
     time_t start;               /* time stamp for start */
     time_t connect;             /* time stamp for connect */
     time_t finish;              /* time stamp for finish */
+    struct timeval deadline;    /* connect/command timeout, or 0 */
     char *cmd;                  /* command */
 
     bool dsh_sopt;              /* true if -s (sep stderr/out) */
@@ -77,6 +99,14 @@ typedef struct thd {
     bool pcp_yopt;              /* target is directory */
     bool pcp_Popt;              /* reverse copy */
     bool pcp_Zopt;              /* pcp client */
+    bool pcp_relay;             /* host relays copy to a subtree (-W) */
+    bool pcp_Dopt;              /* archive mode */
+    bool pcp_Gopt;              /* compress file data */
+    bool pcp_Uopt;              /* skip unchanged files */
+    int pcp_nopt;               /* connections for large files */
+    bool pcp_sopt;              /* sync files to disk */
+    bool pcp_lost;              /* copy lost its connection */
+    pcp_stream_conn_t pcp_streams[PCP_MAX_STREAMS]; /* -n connections */
     char *pcp_progname;         /* program name */
     char *outfile_name;         /* outfile name */
     int rc;                     /* remote return code (-S) */
@@ -89,10 +119,31 @@ typedef struct thd {
     cbuf_t errbuf;              /* stderr buffer  */
 
     bool labels;                /* display host: labels */
+    int labellen;               /* length of host name in labels */
+    coalesce_buf_t cobuf;       /* stdout held for coalescing (-B) */
     char addr[IP_ADDR_LEN];     /* IP address */
 } thd_t;
 
+/*
+ * Compact per-host record kept for every host in the working collective.
+ *  A host's full state (thd_t above, its output buffers and rcmd info)
+ *  is only allocated while the host is in the active fanout window, and
+ *  its results are saved here once it has finished.
+ */
+typedef struct hostrec {
+    char *host;                 /* host name */
+    thd_t *thd;                 /* active host state, or NULL */
+    state_t state;              /* host state while thd == NULL */
+    int rc;                     /* remote return code (-S) */
+    time_t start;               /* time stamp for start */
+    time_t connect;             /* time stamp for connect */
+    time_t finish;              /* time stamp for finish */
+    char *cmd;                  /* pdcp -W/-H relay command, or NULL */
+} hostrec_t;
+
 int dsh(opt_t *);
+int pcp_chain_start(opt_t *);
+int pcp_chain_finish(void);
 void set_rcmd_timeout(int);
 void testcase(int);
 
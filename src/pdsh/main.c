@@ -63,6 +63,8 @@ extern const char *pdsh_module_dir;
 static void _interactive_dsh(opt_t *);
 static int _pcp_remote_client (opt_t *);
 static int _pcp_remote_server (opt_t *);
+static int _pcp_relay (opt_t *);
+static int _pcp_chain (opt_t *);
 
 int main(int argc, char *argv[])
 {
@@ -127,6 +129,11 @@ int main(int argc, char *argv[])
          */
         if (opt.info_only)      /* display info only */
             opt_list(&opt);
+        else if (pdsh_personality() == PCP && opt.pcp_server && opt.wcoll
+                 && opt.chain)
+            retval = _pcp_chain (&opt);
+        else if (pdsh_personality() == PCP && opt.pcp_server && opt.wcoll)
+            retval = _pcp_relay (&opt);
         else if (pdsh_personality() == PCP && opt.pcp_server)
             retval = (_pcp_remote_server (&opt) < 0);
         else if (pdsh_personality() == PCP && opt.pcp_client)
@@ -412,10 +419,80 @@ static int _pcp_remote_server (opt_t *opt)
     svr->preserve =      opt->preserve;
     svr->target_is_dir = opt->target_is_directory;
     svr->outfile =       opt->outfile_name;
+    svr->received =      NULL;
+    svr->chain =         opt->chain;
+    svr->sync =          opt->sync;
+    svr->fwdfd =         -1;
 
     return (pcp_server (svr));
 }
 
+/*
+ * pdcp -W: receive files as pdcp server, then copy them on to the
+ *  hosts in wcoll, which may relay them further.
+ */
+static int _pcp_relay (opt_t *opt)
+{
+    struct pcp_server svr[1];
+    List received = list_create ((ListDelF) free);
+
+    svr->infd =          STDIN_FILENO;
+    svr->outfd =         STDOUT_FILENO;
+    svr->preserve =      opt->preserve;
+    svr->target_is_dir = opt->target_is_directory;
+    svr->outfile =       opt->outfile_name;
+    svr->received =      received;
+    svr->chain =         false;
+    svr->sync =          opt->sync;
+    svr->fwdfd =         -1;
+
+    if ((pcp_server (svr) < 0) || list_is_empty (received)) {
+        list_destroy (received);
+        return (1);
+    }
+
+    /*
+     *  stdout carried the copy protocol, and the sender stops reading
+     *   it once it is done. Write any further output to stderr.
+     */
+    dup2 (STDERR_FILENO, STDOUT_FILENO);
+
+    opt->pcp_server = false;
+    opt->pcp_relay = true;
+    if (opt->infile_names)
+        list_destroy (opt->infile_names);
+    opt->infile_names = received;
+
+    return (dsh (opt));
+}
+
+/*
+ * pdcp -H: receive files as pdcp server, forwarding everything as it
+ *  arrives to the next host in the chain in wcoll.
+ */
+static int _pcp_chain (opt_t *opt)
+{
+    struct pcp_server svr[1];
+    int rc;
+
+    svr->infd =          STDIN_FILENO;
+    svr->outfd =         STDOUT_FILENO;
+    svr->preserve =      opt->preserve;
+    svr->target_is_dir = opt->target_is_directory;
+    svr->outfile =       opt->outfile_name;
+    svr->received =      NULL;
+    svr->chain =         true;
+    svr->sync =          opt->sync;
+    svr->fwdfd =         pcp_chain_start (opt);
+
+    rc = pcp_server (svr);
+
+    if (pcp_chain_finish () != 0)
+        rc = -1;
+
+    return (rc < 0);
+}
+
 static int _pcp_remote_client (opt_t *opt)
 {
     struct pcp_client pcp[1];
@@ -423,11 +500,16 @@ static int _pcp_remote_client (opt_t *opt)
     pcp->infd =  STDIN_FILENO;
     pcp->outfd = STDOUT_FILENO;
 
-    pcp->infiles = pcp_expand_dirs (opt->infile_names);
+    pcp->infiles = pcp_expand_dirs (opt->infile_names, opt->archive);
 
     pcp->host =       opt->pcp_client_host;
     pcp->preserve =   opt->preserve;
     pcp->pcp_client = opt->pcp_client;
+    pcp->archive =    opt->archive;
+    pcp->compress =   opt->compress;
+    pcp->update =     opt->update;
+    pcp->streams =    1;
+    pcp->stream_open = NULL;
 
     return (pcp_client (pcp));
 }
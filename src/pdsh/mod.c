@@ -635,6 +635,42 @@ mod_get_rcmd_destroy (mod_t mod)
         return NULL;
 }
 
+RcmdStartF
+mod_get_rcmd_start (mod_t mod)
+{
+    assert (mod != NULL);
+    assert (mod->pmod != NULL);
+
+    if (mod->pmod->rcmd_ops && mod->pmod->rcmd_ops->rcmd_start)
+        return mod->pmod->rcmd_ops->rcmd_start;
+    else
+        return NULL;
+}
+
+RcmdContinueF
+mod_get_rcmd_continue (mod_t mod)
+{
+    assert (mod != NULL);
+    assert (mod->pmod != NULL);
+
+    if (mod->pmod->rcmd_ops && mod->pmod->rcmd_ops->rcmd_continue)
+        return mod->pmod->rcmd_ops->rcmd_continue;
+    else
+        return NULL;
+}
+
+RcmdFinishF
+mod_get_rcmd_finish (mod_t mod)
+{
+    assert (mod != NULL);
+    assert (mod->pmod != NULL);
+
+    if (mod->pmod->rcmd_ops && mod->pmod->rcmd_ops->rcmd_finish)
+        return mod->pmod->rcmd_ops->rcmd_finish;
+    else
+        return NULL;
+}
+
 
 int
 mod_process_opt(opt_t *opt, int c, char *optarg)
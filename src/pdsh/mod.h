@@ -158,6 +158,44 @@ typedef int        (*RcmdF)         (char *, char *, char *, char *, char *,
                                      int, int *, void **);
 typedef int        (*RcmdDestroyF)  (void *);
 
+/*
+ * Optional non-blocking connect interface for rcmd modules.
+ *
+ *  rcmd_start() begins a connection using the same arguments as
+ *   rcmd (with `fd2p' replaced by a flag requesting a stderr channel),
+ *   and rcmd_continue() advances it when the caller sees activity
+ *   on the fds the module is waiting for. Both return RCMD_NB_DONE
+ *   once the connection is established, RCMD_NB_WAIT if the module is
+ *   waiting on the fds and/or timeout described in the rcmd_nbconn
+ *   structure, or RCMD_NB_ERROR on failure (after printing an error).
+ *
+ *  rcmd_finish() must be called exactly once for every rcmd_start().
+ *   On a successful connection it returns the stdin/stdout fd (in
+ *   blocking mode), and sets stderr fd in *fd2p and module private
+ *   data for rcmd_signal/rcmd_destroy in *arg. On a failed or
+ *   abandoned (e.g. timed out) connection it releases all resources
+ *   and returns -1.
+ *
+ *  Modules that only provide the blocking `rcmd' are driven from
+ *   a thread instead (see rcmd_connect_start() in rcmd.c).
+ */
+#define RCMD_NB_ERROR      -1
+#define RCMD_NB_DONE        0
+#define RCMD_NB_WAIT        1
+
+struct rcmd_nbconn {
+    int   fd[2];         /* distinct fds module is waiting on, or -1    */
+    int   events[2];     /* XPOLLREAD and/or XPOLLWRITE for each fd     */
+    int   revents[2];    /* events seen by caller, set before continue  */
+    int   timeout;       /* msecs after which to continue anyway, or -1 */
+    void *data;          /* module private connection state             */
+};
+
+typedef int        (*RcmdStartF)    (char *, char *, char *, char *, char *,
+                                     int, bool, struct rcmd_nbconn *);
+typedef int        (*RcmdContinueF) (struct rcmd_nbconn *);
+typedef int        (*RcmdFinishF)   (struct rcmd_nbconn *, int *, void **);
+
 /*
  *  Module accessor functions. Return module name, type, and
  *    look up additional exported symbols in given module.
@@ -171,6 +209,9 @@ RcmdInitF    mod_get_rcmd_init(mod_t mod);
 RcmdSigF     mod_get_rcmd_signal(mod_t mod);
 RcmdF        mod_get_rcmd(mod_t mod);
 RcmdDestroyF mod_get_rcmd_destroy(mod_t mod);
+RcmdStartF   mod_get_rcmd_start(mod_t mod);
+RcmdContinueF mod_get_rcmd_continue(mod_t mod);
+RcmdFinishF  mod_get_rcmd_finish(mod_t mod);
 
 
 /*
@@ -191,10 +232,14 @@ struct pdsh_module_operations {
  * Stores all rcmd operations of a module
  */
 struct pdsh_rcmd_operations {
-    RcmdInitF    rcmd_init;
-    RcmdSigF     rcmd_signal;
-    RcmdF        rcmd;
-    RcmdDestroyF rcmd_destroy;
+    RcmdInitF     rcmd_init;
+    RcmdSigF      rcmd_signal;
+    RcmdF         rcmd;
+    RcmdDestroyF  rcmd_destroy;
+
+    RcmdStartF    rcmd_start;     /* Optional non-blocking connect */
+    RcmdContinueF rcmd_continue;
+    RcmdFinishF   rcmd_finish;
 };
 
 /*
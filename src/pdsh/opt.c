@@ -67,7 +67,8 @@
 #define OPT_USAGE_DSH "\
 Usage: pdsh [-options] command ...\n\
 -S                return largest of remote command return values\n\
--k                fail fast on connect failure or non-zero return code\n"
+-k                fail fast on connect failure or non-zero return code\n\
+-B                coalesce identical output from hosts (like dshbak -c)\n"
 
 /* -s option only useful on AIX */
 #if	HAVE_MAGIC_RSHELL_CLEANUP
@@ -80,7 +81,14 @@ Usage: pdsh [-options] command ...\n\
 Usage: pdcp [-options] src [src2...] dest\n\
 -r                recursively copy files\n\
 -p                preserve modification time and modes\n\
--e PATH           specify the path to pdcp on the remote machine\n"
+-e PATH           specify the path to pdcp on the remote machine\n\
+-W n              relay copies through a tree of hosts, n per level\n\
+-H                forward copies along a chain of hosts\n\
+-D                archive mode: like -r, keep links and sparse files\n\
+-G                compress file data sent to the remote hosts\n\
+-U                copy only files that differ (implies -p)\n\
+-n n              send large files over n connections per host\n\
+-s                sync files to disk before they replace old ones\n"
 /* undocumented "-y"  target must be directory option */
 /* undocumented "-z"  run pdcp server option */
 /* undocumented "-Z"  run pdcp client option */
@@ -114,11 +122,11 @@ Usage: rpdcp [-options] src [src2...] dir\n\
 /* undocumented "-K" option -  keep domain name in output */
 
 #if	HAVE_MAGIC_RSHELL_CLEANUP
-#define DSH_ARGS	"sSk"
+#define DSH_ARGS	"sSkB"
 #else
-#define DSH_ARGS    "Sk"
+#define DSH_ARGS    "SkB"
 #endif
-#define PCP_ARGS	"pryzZe:"
+#define PCP_ARGS	"pryzZe:W:HDGUn:s"
 #define GEN_ARGS	"hLNKR:M:t:cqf:w:x:l:u:bI:dVT:Q"
 
 
@@ -384,6 +392,7 @@ void opt_default(opt_t * opt, char *argv0)
     opt->connect_timeout = CONNECT_TIMEOUT;
     opt->command_timeout = 0;
     opt->fanout = DFLT_FANOUT;
+    opt->engine = ENGINE_THREAD;
     opt->sigint_terminates = false;
     opt->infile_names = NULL;
     opt->altnames = false;
@@ -407,6 +416,7 @@ void opt_default(opt_t * opt, char *argv0)
     opt->dshpath = NULL;
     opt->getstat = NULL;
     opt->ret_remote_rc = false;
+    opt->coalesce = false;
     opt->cmd = NULL;
     opt->stdin_unavailable = false;
 #if	HAVE_MAGIC_RSHELL_CLEANUP
@@ -431,6 +441,14 @@ void opt_default(opt_t * opt, char *argv0)
     opt->target_is_directory = false;
     opt->pcp_client = false;
     opt->pcp_client_host = NULL;
+    opt->tree_width = 0;
+    opt->pcp_relay = false;
+    opt->chain = false;
+    opt->archive = false;
+    opt->compress = false;
+    opt->update = false;
+    opt->streams = 1;
+    opt->sync = false;
 
     return;
 }
@@ -470,6 +488,15 @@ void opt_env(opt_t * opt)
         if (string_to_int (rhs, &opt->command_timeout) < 0)
             errx ("%p: Invalid environment variable PDSH_COMMAND_TIMEOUT=%s\n", rhs);
 
+    if ((rhs = getenv("PDSH_ENGINE")) != NULL) {
+        if (strcmp (rhs, "thread") == 0)
+            opt->engine = ENGINE_THREAD;
+        else if (strcmp (rhs, "event") == 0)
+            opt->engine = ENGINE_EVENT;
+        else
+            errx ("%p: Invalid environment variable PDSH_ENGINE=%s\n", rhs);
+    }
+
     if ((rhs = getenv("PDSH_RCMD_TYPE")) != NULL)
         opt->rcmd_name = Strdup(rhs);
 
@@ -603,6 +630,7 @@ void opt_args(opt_t * opt, int argc, char *argv[])
          *  The following options were handled in opt_args_early() :
          */
         case 'M':
+        case 'd':
             break;
 
         /*  Continue processing regular options...
@@ -636,12 +664,18 @@ void opt_args(opt_t * opt, int argc, char *argv[])
         case 'q':              /* display fanout and wcoll then quit */
             opt->info_only = true;
             break;
-/* -s option only useful on AIX */
+        case 's':
+            if (pdsh_personality() == PCP)
+                opt->sync = true;
+/* -s option for pdsh only useful on AIX */
 #if	HAVE_MAGIC_RSHELL_CLEANUP
-        case 's':              /* split stderr and stdout */
-            opt->separate_stderr = true;
-            break;
+            else                /* split stderr and stdout */
+                opt->separate_stderr = true;
+#else
+            else
+                goto test_module_option;
 #endif
+            break;
         case 't':              /* set connect timeout */
             opt->connect_timeout = atoi(optarg);
             break;
@@ -708,9 +742,50 @@ void opt_args(opt_t * opt, int argc, char *argv[])
             else
                 goto test_module_option;
             break;
+        case 'W':
+            if (pdsh_personality() == PCP)
+                opt->tree_width = atoi(optarg);
+            else
+                goto test_module_option;
+            break;
+        case 'H':
+            if (pdsh_personality() == PCP)
+                opt->chain = true;
+            else
+                goto test_module_option;
+            break;
+        case 'D':
+            if (pdsh_personality() == PCP) {
+                opt->archive = true;
+                opt->recursive = true;
+            } else
+                goto test_module_option;
+            break;
+        case 'G':
+            if (pdsh_personality() == PCP)
+                opt->compress = true;
+            else
+                goto test_module_option;
+            break;
+        case 'U':
+            if (pdsh_personality() == PCP) {
+                opt->update = true;
+                opt->preserve = true;
+            } else
+                goto test_module_option;
+            break;
+        case 'n':
+            if (pdsh_personality() == PCP)
+                opt->streams = atoi(optarg);
+            else
+                goto test_module_option;
+            break;
         case 'k':
             opt->kill_on_fail = true;
             break;
+        case 'B':              /* coalesce identical output */
+            opt->coalesce = true;
+            break;
         default: test_module_option:
             if (mod_process_opt(opt, c, optarg) < 0)
                _usage(opt);
@@ -761,8 +836,11 @@ void opt_args(opt_t * opt, int argc, char *argv[])
         }
     }
 
-    /* ignore wcoll filtering when running pcp server */
-    if (opt->pcp_server)
+    /*
+     * ignore wcoll filtering when running pcp server, unless the
+     *  server relays the copy to other hosts given with -w (-W, -H)
+     */
+    if (opt->pcp_server && (!(opt->tree_width || opt->chain) || !opt->wcoll))
         return;
 
     /*
@@ -832,11 +910,14 @@ _infile_names_check(opt_t * opt)
     i = list_iterator_create(opt->infile_names);
     while ((name = list_next(i))) {
         struct stat sb;
-        if (stat(name, &sb) < 0) {
+        /* -D copies symbolic links as links */
+        if ((opt->archive ? lstat(name, &sb) : stat(name, &sb)) < 0) {
             err("%p: can't stat %s\n", name);
             verified = false;
             continue;
         }
+        if (opt->archive && S_ISLNK(sb.st_mode))
+            continue;
         if (!S_ISREG(sb.st_mode) && !S_ISDIR(sb.st_mode)) {
             err("%p: not a regular file or directory: %s\n", name);
             verified = false;
@@ -902,6 +983,54 @@ bool opt_verify(opt_t * opt)
             verified = false;
         }
 
+        if (opt->tree_width < 0) {
+            err("%p: tree width must be >= 0\n");
+            verified = false;
+        }
+
+        if (opt->reverse_copy && opt->tree_width) {
+            err("%p: reverse copy cannot be relayed through a tree\n");
+            verified = false;
+        }
+
+        if (opt->reverse_copy && opt->chain) {
+            err("%p: reverse copy cannot be forwarded along a chain\n");
+            verified = false;
+        }
+
+        if (opt->reverse_copy && opt->update) {
+            err("%p: reverse copy does not support update mode\n");
+            verified = false;
+        }
+
+        if (opt->reverse_copy && opt->archive) {
+            err("%p: reverse copy does not support archive mode\n");
+            verified = false;
+        }
+
+        if (opt->streams < 1 || opt->streams > PCP_MAX_STREAMS) {
+            err("%p: number of streams must be between 1 and %d\n",
+                PCP_MAX_STREAMS);
+            verified = false;
+        }
+
+        if (opt->reverse_copy && opt->streams > 1) {
+            err("%p: reverse copy does not support multiple streams\n");
+            verified = false;
+        }
+
+#if !HAVE_LIBZ
+        if (opt->compress) {
+            err("%p: compression (-G) requires pdcp built with zlib\n");
+            verified = false;
+        }
+#endif
+
+        if (opt->tree_width && opt->chain) {
+            err("%p: -W and -H cannot both be specified\n");
+            verified = false;
+        }
+
         /* If reverse copy, the infiles need not exist locally */
         if (!opt->reverse_copy) {
             if (!_infile_names_check(opt))
@@ -1006,6 +1135,7 @@ void opt_list(opt_t * opt)
             BOOLSTR(opt->separate_stderr));
         out("Path prepended to cmd	%s\n", STRORNULL(opt->dshpath));
         out("Appended to cmd         %s\n", STRORNULL(opt->getstat));
+        out("Coalesce output		%s\n", BOOLSTR(opt->coalesce));
         out("Command:		%s\n", STRORNULL(opt->cmd));
     } else {
         char infiles [4096];
@@ -1015,6 +1145,13 @@ void opt_list(opt_t * opt)
         out("Outfile			%s\n", STRORNULL(opt->outfile_name));
         out("Recursive		%s\n", BOOLSTR(opt->recursive));
         out("Preserve mod time/mode	%s\n", BOOLSTR(opt->preserve));
+        out("Tree width		%d\n", opt->tree_width);
+        out("Chain copy		%s\n", BOOLSTR(opt->chain));
+        out("Archive mode		%s\n", BOOLSTR(opt->archive));
+        out("Compression		%s\n", BOOLSTR(opt->compress));
+        out("Update only		%s\n", BOOLSTR(opt->update));
+        out("Streams per host	%d\n", opt->streams);
+        out("Sync files		%s\n", BOOLSTR(opt->sync));
         if (opt->pcp_server) {
             out("pcp server         	%s\n", BOOLSTR(opt->pcp_server));
             out("target is directory	%s\n", BOOLSTR(opt->target_is_directory));
@@ -1034,6 +1171,8 @@ void opt_list(opt_t * opt)
         out("Connect timeout (secs)	%d\n", opt->connect_timeout);
         out("Command timeout (secs)	%d\n", opt->command_timeout);
         out("Fanout			%d\n", opt->fanout);
+        out("Execution engine	%s\n",
+            opt->engine == ENGINE_EVENT ? "event" : "thread");
         out("Display hostname labels	%s\n", BOOLSTR(opt->labels));
         out("Debugging       	%s\n", BOOLSTR(opt->debug));
 
@@ -43,6 +43,11 @@
 
 #define RC_FAILED	254     /* -S exit value if any hosts fail to connect */
 
+#define PCP_MAX_STREAMS	16      /* most pdcp -n connections per host */
+
+/* dsh execution engine: thread per host, or event-driven (PDSH_ENGINE) */
+typedef enum { ENGINE_THREAD, ENGINE_EVENT } engine_t;
+
 /* set to 0x1 and 0x2 so we can do bitwise operations with DSH and PCP */
 typedef enum { DSH = 0x1, PCP = 0x2} pers_t;
 
@@ -64,6 +69,7 @@ typedef struct {
     int fanout;                 /* (-f, FANOUT, or default) */
     int connect_timeout;
     int command_timeout;
+    engine_t engine;            /* PDSH_ENGINE */
 
     char *rcmd_name;            /* -R name   */
     char *misc_modules;         /* Explicit list of misc modules to load */
@@ -79,6 +85,7 @@ typedef struct {
     char *getstat;              /* optional echo $? appended to cmd */
     bool ret_remote_rc;         /* -S: return largest remote return val */
     bool labels;                /* display host: before output */
+    bool coalesce;              /* -B: coalesce identical output */
 
     /* PCP-specific options */
     bool preserve;              /* -p */
@@ -92,6 +99,14 @@ typedef struct {
     char *local_program_path;   /* absolute path to program on local node   */
     char *remote_program_path;  /* absolute path to program on remote nodes */
     bool reverse_copy;          /* rpdcp: reverse copy */
+    int tree_width;             /* -W: relay copies through a tree */
+    bool pcp_relay;             /* -W: infile_names are files received */
+    bool chain;                 /* -H: forward copies along a chain */
+    bool archive;               /* -D: keep links and sparse files */
+    bool compress;              /* -G: compress file data */
+    bool update;                /* -U: skip unchanged files */
+    int streams;                /* -n: connections per host for big files */
+    bool sync;                  /* -s: sync files to disk before renaming */
 } opt_t;
 
 
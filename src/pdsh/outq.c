@@ -0,0 +1,370 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ * Output queue (see outq.h).
+ *
+ * Messages are pushed onto a singly linked LIFO with compare-and-swap, so
+ *  threads producing output never wait on a lock (unless the writer has
+ *  fallen OUTQ_MAX_BYTES behind). The writer thread detaches the whole
+ *  list at once, reverses it into queue order, and writes consecutive
+ *  messages for the same fd with a single writev(). Since the writer
+ *  never removes individual entries, the usual ABA problem of lock-free
+ *  stacks does not arise.
+ *
+ * outq_mutex is only used by the writer to sleep when the queue is empty,
+ *  by the first thread to queue a message into an empty queue to wake the
+ *  writer, and by threads waiting in outq_flush() or on a full queue.
+ */
+
+#if     HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if	HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/poll.h>
+#if	HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "src/common/err.h"
+#include "src/common/xmalloc.h"
+#include "src/common/macros.h"
+#include "outq.h"
+
+#if defined (IOV_MAX) && (IOV_MAX < 256)
+#  define OUTQ_IOV_MAX  IOV_MAX
+#elif defined (IOV_MAX)
+#  define OUTQ_IOV_MAX  256
+#else
+#  define OUTQ_IOV_MAX  16      /* _XOPEN_IOV_MAX */
+#endif
+
+struct outq_msg {
+    struct outq_msg *next;
+    int              fd;        /* fileno of stdout or stderr            */
+    int              len;       /* strlen (buf)                          */
+    char            *buf;       /* message from err()/out(), freed here  */
+};
+
+static struct outq_msg * volatile outq_head = NULL; /* newest first      */
+static volatile long outq_bytes = 0;                /* bytes not written */
+
+static pthread_mutex_t outq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outq_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t outq_written = PTHREAD_COND_INITIALIZER;
+static pthread_t outq_writer;
+static bool outq_running = false;
+static bool outq_shutdown = false;
+static bool outq_busy = false;  /* writer is writing a detached batch */
+
+#if HAVE_SYNC_BUILTINS
+/*
+ *  Push `m' onto the queue. Returns the previous head of the queue.
+ */
+static struct outq_msg *_outq_push (struct outq_msg *m)
+{
+    struct outq_msg *head;
+
+    do {
+        head = outq_head;
+        m->next = head;
+    } while (!__sync_bool_compare_and_swap (&outq_head, head, m));
+
+    return (head);
+}
+
+/*
+ *  Detach and return all queued messages, newest first.
+ */
+static struct outq_msg *_outq_take (void)
+{
+    struct outq_msg *head;
+
+    do {
+        head = outq_head;
+    } while (head && !__sync_bool_compare_and_swap (&outq_head, head, NULL));
+
+    return (head);
+}
+
+static long _outq_add_bytes (long n)
+{
+    return (__sync_add_and_fetch (&outq_bytes, n));
+}
+#else
+/*
+ *  No atomic builtins: fall back to a mutex around the queue head.
+ */
+static pthread_mutex_t outq_head_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct outq_msg *_outq_push (struct outq_msg *m)
+{
+    struct outq_msg *head;
+
+    pthread_mutex_lock (&outq_head_mutex);
+    head = m->next = outq_head;
+    outq_head = m;
+    pthread_mutex_unlock (&outq_head_mutex);
+
+    return (head);
+}
+
+static struct outq_msg *_outq_take (void)
+{
+    struct outq_msg *head;
+
+    pthread_mutex_lock (&outq_head_mutex);
+    head = outq_head;
+    outq_head = NULL;
+    pthread_mutex_unlock (&outq_head_mutex);
+
+    return (head);
+}
+
+static long _outq_add_bytes (long n)
+{
+    long bytes;
+
+    pthread_mutex_lock (&outq_head_mutex);
+    bytes = (outq_bytes += n);
+    pthread_mutex_unlock (&outq_head_mutex);
+
+    return (bytes);
+}
+#endif /* HAVE_SYNC_BUILTINS */
+
+/*
+ *  Write all of `iov' to `fd', retrying on short writes. Output is
+ *   discarded if `fd' cannot be written.
+ */
+static void _outq_writev (int fd, struct iovec *iov, int n)
+{
+    ssize_t rv;
+
+    while (n > 0) {
+        if ((rv = writev (fd, iov, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                poll (&pfd, 1, -1);
+                continue;
+            }
+            return;
+        }
+        while ((n > 0) && (rv >= (ssize_t) iov->iov_len)) {
+            rv -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *) iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+}
+
+/*
+ *  Write and free the list of messages `m' (newest first).
+ */
+static void _outq_write (struct outq_msg *m)
+{
+    struct iovec iov[OUTQ_IOV_MAX];
+    struct outq_msg *prev = NULL;
+    struct outq_msg *next;
+    long bytes = 0;
+    int n, fd;
+
+    /* reverse into queue order */
+    while (m) {
+        next = m->next;
+        m->next = prev;
+        prev = m;
+        m = next;
+    }
+    m = prev;
+
+    while (m) {
+        struct outq_msg *first = m;
+
+        fd = m->fd;
+        for (n = 0; m && (m->fd == fd) && (n < OUTQ_IOV_MAX); n++) {
+            iov[n].iov_base = m->buf;
+            iov[n].iov_len = m->len;
+            bytes += m->len;
+            m = m->next;
+        }
+        _outq_writev (fd, iov, n);
+
+        while (first != m) {
+            next = first->next;
+            Free ((void **) &first->buf);
+            Free ((void **) &first);
+            first = next;
+        }
+    }
+
+    _outq_add_bytes (-bytes);
+}
+
+static void *_outq_writer_thread (void *arg)
+{
+    struct outq_msg *m;
+
+    pthread_mutex_lock (&outq_mutex);
+    for (;;) {
+        if ((m = _outq_take ()) == NULL) {
+            outq_busy = false;
+            pthread_cond_broadcast (&outq_written);
+            if (outq_shutdown)
+                break;
+            pthread_cond_wait (&outq_wake, &outq_mutex);
+            continue;
+        }
+        outq_busy = true;
+        pthread_mutex_unlock (&outq_mutex);
+
+        _outq_write (m);
+
+        pthread_mutex_lock (&outq_mutex);
+        pthread_cond_broadcast (&outq_written);
+    }
+    pthread_mutex_unlock (&outq_mutex);
+
+    return (NULL);
+}
+
+/*
+ *  Output function for err() and out() while the queue is running.
+ */
+static void _outq_output (FILE *stream, char *buf)
+{
+    struct outq_msg *m;
+    int len = strlen (buf);
+    long bytes;
+
+    if (len == 0) {
+        Free ((void **) &buf);
+        return;
+    }
+
+    m = Malloc (sizeof (*m));
+    m->fd = fileno (stream);
+    m->len = len;
+    m->buf = buf;
+
+    /* count bytes before the push so the total never goes negative */
+    bytes = _outq_add_bytes (len);
+
+    /* first message in an empty queue: wake the writer */
+    if (_outq_push (m) == NULL) {
+        pthread_mutex_lock (&outq_mutex);
+        pthread_cond_signal (&outq_wake);
+        pthread_mutex_unlock (&outq_mutex);
+    }
+
+    if (bytes > OUTQ_MAX_BYTES) {
+        pthread_mutex_lock (&outq_mutex);
+        while (outq_running && (_outq_add_bytes (0) > OUTQ_MAX_BYTES))
+            pthread_cond_wait (&outq_written, &outq_mutex);
+        pthread_mutex_unlock (&outq_mutex);
+    }
+}
+
+/*
+ *  Don't lose queued output if a thread calls exit(), e.g. via errx().
+ */
+static void _outq_atexit (void)
+{
+    outq_flush ();
+}
+
+void outq_start (void)
+{
+    static bool atexit_registered = false;
+    int rv;
+
+    if (outq_running)
+        return;
+
+    fflush (NULL);
+
+    outq_shutdown = false;
+    outq_busy = false;
+    if ((rv = pthread_create (&outq_writer, NULL, _outq_writer_thread, NULL)))
+        errx ("%p: pthread_create: %s\n", strerror (rv));
+    outq_running = true;
+
+    if (!atexit_registered) {
+        atexit (_outq_atexit);
+        atexit_registered = true;
+    }
+
+    err_set_output (_outq_output);
+}
+
+void outq_flush (void)
+{
+    pthread_mutex_lock (&outq_mutex);
+    while (outq_running && ((outq_head != NULL) || outq_busy))
+        pthread_cond_wait (&outq_written, &outq_mutex);
+    pthread_mutex_unlock (&outq_mutex);
+}
+
+void outq_stop (void)
+{
+    if (!outq_running)
+        return;
+
+    err_set_output (NULL);
+
+    pthread_mutex_lock (&outq_mutex);
+    outq_shutdown = true;
+    pthread_cond_signal (&outq_wake);
+    pthread_mutex_unlock (&outq_mutex);
+
+    pthread_join (outq_writer, NULL);
+
+    pthread_mutex_lock (&outq_mutex);
+    outq_running = false;
+    pthread_cond_broadcast (&outq_written);
+    pthread_mutex_unlock (&outq_mutex);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,63 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+#ifndef _OUTQ_INCLUDED
+#define _OUTQ_INCLUDED
+
+/*
+ *  Output queue. While the queue is running, messages written to stdout
+ *   and stderr with out() and err() are appended to a queue by the calling
+ *   thread and written by a single writer thread, which coalesces queued
+ *   messages into large writev(2) calls. Each message is written whole,
+ *   so lines of output from different hosts are never interleaved, and
+ *   messages are written in the order they were queued.
+ *
+ *  If the writer falls behind by more than OUTQ_MAX_BYTES, threads
+ *   queueing output block until it catches up.
+ */
+#define OUTQ_MAX_BYTES  (4 * 1024 * 1024)
+
+/*
+ *  Flush stdio and start the writer thread. From now on out() and
+ *   err() output is queued.
+ */
+void outq_start (void);
+
+/*
+ *  Wait until all queued output has been written.
+ */
+void outq_flush (void);
+
+/*
+ *  Write all queued output, stop the writer thread, and go back to
+ *   writing out() and err() output directly.
+ */
+void outq_stop (void);
+
+#endif /* !_OUTQ_INCLUDED */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
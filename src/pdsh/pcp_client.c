@@ -66,6 +66,7 @@
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -76,6 +77,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
+#if HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
+#if HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif
 
 #include "src/common/err.h"
 #include "src/common/fd.h"
@@ -83,88 +95,508 @@
 #include "src/common/xstring.h"
 #include "src/common/err.h"
 #include "src/common/xmalloc.h"
+#include "src/common/macros.h"
 #include "pcp_client.h"
+#include "pcp_server.h"
+#include "pcp_delta.h"
 #include "wcoll.h"
 
 #ifndef MAXPATHNAMELEN
 #define MAXPATHNAMELEN MAXPATHLEN
 #endif
 
+/* largest buffer or write used when sendfile() can't be used */
+#define PCP_DATA_BUFSIZ     (1024 * 1024)
+
+/* largest count passed to a single sendfile() call */
+#define PCP_SENDFILE_MAX    (1024 * 1024 * 1024)
+
+/* glibc only defines these with _GNU_SOURCE */
+#if defined(__linux__) && !defined(SEEK_DATA)
+#  define SEEK_DATA 3
+#  define SEEK_HOLE 4
+#endif
+
+#define RCP_MODEMASK (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO)
+
+/*
+ * Archive mode (-D): regular files with more than one link seen while
+ * expanding directories, by device and inode, with the path of the
+ * first one relative to the target directory.
+ */
+#define PCP_LINK_HASHSIZE   4099
+
+struct pcp_link {
+    dev_t dev;
+    ino_t ino;
+    char *path;
+    struct pcp_link *next;
+};
+
+static struct pcp_link **pcp_links = NULL;
+
+/*
+ * Source file cache. Files stay open (and mapped, if they had to be
+ * mapped, or compressed for -G) after all hosts currently sending them
+ * are done, so hosts that reach the same file later reuse them. Idle
+ * files are evicted oldest first when there are more than
+ * PCP_CACHE_MAX_IDLE of them, or to make room for a new mapping or
+ * compressed copy within PCP_CACHE_MAX_BYTES.
+ */
+#define PCP_CACHE_MAX_BYTES (256 * 1024 * 1024)
+#define PCP_CACHE_MAX_IDLE  64
+
+/* protects the cache and the cache fields of struct pcp_filename */
+static pthread_mutex_t pcp_file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct pcp_filename *pcp_idle_head = NULL;  /* least recently used */
+static struct pcp_filename *pcp_idle_tail = NULL;
+static int pcp_idle_count = 0;
+static size_t pcp_mapped_bytes = 0;     /* mapped and compressed */
+
+/* -G: signaled when a host is done compressing a file */
+static pthread_cond_t pcp_deflate_cond = PTHREAD_COND_INITIALIZER;
+
+/* -U: block signatures are computed by one host at a time */
+static pthread_mutex_t pcp_sigs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void _pcp_init_filename(struct pcp_filename *pf)
+{
+    pf->fd = -1;
+    pf->refcnt = 0;
+    pf->size = 0;
+    pf->map = NULL;
+    pf->prev = pf->next = NULL;
+    pf->path = NULL;
+    pf->link = NULL;
+    pf->zbuf = NULL;
+    pf->zsize = -1;
+    pf->deflating = false;
+    pf->sigs = NULL;
+    pf->hdr = NULL;
+    pf->tlen = 0;
+}
+
+/*
+ * Format the records that announce a file with stat sb, copied as name,
+ * into buf: the time record "T%ld %ld %ld %ld\n" (st_mtime,
+ * st_mtime_usec, st_atime, st_atime_usec), then "D%04o %d %s\n"
+ * (st_mode & RCP_MODEMASK, 0, name) for a directory or "C%04o %lld %s\n"
+ * (st_mode & RCP_MODEMASK, st_size, name) for a file.
+ *	RETURN		length of the time record
+ */
+static int _pcp_format_header(char *buf, int size, struct stat *sb,
+                              char *name)
+{
+    int tlen;
+
+    tlen = snprintf(buf, size, "T%ld %ld %ld %ld\n",
+                    (long) sb->st_mtime, 0L, (long) sb->st_atime, 0L);
+    if (S_ISDIR(sb->st_mode))
+        snprintf(buf + tlen, size - tlen, "D%04o %d %s\n",
+                 sb->st_mode & RCP_MODEMASK, 0, name);
+    else
+        snprintf(buf + tlen, size - tlen, "C%04o %lld %s\n",
+                 sb->st_mode & RCP_MODEMASK, (long long) sb->st_size, name);
+    return tlen;
+}
+
+/*
+ * Format the records for the regular file or directory pf once, when
+ * it is listed. All hosts then send them as they are.
+ */
+static void _pcp_make_header(struct pcp_filename *pf)
+{
+    char buf[BUFSIZ];
+
+    if (!S_ISREG(pf->sb.st_mode) && !S_ISDIR(pf->sb.st_mode))
+        return;
+    pf->tlen = _pcp_format_header(buf, sizeof(buf), &pf->sb,
+                                  xbasename(pf->filename));
+    pf->hdr = Strdup(buf);
+}
+
+/*
+ * Remember that the file with stat sb is copied to path (relative to
+ * the target directory) if it has more than one link.
+ *	RETURN		copy of the path of an earlier link to the file, or NULL
+ */
+static char *_pcp_link(struct stat *sb, const char *path)
+{
+    unsigned int h;
+    struct pcp_link *l;
+
+    if (!S_ISREG(sb->st_mode) || sb->st_nlink < 2)
+        return NULL;
+
+    h = ((unsigned int) sb->st_dev * 31 + (unsigned int) sb->st_ino)
+        % PCP_LINK_HASHSIZE;
+    for (l = pcp_links[h]; l; l = l->next) {
+        if (l->dev == sb->st_dev && l->ino == sb->st_ino)
+            return Strdup(l->path);
+    }
+
+    l = Malloc(sizeof(struct pcp_link));
+    l->dev = sb->st_dev;
+    l->ino = sb->st_ino;
+    l->path = Strdup(path);
+    l->next = pcp_links[h];
+    pcp_links[h] = l;
+    return NULL;
+}
+
+/*
+ * Forget the links remembered by _pcp_link() for an earlier expansion.
+ */
+static void _pcp_links_free(void)
+{
+    struct pcp_link *l;
+    int h;
+
+    for (h = 0; h < PCP_LINK_HASHSIZE; h++) {
+        while ((l = pcp_links[h])) {
+            pcp_links[h] = l->next;
+            Free((void **) &l->path);
+            Free((void **) &l);
+        }
+    }
+}
+
+/*
+ * Start a new list of files: forget the links of an earlier one, and
+ * set up the table for -D.
+ */
+static void _pcp_links_reset(bool archive)
+{
+    if (pcp_links)
+        _pcp_links_free();
+    else if (archive) {
+        pcp_links = Malloc(PCP_LINK_HASHSIZE * sizeof(struct pcp_link *));
+        memset(pcp_links, 0, PCP_LINK_HASHSIZE * sizeof(struct pcp_link *));
+    }
+}
+
+/*
+ * Directories are expanded by up to PCP_WALK_THREADS threads at once.
+ * Each takes a directory from the queue, reads it, stats its entries
+ * with fstatat() and queues its subdirectories. The entries of each
+ * directory are kept in one array, and the arrays are put in order
+ * once all directories are read.
+ */
+#define PCP_WALK_THREADS    8
+
+struct pcp_dir {
+    char *name;                 /* directory to read                    */
+    char *path;                 /* its path relative to the target      */
+    struct pcp_filename *ents;  /* its entries, in the order read       */
+    struct pcp_dir **subdirs;   /* subdirs[i]: contents of ents[i]      */
+    int count;                  /* number of entries                    */
+    struct pcp_dir *next;       /* work queue                           */
+};
 
-static void _rexpand_dir(List list, char *name)
+static pthread_mutex_t pcp_walk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pcp_walk_cond = PTHREAD_COND_INITIALIZER;
+static struct pcp_dir *pcp_walk_queue = NULL;
+static int pcp_walk_busy = 0;           /* directories being read */
+static bool pcp_walk_archive = false;
+
+static struct pcp_dir *_pcp_dir_create(char *name, char *path)
+{
+    struct pcp_dir *d = Malloc(sizeof(struct pcp_dir));
+
+    d->name = name;
+    d->path = path;
+    d->ents = NULL;
+    d->subdirs = NULL;
+    d->count = 0;
+    d->next = NULL;
+    return d;
+}
+
+/*
+ * Read the directory d, stat its entries and queue its subdirectories.
+ */
+static void _pcp_read_dir(struct pcp_dir *d)
 {
     DIR *dir;
     struct dirent *dp;
     struct stat sb;
     char file[MAXPATHNAMELEN];
-    struct pcp_filename *pf = NULL;
+    char filepath[MAXPATHNAMELEN];
+    struct pcp_filename *pf;
+    struct pcp_dir *sub, *queue = NULL;
+    int flags = pcp_walk_archive ? AT_SYMLINK_NOFOLLOW : 0;
+    int size = 16, i;
 
-    dir = opendir(name);
+    dir = opendir(d->name);
     if (dir == NULL)
-        errx("%p: opendir: %s: %m\n", name);
+        errx("%p: opendir: %s: %m\n", d->name);
+    d->ents = Malloc(size * sizeof(struct pcp_filename));
     while ((dp = readdir(dir))) {
         if (dp->d_ino == 0)
             continue;
         if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
             continue;
-        snprintf(file, sizeof(file), "%s/%s", name, dp->d_name);
-        if (stat(file, &sb) < 0)
+        snprintf(file, sizeof(file), "%s/%s", d->name, dp->d_name);
+        snprintf(filepath, sizeof(filepath), "%s/%s", d->path, dp->d_name);
+        if (fstatat(dirfd(dir), dp->d_name, &sb, flags) < 0)
             errx("%p: can't stat %s: %m\n", file);
-        if (access(name, R_OK) < 0)
-            errx("%p: access: %s: %m\n", name);
-        if (!S_ISDIR(sb.st_mode) && !S_ISREG(sb.st_mode))
+        if (!S_ISDIR(sb.st_mode) && !S_ISREG(sb.st_mode)
+            && !(pcp_walk_archive && S_ISLNK(sb.st_mode)))
             errx("%p: not a regular file or directory: %s\n", file);
 
-        /* XXX: This memleaks */
-        pf = Malloc(sizeof(struct pcp_filename));
+        if (d->count == size) {
+            size *= 2;
+            Realloc((void **) &d->ents, size * sizeof(struct pcp_filename));
+        }
+        pf = &d->ents[d->count++];
         pf->filename = Strdup(file);
         pf->file_specified_by_user = 0;
-
-        list_append(list, pf);
-        if (S_ISDIR(sb.st_mode))
-            _rexpand_dir(list, file);
+        _pcp_init_filename(pf);
+        pf->path = Strdup(filepath);
+        pf->sb = sb;
+        _pcp_make_header(pf);
     }
     closedir(dir);
 
-    /* Since pdcp reads file names and directories only once for
-     * efficiency, we must specify a special flag so we know when
-     * to tell the server to "move up" the directory tree.
-     */
+    if (d->count > 0 && d->count < size)
+        Realloc((void **) &d->ents, d->count * sizeof(struct pcp_filename));
+
+    d->subdirs = Malloc((d->count + 1) * sizeof(struct pcp_dir *));
+    for (i = 0; i < d->count; i++) {
+        sub = NULL;
+        if (S_ISDIR(d->ents[i].sb.st_mode)) {
+            sub = _pcp_dir_create(d->ents[i].filename, d->ents[i].path);
+            sub->next = queue;
+            queue = sub;
+        }
+        d->subdirs[i] = sub;
+    }
+
+    if (queue) {
+        pthread_mutex_lock(&pcp_walk_mutex);
+        while ((sub = queue)) {
+            queue = sub->next;
+            sub->next = pcp_walk_queue;
+            pcp_walk_queue = sub;
+        }
+        pthread_cond_broadcast(&pcp_walk_cond);
+        pthread_mutex_unlock(&pcp_walk_mutex);
+    }
+}
+
+/*
+ * Read directories from the queue until all are done.
+ */
+static void *_pcp_walk_thread(void *arg)
+{
+    struct pcp_dir *d;
+
+    pthread_mutex_lock(&pcp_walk_mutex);
+    while (1) {
+        while (!pcp_walk_queue && (pcp_walk_busy > 0))
+            pthread_cond_wait(&pcp_walk_cond, &pcp_walk_mutex);
+        if (!(d = pcp_walk_queue))
+            break;
+        pcp_walk_queue = d->next;
+        pcp_walk_busy++;
+        pthread_mutex_unlock(&pcp_walk_mutex);
 
+        _pcp_read_dir(d);
+
+        pthread_mutex_lock(&pcp_walk_mutex);
+        if ((--pcp_walk_busy == 0) && !pcp_walk_queue)
+            pthread_cond_broadcast(&pcp_walk_cond);
+    }
+    pthread_mutex_unlock(&pcp_walk_mutex);
+    return NULL;
+}
+
+/*
+ * Expand all queued directories, with the calling thread and up to
+ * PCP_WALK_THREADS - 1 more.
+ */
+static void _pcp_walk(void)
+{
+    pthread_t threads[PCP_WALK_THREADS - 1];
+    int i, n;
+
+    for (n = 0; n < PCP_WALK_THREADS - 1; n++) {
+        if (pthread_create(&threads[n], NULL, _pcp_walk_thread, NULL))
+            break;
+    }
+    _pcp_walk_thread(NULL);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*
+ * Since pdcp reads file names and directories only once for
+ * efficiency, we must specify a special flag so we know when
+ * to tell the server to "move up" the directory tree.
+ */
+static struct pcp_filename *_pcp_exit_subdir(void)
+{
     /* XXX: This memleaks */
-    pf = Malloc(sizeof(struct pcp_filename));
+    struct pcp_filename *pf = Malloc(sizeof(struct pcp_filename));
+
     pf->filename = Strdup(EXIT_SUBDIR_FILENAME);
     pf->file_specified_by_user = 0;
-    list_append(list, pf);
+    _pcp_init_filename(pf);
+    return pf;
 }
 
-List pcp_expand_dirs(List infiles)
+/*
+ * Add the contents of the expanded directory d to list, depth first.
+ * Hard links are looked up here, in the order files will be sent.
+ */
+static void _pcp_dir_flatten(List list, struct pcp_dir *d, bool archive)
+{
+    struct pcp_filename *pf = NULL;
+    int i;
+
+    for (i = 0; i < d->count; i++) {
+        pf = &d->ents[i];
+        if (archive)
+            pf->link = _pcp_link(&pf->sb, pf->path);
+        list_append(list, pf);
+        if (d->subdirs[i])
+            _pcp_dir_flatten(list, d->subdirs[i], archive);
+    }
+    list_append(list, _pcp_exit_subdir());
+
+    Free((void **) &d->subdirs);
+    Free((void **) &d);
+}
+
+List pcp_expand_dirs(List infiles, bool archive)
 {
     List new = list_create(NULL);
+    int count = list_count(infiles);
+    struct pcp_filename **files = Malloc((count + 1) * sizeof(*files));
+    struct pcp_dir **dirs = Malloc((count + 1) * sizeof(*dirs));
     struct stat sb;
     char *name;
     ListIterator i;
+    int rc, n = 0, j;
+
+    _pcp_links_reset(archive);
 
     i = list_iterator_create(infiles);
     while ((name = list_next(i))) {
         struct pcp_filename *pf = NULL;
 
-        if (access(name, R_OK) < 0)
+        rc = archive ? lstat(name, &sb) : stat(name, &sb);
+        /* -D copies a symbolic link as such, it need not resolve */
+        if ((rc < 0 || !S_ISLNK(sb.st_mode)) && access(name, R_OK) < 0)
             errx("%p: access: %s: %m\n", name);
-        if (stat(name, &sb) < 0)
+        if (rc < 0)
             errx("%p: stat: %s: %m\n", name);
 
         /* XXX: This memleaks */
         pf = Malloc(sizeof(struct pcp_filename));
         pf->filename = name;
         pf->file_specified_by_user = 1;
+        _pcp_init_filename(pf);
+        pf->path = xbasename(name);
+        pf->sb = sb;
+        _pcp_make_header(pf);
+
+        /* -r option checked during command line argument checks */
+        dirs[n] = NULL;
+        if (S_ISDIR(sb.st_mode)) {
+            dirs[n] = _pcp_dir_create(name, xbasename(name));
+            dirs[n]->next = pcp_walk_queue;
+            pcp_walk_queue = dirs[n];
+        }
+        files[n++] = pf;
+    }
+    list_iterator_destroy(i);
+
+    pcp_walk_archive = archive;
+    _pcp_walk();
+
+    for (j = 0; j < n; j++) {
+        if (archive)
+            files[j]->link = _pcp_link(&files[j]->sb, files[j]->path);
+        list_append(new, files[j]);
+        if (dirs[j])
+            _pcp_dir_flatten(new, dirs[j], archive);
+    }
+    Free((void **) &files);
+    Free((void **) &dirs);
+
+    return new;
+}
+
+/*
+ * pdcp -W: list the files and directories a relay received, in the
+ * order pcp_server() wrote and recorded them: directories with a
+ * trailing '/', and an empty name ending the contents of each. Only
+ * these are passed on, not whatever else the relay has in the
+ * directories copied.
+ */
+List pcp_received_files(List received, bool archive)
+{
+    List new = list_create(NULL);
+    int size = 16, depth = 0;
+    char **paths = Malloc(size * sizeof(char *));
+    struct stat sb;
+    char *name;
+    ListIterator i;
+    int rc, len, isdir;
 
+    _pcp_links_reset(archive);
+
+    i = list_iterator_create(received);
+    while ((name = list_next(i))) {
+        struct pcp_filename *pf;
+
+        if (*name == '\0') {
+            if (depth > 0)
+                depth--;
+            list_append(new, _pcp_exit_subdir());
+            continue;
+        }
+
+        len = strlen(name);
+        if ((isdir = (len > 1 && name[len - 1] == '/')))
+            name[len - 1] = '\0';
+
+        /* the relay wrote into a directory, even through a link to it */
+        rc = (archive && !isdir) ? lstat(name, &sb) : stat(name, &sb);
+        if (rc < 0)
+            errx("%p: stat: %s: %m\n", name);
+        if (isdir && !S_ISDIR(sb.st_mode))
+            errx("%p: not a directory: %s\n", name);
+
+        pf = Malloc(sizeof(struct pcp_filename));
+        pf->filename = name;
+        pf->file_specified_by_user = (depth == 0);
+        _pcp_init_filename(pf);
+        if (depth == 0)
+            pf->path = xbasename(name);
+        else {
+            pf->path = Strdup(paths[depth - 1]);
+            xstrcat(&pf->path, "/");
+            xstrcat(&pf->path, xbasename(name));
+        }
+        pf->sb = sb;
+        _pcp_make_header(pf);
+        if (archive)
+            pf->link = _pcp_link(&pf->sb, pf->path);
         list_append(new, pf);
 
-        /* -r option checked during command line argument checks */
-        if (S_ISDIR(sb.st_mode))
-            _rexpand_dir(new, name);
+        if (isdir) {
+            if (depth == size) {
+                size *= 2;
+                Realloc((void **) &paths, size * sizeof(char *));
+            }
+            paths[depth++] = pf->path;
+        }
     }
+    list_iterator_destroy(i);
+    Free((void **) &paths);
 
     return new;
 }
@@ -195,39 +627,353 @@ static int _pcp_write(int fd, char *buf, int size)
     return size;
 }
 
+static void _pcp_idle_remove(struct pcp_filename *pf)
+{
+    if (pf->prev)
+        pf->prev->next = pf->next;
+    else
+        pcp_idle_head = pf->next;
+    if (pf->next)
+        pf->next->prev = pf->prev;
+    else
+        pcp_idle_tail = pf->prev;
+    pf->prev = pf->next = NULL;
+    pcp_idle_count--;
+}
+
+static void _pcp_idle_append(struct pcp_filename *pf)
+{
+    pf->next = NULL;
+    pf->prev = pcp_idle_tail;
+    if (pcp_idle_tail)
+        pcp_idle_tail->next = pf;
+    else
+        pcp_idle_head = pf;
+    pcp_idle_tail = pf;
+    pcp_idle_count++;
+}
+
 /*
- * Write the contents of the named file to the specified file descriptor.
- *	outfd (IN)	file descriptor to write to
- *	filename (IN)	name of file
+ * Close and unmap idle files, oldest first, until at most max_idle
+ * remain and need more bytes can be mapped within the cache budget.
+ * Called with pcp_file_mutex held.
+ */
+static void _pcp_cache_evict(int max_idle, size_t need)
+{
+    struct pcp_filename *pf;
+
+    while ((pf = pcp_idle_head)
+           && ((pcp_idle_count > max_idle)
+               || (pcp_mapped_bytes + need > PCP_CACHE_MAX_BYTES))) {
+        _pcp_idle_remove(pf);
+        if (pf->map) {
+            munmap(pf->map, pf->size);
+            pcp_mapped_bytes -= pf->size;
+            pf->map = NULL;
+        }
+        if (pf->zbuf) {
+            Free((void **) &pf->zbuf);
+            pcp_mapped_bytes -= pf->zsize;
+        }
+        pf->zsize = -1;
+        if (pf->sigs)
+            Free((void **) &pf->sigs);
+        close(pf->fd);
+        pf->fd = -1;
+    }
+}
+
+/*
+ * Get the open file descriptor for pf, opening the file unless it is
+ * already in the cache. Since all hosts share the same fd, it must
+ * only be used with pread() or sendfile() with an offset.
+ *	pf (IN)		file to open
  *	host (IN)	name of remote host for error messages
- *	RETURN		-1 on failure, 0 on success.
+ *	RETURN		-1 on failure, fd on success
  */
-static int _pcp_send_file_data(int outfd, char *filename, char *host)
+static int _pcp_file_open(struct pcp_filename *pf, char *host)
 {
-    int filefd, inbytes, total = 0;
-    char tmpbuf[BUFSIZ];
+    struct stat sb;
+    int fd;
 
-    filefd = open(filename, O_RDONLY);
-    /* checked ahead of time - shouldn't happen */
-    if (filefd < 0) {
-        err("%S: _pcp_send_file_data: open %s: %m\n", host, filename);
-        return -1;
+    pthread_mutex_lock(&pcp_file_mutex);
+    if (pf->fd < 0) {
+        _pcp_cache_evict(PCP_CACHE_MAX_IDLE - 1, 0);
+        if ((pf->fd = open(pf->filename, O_RDONLY)) < 0) {
+            /* checked ahead of time - shouldn't happen */
+            err("%S: _pcp_file_open: open %s: %m\n", host, pf->filename);
+            pthread_mutex_unlock(&pcp_file_mutex);
+            return -1;
+        }
+        pf->size = (fstat(pf->fd, &sb) == 0) ? sb.st_size : 0;
+#if HAVE_POSIX_FADVISE
+        posix_fadvise(pf->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    } else if (pf->refcnt == 0)
+        _pcp_idle_remove(pf);
+    pf->refcnt++;
+    fd = pf->fd;
+    pthread_mutex_unlock(&pcp_file_mutex);
+
+    return fd;
+}
+
+/*
+ * Map the file opened with _pcp_file_open() so that all hosts can
+ * write it from the same pages, if it fits in the cache budget.
+ *	RETURN		mapping of pf->size bytes, or NULL
+ */
+static void *_pcp_file_map(struct pcp_filename *pf)
+{
+    void *map;
+
+    pthread_mutex_lock(&pcp_file_mutex);
+    if (!pf->map && (pf->size > 0) && (pf->size <= PCP_CACHE_MAX_BYTES)) {
+        _pcp_cache_evict(PCP_CACHE_MAX_IDLE, pf->size);
+        if (pcp_mapped_bytes + pf->size <= PCP_CACHE_MAX_BYTES) {
+            map = mmap(NULL, pf->size, PROT_READ, MAP_SHARED, pf->fd, 0);
+            if (map != MAP_FAILED) {
+#if HAVE_MADVISE
+                madvise(map, pf->size, MADV_SEQUENTIAL);
+#endif
+                pf->map = map;
+                pcp_mapped_bytes += pf->size;
+            }
+        }
     }
-    do {
-        inbytes = read(filefd, tmpbuf, BUFSIZ);
+    map = pf->map;
+    pthread_mutex_unlock(&pcp_file_mutex);
+
+    return map;
+}
+
+#if HAVE_LIBZ
+/*
+ * Compress the data of the file pf, opened with _pcp_file_open().
+ *	RETURN		zlib stream of *zsize bytes, or NULL if the file
+ *			can't be compressed or would not get smaller
+ */
+static char *_pcp_deflate(struct pcp_filename *pf, off_t *zsize, char *host)
+{
+    z_stream zs;
+    char *in, *out;
+    uLong bound;
+    off_t offset = 0;
+    ssize_t inbytes;
+    int rc = Z_OK;
+
+    if ((pf->size == 0) || (pf->size > PCP_CACHE_MAX_BYTES))
+        return NULL;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return NULL;
+
+    bound = deflateBound(&zs, pf->size);
+    out = Malloc(bound);
+    in = Malloc(MIN(pf->size, PCP_DATA_BUFSIZ));
+    zs.next_out = (Bytef *) out;
+    zs.avail_out = bound;
+    while ((offset < pf->size) && (rc == Z_OK)) {
+        inbytes = pread(pf->fd, in, MIN(pf->size - offset, PCP_DATA_BUFSIZ),
+                        offset);
+        if ((inbytes < 0) && (errno == EINTR))
+            continue;
+        if (inbytes <= 0) {
+            err("%S: _pcp_deflate: read %s: %s\n", host, pf->filename,
+                inbytes < 0 ? strerror(errno) : "file truncated");
+            break;
+        }
+        offset += inbytes;
+        zs.next_in = (Bytef *) in;
+        zs.avail_in = inbytes;
+        rc = deflate(&zs, (offset < pf->size) ? Z_NO_FLUSH : Z_FINISH);
+    }
+    Free((void **) &in);
+
+    *zsize = zs.total_out;
+    deflateEnd(&zs);
+    if ((rc != Z_STREAM_END) || (*zsize >= pf->size)) {
+        Free((void **) &out);
+        return NULL;
+    }
+    return out;
+}
+#endif
+
+/*
+ * -G: get the data of the file pf, opened with _pcp_file_open(),
+ * compressed. It is compressed by the first host to send it and kept
+ * in the cache for the others.
+ *	RETURN		compressed data of *zsize bytes, or NULL to send
+ *			the file as it is
+ */
+static char *_pcp_file_deflate(struct pcp_filename *pf, off_t *zsize,
+                               char *host)
+{
+    char *zbuf = NULL;
+    off_t n = 0;
+
+    pthread_mutex_lock(&pcp_file_mutex);
+    /* hosts sending the same file wait for the one compressing it */
+    while (pf->deflating)
+        pthread_cond_wait(&pcp_deflate_cond, &pcp_file_mutex);
+    if (pf->zsize < 0) {
+        pf->deflating = true;
+        pthread_mutex_unlock(&pcp_file_mutex);
+#if HAVE_LIBZ
+        zbuf = _pcp_deflate(pf, &n, host);
+#endif
+        pthread_mutex_lock(&pcp_file_mutex);
+        if (zbuf) {
+            _pcp_cache_evict(PCP_CACHE_MAX_IDLE, n);
+            if (pcp_mapped_bytes + n <= PCP_CACHE_MAX_BYTES)
+                pcp_mapped_bytes += n;
+            else
+                Free((void **) &zbuf);
+        }
+        pf->zbuf = zbuf;
+        pf->zsize = zbuf ? n : 0;
+        pf->deflating = false;
+        pthread_cond_broadcast(&pcp_deflate_cond);
+    }
+    zbuf = pf->zbuf;
+    *zsize = pf->zsize;
+    pthread_mutex_unlock(&pcp_file_mutex);
+
+    return zbuf;
+}
+
+/*
+ * -U: get the signatures of the blocks of blksize bytes of the file pf,
+ * opened with _pcp_file_open(). They are computed by the first host to
+ * get a delta of the file and kept in the cache for the others.
+ *	RETURN		signatures, or NULL to send the whole file
+ */
+static unsigned char *_pcp_file_sigs(struct pcp_filename *pf, off_t blksize,
+                                     char *host)
+{
+    unsigned char *sigs;
+
+    pthread_mutex_lock(&pcp_sigs_mutex);
+    if (!pf->sigs) {
+        sigs = Malloc(pcp_delta_nblocks(pf->size, blksize)
+                      * PCP_DELTA_SIGSIZE);
+        if (pcp_delta_signatures(pf->fd, pf->size, blksize, sigs) < 0) {
+            err("%S: _pcp_file_sigs: read %s: %s\n", host, pf->filename,
+                errno ? strerror(errno) : "file truncated");
+            Free((void **) &sigs);
+        }
+        pthread_mutex_lock(&pcp_file_mutex);
+        pf->sigs = sigs;
+        pthread_mutex_unlock(&pcp_file_mutex);
+    }
+    sigs = pf->sigs;
+    pthread_mutex_unlock(&pcp_sigs_mutex);
+
+    return sigs;
+}
+
+/*
+ * Release the file obtained with _pcp_file_open(). Once no host is
+ * sending it, the file stays cached as idle until it is evicted.
+ */
+static void _pcp_file_close(struct pcp_filename *pf)
+{
+    pthread_mutex_lock(&pcp_file_mutex);
+    if (--pf->refcnt == 0) {
+        _pcp_idle_append(pf);
+        _pcp_cache_evict(PCP_CACHE_MAX_IDLE, 0);
+    }
+    pthread_mutex_unlock(&pcp_file_mutex);
+}
+
+/*
+ * Copy data from filefd to outfd by reading it into a buffer, for when
+ * sendfile() is not available or not supported for these descriptors.
+ */
+static int _pcp_copy_file_data(int outfd, int filefd, off_t offset,
+                               off_t size, char *filename, char *host)
+{
+    int bufsize = MIN(size - offset, PCP_DATA_BUFSIZ);
+    char *buf = Malloc(bufsize);
+    ssize_t inbytes;
+    int rc = -1;
+
+    while (offset < size) {
+        inbytes = pread(filefd, buf, MIN(size - offset, bufsize), offset);
         if (inbytes < 0) {
+            if (errno == EINTR)
+                continue;
             err("%S: _pcp_send_file_data: read %s: %m\n", host, filename);
+            goto out;
+        }
+        if (inbytes == 0) {
+            err("%S: _pcp_send_file_data: %s: file truncated\n",
+                host, filename);
+            goto out;
+        }
+        if (_pcp_write(outfd, buf, inbytes) < 0) {
+            err("%S: _pcp_send_file_data: write: %m\n", host);
+            goto out;
+        }
+        offset += inbytes;
+    }
+    rc = 0;
+  out:
+    Free((void **) &buf);
+    return rc;
+}
+
+/*
+ * Write the bytes from offset up to size of the file pf, opened with
+ * _pcp_file_open(), to the specified file descriptor. Where possible
+ * the data is sent with sendfile(), so it goes straight from the page
+ * cache to outfd without being copied through user space for each
+ * host. Otherwise it is written from a mapping of the file shared by
+ * all hosts, or, if the file can't be mapped, read with pread().
+ *	outfd (IN)	file descriptor to write to
+ *	pf (IN)		file to send
+ *	offset (IN)	first byte to send
+ *	size (IN)	end of the data to send, as announced to the server
+ *	host (IN)	name of remote host for error messages
+ *	RETURN		-1 on failure, 0 on success.
+ */
+static int _pcp_send_file_data(int outfd, struct pcp_filename *pf,
+                               off_t offset, off_t size, char *host)
+{
+    char *map;
+
+#if HAVE_SYS_SENDFILE_H && HAVE_SENDFILE
+    while (offset < size) {
+        ssize_t n = sendfile(outfd, pf->fd, &offset,
+                             MIN(size - offset, PCP_SENDFILE_MAX));
+        if (n < 0) {
+            /* not supported for this pair of descriptors */
+            if ((errno == EINVAL) || (errno == ENOSYS))
+                break;
+            err("%S: _pcp_send_file_data: write: %m\n", host);
+            return -1;
+        }
+        if (n == 0) {
+            err("%S: _pcp_send_file_data: %s: file truncated\n",
+                host, pf->filename);
             return -1;
         }
-        if (inbytes > 0) {
-            total += inbytes;
-            if (_pcp_write(outfd, tmpbuf, inbytes) < 0) {
+    }
+#endif
+    if ((offset < size) && (size <= pf->size) && (map = _pcp_file_map(pf))) {
+        while (offset < size) {
+            int n = MIN(size - offset, PCP_DATA_BUFSIZ);
+            if (_pcp_write(outfd, map + offset, n) < 0) {
                 err("%S: _pcp_send_file_data: write: %m\n", host);
                 return -1;
             }
+            offset += n;
         }
-    } while (inbytes > 0);      /* until EOF */
-    close(filefd);
+    }
+    if (offset < size)
+        return _pcp_copy_file_data(outfd, pf->fd, offset, size,
+                                   pf->filename, host);
     return 0;
 }
 
@@ -253,21 +999,17 @@ static int pcp_sendstr(int outfd, char *str, char *host)
 }
 
 /*
- * Receive an RCP response code and possibly error message.
- *	fd (IN)		file desciptor to read from
+ * Handle an RCP response code resp and possibly error message.
+ *	fd (IN)		file desciptor to read message from
+ *	resp (IN)	response code already read
  *	host (IN)	hostname for error messages
  *	RETURN		-1 on fatal error, 0 otherwise
  */
-static int pcp_response(int infd, char *host)
+static int _pcp_response_code(int infd, char resp, char *host)
 {
-    char resp;
     int i = 0, result = -1;
-    int n;
     char errstr[BUFSIZ];
 
-    if ((n = read(infd, &resp, sizeof(resp))) != sizeof(resp))
-        return (-1);
-
     switch (resp) {
         case 0:                /* ok */
             result = 0;
@@ -283,69 +1025,742 @@ static int pcp_response(int infd, char *host)
     return result;
 }
 
-#define RCP_MODEMASK (S_ISUID|S_ISGID|S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO)
+/*
+ * Receive an RCP response code and possibly error message.
+ *	fd (IN)		file desciptor to read from
+ *	host (IN)	hostname for error messages
+ *	RETURN		-1 on fatal error, 0 otherwise
+ */
+static int pcp_response(int infd, char *host)
+{
+    char resp;
+
+    if (read(infd, &resp, sizeof(resp)) != sizeof(resp))
+        return (-1);
+
+    return _pcp_response_code(infd, resp, host);
+}
+
+/*
+ * Pipelined protocol (see pcp_server.h): while the answer to the first
+ *  record is pending we do not know yet whether the server takes
+ *  pipelined records.
+ */
+#define PCP_CLASSIC     0
+#define PCP_PROBING     1
+#define PCP_PIPELINED   2
+
+/*
+ * Print any errors a pipelined server has sent so far, without waiting.
+ */
+static void _pcp_errors(struct pcp_client *pcp)
+{
+    struct pollfd pfd;
+    char resp;
+
+    pfd.fd = pcp->infd;
+    pfd.events = POLLIN;
+    while ((poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLIN)) {
+        if (read(pcp->infd, &resp, sizeof(resp)) != sizeof(resp))
+            return;
+        _pcp_response_code(pcp->infd, resp, pcp->host);
+    }
+}
+
+/*
+ * Receive the response to a record. A pipelined server does not send
+ *  one, but errors may have arrived in the meantime.
+ *	RETURN		-1 on fatal error, 0 otherwise
+ */
+static int _pcp_record_response(struct pcp_client *pcp)
+{
+    char resp;
+
+    switch (pcp->pipelined) {
+        case PCP_PIPELINED:
+            _pcp_errors(pcp);
+            return 0;
+        case PCP_PROBING:
+            if (read(pcp->infd, &resp, sizeof(resp)) != sizeof(resp))
+                return -1;
+            if (resp == PCP_PIPELINE_ACK) {
+                pcp->pipelined = PCP_PIPELINED;
+                return 0;
+            }
+            pcp->pipelined = PCP_CLASSIC;
+            return _pcp_response_code(pcp->infd, resp, pcp->host);
+        default:
+            return pcp_response(pcp->infd, pcp->host);
+    }
+}
+
+/*
+ * Wait until a pipelined server has handled all records, printing
+ *  errors for the last ones.
+ *	RETURN		-1 on lost connection, 0 otherwise
+ */
+static int _pcp_sync(struct pcp_client *pcp)
+{
+    char resp;
+
+    if (pcp_sendstr(pcp->outfd, PCP_SYNC_FLAG, pcp->host) < 0)
+        return -1;
+    while (read(pcp->infd, &resp, sizeof(resp)) == sizeof(resp)) {
+        if (resp == 0)
+            return 0;
+        _pcp_response_code(pcp->infd, resp, pcp->host);
+    }
+    return -1;
+}
+
+/*
+ * Send the bytes from offset up to end of pf as a segment of an 'R' or
+ * 'P' record: "offset length\n" followed by the data.
+ *	RETURN		-1 on failure, 0 on success.
+ */
+static int _pcp_send_segment(int outfd, struct pcp_filename *pf,
+                             off_t offset, off_t end, char *host)
+{
+    char tmpstr[64];
+
+    snprintf(tmpstr, sizeof(tmpstr), "%lld %lld\n",
+             (long long) offset, (long long) (end - offset));
+    if (pcp_sendstr(outfd, tmpstr, host) < 0)
+        return -1;
+    return _pcp_send_file_data(outfd, pf, offset, end, host);
+}
+
+/*
+ * Archive mode: send only the parts of the sparse file pf that hold
+ * data, each as "offset length\n" followed by the data, and then
+ * "size 0\n". The server leaves holes in between.
+ *	RETURN		-1 on failure, 0 on success.
+ */
+static int _pcp_send_sparse_data(int outfd, struct pcp_filename *pf,
+                                 off_t size, char *host)
+{
+    char tmpstr[64];
+    off_t data, hole = 0;
+
+    while (hole < size) {
+#ifdef SEEK_DATA
+        data = lseek(pf->fd, hole, SEEK_DATA);
+        if ((data < 0) && (errno == ENXIO))
+            break;              /* only a hole left */
+        if (data < 0) {         /* not supported, send the rest */
+            data = hole;
+            hole = size;
+        } else if (data >= size)
+            break;
+        else if (((hole = lseek(pf->fd, data, SEEK_HOLE)) < 0)
+                 || (hole > size))
+            hole = size;
+#else
+        data = hole;
+        hole = size;
+#endif
+        if (_pcp_send_segment(outfd, pf, data, hole, host) < 0)
+            return -1;
+    }
+    snprintf(tmpstr, sizeof(tmpstr), "%lld 0\n", (long long) size);
+    return pcp_sendstr(outfd, tmpstr, host);
+}
+
+/*
+ * Resuming: ask the server for the blocks it kept of pf, a file of size
+ * bytes, when an earlier connection was lost, with an 'O' record made
+ * of the mode, size and name in rec. The blocks that match those of pf
+ * need not be sent again.
+ *	RETURN		-1 on lost connection, else the offset to send from
+ */
+static off_t _pcp_resume_offset(struct pcp_client *pcp,
+                                struct pcp_filename *pf, off_t size,
+                                const char *rec)
+{
+    unsigned char *theirs = NULL, *mine = NULL;
+    off_t blksize = pcp_delta_blocksize(size);
+    off_t n, k = 0;
+    char tmpstr[BUFSIZ];
+    char resp;
+
+    snprintf(tmpstr, sizeof(tmpstr), "O%s", rec);
+    if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0)
+        return -1;
+    do {
+        if (read(pcp->infd, &resp, sizeof(resp)) != sizeof(resp)) {
+            err("%S: _pcp_resume_offset: lost connection\n", pcp->host);
+            return -1;
+        }
+        if (resp != PCP_RESUME_SIGS)
+            _pcp_response_code(pcp->infd, resp, pcp->host);
+    } while (resp != PCP_RESUME_SIGS);
+    if (fd_read_line(pcp->infd, tmpstr, sizeof(tmpstr)) <= 0)
+        return -1;
+    n = strtoll(tmpstr, NULL, 10);
+    if ((n < 0) || (n > size / blksize)) {
+        err("%S: _pcp_resume_offset: bad answer\n", pcp->host);
+        return -1;
+    }
+    if (n == 0)
+        return 0;
+
+    theirs = Malloc(n * PCP_DELTA_SIGSIZE);
+    mine = Malloc(n * PCP_DELTA_SIGSIZE);
+    if (fd_read_n(pcp->infd, theirs, n * PCP_DELTA_SIGSIZE)
+        != n * PCP_DELTA_SIGSIZE)
+        k = -1;
+    else if (pcp_delta_signatures(pf->fd, n * blksize, blksize, mine) == 0) {
+        while ((k < n) && (memcmp(theirs + k * PCP_DELTA_SIGSIZE,
+                                  mine + k * PCP_DELTA_SIGSIZE,
+                                  PCP_DELTA_SIGSIZE) == 0))
+            k++;
+    }
+    Free((void **) &theirs);
+    Free((void **) &mine);
+    return (k < 0) ? -1 : k * blksize;
+}
+
+/* -n: smallest file sent over several connections */
+#define PCP_STREAMS_MIN     (64 * 1024 * 1024)
+
+struct pcp_stream {
+    struct pcp_client *pcp;
+    struct pcp_filename *pf;
+    char *tmp;                  /* file the server writes          */
+    off_t offset, end;          /* range of pf to send             */
+    int started;                /* thread was created              */
+    int rc;                     /* 0 once the server has the range */
+    pthread_t thread;
+};
+
+/*
+ * -n: send one range of a file over a connection of its own, as a 'W'
+ * record to a new pdcp server on the same host.
+ */
+static void *_pcp_stream_thread(void *arg)
+{
+    struct pcp_stream *st = arg;
+    struct pcp_client *pcp = st->pcp;
+    char tmpstr[BUFSIZ];
+    void *conn;
+    char resp;
+    int fd;
+
+    if (!(conn = pcp->stream_open(pcp->stream_arg, &fd)))
+        return NULL;
+    snprintf(tmpstr, sizeof(tmpstr), "W%lld %lld %s\n",
+             (long long) st->offset, (long long) (st->end - st->offset),
+             st->tmp);
+    if ((pcp_response(fd, pcp->host) == 0)
+        && (pcp_sendstr(fd, PCP_RANGES_PROBE, pcp->host) == 0)
+        && (read(fd, &resp, sizeof(resp)) == sizeof(resp))
+        && (resp == PCP_RANGES_ACK)
+        && (pcp_sendstr(fd, tmpstr, pcp->host) == 0)
+        && (_pcp_send_file_data(fd, st->pf, st->offset, st->end,
+                                pcp->host) == 0)
+        && (_pcp_write(fd, "", 1) == 1)
+        && (pcp_response(fd, pcp->host) == 0))
+        st->rc = 0;
+    pcp->stream_close(conn);
+    return NULL;
+}
+
+/*
+ * -n: send the data of pf after its 'P' record. The server answers with
+ * the temporary file it writes, and pcp->streams connections each send
+ * a range of the data into it, the first of them this one. Ranges that
+ * fail on their own connection are sent over this one, and then the
+ * end of the file tells the server that all data is there.
+ *	RETURN		-1 on failure, 0 on success.
+ */
+static int _pcp_send_streams(struct pcp_client *pcp, struct pcp_filename *pf,
+                             off_t size)
+{
+    struct pcp_stream st[PCP_MAX_STREAMS];
+    char tmp[MAXPATHNAMELEN], tmpstr[64];
+    off_t chunk;
+    char resp;
+    int i, n, rc;
+
+    do {
+        if (read(pcp->infd, &resp, sizeof(resp)) != sizeof(resp)) {
+            err("%S: _pcp_send_streams: lost connection\n", pcp->host);
+            return -1;
+        }
+        if (resp != PCP_STREAMS_FILE)
+            _pcp_response_code(pcp->infd, resp, pcp->host);
+    } while (resp != PCP_STREAMS_FILE);
+    if ((fd_read_line(pcp->infd, tmp, sizeof(tmp)) <= 0)
+        || (tmp[strlen(tmp) - 1] != '\n'))
+        return -1;
+    tmp[strlen(tmp) - 1] = '\0';
+    if (tmp[0] == '\0')
+        return -1;              /* the server said why */
+
+    chunk = roundup((size + pcp->streams - 1) / pcp->streams,
+                    PCP_DATA_BUFSIZ);
+    for (n = 1; (n < pcp->streams) && (n * chunk < size); n++) {
+        st[n].pcp = pcp;
+        st[n].pf = pf;
+        st[n].tmp = tmp;
+        st[n].offset = n * chunk;
+        st[n].end = MIN((n + 1) * chunk, size);
+        st[n].rc = -1;
+        st[n].started = (pthread_create(&st[n].thread, NULL,
+                                        _pcp_stream_thread, &st[n]) == 0);
+    }
+
+    rc = _pcp_send_segment(pcp->outfd, pf, 0, MIN(chunk, size), pcp->host);
+    for (i = 1; i < n; i++) {
+        if (st[i].started)
+            pthread_join(st[i].thread, NULL);
+        if ((rc == 0) && (st[i].rc < 0))
+            rc = _pcp_send_segment(pcp->outfd, pf, st[i].offset, st[i].end,
+                                   pcp->host);
+    }
+    if (rc < 0)
+        return -1;
+
+    snprintf(tmpstr, sizeof(tmpstr), "%lld 0\n", (long long) size);
+    return pcp_sendstr(pcp->outfd, tmpstr, pcp->host);
+}
 
-int pcp_sendfile(struct pcp_client *pcp, char *file, char *output_file)
+/*
+ * Return 1 if the connection to the server is gone, for after a failure.
+ */
+static int _pcp_lost(struct pcp_client *pcp)
 {
+    struct pollfd pfd;
+
+    pfd.fd = pcp->outfd;
+    pfd.events = POLLOUT;
+    return (poll(&pfd, 1, 0) > 0) && (pfd.revents & (POLLERR | POLLHUP));
+}
+
+/*
+ * Ask a pipelined server whether it supports a feature (-G, -U).
+ *	probe (IN)	PCP_ZLIB_PROBE etc.
+ *	ack (IN)	answer of a server that supports it
+ *	RETURN		1 if it does, 0 otherwise
+ */
+static int _pcp_probe(struct pcp_client *pcp, char *probe, char ack)
+{
+    char resp;
     int result = 0;
-    char tmpstr[BUFSIZ], *template;
-    struct stat sb;
 
-	if (output_file == NULL)
-		output_file = file;
+    if (pcp_sendstr(pcp->outfd, probe, pcp->host) < 0)
+        return 0;
+    if (pcp_sendstr(pcp->outfd, PCP_SYNC_FLAG, pcp->host) < 0)
+        return 0;
+    while (read(pcp->infd, &resp, sizeof(resp)) == sizeof(resp)) {
+        if (resp == 0)
+            return result;
+        if (resp == ack)
+            result = 1;
+        else
+            _pcp_response_code(pcp->infd, resp, pcp->host);
+    }
+    return 0;
+}
+
+/* -U: number of files asked about before reading the answers */
+#define PCP_QUERY_WINDOW    1024
 
-    /*err("%S: %s\n", host, file); */
+/* -U: what to do with each file, by the server's answer */
+#define PCP_SEND        0
+#define PCP_SKIP        1
+#define PCP_DELTA       2
 
-    if (stat(file, &sb) < 0) {
-        err("%S: %s: %m\n", pcp->host, file);
-        goto fail;
+/*
+ * -U: ask the server which of the files from pcp->index on it already
+ * has with the same mode, size and modification time, and mark those
+ * PCP_SKIP in pcp->answer. Files it has in another version are marked
+ * PCP_DELTA if it takes block deltas. The questions go out in windows
+ * of PCP_QUERY_WINDOW, whose answers fit in the socket buffers while we
+ * are still writing.
+ *	RETURN		-1 on lost connection, 0 otherwise
+ */
+static int _pcp_query(struct pcp_client *pcp)
+{
+    int *asked = Malloc(PCP_QUERY_WINDOW * sizeof(int));
+    int count = list_count(pcp->infiles);
+    struct pcp_filename *pf;
+    char tmpstr[BUFSIZ];
+    ListIterator i;
+    int n, nasked, nanswered, rc = 0;
+    char resp;
+
+    pcp->answer = Malloc(count);
+    memset(pcp->answer, PCP_SEND, count);
+    if (!_pcp_probe(pcp, PCP_UPDATE_PROBE, PCP_UPDATE_ACK))
+        goto out;
+    (void) _pcp_probe(pcp, PCP_DELTA_PROBE, PCP_DELTA_ACK);
+
+    i = list_iterator_create(pcp->infiles);
+    for (n = 0; n < pcp->index; n++)
+        list_next(i);
+    do {
+        nasked = 0;
+        while ((nasked < PCP_QUERY_WINDOW) && (pf = list_next(i))) {
+            int index = n++;
+            if (!pf->path)
+                continue;       /* end of directory */
+            if (!S_ISREG(pf->sb.st_mode))
+                continue;
+            snprintf(tmpstr, sizeof(tmpstr), "Q%04o %lld %ld %s\n",
+                     pf->sb.st_mode & RCP_MODEMASK,
+                     (long long) pf->sb.st_size,
+                     (long) pf->sb.st_mtime, pf->path);
+            if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0) {
+                rc = -1;
+                break;
+            }
+            asked[nasked++] = index;
+        }
+        nanswered = 0;
+        while ((rc == 0) && (nanswered < nasked)) {
+            if (read(pcp->infd, &resp, sizeof(resp)) != sizeof(resp))
+                rc = -1;
+            else if (resp == PCP_UNCHANGED)
+                pcp->answer[asked[nanswered++]] = PCP_SKIP;
+            else if (resp == PCP_DIFFERENT)
+                pcp->answer[asked[nanswered++]] = PCP_DELTA;
+            else if (resp == PCP_CHANGED)
+                pcp->answer[asked[nanswered++]] = PCP_SEND;
+            else
+                _pcp_response_code(pcp->infd, resp, pcp->host);
+        }
+    } while ((rc == 0) && (nasked == PCP_QUERY_WINDOW));
+    list_iterator_destroy(i);
+  out:
+    Free((void **) &asked);
+    return rc;
+}
+
+/*
+ * -U: send the signatures of the blocks of pf after its 'B' record, read
+ * which blocks the server is missing, and send those.
+ *	RETURN		-1 on failure, 0 on success.
+ */
+static int _pcp_send_delta(struct pcp_client *pcp, struct pcp_filename *pf,
+                           off_t size, off_t blksize, unsigned char *sigs)
+{
+    off_t nblocks = pcp_delta_nblocks(size, blksize);
+    int nbytes = (nblocks + 7) / 8;
+    unsigned char *need;
+    off_t i, j;
+    char resp;
+    int rc = -1;
+
+    if (_pcp_write(pcp->outfd, (char *) sigs,
+                   nblocks * PCP_DELTA_SIGSIZE) < 0) {
+        err("%S: _pcp_send_delta: write: %m\n", pcp->host);
+        return -1;
+    }
+    do {
+        if (read(pcp->infd, &resp, sizeof(resp)) != sizeof(resp)) {
+            err("%S: _pcp_send_delta: lost connection\n", pcp->host);
+            return -1;
+        }
+        if (resp != PCP_DELTA_NEED)
+            _pcp_response_code(pcp->infd, resp, pcp->host);
+    } while (resp != PCP_DELTA_NEED);
+
+    need = Malloc(nbytes);
+    if (fd_read_n(pcp->infd, need, nbytes) != nbytes) {
+        err("%S: _pcp_send_delta: lost connection\n", pcp->host);
+        goto out;
+    }
+
+    /* send each run of needed blocks in one piece */
+#define NEED(k) (need[(k) / 8] & (1 << ((k) % 8)))
+    for (i = 0; i < nblocks; i = j) {
+        for (j = i + 1; (j < nblocks) && (!NEED(j) == !NEED(i)); j++)
+            ;
+        if (NEED(i) && (_pcp_send_file_data(pcp->outfd, pf, i * blksize,
+                                            MIN(j * blksize, size),
+                                            pcp->host) < 0))
+            goto out;
     }
+#undef NEED
+    rc = 0;
+  out:
+    Free((void **) &need);
+    return rc;
+}
 
-    if (pcp->preserve) {
-        /*
-         * 1: SEND stat time: "T%ld %ld %ld %ld\n"
-         *    (st_mtime, st_mtime_usec, st_atime, st_atime_usec)
-         */
+/*
+ * Archive mode: send a symbolic link, or a hard link to a file sent
+ * before, as "L%04o %d %s\n" or "H%04o %d %s\n" followed by the link
+ * target and a NUL byte. Only a pipelined server takes these, older
+ * ones get the file the link refers to instead.
+ *	RETURN		1 if sent, 0 on failure, -1 to send pf as a file
+ */
+static int _pcp_sendlink(struct pcp_client *pcp, struct pcp_filename *pf,
+                         char *output_file, struct stat *sb)
+{
+    char target[MAXPATHNAMELEN], tmpstr[BUFSIZ];
+    char *link = target;
+    int type, len;
+
+    if (S_ISLNK(sb->st_mode)) {
+        len = readlink(pf->filename, target, sizeof(target) - 1);
+        if (len < 0) {
+            err("%S: readlink %s: %m\n", pcp->host, pf->filename);
+            return 0;
+        }
+        target[len] = '\0';
+        type = 'L';
+    } else if (pf->link) {
+        link = pf->link;
+        type = 'H';
+    } else
+        return -1;
+
+    /*
+     * Only the answer to the first record tells whether the server is
+     * pipelined. Get it with a time record, which an older server then
+     * applies to the file sent in place of the link.
+     */
+    if (pcp->pipelined == PCP_PROBING) {
         snprintf(tmpstr, sizeof(tmpstr), "T%ld %ld %ld %ld\n",
-                 (long) sb.st_mtime, 0L, sb.st_atime, 0L);
+                 (long) sb->st_mtime, 0L, (long) sb->st_atime, 0L);
+        if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0)
+            return 0;
+        if (_pcp_record_response(pcp) < 0)
+            return 0;
+    }
+
+    if (pcp->pipelined != PCP_PIPELINED) {
+        if ((type == 'L')
+            && ((stat(pf->filename, sb) < 0) || !S_ISREG(sb->st_mode))) {
+            err("%S: %s: remote pdcp can't create links, skipped\n",
+                pcp->host, pf->filename);
+            return 0;
+        }
+        return -1;
+    }
+
+    len = strlen(link);
+    snprintf(tmpstr, sizeof(tmpstr), "%c%04o %d %s\n", type,
+             sb->st_mode & RCP_MODEMASK, len, xbasename(output_file));
+    if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0)
+        return 0;
+    if (_pcp_write(pcp->outfd, link, len + 1) < 0)
+        return 0;
+    if (_pcp_record_response(pcp) < 0)
+        return 0;
+    return 1;
+}
+
+int pcp_sendfile(struct pcp_client *pcp, struct pcp_filename *pf,
+                 char *output_file)
+{
+    int result = 0;
+    char tmpstr[BUFSIZ], hdrbuf[BUFSIZ];
+    char *file = pf->filename;
+    char *hdr = pf->hdr;
+    char *zbuf = NULL;
+    off_t zsize = 0;
+    unsigned char *sigs = NULL;
+    off_t blksize = 0;
+    struct stat sb;
+    int rc, n, tlen = pf->tlen, tsent = 0, opened = 0, sparse = 0;
+    int streams = 0;
+    off_t offset = 0;
+
+    /*err("%S: %s\n", host, file); */
+
+    /* stat()ed once when listed, not again for each host */
+    sb = pf->sb;
+
+    if (pcp->archive) {
+        if ((rc = _pcp_sendlink(pcp, pf, output_file ? output_file : file,
+                                &sb)) >= 0)
+            return rc;
+    }
+
+    /*
+     * The records for pf were formatted when it was listed, unless it
+     * is renamed (reverse copy) or a link sent as the file it refers to.
+     */
+    if (output_file || !hdr) {
+        if (output_file == NULL)
+            output_file = file;
+        tlen = _pcp_format_header(hdrbuf, sizeof(hdrbuf), &sb,
+                                  xbasename(output_file));
+        hdr = hdrbuf;
+    } else
+        output_file = file;
+
+    /*
+     * -n and resuming: only the answer to the first record shows whether
+     * the server is pipelined, as both need. Without -p, ask with a time
+     * record for now, which leaves the file with much the same times as
+     * if none had been sent.
+     */
+    if (((pcp->streams > 1 && pcp->stream_open
+          && sb.st_size >= PCP_STREAMS_MIN)
+         || sb.st_size >= PCP_DELTA_MIN)
+        && !pcp->preserve && (pcp->pipelined == PCP_PROBING)
+        && S_ISREG(sb.st_mode)) {
+        long now = (long) time(NULL);
+
+        snprintf(tmpstr, sizeof(tmpstr), "T%ld 0 %ld 0\n", now, now);
         if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0)
             goto fail;
+        if (_pcp_record_response(pcp) < 0)
+            goto fail;
+    }
 
-        /* 2: RECV response code */
-        if (pcp_response(pcp->infd, pcp->host) < 0)
+    /*
+     * 1: SEND stat time: "T%ld %ld %ld %ld\n"
+     *    (st_mtime, st_mtime_usec, st_atime, st_atime_usec)
+     * 2: RECV response code
+     * A pipelined server does not answer, so it gets the time record
+     * together with the next one.
+     */
+    if (pcp->preserve && (pcp->pipelined != PCP_PIPELINED)) {
+        if (_pcp_write(pcp->outfd, hdr, tlen) < 0)
+            goto fail;
+        if (_pcp_record_response(pcp) < 0)
             goto fail;
+        tsent = 1;
     }
 
-    if (S_ISDIR(sb.st_mode)) {
-        /*
-         * 3a: SEND directory mode: "D%04o %d %s\n"
-         *     (st_mode & RCP_MODEMASK, 0, name)
-         */
-        snprintf(tmpstr, sizeof(tmpstr), "D%04o %d %s\n",
-                 sb.st_mode & RCP_MODEMASK, 0, xbasename(output_file));
-        if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0)
+    /* -U: as soon as the server is known to be pipelined, ask it */
+    if (pcp->update && !pcp->answer && (pcp->pipelined == PCP_PIPELINED)) {
+        if (_pcp_query(pcp) < 0)
+            goto fail;
+    }
+    if (pcp->answer && (pcp->answer[pcp->index] == PCP_SKIP))
+        return 1;
+
+    /* -D: send only the data of a file with holes */
+    if (pcp->archive && (pcp->pipelined == PCP_PIPELINED)
+        && S_ISREG(sb.st_mode) && (sb.st_blocks * 512 < sb.st_size))
+        sparse = 1;
+
+    /*
+     * Open the file before announcing it: a pipelined server takes the
+     * data that follows without answering, so there is no backing out.
+     */
+    if (S_ISREG(sb.st_mode)) {
+        if (_pcp_file_open(pf, pcp->host) < 0)
+            goto fail;
+        opened = 1;
+    }
+
+    /* -U: send a large file the server has another version of as a delta */
+    if (pcp->answer && (pcp->answer[pcp->index] == PCP_DELTA) && opened
+        && !sparse && (sb.st_size == pf->size)
+        && (sb.st_size >= PCP_DELTA_MIN)) {
+        blksize = pcp_delta_blocksize(sb.st_size);
+        sigs = _pcp_file_sigs(pf, blksize, pcp->host);
+    }
+
+    /* -G: compress the data if the server can take it */
+    if (pcp->compress && (pcp->pipelined == PCP_PIPELINED)
+        && S_ISREG(sb.st_mode) && !sparse && !sigs) {
+        if (pcp->zlib < 0)
+            pcp->zlib = _pcp_probe(pcp, PCP_ZLIB_PROBE, PCP_ZLIB_ACK);
+        if (pcp->zlib)
+            zbuf = _pcp_file_deflate(pf, &zsize, pcp->host);
+    }
+
+    /* -n: send a large file over several connections at once */
+    if ((pcp->streams > 1) && pcp->stream_open && opened
+        && (pcp->pipelined == PCP_PIPELINED) && !sparse && !zbuf && !sigs
+        && (sb.st_size == pf->size) && (sb.st_size >= PCP_STREAMS_MIN)) {
+        if (pcp->streaming < 0)
+            pcp->streaming = _pcp_probe(pcp, PCP_STREAMS_PROBE,
+                                        PCP_STREAMS_ACK);
+        streams = pcp->streaming;
+    }
+
+    /* go on from what the server kept of an earlier copy, if anything */
+    if (opened && (pcp->pipelined == PCP_PIPELINED)
+        && !sparse && !zbuf && !sigs && !streams
+        && (sb.st_size == pf->size) && (sb.st_size >= PCP_DELTA_MIN)) {
+        if (pcp->resuming < 0)
+            pcp->resuming = _pcp_probe(pcp, PCP_RESUME_PROBE,
+                                       PCP_RESUME_ACK);
+        if (pcp->resuming
+            && ((offset = _pcp_resume_offset(pcp, pf, sb.st_size,
+                                             hdr + tlen + 1)) < 0))
+            goto fail;
+    }
+
+    /*
+     * 3a: SEND directory mode: "D%04o %d %s\n"
+     * 3b: SEND file mode: "C%04o %lld %s\n"
+     *     The records formatted above, after the time record if it
+     *     is still to be sent.
+     */
+    if (!sparse && !zbuf && !sigs && !streams && !offset) {
+        if (pcp->preserve && !tsent)
+            rc = pcp_sendstr(pcp->outfd, hdr, pcp->host);
+        else
+            rc = pcp_sendstr(pcp->outfd, hdr + tlen, pcp->host);
+        if (rc < 0)
             goto fail;
     } else {
-        /*
-         * 3b: SEND file mode: "C%04o %lld %s\n" or "C%04o %ld %s\n"
-         *    (st_mode & MODE_MASK, st_size, basename(filename))
-         *    Use second template if sizeof(st_size) > sizeof(long).
-         */
-        template = (sizeof(sb.st_size) > sizeof(long)
-                    ? "C%04o %lld %s\n" : "C%04o %ld %s\n");
-        snprintf(tmpstr, sizeof(tmpstr), template,
-                 sb.st_mode & RCP_MODEMASK, sb.st_size, xbasename(output_file));
+        n = 0;
+        if (pcp->preserve && !tsent) {
+            memcpy(tmpstr, hdr, tlen);
+            n = tlen;
+        }
+        /* -D: a sparse file is sent as "R%04o %lld %s\n" */
+        if (sparse)
+            snprintf(tmpstr + n, sizeof(tmpstr) - n, "R%s", hdr + tlen + 1);
+        /* -n: a file sent over several connections is "P%04o %lld %s\n" */
+        if (streams)
+            snprintf(tmpstr + n, sizeof(tmpstr) - n, "P%s", hdr + tlen + 1);
+        /* resuming: the rest of a file is "A%04o %lld %lld %s\n" */
+        if (offset)
+            snprintf(tmpstr + n, sizeof(tmpstr) - n, "A%04o %lld %lld %s\n",
+                     sb.st_mode & RCP_MODEMASK, (long long) sb.st_size,
+                     (long long) offset, xbasename(output_file));
+        /* -G: compressed data is sent as "Z%04o %lld %lld %s\n" */
+        if (zbuf)
+            snprintf(tmpstr + n, sizeof(tmpstr) - n, "Z%04o %lld %lld %s\n",
+                     sb.st_mode & RCP_MODEMASK, (long long) sb.st_size,
+                     (long long) zsize, xbasename(output_file));
+        /* -U: a delta is sent as "B%04o %lld %lld %s\n" */
+        if (sigs)
+            snprintf(tmpstr + n, sizeof(tmpstr) - n, "B%04o %lld %lld %s\n",
+                     sb.st_mode & RCP_MODEMASK, (long long) sb.st_size,
+                     (long long) blksize, xbasename(output_file));
         if (pcp_sendstr(pcp->outfd, tmpstr, pcp->host) < 0)
             goto fail;
     }
 
-    /* 4: RECV response code */
-    if (pcp_response(pcp->infd, pcp->host) < 0)
+    /*
+     * 4: RECV response code
+     *    -n: the server answers a 'P' record with the file to write
+     *    into, which _pcp_send_streams() waits for.
+     */
+    if (!streams && (_pcp_record_response(pcp) < 0))
         goto fail;
 
     if (S_ISREG(sb.st_mode)) {
         /* 5: SEND data */
-        if (_pcp_send_file_data(pcp->outfd, file, pcp->host) < 0)
+        if (sigs)
+            rc = _pcp_send_delta(pcp, pf, sb.st_size, blksize, sigs);
+        else if (zbuf) {
+            if ((rc = _pcp_write(pcp->outfd, zbuf, (int) zsize)) < 0)
+                err("%S: pcp_sendfile: write: %m\n", pcp->host);
+        } else if (streams)
+            rc = _pcp_send_streams(pcp, pf, sb.st_size);
+        else if (sparse)
+            rc = _pcp_send_sparse_data(pcp->outfd, pf, sb.st_size,
+                                       pcp->host);
+        else
+            rc = _pcp_send_file_data(pcp->outfd, pf, offset, sb.st_size,
+                                     pcp->host);
+        _pcp_file_close(pf);
+        opened = 0;
+        if (rc < 0)
             goto fail;
 
         /* 6: SEND NULL byte */
@@ -353,12 +1768,14 @@ int pcp_sendfile(struct pcp_client *pcp, char *file, char *output_file)
             goto fail;
 
         /* 7: RECV response code */
-        if (pcp_response(pcp->infd, pcp->host) < 0)
+        if (_pcp_record_response(pcp) < 0)
             goto fail;
     }
 
     result = 1;                 /* indicate success */
   fail:
+    if (opened)
+        _pcp_file_close(pf);
     return result;
 }
 
@@ -367,11 +1784,17 @@ static int _pcp_sendfile (struct pcp_filename *pf, struct pcp_client *pcp)
 	char *output_filename = NULL;
 
 	if (strcmp(pf->filename, EXIT_SUBDIR_FILENAME) == 0) {
-		if (pcp_sendstr(pcp->outfd, EXIT_SUBDIR_FLAG, pcp->host) < 0)
+		if (pcp_sendstr(pcp->outfd, EXIT_SUBDIR_FLAG, pcp->host) < 0) {
+			if (_pcp_lost(pcp))
+				return (0);
 			errx("%p: failed to send exit subdir flag\n");
-		if (pcp_response(pcp->infd, pcp->host) < 0)
+		}
+		if (_pcp_record_response(pcp) < 0) {
+			if (_pcp_lost(pcp))
+				return (0);
 			errx("%p: failed to exit subdir properly\n");
-		return (0);
+		}
+		return (1);
 	}
 
 	/* during a reverse copy, the hostname has to be attached
@@ -384,20 +1807,48 @@ static int _pcp_sendfile (struct pcp_filename *pf, struct pcp_client *pcp)
 		xstrcat(&output_filename, pcp->host);
 	}
 
-	pcp_sendfile (pcp, pf->filename, output_filename);
-
-	return (0);
+	return (pcp_sendfile (pcp, pf, output_filename));
 }
 
 int pcp_client(struct pcp_client *pcp)
 {
+    pcp->lost = false;
+
     /* 0: RECV response code */
     if (pcp_response(pcp->infd, pcp->host) >= 0) {
         struct pcp_filename *pf;
-        ListIterator i = list_iterator_create (pcp->infiles);
-        while ((pf = list_next (i)))
-            _pcp_sendfile (pf, pcp);
+        ListIterator i;
+
+        /* offer to send records without waiting for each answer */
+        if (pcp_sendstr(pcp->outfd, PCP_PIPELINE_PROBE, pcp->host) < 0)
+            return -1;
+        pcp->pipelined = PCP_PROBING;
+        pcp->zlib = -1;
+        pcp->streaming = -1;
+        pcp->resuming = -1;
+
+        pcp->index = 0;
+        pcp->answer = NULL;
+        i = list_iterator_create (pcp->infiles);
+        while ((pf = list_next (i))) {
+            /* -U: the server has it already */
+            if ((!pcp->answer || (pcp->answer[pcp->index] != PCP_SKIP))
+                && (_pcp_sendfile (pf, pcp) <= 0) && _pcp_lost (pcp)) {
+                pcp->lost = true;
+                break;
+            }
+            pcp->index++;
+        }
         list_iterator_destroy (i);
+        if (pcp->answer)
+            Free ((void **) &pcp->answer);
+
+        if (pcp->lost)
+            return -1;
+        if ((pcp->pipelined == PCP_PIPELINED) && (_pcp_sync (pcp) < 0)) {
+            pcp->lost = true;
+            return -1;
+        }
         return 0;
     }
     return -1;
@@ -31,6 +31,9 @@
 #  include <config.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include "src/pdsh/opt.h"
 
 #include "src/common/list.h"
@@ -44,14 +47,46 @@
  * recursively moving down a directory (-r option).  This flag
  * is needed so the right output filename can be determined
  * on reverse copies.
+ *
+ * Regular files are opened once and shared by all hosts sending
+ * them, and then kept in a cache of open and mapped source files.
+ *
+ * In archive mode (-D) a regular file with a hard link that was
+ * already listed refers to the first link by its path relative to
+ * the target directory.
+ *
+ * The file is stat()ed (lstat() for -D) once when it is listed, and
+ * the records announcing it are formatted then, and used for every
+ * host it is sent to.
  */
 struct pcp_filename {
     char *filename;
+    char *path;         /* path relative to the target directory */
+    struct stat sb;     /* stat of filename when it was listed */
     int file_specified_by_user;
+    int fd;             /* open file shared by all hosts, or -1 */
+    int refcnt;         /* number of hosts currently sending fd */
+    off_t size;         /* size of open file                    */
+    void *map;          /* mapping of size bytes, or NULL       */
+    struct pcp_filename *prev, *next;   /* cache idle list      */
+    char *link;         /* -D: earlier hard link to file, or NULL */
+    char *zbuf;         /* -G: data compressed once for all hosts */
+    off_t zsize;        /* size of zbuf, -1 if not compressed yet */
+    bool deflating;     /* -G: a host is compressing the file now */
+    unsigned char *sigs; /* -U: block signatures for a delta, or NULL */
+    char *hdr;          /* T and C or D records sent for the file */
+    int tlen;           /* length of the T record in hdr */
 };
 
-/* expand directories, if any, and verify access for all files */
-List pcp_expand_dirs (List infile_names);
+/* expand directories, if any, and verify access for all files.
+ * If archive is true, symbolic links are listed instead of followed.
+ */
+List pcp_expand_dirs (List infile_names, bool archive);
+
+/* pdcp -W: list the files a relay received, from the names recorded
+ * by pcp_server().
+ */
+List pcp_received_files (List received, bool archive);
 
 struct pcp_client {
 	int infd;
@@ -60,6 +95,20 @@ struct pcp_client {
 	bool pcp_client;
 	char *host;
 	List infiles;
+	bool archive;       /* send links and sparse files as such */
+	bool compress;      /* send file data compressed with zlib */
+	bool update;        /* send only files the server doesn't have */
+	int streams;        /* connections to send a large file over */
+	void *(*stream_open) (void *arg, int *fdp);  /* open one, or NULL */
+	void (*stream_close) (void *conn);
+	void *stream_arg;
+	int pipelined;      /* set by pcp_client(): PCP_CLASSIC etc. */
+	int zlib;           /* set by pcp_client(): server inflates data */
+	int streaming;      /* set by pcp_client(): server takes streams */
+	int resuming;       /* set by pcp_client(): server resumes files */
+	bool lost;          /* set by pcp_client(): connection was lost */
+	int index;          /* set by pcp_client(): infiles entry sent */
+	char *answer;       /* set by pcp_client(): PCP_SKIP etc. by entry */
 };
 
 int pcp_client (struct pcp_client *cli);
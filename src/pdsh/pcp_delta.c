@@ -0,0 +1,346 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+
+/*
+ * Block delta for pdcp -U (see pcp_delta.h).
+ *
+ * The weak checksum of a block x[0..n-1] is a | b << 16, with
+ *  a = sum x[i] and b = sum (n - i) * x[i], both mod 2^16, so it can be
+ *  moved along by one byte in constant time. The strong hash is
+ *  MurmurHash3 x64_128, read and written little-endian so that hosts
+ *  of any byte order agree on it.
+ */
+
+#if     HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pcp_delta.h"
+
+#define DELTA_MINBLOCK      (64 * 1024)
+#define DELTA_SCANBUF       (4 * 1024 * 1024)   /* read ahead when matching */
+#define DELTA_STRONGSIZE    16
+
+static uint32_t _get32 (const unsigned char *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+         | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static void _put32 (unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint64_t _get64le (const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void _put64le (unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static uint64_t _rotl64 (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t _fmix64 (uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void _strong (const unsigned char *data, size_t len,
+                     unsigned char *out)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char *tail = data + (len & ~(size_t) 15);
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        k1 = _get64le (data + i);
+        k2 = _get64le (data + i + 8);
+
+        k1 *= c1; k1 = _rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = _rotl64 (h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = _rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = _rotl64 (h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    k1 = k2 = 0;
+    for (i = len & 15; i > 8; i--)
+        k2 ^= (uint64_t) tail[i - 1] << ((i - 9) * 8);
+    if ((len & 15) > 8) {
+        k2 *= c2; k2 = _rotl64 (k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (; i > 0; i--)
+        k1 ^= (uint64_t) tail[i - 1] << ((i - 1) * 8);
+    if ((len & 15) > 0) {
+        k1 *= c1; k1 = _rotl64 (k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = _fmix64 (h1);
+    h2 = _fmix64 (h2);
+    h1 += h2;
+    h2 += h1;
+    _put64le (out, h1);
+    _put64le (out + 8, h2);
+}
+
+static void _weak (const unsigned char *p, size_t len,
+                   uint32_t *ap, uint32_t *bp)
+{
+    uint32_t a = 0, b = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        a += p[i];
+        b += (uint32_t) (len - i) * p[i];
+    }
+    *ap = a & 0xffff;
+    *bp = b & 0xffff;
+}
+
+/*
+ *  pread() exactly len bytes unless the file ends first.
+ *   Returns the number of bytes read, or -1 on error.
+ */
+static ssize_t _preadn (int fd, unsigned char *buf, size_t len, off_t off)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        if ((n = pread (fd, buf + got, len - got, off + got)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+off_t pcp_delta_blocksize (off_t size)
+{
+    off_t blksize = DELTA_MINBLOCK;
+
+    while (pcp_delta_nblocks (size, blksize) > PCP_DELTA_MAXBLOCKS)
+        blksize *= 2;
+    return blksize;
+}
+
+off_t pcp_delta_nblocks (off_t size, off_t blksize)
+{
+    return (size + blksize - 1) / blksize;
+}
+
+int pcp_delta_signatures (int fd, off_t size, off_t blksize,
+                          unsigned char *sigs)
+{
+    unsigned char *buf;
+    uint32_t a, b;
+    off_t off;
+    ssize_t len, n;
+
+    if (!(buf = malloc (blksize)))
+        return -1;
+    for (off = 0; off < size; off += len) {
+        len = (size - off < blksize) ? size - off : blksize;
+        if ((n = _preadn (fd, buf, len, off)) != len) {
+            if (n >= 0)
+                errno = 0;
+            free (buf);
+            return -1;
+        }
+        _weak (buf, len, &a, &b);
+        _put32 (sigs, a | (b << 16));
+        _strong (buf, len, sigs + 4);
+        sigs += PCP_DELTA_SIGSIZE;
+    }
+    free (buf);
+    return 0;
+}
+
+/*
+ *  Check for the short last block of the new file at offset off of fd.
+ */
+static void _match_tail (int fd, off_t off, const unsigned char *sig,
+                         size_t len, unsigned char *buf, off_t *found)
+{
+    unsigned char strong[DELTA_STRONGSIZE];
+    uint32_t a, b;
+
+    if (*found >= 0 || off < 0 || _preadn (fd, buf, len, off) != len)
+        return;
+    _weak (buf, len, &a, &b);
+    if ((a | (b << 16)) != _get32 (sig))
+        return;
+    _strong (buf, len, strong);
+    if (memcmp (strong, sig + 4, DELTA_STRONGSIZE) == 0)
+        *found = off;
+}
+
+static unsigned int _hash (uint32_t weak, unsigned int mask)
+{
+    return (weak * 2654435761U) & mask;
+}
+
+int pcp_delta_match (int fd, off_t oldsize, const unsigned char *sigs,
+                     off_t size, off_t blksize, off_t *found)
+{
+    off_t nblocks = pcp_delta_nblocks (size, blksize);
+    off_t nfull = size / blksize;
+    unsigned char strong[DELTA_STRONGSIZE];
+    unsigned char *buf = NULL;
+    size_t bufsize = DELTA_SCANBUF + blksize;
+    unsigned int hsize = 1, i;
+    int *head = NULL, *next = NULL;
+    off_t base = 0, pos = 0;
+    size_t len = 0;
+    uint32_t a = 0, b = 0, w, out = 0;
+    int rolling = 0, rc = -1;
+    ssize_t n;
+    int j;
+
+    for (j = 0; j < nblocks; j++)
+        found[j] = -1;
+
+    while (hsize < 2 * nfull)
+        hsize *= 2;
+    if (!(buf = malloc (bufsize))
+        || !(head = malloc (hsize * sizeof (int)))
+        || !(next = malloc ((nfull + 1) * sizeof (int))))
+        goto out;
+    for (i = 0; i < hsize; i++)
+        head[i] = -1;
+    for (j = nfull - 1; j >= 0; j--) {
+        i = _hash (_get32 (sigs + j * PCP_DELTA_SIGSIZE), hsize - 1);
+        next[j] = head[i];
+        head[i] = j;
+    }
+
+    while (nfull > 0 && pos + blksize <= oldsize) {
+        const unsigned char *p;
+        int matched = 0;
+
+        /* keep the whole window in buf */
+        if (pos + blksize > base + len) {
+            size_t keep = (base + len > pos) ? base + len - pos : 0;
+            memmove (buf, buf + (pos - base), keep);
+            base = pos;
+            len = keep;
+            if ((n = _preadn (fd, buf + len, bufsize - len, base + len)) < 0)
+                goto out;
+            len += n;
+            if (pos + blksize > base + len)
+                break;          /* file shrank under us */
+        }
+        p = buf + (pos - base);
+
+        if (rolling) {
+            a = (a - out + p[blksize - 1]) & 0xffff;
+            b = (b - (uint32_t) blksize * out + a) & 0xffff;
+        } else {
+            _weak (p, blksize, &a, &b);
+            rolling = 1;
+        }
+        w = a | (b << 16);
+
+        for (j = head[_hash (w, hsize - 1)]; j >= 0; j = next[j]) {
+            const unsigned char *sig = sigs + j * PCP_DELTA_SIGSIZE;
+            if (_get32 (sig) != w)
+                continue;
+            if (!matched)
+                _strong (p, blksize, strong);
+            matched = -1;
+            if (memcmp (strong, sig + 4, DELTA_STRONGSIZE) != 0)
+                continue;
+            if (found[j] < 0)
+                found[j] = pos;
+            matched = 1;
+        }
+
+        if (matched > 0) {
+            pos += blksize;
+            rolling = 0;
+        } else {
+            out = p[0];
+            pos++;
+        }
+    }
+
+    /* the short last block, where it was or at the end of the file */
+    if (nblocks > nfull) {
+        const unsigned char *sig = sigs + nfull * PCP_DELTA_SIGSIZE;
+        size_t tail = size - nfull * blksize;
+        _match_tail (fd, nfull * blksize, sig, tail, buf, &found[nfull]);
+        _match_tail (fd, oldsize - tail, sig, tail, buf, &found[nfull]);
+    }
+    rc = 0;
+  out:
+    free (buf);
+    free (head);
+    free (next);
+    return rc;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
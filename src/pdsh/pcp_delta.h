@@ -0,0 +1,84 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+
+#ifndef _PCP_DELTA_H
+#define _PCP_DELTA_H
+
+#include <sys/types.h>
+
+/*
+ *  Block delta for pdcp -U. The sender splits a file into blocks and
+ *   computes a signature for each: an rsync style rolling checksum and
+ *   a 128-bit hash of the block. The receiver slides a window over its
+ *   old copy of the file, rolling the checksum one byte at a time, and
+ *   looks for blocks with the same signature. Only the blocks it can't
+ *   find there are sent. Since the sender's signatures don't depend on
+ *   the receiver, they are computed once and sent to every host.
+ */
+
+/* smaller files are always sent whole */
+#define PCP_DELTA_MIN       (1024 * 1024)
+
+/* bytes of signature per block on the wire */
+#define PCP_DELTA_SIGSIZE   20
+
+/* limits on what a receiver accepts */
+#define PCP_DELTA_MAXBLOCKS (64 * 1024)
+#define PCP_DELTA_MAXBLKSIZE (1024 * 1024 * 1024)
+
+/*
+ *  Return the block size used for a file of size bytes.
+ */
+off_t pcp_delta_blocksize (off_t size);
+
+/*
+ *  Return the number of blocks, the last one possibly short, of a file
+ *   of size bytes.
+ */
+off_t pcp_delta_nblocks (off_t size, off_t blksize);
+
+/*
+ *  Compute the signatures of the blocks of the first size bytes of fd
+ *   into sigs, which must have room for PCP_DELTA_SIGSIZE bytes per
+ *   block. Returns 0, or -1 with errno set (0 if fd was too short).
+ */
+int pcp_delta_signatures (int fd, off_t size, off_t blksize,
+                          unsigned char *sigs);
+
+/*
+ *  Find the blocks of a file of size bytes, given by their signatures,
+ *   in fd, of oldsize bytes. found[i] is set to the offset in fd of
+ *   block i, or to -1 if it is not there. Returns 0, or -1 with errno
+ *   set if fd could not be read; the blocks found so far are valid.
+ */
+int pcp_delta_match (int fd, off_t oldsize, const unsigned char *sigs,
+                     off_t size, off_t blksize, off_t *found);
+
+#endif /* !_PCP_DELTA_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
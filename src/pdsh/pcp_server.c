@@ -93,9 +93,15 @@ char rcsid[] = "$Id$";
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#if HAVE_LIBZ
+# include <zlib.h>
+#endif
 
 #include "src/common/err.h"
+#include "src/common/fd.h"
+#include "src/common/macros.h"
 #include "pcp_server.h"
+#include "pcp_delta.h"
 #include "opt.h"
 
 #ifndef roundup
@@ -113,16 +119,83 @@ char rcsid[] = "$Id$";
  * - don't exit on error, just return
  */
 
+/*
+ * File data is written in pieces of up to SINK_BUFSIZ. Everything
+ *  else is read from infd through a buffer of SINK_RBUFSIZ, which
+ *  also takes in small files whole.
+ */
+#define SINK_BUFSIZ     (4 * 1024 * 1024)
+#define SINK_RBUFSIZ    (64 * 1024)
+
 typedef struct _buf {
     int	   cnt;
+    int    size;        /* allocated size of buf */
     char  *buf;
 } BUF;
 
+typedef struct _rbuf {
+    char  *buf;
+    int    pos;         /* next byte to be returned */
+    int    len;         /* number of bytes in buf */
+} RBUF;
+
+/*
+ * A chain (-H) or pipelined sender does not wait for our answer before
+ *  sending a file, so nothing may be refused: the data of a file that
+ *  cannot be written is received and dropped.
+ */
+#define NEVER_REFUSE(s)     ((s)->chain || (s)->pipelined)
+
 static int  _verifydir(struct pcp_server *s, const char *cp);
-static int  _response(struct pcp_server *s);
-static BUF *_allocbuf(struct pcp_server *s, BUF *bp, int fd, int blksize);
+static int  _ack(struct pcp_server *s);
+static int  _response(struct pcp_server *s, RBUF *rbp);
+static BUF *_allocbuf(struct pcp_server *s, BUF *bp, int fd, off_t want);
 static void _error(struct pcp_server *s, const char *fmt, ...);
-static void _sink(struct pcp_server *s, char *targ, BUF *bufp);
+static void _sink(struct pcp_server *s, char *targ, BUF *bufp, RBUF *rbp);
+static int  _sinklink(struct pcp_server *s, RBUF *rbp, int type,
+                      const char *np, off_t size);
+static int  _query(struct pcp_server *s, const char *line);
+static int  _sinkdelta(struct pcp_server *s, RBUF *rbp, BUF *bufp,
+                       const char *np, int mode, off_t size, off_t blksize);
+static int  _sinkstreams(struct pcp_server *s, RBUF *rbp, BUF *bufp,
+                         const char *np, int mode, off_t size);
+static int  _sinkrange(struct pcp_server *s, RBUF *rbp, BUF *bufp,
+                       const char *line);
+#if HAVE_LIBZ
+static int  _sinkz(struct pcp_server *s, RBUF *rbp, BUF *bp, int ofd,
+                   off_t size, off_t zlen);
+#endif
+static void _forward(struct pcp_server *s, const void *buf, size_t len);
+
+/*
+ * Remember file or directory np as written, if the caller asked for the
+ *  list. Directories are listed with a trailing '/', and an empty name
+ *  marks the end of the contents of a directory.
+ */
+static void
+_received(struct pcp_server *s, const char *np, int isdir)
+{
+    char *name;
+
+    if (!s->received || !np)
+        return;
+    if ((name = malloc(strlen(np) + 2))) {
+        (void)sprintf(name, "%s%s", np, isdir ? "/" : "");
+        list_append(s->received, name);
+    }
+}
+
+/*
+ * Answer a record. A pipelined sender is not waiting for answers,
+ *  it only gets errors.
+ */
+static int
+_ack(struct pcp_server *s)
+{
+    if (s->pipelined)
+        return 0;
+    return (write(s->outfd, "", 1) == 1) ? 0 : -1;
+}
 
 static int
 _verifydir(struct pcp_server *s, const char *cp)
@@ -138,12 +211,230 @@ _verifydir(struct pcp_server *s, const char *cp)
     return -1;
 }
 
+/*
+ * -s: sync the directory holding np, so a file renamed into it stays
+ *  there after a crash.
+ */
+static void
+_syncdir(const char *np)
+{
+    char dir[MAXPATHLEN];
+    char *cp;
+    int fd;
+
+    if (snprintf(dir, sizeof(dir), "%s", np) >= sizeof(dir))
+        return;
+    if ((cp = strrchr(dir, '/')) == NULL)
+        strcpy(dir, ".");
+    else if (cp == dir)
+        dir[1] = '\0';
+    else
+        *cp = '\0';
+    if ((fd = open(dir, O_RDONLY)) >= 0) {
+        (void)fsync(fd);
+        (void)close(fd);
+    }
+}
+
+/*
+ * Create the temporary file np.pdcpXXXXXX next to np, to write np into
+ *  and rename over it once complete. It gets the owner of an old np if
+ *  we are allowed to give it. Returns the open file, or -1.
+ */
+static int
+_mktemp(const char *np, char *tmp, size_t len)
+{
+    struct stat stb;
+    int fd;
+
+    if (snprintf(tmp, len, "%s" PCP_TMP_SUFFIX "XXXXXX", np) >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = mkstemp(tmp)) < 0)
+        return -1;
+    if (stat(np, &stb) == 0)
+        (void)fchown(fd, stb.st_uid, stb.st_gid);
+    return fd;
+}
+
+/*
+ * Give the temporary file fd its final mode, sync it to disk for -s, and
+ *  rename it to np. Returns -1 on failure.
+ */
+static int
+_commit(struct pcp_server *s, int fd, const char *tmp, const char *np,
+        int mode)
+{
+    if (fchmod(fd, mode) < 0)
+        return -1;
+    if (s->sync && fsync(fd) < 0)
+        return -1;
+    if (rename(tmp, np) < 0)
+        return -1;
+    if (s->sync)
+        _syncdir(np);
+    return 0;
+}
+
+/*
+ * Resuming: keep the first len bytes written to the temporary file fd
+ *  for np as np.pdcp-part, after the connection was lost. Returns 0 if
+ *  they were kept, -1 otherwise.
+ */
+static int
+_keeppart(int fd, const char *tmp, const char *np, off_t len)
+{
+    char part[MAXPATHLEN];
+
+    if (snprintf(part, sizeof(part), "%s" PCP_PART_SUFFIX, np)
+        >= sizeof(part))
+        return -1;
+    if (ftruncate(fd, len) < 0)
+        return -1;
+    if (strcmp(tmp, part) != 0 && rename(tmp, part) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Resuming: np was written in full, so whatever an earlier copy of it
+ *  left in np.pdcp-part is stale.
+ */
+static void
+_droppart(const char *np)
+{
+    char part[MAXPATHLEN];
+
+    if (snprintf(part, sizeof(part), "%s" PCP_PART_SUFFIX, np)
+        < sizeof(part))
+        (void)unlink(part);
+}
+
+/*
+ * Resuming: answer an 'O' record for np of size bytes with the
+ *  signatures of the whole blocks in np.pdcp-part. Returns -1 if the
+ *  answer can't be sent.
+ */
 static int
-_response(struct pcp_server *s)
+_partsigs(struct pcp_server *s, const char *np, off_t size)
+{
+    char part[MAXPATHLEN], line[64];
+    unsigned char *sigs = NULL;
+    struct stat stb;
+    off_t blksize, n = 0;
+    int fd = -1, rc = 0;
+
+    if (np && size >= PCP_DELTA_MIN
+        && snprintf(part, sizeof(part), "%s" PCP_PART_SUFFIX, np)
+           < sizeof(part)
+        && (fd = open(part, O_RDONLY|O_NOFOLLOW)) >= 0
+        && fstat(fd, &stb) == 0 && S_ISREG(stb.st_mode)) {
+        blksize = pcp_delta_blocksize(size);
+        n = MIN(stb.st_size, size) / blksize;
+        if (n > 0 && (!(sigs = malloc(n * PCP_DELTA_SIGSIZE))
+                      || pcp_delta_signatures(fd, n * blksize, blksize,
+                                              sigs) < 0))
+            n = 0;
+    }
+    if (fd >= 0)
+        (void)close(fd);
+
+    line[0] = PCP_RESUME_SIGS;
+    snprintf(line + 1, sizeof(line) - 1, "%lld\n", (long long) n);
+    if (fd_write_n(s->outfd, line, strlen(line)) < 0
+        || (n > 0 && fd_write_n(s->outfd, sigs, n * PCP_DELTA_SIGSIZE) < 0))
+        rc = -1;
+    free(sigs);
+    return rc;
+}
+
+/*
+ * Read from infd, passing anything read on to the next host of a chain.
+ */
+static ssize_t
+_read(struct pcp_server *s, void *buf, size_t len)
+{
+    ssize_t n;
+
+    do {
+        n = read(s->infd, buf, len);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        _forward(s, buf, n);
+    return n;
+}
+
+/*
+ * Read exactly len bytes, first from what is buffered in rbp. Large
+ *  reads go straight to buf, so file data is copied only once.
+ *  Returns -1 if the connection is lost.
+ */
+static int
+_readn(struct pcp_server *s, RBUF *rbp, char *buf, size_t len)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) {
+        if (rbp->pos < rbp->len) {
+            n = MIN(len - got, rbp->len - rbp->pos);
+            memcpy(buf + got, rbp->buf + rbp->pos, n);
+            rbp->pos += n;
+        } else if (len - got >= SINK_RBUFSIZ) {
+            if ((n = _read(s, buf + got, len - got)) <= 0)
+                return -1;
+        } else {
+            if ((n = _read(s, rbp->buf, SINK_RBUFSIZ)) <= 0)
+                return -1;
+            rbp->pos = 0;
+            rbp->len = n;
+            continue;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/*
+ * Read a line of up to size - 1 bytes including the newline into buf,
+ *  and NUL terminate it. Returns the length of the line, 0 on EOF
+ *  before the line, or -1 if the connection is lost within it.
+ */
+static int
+_readline(struct pcp_server *s, RBUF *rbp, char *buf, int size)
+{
+    int len = 0;
+    char *p;
+    int n;
+
+    while (len < size - 1) {
+        if (rbp->pos == rbp->len) {
+            if ((n = _read(s, rbp->buf, SINK_RBUFSIZ)) <= 0)
+                return (len == 0 && n == 0) ? 0 : -1;
+            rbp->pos = 0;
+            rbp->len = n;
+        }
+        n = MIN(size - 1 - len, rbp->len - rbp->pos);
+        if ((p = memchr(rbp->buf + rbp->pos, '\n', n)))
+            n = p - (rbp->buf + rbp->pos) + 1;
+        memcpy(buf + len, rbp->buf + rbp->pos, n);
+        rbp->pos += n;
+        len += n;
+        if (p)
+            break;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static int
+_response(struct pcp_server *s, RBUF *rbp)
 {
     char resp;
 
-    if (read(s->infd, &resp, sizeof(resp)) != sizeof(resp)) {
+    if (_readn(s, rbp, &resp, sizeof(resp)) < 0) {
         _error(s, "lost connection\n");
         return -1;
     }
@@ -160,29 +451,54 @@ _response(struct pcp_server *s)
     return 0;
 }
 
+/*
+ * Pass data read from the sender on to the next host in the chain
+ *  as soon as it arrives. If the next host goes away, keep receiving
+ *  the copy here.
+ */
+static void
+_forward(struct pcp_server *s, const void *buf, size_t len)
+{
+    if (s->fwdfd < 0 || len == 0)
+        return;
+    if (fd_write_n(s->fwdfd, (void *) buf, len) < 0) {
+        err("%p: forward to next host: %m\n");
+        s->fwdfd = -1;
+    }
+}
+
+/*
+ * Get a buffer for writing `want' bytes to fd: a multiple of the block
+ *  size of fd, large enough to take the data in one piece, up to
+ *  SINK_BUFSIZ.
+ */
 static BUF *
-_allocbuf(struct pcp_server *s, BUF *bp, int fd, int blksize)
+_allocbuf(struct pcp_server *s, BUF *bp, int fd, off_t want)
 {
     struct stat stb;
-    int size;
+    int blksize, size;
 
     if (fstat(fd, &stb) < 0) {
         _error(s, "fstat: %m\n");
         return NULL;
     }
 
-    size = roundup(stb.st_blksize, blksize);
+    blksize = (stb.st_blksize > 0) ? stb.st_blksize : BUFSIZ;
+    if (want > SINK_BUFSIZ)
+        want = SINK_BUFSIZ;
+    size = roundup(want, blksize);
     if (size == 0)
         size = blksize;
-    if (bp->cnt < size) {
+    if (bp->size < size) {
         if (bp->buf != 0)
             free(bp->buf);
         bp->buf = malloc(size);
         if (!bp->buf) {
             _error(s, "malloc: out of memory\n");
-            bp->cnt = 0;
+            bp->cnt = bp->size = 0;
             return NULL;
         }
+        bp->size = size;
     }
     bp->cnt = size;
     return(bp);
@@ -196,6 +512,20 @@ _error(struct pcp_server *s, const char *fmt, ...)
     va_list ap;
     int save_errno = errno;   /* errno could be changed by fopen */
 
+    /*
+     *  The sender of a chain copy is sending to the hosts after us as
+     *   well, so it must not be told to skip anything. Report errors on
+     *   stderr instead, which is passed back up the chain.
+     */
+    if (s->chain) {
+        snprintf(newfmt, 1000, "%%p: %s", fmt);
+        va_start(ap, fmt);
+        errno = save_errno;
+        errf(stderr, newfmt, ap);
+        va_end(ap);
+        return;
+    }
+
     if (!(fp = fdopen(s->outfd, "w")))
         return;
 
@@ -210,19 +540,484 @@ _error(struct pcp_server *s, const char *fmt, ...)
     fflush(fp);
 }
 
+/*
+ * Archive mode: read the target of link record `type' and create the
+ *  symbolic or hard link np, replacing any file there. Returns 1 if
+ *  the link was created, -1 if the connection is lost, 0 otherwise.
+ */
+static int
+_sinklink(struct pcp_server *s, RBUF *rbp, int type, const char *np,
+          off_t size)
+{
+    char target[MAXPATHLEN], path[MAXPATHLEN];
+    struct stat stb;
+    int rc;
+
+    if (size >= MAXPATHLEN) {
+        _error(s, "protocol screwup: link target too long\n");
+        return -1;
+    }
+    if (_readn(s, rbp, target, size) < 0) {
+        _error(s, "lost connection\n");
+        return -1;
+    }
+    target[size] = '\0';
+    if (_response(s, rbp) < 0)
+        return -1;
+    if (!np)
+        return 0;
+
+    if (lstat(np, &stb) == 0) {
+        if (S_ISDIR(stb.st_mode)) {
+            errno = EISDIR;
+            _error(s, "%s: %m\n", np);
+            return 0;
+        }
+        (void)unlink(np);
+    }
+    if (type == 'L')
+        rc = symlink(target, np);
+    else {
+        if (snprintf(path, sizeof(path), "%s/%s", s->outfile, target)
+            >= sizeof(path)) {
+            errno = ENAMETOOLONG;
+            rc = -1;
+        } else
+            rc = link(path, np);
+    }
+    if (rc < 0) {
+        _error(s, "%s: %m\n", np);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Update mode: answer "Q<mode> <size> <mtime> <path>" with PCP_UNCHANGED
+ *  if the file is there with that size and mtime, and mode if we are
+ *  preserving modes, or with PCP_DIFFERENT if a delta can be applied to
+ *  it. Everything is sent to a host that passes the copy on to others.
+ *  Returns -1 on a bad record or write error.
+ */
+static int
+_query(struct pcp_server *s, const char *line)
+{
+    char path[MAXPATHLEN];
+    struct stat stb;
+    unsigned int mode;
+    long long size;
+    long mtime;
+    char ans = PCP_CHANGED;
+    int n = 0;
+
+    if (sscanf(line, "Q%o %lld %ld %n", &mode, &size, &mtime, &n) < 3
+        || n == 0)
+        return -1;
+
+    if (!s->chain && !s->received) {
+        if (stat(s->outfile, &stb) == 0 && S_ISDIR(stb.st_mode))
+            n = snprintf(path, sizeof(path), "%s/%s", s->outfile, line + n);
+        else
+            n = snprintf(path, sizeof(path), "%s", s->outfile);
+        if (n < sizeof(path) && stat(path, &stb) == 0
+            && S_ISREG(stb.st_mode)) {
+            if (stb.st_size == size && stb.st_mtime == mtime
+                && (!s->preserve || (stb.st_mode & 07777) == mode))
+                ans = PCP_UNCHANGED;
+            else if (s->delta && stb.st_size > 0)
+                ans = PCP_DIFFERENT;
+        }
+    }
+    return (write(s->outfd, &ans, 1) == 1) ? 0 : -1;
+}
+
+/*
+ * Block delta: receive np as the signatures of its blocks, answer with
+ *  the blocks that are not in the old np, and build the new file from
+ *  those and the rest of the old one in a temporary file, which then
+ *  replaces np. If np is NULL or can't be written the data is still
+ *  read. Returns -1 if the connection is lost, 1 on an error that was
+ *  reported, 0 if np was written.
+ */
+static int
+_sinkdelta(struct pcp_server *s, RBUF *rbp, BUF *bufp, const char *np,
+           int mode, off_t size, off_t blksize)
+{
+    off_t nblocks, i, off, len, done;
+    unsigned char *sigs = NULL, *need = NULL;
+    off_t *found = NULL;
+    char tmp[MAXPATHLEN];
+    int oldfd = -1, tmpfd = -1, werr = 0, result = -1;
+    struct stat stb;
+    BUF *bp;
+    char ch;
+    int amt;
+
+    if (size < 0 || blksize <= 0 || blksize > PCP_DELTA_MAXBLKSIZE
+        || (nblocks = pcp_delta_nblocks(size, blksize)) > PCP_DELTA_MAXBLOCKS) {
+        _error(s, "protocol screwup: bad block size\n");
+        return -1;
+    }
+    if (!(sigs = malloc(nblocks * PCP_DELTA_SIGSIZE + 1))
+        || !(need = calloc((nblocks + 7) / 8 + 1, 1))
+        || !(found = malloc((nblocks + 1) * sizeof(off_t)))) {
+        _error(s, "out of memory\n");
+        goto out;
+    }
+    if (_readn(s, rbp, (char *) sigs, nblocks * PCP_DELTA_SIGSIZE) < 0) {
+        _error(s, "lost connection\n");
+        goto out;
+    }
+
+    for (i = 0; i < nblocks; i++)
+        found[i] = -1;
+    if (np && (oldfd = open(np, O_RDONLY)) >= 0
+        && fstat(oldfd, &stb) == 0 && S_ISREG(stb.st_mode))
+        (void) pcp_delta_match(oldfd, stb.st_size, sigs, size, blksize, found);
+    for (i = 0; i < nblocks; i++) {
+        if (found[i] < 0)
+            need[i / 8] |= 1 << (i % 8);
+    }
+    ch = PCP_DELTA_NEED;
+    if (write(s->outfd, &ch, 1) != 1
+        || fd_write_n(s->outfd, need, (nblocks + 7) / 8) < 0) {
+        _error(s, "write failed\n");
+        goto out;
+    }
+
+    result = 1;
+    if (np && (tmpfd = _mktemp(np, tmp, sizeof(tmp))) < 0)
+        _error(s, "%s: %m\n", np);
+    if ((bp = _allocbuf(s, bufp, tmpfd >= 0 ? tmpfd : s->infd,
+                        blksize)) == NULL) {
+        result = -1;
+        goto out;
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        off = i * blksize;
+        len = MIN(blksize, size - off);
+        for (done = 0; done < len; done += amt) {
+            amt = MIN(bp->cnt, len - done);
+            if (found[i] < 0) {
+                if (_readn(s, rbp, bp->buf, amt) < 0) {
+                    _error(s, "lost connection\n");
+                    result = -1;
+                    goto out;
+                }
+            } else if (tmpfd < 0 || werr)
+                continue;
+            else if (pread(oldfd, bp->buf, amt, found[i] + done) != amt) {
+                werr = 1;
+                continue;
+            }
+            if (tmpfd >= 0 && !werr
+                && pwrite(tmpfd, bp->buf, amt, off + done) != amt)
+                werr = 1;
+        }
+    }
+    if (_response(s, rbp) < 0) {
+        result = -1;
+        goto out;
+    }
+
+    if (tmpfd >= 0) {
+        if (werr || ftruncate(tmpfd, size) < 0
+            || _commit(s, tmpfd, tmp, np, mode) < 0)
+            _error(s, "%s: %m\n", np);
+        else
+            result = 0;
+    }
+  out:
+    if (tmpfd >= 0) {
+        (void)close(tmpfd);
+        if (result != 0)
+            (void)unlink(tmp);
+    }
+    if (oldfd >= 0)
+        (void)close(oldfd);
+    free(sigs);
+    free(need);
+    free(found);
+    return result;
+}
+
+/*
+ * Multiple streams: create a temporary file for np of size bytes and
+ *  tell the client its path. Then write the segments of data that
+ *  follow, while other connections write the rest, and rename it to np
+ *  at the end. Returns -1 if the connection is lost, 1 on an error that
+ *  was reported, 0 if np was written.
+ */
+static int
+_sinkstreams(struct pcp_server *s, RBUF *rbp, BUF *bufp, const char *np,
+             int mode, off_t size)
+{
+    char tmp[MAXPATHLEN], seg[64];
+    long long off, len;
+    off_t i;
+    int fd = -1, werr = 0, result = 1;
+    BUF *bp;
+    char ch;
+    int amt;
+
+    if (np) {
+        if ((fd = _mktemp(np, tmp, sizeof(tmp))) >= 0
+            && ftruncate(fd, size) < 0) {
+            (void)close(fd);
+            (void)unlink(tmp);
+            fd = -1;
+        }
+        if (fd < 0)
+            _error(s, "%s: %m\n", np);
+    }
+    if (fd < 0)
+        tmp[0] = '\0';
+
+    /* an empty path tells the client no data is to follow */
+    ch = PCP_STREAMS_FILE;
+    if (write(s->outfd, &ch, 1) != 1
+        || fd_write_n(s->outfd, tmp, strlen(tmp)) < 0
+        || write(s->outfd, "\n", 1) != 1) {
+        result = -1;
+        goto out;
+    }
+    if (fd < 0)
+        return 1;
+
+    if ((bp = _allocbuf(s, bufp, fd, SINK_BUFSIZ)) == NULL) {
+        result = -1;
+        goto out;
+    }
+    while (1) {
+        if (_readline(s, rbp, seg, sizeof(seg)) <= 0) {
+            _error(s, "lost connection\n");
+            result = -1;
+            goto out;
+        }
+        if (sscanf(seg, "%lld %lld", &off, &len) != 2 || off < 0 || len < 0
+            || off + len > size) {
+            _error(s, "protocol screwup: bad segment\n");
+            result = -1;
+            goto out;
+        }
+        if (len == 0)
+            break;
+        for (i = 0; i < len; i += amt) {
+            amt = MIN(bp->cnt, len - i);
+            if (_readn(s, rbp, bp->buf, amt) < 0) {
+                _error(s, "lost connection\n");
+                result = -1;
+                goto out;
+            }
+            if (!werr && pwrite(fd, bp->buf, amt, off + i) != amt)
+                werr = 1;
+        }
+    }
+    if (_response(s, rbp) < 0) {
+        result = -1;
+        goto out;
+    }
+
+    if (werr || _commit(s, fd, tmp, np, mode) < 0)
+        _error(s, "%s: %m\n", np);
+    else
+        result = 0;
+  out:
+    if (fd >= 0) {
+        (void)close(fd);
+        if (result != 0)
+            (void)unlink(tmp);
+    }
+    return result;
+}
+
+/*
+ * Multiple streams: open path for a 'W' record, which must be a file
+ *  _sinkstreams() created for a 'P' record: a new temporary file named
+ *  after a file in the target. Returns -1 with errno set if it is not.
+ */
+static int
+_rangefile(struct pcp_server *s, const char *path)
+{
+    static const char tmpchars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    size_t olen = strlen(s->outfile), slen = strlen(PCP_TMP_SUFFIX);
+    const char *base, *cp;
+    struct stat stb;
+    int fd;
+
+    /* <outfile>.pdcpXXXXXX, or <outfile>/<dir>/.../<name>.pdcpXXXXXX */
+    if (strncmp(path, s->outfile, olen) != 0)
+        goto bad;
+    if (path[olen] == '/') {
+        for (cp = path + olen; cp; cp = strchr(cp + 1, '/'))
+            if (strncmp(cp, "/..", 3) == 0 && (cp[3] == '/' || cp[3] == '\0'))
+                goto bad;
+    } else if (strlen(path + olen) != slen + 6)
+        goto bad;
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if (strlen(base) <= slen + 6
+        || strncmp(base + strlen(base) - slen - 6, PCP_TMP_SUFFIX, slen) != 0
+        || strspn(base + strlen(base) - 6, tmpchars) != 6)
+        goto bad;
+
+    if ((fd = open(path, O_WRONLY|O_NOFOLLOW)) < 0)
+        return -1;
+    if (fstat(fd, &stb) < 0 || !S_ISREG(stb.st_mode) || stb.st_nlink != 1
+        || (stb.st_mode & 07777) != 0600) {
+        (void)close(fd);
+        goto bad;
+    }
+    return fd;
+bad:
+    errno = EPERM;
+    return -1;
+}
+
+/*
+ * Multiple streams: write "W<offset> <len> <path>" and the data that
+ *  follows into the temporary file created for a 'P' record on another
+ *  connection, and answer once it is written. Returns -1 if the
+ *  connection is lost or the record is bad.
+ */
+static int
+_sinkrange(struct pcp_server *s, RBUF *rbp, BUF *bufp, const char *line)
+{
+    const char *path;
+    long long off, len;
+    off_t i;
+    int fd, werr = 0;
+    int amt, n = 0;
+    BUF *bp;
+
+    if (sscanf(line, "W%lld %lld %n", &off, &len, &n) < 2 || n == 0
+        || off < 0 || len < 0) {
+        _error(s, "protocol screwup: bad range\n");
+        return -1;
+    }
+    path = line + n;
+
+    if ((fd = _rangefile(s, path)) < 0)
+        _error(s, "%s: %m\n", path);
+
+    if ((bp = _allocbuf(s, bufp, fd >= 0 ? fd : s->infd, len)) == NULL) {
+        if (fd >= 0)
+            (void)close(fd);
+        return -1;
+    }
+    for (i = 0; i < len; i += amt) {
+        amt = MIN(bp->cnt, len - i);
+        if (_readn(s, rbp, bp->buf, amt) < 0) {
+            _error(s, "lost connection\n");
+            if (fd >= 0)
+                (void)close(fd);
+            return -1;
+        }
+        if (fd >= 0 && !werr && pwrite(fd, bp->buf, amt, off + i) != amt)
+            werr = 1;
+    }
+    if (fd >= 0)
+        (void)close(fd);
+    if (_response(s, rbp) < 0)
+        return -1;
+    if (werr)
+        _error(s, "%s: %m\n", path);
+    else if (fd >= 0 && _ack(s) < 0)
+        return -1;
+    return 0;
+}
+
+#if HAVE_LIBZ
+/*
+ * Compression: inflate the zlen byte zlib stream that follows a 'Z'
+ *  record into ofd (if >= 0), where it must make size bytes. Returns -1
+ *  if the connection is lost, 1 if writing ofd failed, 2 if the data
+ *  was bad (already reported), 0 otherwise.
+ */
+static int
+_sinkz(struct pcp_server *s, RBUF *rbp, BUF *bp, int ofd, off_t size,
+       off_t zlen)
+{
+    z_stream zs;
+    off_t out = 0;
+    int rc = Z_OK, result = 0;
+    int inflating = 0, initialized = 0;
+    ssize_t n;
+    int have;
+
+    memset(&zs, 0, sizeof(zs));
+    if (ofd >= 0) {
+        if (inflateInit(&zs) == Z_OK)
+            inflating = initialized = 1;
+        else {
+            _error(s, "inflateInit failed\n");
+            result = 2;
+        }
+    }
+
+    /* read all of the stream even if it can't be used */
+    while (zlen > 0) {
+        if (rbp->pos == rbp->len) {
+            if ((n = _read(s, rbp->buf, SINK_RBUFSIZ)) <= 0) {
+                _error(s, "lost connection\n");
+                result = -1;
+                break;
+            }
+            rbp->pos = 0;
+            rbp->len = n;
+        }
+        n = MIN(zlen, rbp->len - rbp->pos);
+        zs.next_in = (Bytef *) rbp->buf + rbp->pos;
+        zs.avail_in = n;
+        while (inflating) {
+            zs.next_out = (Bytef *) bp->buf;
+            zs.avail_out = bp->cnt;
+            rc = inflate(&zs, Z_NO_FLUSH);
+            if ((rc != Z_OK) && (rc != Z_STREAM_END) && (rc != Z_BUF_ERROR)) {
+                inflating = 0;
+                break;
+            }
+            have = bp->cnt - zs.avail_out;
+            out += have;
+            if (have > 0 && result == 0
+                && fd_write_n(ofd, bp->buf, have) != have)
+                result = 1;
+            if ((rc == Z_STREAM_END) || (zs.avail_out > 0))
+                break;
+        }
+        if (rc == Z_STREAM_END)
+            inflating = 0;
+        rbp->pos += n;
+        zlen -= n;
+    }
+
+    if (initialized)
+        (void)inflateEnd(&zs);
+    if (ofd >= 0 && result == 0 && ((rc != Z_STREAM_END) || (out != size))) {
+        _error(s, "bad compressed data\n");
+        result = 2;
+    }
+    return result;
+}
+#endif
+
 static void
-_sink(struct pcp_server *svr, char *targ, BUF *bufp) {
+_sink(struct pcp_server *svr, char *targ, BUF *bufp, RBUF *rbp) {
     register char *cp;
     struct stat stb;
     struct timeval tv[2];
     enum { YES, NO, DISPLAYED } wrerr;
     BUF *bp;
-    off_t i, j, size;
+    off_t i, size, zlen, blksize, offset;
     char ch;
     const char *why = "failed to set 'why' string";
-    int amt, count, exists, mask, mode;
-    int ofd, setimes, targisdir, cursize = 0;
+    int amt, exists, mask, mode, fmode, n;
+    int ofd = -1, setimes, targisdir, cursize = 0;
     char *np, *buf = NULL, *namebuf = NULL;
+    char seg[64], tmp[MAXPATHLEN];
 
 #define	atime	tv[0]
 #define	mtime	tv[1]
@@ -234,52 +1029,117 @@ _sink(struct pcp_server *svr, char *targ, BUF *bufp) {
     }
 
     setimes = targisdir = 0;
+    tmp[0] = '\0';
     mask = umask(0);
     if (!svr->preserve)
         (void)umask(mask);
 
-    if (svr->target_is_dir) {
-        if (_verifydir(svr, svr->outfile) < 0)
+    if (svr->target_is_dir && targ && _verifydir(svr, svr->outfile) < 0) {
+        if (!NEVER_REFUSE(svr))
             return;
+        targ = NULL;            /* receive for the rest of the chain only */
     }
 
-    if (write(svr->outfd, "", 1) != 1)
+    if (_ack(svr) < 0)
         SCREWUP("write failed");
-    if (stat(targ, &stb) == 0 && (stb.st_mode & S_IFMT) == S_IFDIR)
+    if (targ && stat(targ, &stb) == 0 && (stb.st_mode & S_IFMT) == S_IFDIR)
         targisdir = 1;
 
     while (1) {
-		int rc;
-        cp = buf;
-        if ((rc = read(svr->infd, cp, 1)) <= 0)
+        if ((n = _readline(svr, rbp, buf, BUFSIZ)) == 0)
             goto end_server;
-        if (*cp++ == '\n')
+        if (buf[0] == '\n')
             SCREWUP("unexpected <newline>");
-
-        do {
-            if (read(svr->infd, &ch, sizeof(ch)) != sizeof(ch))
-                SCREWUP("lost connection");
-            *cp++ = ch;
-        } while (cp < &buf[BUFSIZ - 1] && ch != '\n');
-        *cp = 0;
+        if (n < 0)
+            SCREWUP("lost connection");
+        cp = buf + n;
+        ch = cp[-1];
 
         if (buf[0] == '\01' || buf[0] == '\02') {
             if (buf[0] == '\02')
                 goto end_server;
+            if (strcmp(buf, PCP_PIPELINE_PROBE) == 0 && !svr->pipelined
+                && !svr->ranges) {
+                ch = PCP_PIPELINE_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+                svr->pipelined = true;
+            }
+            if (strcmp(buf, PCP_UPDATE_PROBE) == 0 && svr->pipelined) {
+                ch = PCP_UPDATE_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+            }
+            /* a delta can't be passed on to other hosts */
+            if (strcmp(buf, PCP_DELTA_PROBE) == 0 && svr->pipelined
+                && !svr->chain && !svr->received) {
+                ch = PCP_DELTA_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+                svr->delta = true;
+            }
+            if (strcmp(buf, PCP_STREAMS_PROBE) == 0 && svr->pipelined
+                && !svr->chain && !svr->received) {
+                ch = PCP_STREAMS_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+                svr->streams = true;
+            }
+            /* -n: another connection for the ranges of 'P' records */
+            if (strcmp(buf, PCP_RANGES_PROBE) == 0 && !svr->pipelined
+                && !svr->chain && !svr->received) {
+                ch = PCP_RANGES_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+                svr->ranges = true;
+            }
+            /* a partly sent file is only kept by the host it was for */
+            if (strcmp(buf, PCP_RESUME_PROBE) == 0 && svr->pipelined
+                && !svr->chain && !svr->received) {
+                ch = PCP_RESUME_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+                svr->resume = true;
+            }
+#if HAVE_LIBZ
+            if (strcmp(buf, PCP_ZLIB_PROBE) == 0 && svr->pipelined) {
+                ch = PCP_ZLIB_ACK;
+                if (write(svr->outfd, &ch, 1) != 1)
+                    SCREWUP("write failed");
+            }
+#endif
             continue;
         }
 
         if (buf[0] == 'E') {
-            if (write(svr->outfd, "", 1) != 1)
+            if (_ack(svr) < 0)
                 SCREWUP("write failed");
             goto end_server;
         }
 
+        if (buf[0] == 'S') {    /* all records so far are done */
+            if (write(svr->outfd, "", 1) != 1)
+                SCREWUP("write failed");
+            continue;
+        }
+
         if (ch == '\n')
             *--cp = 0;
 
 #define getnum(t) (t) = 0; while (isdigit(*cp)) (t) = (t) * 10 + (*cp++ - '0');
         cp = buf;
+        if (*cp == 'Q' && svr->pipelined) {
+            if (_query(svr, buf) < 0)
+                SCREWUP("bad query or write failed");
+            continue;
+        }
+        if (svr->ranges) {
+            if (*cp != 'W')
+                SCREWUP("expected range record");
+            if (_sinkrange(svr, rbp, bufp, buf) < 0)
+                goto end_server;
+            continue;
+        }
         if (*cp == 'T') {
             setimes++;
             cp++;
@@ -295,11 +1155,19 @@ _sink(struct pcp_server *svr, char *targ, BUF *bufp) {
             getnum(atime.tv_usec);
             if (*cp++ != '\0')
                 SCREWUP("atime.usec not delimited");
-            if (write(svr->outfd, "", 1) != 1)
+            if (_ack(svr) < 0)
                 SCREWUP("write failed");
             continue;
         }
-        if (*cp != 'C' && *cp != 'D')
+        if (*cp != 'C' && *cp != 'D'
+            && !(svr->pipelined && (*cp == 'L' || *cp == 'H' || *cp == 'R'))
+            && !(svr->delta && *cp == 'B')
+            && !(svr->streams && *cp == 'P')
+            && !(svr->resume && (*cp == 'O' || *cp == 'A'))
+#if HAVE_LIBZ
+            && !(svr->pipelined && *cp == 'Z')
+#endif
+           )
             SCREWUP("expected control record");
 
         mode = 0;
@@ -315,6 +1183,26 @@ _sink(struct pcp_server *svr, char *targ, BUF *bufp) {
             size = size * 10 + (*cp++ - '0');
         if (*cp++ != ' ')
             SCREWUP("size not delimited");
+        zlen = 0;
+        if (buf[0] == 'Z') {
+            getnum(zlen);
+            if (*cp++ != ' ')
+                SCREWUP("compressed size not delimited");
+        }
+        blksize = 0;
+        if (buf[0] == 'B') {
+            getnum(blksize);
+            if (*cp++ != ' ')
+                SCREWUP("block size not delimited");
+        }
+        offset = 0;
+        if (buf[0] == 'A') {
+            getnum(offset);
+            if (*cp++ != ' ')
+                SCREWUP("offset not delimited");
+            if (offset > size)
+                SCREWUP("offset beyond end of file");
+        }
 
         /* filename is "retrieved" in this if/else block */
         if (targisdir) {
@@ -354,9 +1242,55 @@ _sink(struct pcp_server *svr, char *targ, BUF *bufp) {
         else
             np = targ;
 
-        exists = stat(np, &stb) == 0;
+        if (buf[0] == 'O') {
+            if (_partsigs(svr, np, size) < 0)
+                SCREWUP("write failed");
+            continue;
+        }
+
+        if (buf[0] == 'L' || buf[0] == 'H') {
+            setimes = 0;
+            if ((n = _sinklink(svr, rbp, buf[0], np, size)) < 0)
+                goto end_server;
+            if (n > 0) {
+                _droppart(np);
+                _received(svr, np, 0);
+            }
+            continue;
+        }
+
+        /*
+         * Files are written to a temporary file and renamed into place,
+         * so they get the mode an old np has (unless -p) and the mode
+         * open() would have given a new one.
+         */
+        exists = np && stat(np, &stb) == 0;
+        if (exists && !svr->preserve)
+            fmode = stb.st_mode & 07777;
+        else
+            fmode = svr->preserve ? mode : (mode & ~mask);
+
+        if (buf[0] == 'B' || buf[0] == 'P') {
+            if (buf[0] == 'B')
+                n = _sinkdelta(svr, rbp, bufp, np, fmode, size, blksize);
+            else
+                n = _sinkstreams(svr, rbp, bufp, np, fmode, size);
+            if (n < 0)
+                goto end_server;
+            if (n == 0 && setimes && utimes(np, tv) < 0)
+                _error(svr, "can't set times on %s: %m\n", np);
+            if (n == 0) {
+                _droppart(np);
+                _received(svr, np, 0);
+            }
+            setimes = 0;
+            continue;
+        }
+
         if (buf[0] == 'D') {
-            if (exists) {
+            if (!np)
+                ;               /* in a directory we could not create */
+            else if (exists) {
                 if ((stb.st_mode & S_IFMT) != S_IFDIR) {
                     errno = ENOTDIR;
                     goto bad;
@@ -365,89 +1299,195 @@ _sink(struct pcp_server *svr, char *targ, BUF *bufp) {
                     (void)chmod(np, mode);
             } else if (mkdir(np, mode) < 0)
                 goto bad;
+            _received(svr, np, 1);
 
             /* recursively go down a directory */
-            _sink(svr, np, bufp);
+            _sink(svr, np, bufp, rbp);
+            if (np)
+                _received(svr, "", 0);
 
             if (setimes) {
                 setimes = 0;
-                if (utimes(np, tv) < 0)
+                if (np && utimes(np, tv) < 0)
                     _error(svr, "can't set times on %s: %m\n", np);
             }
             continue;
         }
 
-        if ((ofd = open(np, O_WRONLY|O_CREAT, mode)) < 0) {
+        /*
+         * Symlinks, devices and the like, and files in directories we
+         * can't create files in, are written in place.
+         */
+        ofd = -1;
+        if (!np)
+            ;
+        else if (buf[0] == 'A') {
+            /* resuming: go on writing the part kept from before */
+            if (snprintf(tmp, sizeof(tmp), "%s" PCP_PART_SUFFIX, np)
+                >= sizeof(tmp))
+                errno = ENAMETOOLONG;
+            else if ((ofd = open(tmp, O_WRONLY|O_NOFOLLOW)) >= 0
+                     && (fstat(ofd, &stb) < 0 || stb.st_size < offset
+                         || lseek(ofd, offset, SEEK_SET) < 0)) {
+                (void)close(ofd);
+                ofd = -1;
+                errno = ENOENT;
+            }
+        } else if (!exists || (lstat(np, &stb) == 0 && S_ISREG(stb.st_mode)))
+            ofd = _mktemp(np, tmp, sizeof(tmp));
+        if (ofd < 0)
+            tmp[0] = '\0';
+        if (!np)
+            ;
+        else if (ofd < 0 && (buf[0] == 'A'
+                             || (ofd = open(np, O_WRONLY|O_CREAT, mode)) < 0)) {
 bad:	
             _error(svr, "%s: %m\n", np);
-            continue;
+            if (!NEVER_REFUSE(svr))
+                continue;
+            /*
+             *  The sender is sending this file or directory regardless
+             *   (to us, or to hosts further down the chain), so receive
+             *   it anyway and drop it here.
+             */
+            if (buf[0] == 'D') {
+                _sink(svr, NULL, bufp, rbp);
+                continue;
+            }
+            ofd = -1;
         }
-        if (exists && svr->preserve)
+        if (ofd >= 0 && !tmp[0] && exists && svr->preserve)
             (void)fchmod(ofd, mode);
+#if HAVE_POSIX_FALLOCATE
+        /* allocate the whole file at once, it is written sequentially */
+        if (ofd >= 0 && size > offset && buf[0] != 'R')
+            (void)posix_fallocate(ofd, offset, size - offset);
+#endif
 
-        if (write(svr->outfd, "", 1) != 1)
+        if (_ack(svr) < 0)
             _error(svr, "failed to write to outfd: %m\n");
-        if ((bp = _allocbuf(svr, bufp, ofd, BUFSIZ)) == NULL) {
-            (void)close(ofd);
+        if ((bp = _allocbuf(svr, bufp, ofd >= 0 ? ofd : svr->infd,
+                            size)) == NULL) {
+            if (ofd >= 0)
+                (void)close(ofd);
+            ofd = -1;
+            if (tmp[0])
+                (void)unlink(tmp);
+            tmp[0] = '\0';
             continue;
         }
-        cp = bp->buf;
-        count = 0;
-        wrerr = NO;
-        for (i = 0; i < size; i += BUFSIZ) {
-            amt = BUFSIZ;
-            if (i + amt > size)
-                amt = size - i;
-            count += amt;
-            do {
-                j = read(svr->infd, cp, amt);
-                if (j <= 0) {
-                    _error(svr, "%m\n");
+        wrerr = (ofd >= 0) ? NO : DISPLAYED;
+        if (buf[0] == 'R') {
+            off_t off, len;
+
+            /* sparse file: write the segments with data, leave holes */
+            if (wrerr == NO && ftruncate(ofd, 0) < 0)
+                wrerr = YES;
+            while (1) {
+                if (_readline(svr, rbp, seg, sizeof(seg)) <= 0) {
+                    _error(svr, "lost connection\n");
+                    goto end_server;
+                }
+                cp = seg;
+                getnum(off);
+                if (*cp++ != ' ')
+                    SCREWUP("segment offset not delimited");
+                getnum(len);
+                if (*cp != '\n')
+                    SCREWUP("segment length not delimited");
+                if (len == 0)
+                    break;
+                if (off + len > size)
+                    SCREWUP("segment beyond end of file");
+                for (i = 0; i < len; i += amt) {
+                    amt = bp->cnt;
+                    if (i + amt > len)
+                        amt = len - i;
+                    if (_readn(svr, rbp, bp->buf, amt) < 0) {
+                        _error(svr, "lost connection\n");
+                        goto end_server;
+                    }
+                    if (wrerr == NO
+                        && pwrite(ofd, bp->buf, amt, off + i) != amt)
+                        wrerr = YES;
+                }
+            }
+#if HAVE_LIBZ
+        } else if (buf[0] == 'Z') {
+            if ((n = _sinkz(svr, rbp, bp, ofd, size, zlen)) < 0)
+                goto end_server;
+            if (n > 0 && wrerr == NO)
+                wrerr = (n == 1) ? YES : DISPLAYED;
+#endif
+        } else {
+            for (i = offset; i < size; i += amt) {
+                amt = bp->cnt;
+                if (i + amt > size)
+                    amt = size - i;
+                if (_readn(svr, rbp, bp->buf, amt) < 0) {
+                    _error(svr, "lost connection\n");
+                    /* keep a large file's data for a retry to resume */
+                    if (tmp[0] && wrerr == NO && size >= PCP_DELTA_MIN
+                        && _keeppart(ofd, tmp, np, i) == 0)
+                        tmp[0] = '\0';
                     goto end_server;
                 }
-                amt -= j;
-                cp += j;
-            } while (amt > 0);
-            if (count == bp->cnt) {
-                if (wrerr == NO && write(ofd, bp->buf, count) != count)
+                if (wrerr == NO && fd_write_n(ofd, bp->buf, amt) != amt)
                     wrerr = YES;
-                count = 0;
-                cp = bp->buf;
             }
         }
-        if (count != 0 && wrerr == NO && write(ofd, bp->buf, count) != count)
-            wrerr = YES;
-        if (ftruncate(ofd, size)) {
+        if (ofd >= 0 && wrerr == NO && ftruncate(ofd, size)) {
             _error(svr, "can't truncate %s: %m\n", np);
             wrerr = DISPLAYED;
         }
-        (void)close(ofd);
-        if (_response(svr) < 0)
+        if (_response(svr, rbp) < 0)
             goto end_server;
         if (setimes && wrerr == NO) {
             setimes = 0;
-            if (utimes(np, tv) < 0) {
+            if (utimes(tmp[0] ? tmp : np, tv) < 0) {
                 _error(svr, "can't set times on %s: %m\n", np);
                 wrerr = DISPLAYED;
             }
         }
+        if (ofd >= 0) {
+            if (wrerr == NO && (tmp[0] ? _commit(svr, ofd, tmp, np, fmode) < 0
+                                : (svr->sync && fsync(ofd) < 0))) {
+                _error(svr, "%s: %m\n", np);
+                wrerr = DISPLAYED;
+            }
+            (void)close(ofd);
+            ofd = -1;
+            if (tmp[0] && wrerr != NO)
+                (void)unlink(tmp);
+            tmp[0] = '\0';
+        }
         switch(wrerr) {
             case YES:
                 _error(svr, "%s: %m\n", np);
                 break;
             case NO:
-                if (write(svr->outfd, "", 1) != 1)
+                if (_ack(svr) < 0)
                     _error(svr, "write failed to outfd: %m\n");
+                _droppart(np);
+                _received(svr, np, 0);
                 break;
             case DISPLAYED:
                 break;
         }
+        /* errors went to stderr, the sender still expects an answer */
+        if (svr->chain && wrerr != NO && _ack(svr) < 0)
+            _error(svr, "write failed to outfd: %m\n");
     }
 
 screwup:
     _error(svr, "protocol screwup: %s\n", why);
 
 end_server:
+    /* don't leave a partly written file behind */
+    if (tmp[0])
+        (void)unlink(tmp);
+    if (ofd >= 0)
+        (void)close(ofd);
     if (buf)
         free(buf);
     if (namebuf)
@@ -458,12 +1498,25 @@ end_server:
 int pcp_server(struct pcp_server *svr)
 {
 	BUF buffer;
+	RBUF rbuffer;
 	memset (&buffer, 0, sizeof (buffer));
+	memset (&rbuffer, 0, sizeof (rbuffer));
+	svr->pipelined = false;
+	svr->delta = false;
+	svr->streams = false;
+	svr->ranges = false;
+	svr->resume = false;
+
+	if (!(rbuffer.buf = malloc (SINK_RBUFSIZ))) {
+		_error (svr, "out of memory for buf: %m\n");
+		return -1;
+	}
 
     /* If reverse copy, outfile is always a directory. */
-    _sink (svr, svr->outfile, &buffer);
+    _sink (svr, svr->outfile, &buffer, &rbuffer);
 
 	if (buffer.buf)
 		free (buffer.buf);
+	free (rbuffer.buf);
     return 0;
 }
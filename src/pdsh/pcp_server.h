@@ -33,12 +33,116 @@
 
 #include "src/pdsh/opt.h"
 
+#include "src/common/list.h"
+
+/*
+ * Pipelined protocol: a client that sends PCP_PIPELINE_PROBE before its
+ *  first record, and gets PCP_PIPELINE_ACK in place of the answer to
+ *  that record, sends all further records and file data without waiting
+ *  for answers. The server then only sends errors, and a 0 in answer to
+ *  PCP_SYNC_FLAG. Older servers ignore the probe.
+ */
+#define PCP_PIPELINE_PROBE  "\01pipeline\n"
+#define PCP_PIPELINE_ACK    '\02'
+#define PCP_SYNC_FLAG       "S\n"
+
+/*
+ * Archive mode (-D) records, sent to pipelined servers only:
+ *  "L<mode> <len> <name>\n" and "H<mode> <len> <name>\n" followed by
+ *  len bytes of target and a NUL byte create a symbolic link, or a hard
+ *  link to an earlier file given by its path from the target directory.
+ *  "R<mode> <size> <name>\n" is a sparse file, sent as any number of
+ *  "<offset> <len>\n" and len bytes of data, then "<size> 0\n" and a NUL.
+ */
+
+/*
+ * Compression (-G): a pipelined client sends PCP_ZLIB_PROBE and then
+ *  PCP_SYNC_FLAG. A server built with zlib answers PCP_ZLIB_ACK before
+ *  the 0, and then takes "Z<mode> <size> <zlen> <name>\n" followed by
+ *  the file data as a zlen byte zlib stream and a NUL.
+ */
+#define PCP_ZLIB_PROBE      "\01zlib\n"
+#define PCP_ZLIB_ACK        '\03'
+
+/*
+ * Update mode (-U): after PCP_UPDATE_PROBE is answered the same way with
+ *  PCP_UPDATE_ACK, "Q<mode> <size> <mtime> <path>\n" asks whether the
+ *  file at path from the target directory is already there. The server
+ *  answers each at once with PCP_UNCHANGED or PCP_CHANGED.
+ */
+#define PCP_UPDATE_PROBE    "\01update\n"
+#define PCP_UPDATE_ACK      '\04'
+#define PCP_UNCHANGED       '\05'
+#define PCP_CHANGED         '\06'
+
+/*
+ * Block delta (-U, see pcp_delta.h): a server that writes files itself
+ *  answers PCP_DELTA_PROBE with PCP_DELTA_ACK, and then answers a query
+ *  for a regular file it has in a different version with PCP_DIFFERENT.
+ *  Such a file may be sent as "B<mode> <size> <blksize> <name>\n" and
+ *  the signatures of its blocks. The server answers PCP_DELTA_NEED and
+ *  a bitmap of the blocks it did not find, lowest bit first, and the
+ *  client sends the data of those blocks in order and a NUL.
+ */
+#define PCP_DELTA_PROBE     "\01delta\n"
+#define PCP_DELTA_ACK       '\07'
+#define PCP_DIFFERENT       '\010'
+#define PCP_DELTA_NEED      '\011'
+
+/*
+ * Multiple streams (-n): a server that writes files itself answers
+ *  PCP_STREAMS_PROBE with PCP_STREAMS_ACK. A large file may then be
+ *  sent as "P<mode> <size> <name>\n". The server creates a temporary
+ *  file of that size next to it and answers PCP_STREAMS_FILE and its
+ *  path on a line, or an empty line if it can't. Ranges of the data
+ *  are sent over other connections to the host, which start with
+ *  PCP_RANGES_PROBE, answered with PCP_RANGES_ACK, and then only send
+ *  "W<offset> <len> <path>\n", the data and a NUL, each answered once
+ *  written. The rest follows the 'P' record in segments as for 'R', and
+ *  when "<size> 0\n" and a NUL arrive all ranges are there, and the
+ *  file is renamed into place.
+ */
+#define PCP_STREAMS_PROBE   "\01streams\n"
+#define PCP_STREAMS_ACK     '\016'
+#define PCP_STREAMS_FILE    '\017'
+#define PCP_RANGES_PROBE    "\01ranges\n"
+#define PCP_RANGES_ACK      '\022'
+
+/* suffix of the temporary files that files are written to, then renamed */
+#define PCP_TMP_SUFFIX      ".pdcp"
+
+/*
+ * Resuming: a server that writes files itself keeps what it got of a
+ *  file of PCP_DELTA_MIN bytes or more, sent in a 'C' record, as
+ *  <file>.pdcp-part when the connection is lost. A client that connects
+ *  again sends PCP_RESUME_PROBE, answered with PCP_RESUME_ACK, and may
+ *  then ask "O<mode> <size> <name>\n" before sending such a file. The
+ *  server answers PCP_RESUME_SIGS, the number of whole blocks of
+ *  pcp_delta_blocksize(size) bytes it holds on a line, and the delta
+ *  signatures of those blocks. If the first n blocks are those of the
+ *  file, it is sent as "A<mode> <size> <offset> <name>\n" with offset
+ *  n times the block size, the data from there on, and a NUL.
+ */
+#define PCP_RESUME_PROBE    "\01resume\n"
+#define PCP_RESUME_ACK      '\020'
+#define PCP_RESUME_SIGS     '\021'
+#define PCP_PART_SUFFIX     PCP_TMP_SUFFIX "-part"
+
 struct pcp_server {
 	int infd;
 	int outfd;
 	bool preserve;
 	bool target_is_dir;
 	char *outfile;
+	List received;      /* if non-NULL, -W: files and dirs written */
+	bool chain;         /* -H: never refuse data the chain still needs */
+	bool sync;          /* -s: sync files to disk before renaming them */
+	int fwdfd;          /* if >= 0, forward everything read to this fd */
+	bool pipelined;     /* set by pcp_server(): client does not wait */
+	bool delta;         /* set by pcp_server(): client sends deltas */
+	bool streams;       /* set by pcp_server(): client sends 'P' */
+	bool ranges;        /* set by pcp_server(): client only sends 'W' */
+	bool resume;        /* set by pcp_server(): client sends 'O', 'A' */
 };
 
 int pcp_server (struct pcp_server *s);
@@ -31,11 +31,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#if HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "src/common/err.h"
 #include "src/common/xmalloc.h"
 #include "src/common/xstring.h"
 #include "src/common/list.h"
+#include "src/common/xpoll.h"
 #include "opt.h"
 #include "mod.h"
 #include "rcmd.h"
@@ -59,6 +63,9 @@ struct rcmd_module {
     RcmdSigF            signal;
     RcmdF               rcmd;
     RcmdDestroyF        rcmd_destroy;
+    RcmdStartF          rcmd_start;
+    RcmdContinueF       rcmd_continue;
+    RcmdFinishF         rcmd_finish;
 };
 
 struct node_rcmd_info {
@@ -118,7 +125,24 @@ struct rcmd_module * rcmd_module_create (mod_t mod)
         goto fail;
     }
 
-    if (!(rmod->rcmd = (RcmdF) mod_get_rcmd(mod))) {
+    /*
+     * Non-blocking connect is optional, but must be complete if provided
+     */
+    rmod->rcmd_start = mod_get_rcmd_start (mod);
+    rmod->rcmd_continue = mod_get_rcmd_continue (mod);
+    rmod->rcmd_finish = mod_get_rcmd_finish (mod);
+
+    if (rmod->rcmd_start &&
+        (!rmod->rcmd_continue || !rmod->rcmd_finish)) {
+        err("Incomplete non-blocking rcmd interface in module \"%s\"\n",
+                mod_get_name(mod));
+        goto fail;
+    }
+
+    /*
+     * Blocking rcmd only required without non-blocking interface
+     */
+    if (!(rmod->rcmd = (RcmdF) mod_get_rcmd(mod)) && !rmod->rcmd_start) {
         err("Unable to resolve \"rcmd\" in module \"%s\"\n",
                 mod_get_name(mod));
         goto fail;
@@ -295,6 +319,12 @@ struct rcmd_info * rcmd_info_create (struct rcmd_module *rmod)
     r->arg = NULL;
     r->ruser = NULL;
 
+    memset (&r->nb, 0, sizeof (r->nb));
+    r->nb.fd[0] = r->nb.fd[1] = -1;
+    r->nb.timeout = -1;
+    timerclear (&r->nb_expire);
+    r->nb_want_err = false;
+
     return (r);
 }
 
@@ -335,19 +365,175 @@ struct rcmd_info * rcmd_create (char *host)
 }
 
 
+bool rcmd_nonblocking (struct rcmd_info *rcmd)
+{
+    return (rcmd->rmod->rcmd_start != NULL);
+}
+
+/*
+ *  Record absolute expiration time for any timeout requested by module.
+ */
+static int _rcmd_nb_update (struct rcmd_info *rcmd, int rv)
+{
+    timerclear (&rcmd->nb_expire);
+
+    if ((rv == RCMD_NB_WAIT) && (rcmd->nb.timeout >= 0)) {
+        struct timeval tv;
+
+        gettimeofday (&rcmd->nb_expire, NULL);
+        tv.tv_sec = rcmd->nb.timeout / 1000;
+        tv.tv_usec = (rcmd->nb.timeout % 1000) * 1000;
+        timeradd (&rcmd->nb_expire, &tv, &rcmd->nb_expire);
+    }
+
+    rcmd->nb.revents[0] = rcmd->nb.revents[1] = 0;
+
+    return (rv);
+}
+
+static int _rcmd_blocking_connect (struct rcmd_info *rcmd, char *ahost,
+                                   char *addr, char *locuser, char *remuser,
+                                   char *cmd, int nodeid, bool error_fd)
+{
+    rcmd->fd = (*rcmd->rmod->rcmd) (ahost, addr, locuser, remuser, cmd, nodeid,
+                                    error_fd ? &rcmd->efd : NULL, &rcmd->arg);
+    return (rcmd->fd);
+}
+
+int rcmd_connect_start (struct rcmd_info *rcmd, char *ahost, char *addr,
+                        char *locuser, char *remuser, char *cmd, int nodeid,
+                        bool error_fd)
+{
+    int rv;
+
+    /*
+     *  rcmd->ruser overrides default
+     */
+    if (rcmd->ruser)
+        remuser = rcmd->ruser;
+
+    /*
+     *  Compatibility: connect synchronously if no non-blocking support
+     */
+    if (!rcmd_nonblocking (rcmd)) {
+        if (_rcmd_blocking_connect (rcmd, ahost, addr, locuser, remuser,
+                                    cmd, nodeid, error_fd) < 0)
+            return (RCMD_NB_ERROR);
+        return (RCMD_NB_DONE);
+    }
+
+    rcmd->nb_want_err = error_fd;
+    rv = (*rcmd->rmod->rcmd_start) (ahost, addr, locuser, remuser, cmd,
+                                    nodeid, error_fd, &rcmd->nb);
+    return (_rcmd_nb_update (rcmd, rv));
+}
+
+int rcmd_connect_continue (struct rcmd_info *rcmd)
+{
+    assert (rcmd_nonblocking (rcmd));
+    return (_rcmd_nb_update (rcmd, (*rcmd->rmod->rcmd_continue) (&rcmd->nb)));
+}
+
+int rcmd_connect_finish (struct rcmd_info *rcmd)
+{
+    if (!rcmd_nonblocking (rcmd))
+        return (rcmd->fd);
+
+    rcmd->fd = (*rcmd->rmod->rcmd_finish) (&rcmd->nb,
+                                           rcmd->nb_want_err ? &rcmd->efd : NULL,
+                                           &rcmd->arg);
+    if (rcmd->fd < 0)
+        rcmd->efd = -1;
+
+    rcmd->nb.fd[0] = rcmd->nb.fd[1] = -1;
+    timerclear (&rcmd->nb_expire);
+
+    return (rcmd->fd);
+}
+
+bool rcmd_connect_timer_expired (struct rcmd_info *rcmd, struct timeval *now)
+{
+    if (!timerisset (&rcmd->nb_expire))
+        return (false);
+    return (!timercmp (now, &rcmd->nb_expire, <));
+}
+
+/*
+ *  Drive a non-blocking connect to completion with xpoll().
+ *   A connect timeout is signalled by SIGALRM from the dsh watchdog,
+ *   which interrupts xpoll().
+ */
+static int _rcmd_nb_connect (struct rcmd_info *rcmd, char *ahost)
+{
+    struct rcmd_nbconn *nb = &rcmd->nb;
+    int rv = RCMD_NB_WAIT;
+
+    while (rv == RCMD_NB_WAIT) {
+        struct xpollfd xpfds[2];
+        int idx[2];
+        int timeout = -1;
+        int i, n = 0;
+
+        memset (xpfds, 0, sizeof (xpfds));
+        for (i = 0; i < 2; i++) {
+            if (nb->fd[i] < 0)
+                continue;
+            xpfds[n].fd = nb->fd[i];
+            xpfds[n].events = nb->events[i];
+            idx[n++] = i;
+        }
+
+        /* xpoll() timeout is in seconds */
+        if (nb->timeout >= 0)
+            timeout = (nb->timeout + 999) / 1000;
+
+        if (n == 0) {
+            /*  Module is only waiting for a timer
+             */
+            if ((timeout < 0) || (sleep (timeout) != 0)) {
+                err ("%p: %S: connect: timed out\n", ahost);
+                break;
+            }
+        }
+        else if (xpoll (xpfds, n, timeout) < 0) {
+            if (errno == EINTR)
+                err ("%p: %S: connect: timed out\n", ahost);
+            else
+                err ("%p: %S: connect: xpoll: %m\n", ahost);
+            break;
+        }
+
+        for (i = 0; i < n; i++)
+            nb->revents[idx[i]] = xpfds[i].revents;
+
+        rv = rcmd_connect_continue (rcmd);
+    }
+
+    return (rcmd_connect_finish (rcmd));
+}
+
 int rcmd_connect (struct rcmd_info *rcmd, char *ahost, char *addr,
                   char *locuser, char *remuser, char *cmd, int nodeid,
                   bool error_fd)
 {
+    int rv;
+
     /*
      *  rcmd->ruser overrides default
      */
     if (rcmd->ruser)
         remuser = rcmd->ruser;
 
-    rcmd->fd = (*rcmd->rmod->rcmd) (ahost, addr, locuser, remuser, cmd, nodeid,
-                                    error_fd ? &rcmd->efd : NULL, &rcmd->arg);
-    return (rcmd->fd);
+    if (!rcmd_nonblocking (rcmd))
+        return (_rcmd_blocking_connect (rcmd, ahost, addr, locuser, remuser,
+                                        cmd, nodeid, error_fd));
+
+    rv = rcmd_connect_start (rcmd, ahost, addr, locuser, remuser, cmd,
+                             nodeid, error_fd);
+    if (rv == RCMD_NB_WAIT)
+        return (_rcmd_nb_connect (rcmd, ahost));
+
+    return (rcmd_connect_finish (rcmd));
 }
 
 int rcmd_destroy (struct rcmd_info *rcmd)
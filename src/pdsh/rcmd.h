@@ -27,7 +27,10 @@
 #ifndef _HAVE_RCMD_H
 #define _HAVE_RCMD_H
 
+#include <sys/time.h>
+
 #include "opt.h"
+#include "mod.h"
 
 struct rcmd_options {
 	bool resolve_hosts;
@@ -42,6 +45,10 @@ struct rcmd_info {
 	struct rcmd_options  *opts;
 	char                 *ruser;
 	void                 *arg;
+
+	struct rcmd_nbconn    nb;         /* non-blocking connect state     */
+	struct timeval        nb_expire;  /* when nb.timeout expires, or 0  */
+	bool                  nb_want_err;
 };
 
 
@@ -74,6 +81,12 @@ char * rcmd_get_default_module (void);
  */
 struct rcmd_info * rcmd_create (char *host);
 
+/*
+ *  Free an rcmd_info object which was never connected. Connected
+ *   objects are freed by rcmd_destroy().
+ */
+void rcmd_info_destroy (struct rcmd_info *rcmd);
+
 /*
  *  Connect using rcmd_info rcmd
  */
@@ -81,6 +94,35 @@ int rcmd_connect (struct rcmd_info *rcmd, char *host, char *addr,
                   char *locuser, char *remuser, char *cmd, int nodeid,
 		  bool err);
 
+/*
+ *  Returns true if the rcmd module for this connection implements
+ *   the non-blocking connect interface (rcmd_start/continue/finish).
+ */
+bool rcmd_nonblocking (struct rcmd_info *rcmd);
+
+/*
+ *  Non-blocking connect. rcmd_connect_start() and rcmd_connect_continue()
+ *   return RCMD_NB_DONE, RCMD_NB_WAIT or RCMD_NB_ERROR as described
+ *   in mod.h. While waiting, rcmd->nb describes the fds and events
+ *   to wait for; set rcmd->nb.revents before calling continue.
+ *   rcmd_connect_finish() must always be called and returns rcmd->fd
+ *   (-1 on failure or if the connection is abandoned before done).
+ *
+ *  For modules without non-blocking support, rcmd_connect_start()
+ *   performs a full blocking connect and never returns RCMD_NB_WAIT.
+ */
+int rcmd_connect_start (struct rcmd_info *rcmd, char *host, char *addr,
+                        char *locuser, char *remuser, char *cmd, int nodeid,
+                        bool err);
+int rcmd_connect_continue (struct rcmd_info *rcmd);
+int rcmd_connect_finish (struct rcmd_info *rcmd);
+
+/*
+ *  Returns true if the module timeout requested in rcmd->nb.timeout
+ *   has expired as of `now.'
+ */
+bool rcmd_connect_timer_expired (struct rcmd_info *rcmd, struct timeval *now);
+
 /*
  *  Destroy rcmd connections
  */
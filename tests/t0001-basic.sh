@@ -148,6 +148,31 @@ test_expect_success LONGTESTS '-u option is functional' '
             | grep -i "command timeout"
 '
 
+test_expect_success '-d reports connect and command times' '
+	pdsh -d -Rexec -w foo[1-20] -f 4 true 2>&1 | grep -v "^pdsh@.*load" >output &&
+	grep "^Connect time:" output &&
+	grep "^Command time:" output &&
+	grep "^Failures: *0" output
+'
+
+test_expect_success '-d reports output buffer reuse' '
+	pdsh -d -Rexec -w foo[1-20] -f 4 true 2>&1 | grep -v "^pdsh@.*load" >output &&
+	grep "^Buffers: *[1-8] created, *[1-9][0-9]* reused" output
+'
+
+test_expect_success 'output lines from many hosts are not interleaved' '
+	pdsh -Rexec -w foo[1-64] -f 64 -- \
+	    sh -c "i=0; while [ \$i -lt 100 ]; do echo line \$i; i=\$((i+1)); done" \
+	    >output &&
+	test $(wc -l <output) -eq 6400 &&
+	test $(grep -c "^foo[0-9]*: line [0-9]*$" output) -eq 6400
+'
+
+test_expect_success '-u timeout fires without watchdog polling delay' '
+	run_timeout 3 pdsh -wfoo,bar -Rexec -u 1 sleep 10 2>&1 \
+            | grep -ic "command timeout" | grep 2
+'
+
 check_pdsh_option() {
 	flag=$1; name=$2; value=$3;
 	flagval=$value
@@ -206,4 +231,25 @@ test_expect_success 'pdsh -N option works' '
     fi
 '
 
+test_expect_success '-B sets coalesce output' '
+	check_pdsh_option B "Coalesce output" Yes
+'
+test_expect_success '-B coalesces identical output' '
+	cat >expected <<-EOF &&
+	----------------
+	foo[1-3,5]
+	----------------
+	a
+	b
+	----------------
+	foo4
+	----------------
+	c
+	EOF
+	pdsh -B -Rexec -w foo[1-5] -- \
+	    sh -c "if [ %h = foo4 ]; then echo c; else echo a; echo b; fi" \
+	    >output &&
+	test_cmp expected output
+'
+
 test_done
@@ -83,6 +83,14 @@ setup_host_dirs() {
 	pdsh -w "$1" -Rexec mkdir %h
 }
 
+#  pcptest runs the server in host dir %h, link the other host dirs
+#   there for pdcp -W and -H relays
+setup_host_links() {
+	for h in host*; do
+	    for g in host*; do ln -s ../$g $h/$g; done
+	done
+}
+
 create_random_file() {
 	name=${1-testfile}
 	size=${2-1}
@@ -99,6 +107,83 @@ test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp basic functionality' '
 '
 rm -rf host* testfile
 
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp sends large file to many hosts' '
+	HOSTS="host[0-19]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* testfile" &&
+	create_random_file testfile 8192 &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -f 20 -w "$HOSTS" testfile testfile &&
+	pdsh -SRexec -w "$HOSTS" $GIT_TEST_CMP testfile %h/testfile
+'
+rm -rf host* testfile
+
+test_expect_success '-W sets tree width' '
+	check_pdcp_option W "Tree width" 4
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp replaces files by renaming' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* testfile" &&
+	create_random_file testfile 64 &&
+	echo old >host0/testfile &&
+	chmod 600 host0/testfile &&
+	ln host0/testfile host0/oldlink &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -s testfile testfile &&
+	pdsh -SRexec -w "$HOSTS" $GIT_TEST_CMP testfile %h/testfile &&
+	grep old host0/oldlink &&
+	ls -l host0/testfile | grep "^-rw------- " &&
+	! ls host*/*.pdcp* 2>/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -W relays copy through a tree' '
+	HOSTS="host[0-19]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* testfile" &&
+	setup_host_links &&
+	create_random_file testfile 1024 &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -W 3 -w "$HOSTS" testfile testfile &&
+	pdsh -SRexec -w "$HOSTS" $GIT_TEST_CMP testfile %h/testfile
+'
+rm -rf host* testfile
+
+test_expect_success '-H sets chain copy' '
+	check_pdcp_option H "Chain copy" Yes
+'
+pdcp -V 2>&1 | grep -q zlib && test_set_prereq ZLIB
+test_expect_success '-U sets update only' '
+	check_pdcp_option U "Update only" Yes
+'
+test_expect_success ZLIB '-G sets compression' '
+	check_pdcp_option G "Compression" Yes
+'
+test_expect_success '-n sets streams per host' '
+	check_pdcp_option n "Streams per host" 4
+'
+test_expect_success '-s sets sync files' '
+	check_pdcp_option s "Sync files" Yes
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -H forwards copy along a chain' '
+	HOSTS="host[0-19]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* testfile" &&
+	setup_host_links &&
+	create_random_file testfile 2048 &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -H -w "$HOSTS" testfile testfile &&
+	pdsh -SRexec -w "$HOSTS" $GIT_TEST_CMP testfile %h/testfile
+'
+rm -rf host* testfile
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -H chain continues past a failed host' '
+	HOSTS="host[0-4]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "chmod +w host2; rm -rf host* testfile err" &&
+	setup_host_links &&
+	chmod -w host2 &&
+	create_random_file testfile 64 &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -H -w "$HOSTS" testfile testfile 2>err
+	grep "testfile: Permission denied" err &&
+	pdsh -SRexec -w "host[0-1,3-4]" $GIT_TEST_CMP testfile %h/testfile
+'
+rm -rf host* testfile
+
 test_expect_success DYNAMIC_MODULES,NOTROOT 'rpdcp basic functionality' '
 	HOSTS="host[0-10]"
 	setup_host_dirs "$HOSTS"
@@ -136,6 +221,239 @@ test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -r works' '
 	pdsh -SRexec -w "$HOSTS" test -h tree/foo.link &&
 	pdsh -SRexec -w "$HOSTS" test ! -w dir/a/b/c/xw
 '
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -W relays only the files it received' '
+	HOSTS="host[0-5]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host*" &&
+	setup_host_links &&
+	mkdir -p host0/tree/dir host1/tree/bar &&
+	echo stale >host0/tree/stale &&
+	echo stale >host0/tree/dir/stale &&
+	echo stale >host1/tree/bar/stale &&
+	for opt in "" "-D"; do
+	    rm -rf host[2-5]/tree &&
+	    PDSH_MODULE_DIR=$T pdcp -Rpcptest -W 2 -w "$HOSTS" $opt \
+	        -r tree . &&
+	    pdsh -SRexec -w "host[2-5]" diff -r tree %h/tree >/dev/null &&
+	    test -f host0/tree/stale || return 1
+	done
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -r copies many small files' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* small" &&
+	mkdir small &&
+	for i in $(seq 1 300); do
+	    echo "file $i" >small/f$i || return 1
+	done &&
+	create_random_file small/big 3000 &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -r small . &&
+	pdsh -SRexec -w "$HOSTS" diff -r small %h/small >/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -r copies wide and deep trees' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* wide" &&
+	for i in $(seq 1 30); do
+	    mkdir -p wide/d$i/a/b wide/d$i/c &&
+	    echo "$i" >wide/d$i/f &&
+	    echo "$i a" >wide/d$i/a/f &&
+	    echo "$i b" >wide/d$i/a/b/f &&
+	    echo "$i c" >wide/d$i/c/f || return 1
+	done &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -r wide . &&
+	pdsh -SRexec -w "$HOSTS" diff -r wide %h/wide >/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -r reports errors and copies remaining files' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "chmod -R +w host*; rm -rf host* small err" &&
+	mkdir -p small/sub host1/small/sub &&
+	for i in $(seq 1 100); do
+	    echo "file $i" >small/f$i || return 1
+	done &&
+	echo "sub" >small/sub/file &&
+	chmod -w host1/small/sub &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -r small . 2>err
+	grep "host1: .*small/sub/file: Permission denied" err &&
+	test $(wc -l <err) -eq 1 &&
+	pdsh -SRexec -w "host[0,2-3]" diff -r small %h/small >/dev/null &&
+	rm -r small/sub &&
+	diff -r -x sub small host1/small
+'
+test_expect_success '-D sets archive mode' '
+	check_pdcp_option D "Archive mode" Yes
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -D keeps links and sparse files' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* arch" &&
+	mkdir -p arch/sub &&
+	echo data >arch/file &&
+	ln arch/file arch/sub/hard &&
+	ln -s ../file arch/sub/sym &&
+	ln -s nowhere arch/dangling &&
+	dd if=/dev/urandom of=arch/sparse bs=1024 count=4 seek=8192 \
+	    >/dev/null 2>&1 &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -D arch . &&
+	pdsh -SRexec -w "$HOSTS" diff -r -x dangling arch %h/arch >/dev/null &&
+	pdsh -SRexec -w "$HOSTS" test %h/arch/file -ef %h/arch/sub/hard &&
+	pdsh -SRexec -w "$HOSTS" test -h %h/arch/sub/sym &&
+	pdsh -SRexec -w "$HOSTS" test -h %h/arch/dangling &&
+	test "$(readlink host2/arch/dangling)" = nowhere &&
+	if test $(du -k arch/sparse | cut -f1) -lt 1024; then
+	    test $(du -k host1/arch/sparse | cut -f1) -lt 1024
+	fi
+'
+test_expect_success ZLIB,DYNAMIC_MODULES,NOTROOT 'pdcp -G sends compressed files' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* comp" &&
+	mkdir comp &&
+	for i in $(seq 1 5000); do
+	    echo "line $i of a file that compresses well" || return 1
+	done >comp/text &&
+	create_random_file comp/random 1024 &&
+	: >comp/empty &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -G -r comp . &&
+	pdsh -SRexec -w "$HOSTS" diff -r comp %h/comp >/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -U copies only changed files' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* upd" &&
+	mkdir upd &&
+	echo same >upd/same &&
+	echo old >upd/changed &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -U -r upd . &&
+	pdsh -SRexec -w "$HOSTS" diff -r upd %h/upd >/dev/null &&
+	echo SAME >host1/upd/same &&
+	touch -r upd/same host1/upd/same &&
+	echo newer >upd/changed &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -U -r upd . &&
+	grep SAME host1/upd/same &&
+	pdsh -SRexec -w "$HOSTS" diff upd/changed %h/upd/changed
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -U sends changed large files as deltas' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* big" &&
+	dd if=/dev/urandom of=big bs=65536 count=40 2>/dev/null &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -U big . &&
+	ln host0/big host0/biglink &&
+	tail -c +101 host1/big >host1/tmp && mv host1/tmp host1/big &&
+	head -c 1000000 host2/big >host2/tmp && mv host2/tmp host2/big &&
+	printf changed | dd of=big bs=1 seek=1500000 conv=notrunc 2>/dev/null &&
+	printf more >>big &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -U big . &&
+	pdsh -SRexec -w "$HOSTS" cmp big %h/big &&
+	test_must_fail cmp -s big host0/biglink
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -n sends large files over many connections' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* big" &&
+	dd if=/dev/urandom of=big bs=1048576 count=1 2>/dev/null &&
+	dd if=/dev/urandom of=big bs=1048576 count=1 seek=66 2>/dev/null &&
+	echo old >host1/big &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -n 4 big . &&
+	pdsh -SRexec -w "$HOSTS" cmp big %h/big &&
+	! ls host*/*.pdcp* 2>/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp -u interrupts stalled -n connections' '
+	HOSTS="host0"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* big stall.sh" &&
+	dd if=/dev/urandom of=big bs=1048576 count=1 2>/dev/null &&
+	dd if=/dev/urandom of=big bs=1048576 count=1 seek=66 2>/dev/null &&
+	cat >stall.sh <<-EOF &&
+	#!$SHELL_PATH
+	if mkdir main 2>/dev/null; then
+	    exec "$PWD/pdcp" "\$@"
+	fi
+	exec sleep 100
+	EOF
+	chmod +x stall.sh &&
+	start=$(date +%s) &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" \
+	    -e "$PWD/stall.sh" -u 2 -n 4 big . 2>/dev/null &&
+	test $(($(date +%s) - start)) -lt 30 &&
+	cmp big host0/big
+'
+test_expect_success 'pdcp server only writes ranges into its temporary files' '
+	test_when_finished "rm -rf tgt input" &&
+	mkdir tgt &&
+	echo secret >tgt/victim.pdcp &&
+	echo secret >tgt/target &&
+	ln -s target tgt/link.pdcpAAAAAA &&
+	echo old >tgt/file.pdcpAAAAAA &&
+	chmod 600 tgt/file.pdcpAAAAAA &&
+	printf "W0 3 tgt/file.pdcpAAAAAA\nnew\000" | pdcp -z tgt >/dev/null &&
+	grep "^old$" tgt/file.pdcpAAAAAA &&
+	printf "\001ranges\nW0 3 tgt/victim.pdcp\nnew\000" >input &&
+	printf "W0 3 tgt/link.pdcpAAAAAA\nnew\000" >>input &&
+	printf "W0 3 tgt/../tgt/file.pdcpAAAAAA\nnew\000" >>input &&
+	pdcp -z tgt <input >/dev/null &&
+	grep "^secret$" tgt/victim.pdcp &&
+	grep "^secret$" tgt/target &&
+	grep "^old$" tgt/file.pdcpAAAAAA &&
+	printf "\001ranges\nW0 3 tgt/file.pdcpAAAAAA\nnew\000" |
+	    pdcp -z tgt >/dev/null &&
+	grep "^new$" tgt/file.pdcpAAAAAA
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp resumes a copy after a lost connection' '
+	HOSTS="host[0-3]"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* big cut.sh output" &&
+	create_random_file big 40960 &&
+	cat >cut.sh <<-EOF &&
+	#!$SHELL_PATH
+	if test -f lost; then
+	    exec "$PWD/pdcp" "\$@"
+	fi
+	touch lost
+	dd bs=65536 count=256 2>/dev/null | "$PWD/pdcp" "\$@"
+	EOF
+	chmod +x cut.sh &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -e "$PWD/cut.sh" \
+	    big . 2>output &&
+	test $(grep -c "connection lost, retrying" output) -eq 4 &&
+	pdsh -SRexec -w "$HOSTS" cmp big %h/big &&
+	! ls host*/*.pdcp* 2>/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp resumes from what an earlier run left' '
+	HOSTS="host0"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* big small tee.sh input" &&
+	create_random_file big 40960 &&
+	echo small >small &&
+	dd if=big of=host0/big.pdcp-part bs=65536 count=256 2>/dev/null &&
+	echo stale >host0/small.pdcp-part &&
+	cat >tee.sh <<-EOF &&
+	#!$SHELL_PATH
+	tee -a "$PWD/input" | "$PWD/pdcp" "\$@"
+	EOF
+	chmod +x tee.sh &&
+	PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" -e "$PWD/tee.sh" \
+	    big small . &&
+	cmp big host0/big &&
+	cmp small host0/small &&
+	test $(wc -c <input) -lt $(wc -c <big) &&
+	! ls host0/*.pdcp* 2>/dev/null
+'
+test_expect_success DYNAMIC_MODULES,NOTROOT 'pdcp leaves no stale parts behind' '
+	HOSTS="host0"
+	setup_host_dirs "$HOSTS" &&
+	test_when_finished "rm -rf host* big" &&
+	create_random_file big 8192 &&
+	for opt in "-n 2" "-U"; do
+	    echo old >host0/big &&
+	    echo stale >host0/big.pdcp-part &&
+	    PDSH_MODULE_DIR=$T pdcp -Rpcptest -w "$HOSTS" $opt big . &&
+	    cmp big host0/big &&
+	    ! ls host0/*.pdcp* 2>/dev/null || return 1
+	done
+'
 test_expect_success DYNAMIC_MODULES,NOTROOT 'rpdcp -r works' '
 	HOSTS="host[0-10]"
 	setup_host_dirs "$HOSTS" &&
@@ -0,0 +1,59 @@
+#!/bin/sh
+
+test_description='pdsh event-driven execution engine
+
+Check that PDSH_ENGINE=event produces the same results as the
+default thread-per-host engine.'
+
+. ${srcdir:-.}/test-lib.sh
+
+if ! test_have_prereq MOD_RCMD_EXEC; then
+	skip_all='skipping event engine tests, exec module not available'
+	test_done
+fi
+
+test_expect_success 'PDSH_ENGINE=event is reported by -q' '
+	PDSH_ENGINE=event pdsh -w foo -q | grep "^Execution engine.*event"
+'
+test_expect_success 'invalid PDSH_ENGINE is rejected' '
+	test_must_fail env PDSH_ENGINE=bogus pdsh -Rexec -w foo true
+'
+test_expect_success 'event engine runs command' '
+	OUTPUT=$(PDSH_ENGINE=event pdsh -Rexec -w foo echo test_command) &&
+	test "$OUTPUT" = "foo: test_command"
+'
+test_expect_success 'event engine output matches thread engine' '
+	pdsh -Rexec -w host[0-99] -f 7 echo %h %n | sort >expected &&
+	PDSH_ENGINE=event pdsh -Rexec -w host[0-99] -f 7 echo %h %n \
+		| sort >output &&
+	test_cmp expected output
+'
+test_expect_success 'event engine handles stderr' '
+	PDSH_ENGINE=event pdsh -Rexec -w foo[1-3] sh -c "echo err >&2" \
+		2>&1 >/dev/null | sort >output &&
+	cat >expected <<-EOF &&
+	foo1: err
+	foo2: err
+	foo3: err
+	EOF
+	test_cmp expected output
+'
+test_expect_success 'event engine handles -N' '
+	OUTPUT=$(PDSH_ENGINE=event pdsh -N -Rexec -w foo echo test_command) &&
+	test "$OUTPUT" = "test_command"
+'
+test_expect_success 'event engine -S returns largest return code' '
+	PDSH_ENGINE=event pdsh -S -Rexec -w foo[0-9] sh -c "exit %n"
+	test $? -eq 9
+'
+test_expect_success 'event engine -k terminates on failure' '
+	test_must_fail env PDSH_ENGINE=event \
+		pdsh -k -f1 -Rexec -w foo[0-9] sh -c "exit %n" 2>err &&
+	grep "terminating all processes" err
+'
+test_expect_success 'event engine enforces command timeout' '
+	test_must_fail env PDSH_ENGINE=event \
+		pdsh -S -u 1 -Rexec -w foo sleep 10 2>err &&
+	grep "command timeout" err
+'
+test_done
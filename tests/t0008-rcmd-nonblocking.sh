@@ -0,0 +1,46 @@
+#!/bin/sh
+
+test_description='pdsh non-blocking rcmd connect interface
+
+Check rcmd modules which implement rcmd_start/continue/finish with
+both the thread and event execution engines, using the "nbtest"
+rcmd test module.'
+
+. ${srcdir:-.}/test-lib.sh
+
+export T="$TEST_DIRECTORY/test-modules/.libs"
+
+#  Test module "A" prints a message from its init routine
+nbpdsh() {
+	PDSH_MODULE_DIR=$T pdsh -Rnbtest "$@" | grep -v "^A: in init"
+}
+
+test_expect_success DYNAMIC_MODULES,NOTROOT 'Have nbtest rcmd module' '
+	PDSH_MODULE_DIR=$T pdsh -L | grep -q nbtest
+'
+for engine in thread event; do
+    test_expect_success DYNAMIC_MODULES,NOTROOT "$engine engine runs command" '
+	OUTPUT=$(PDSH_ENGINE=$engine nbpdsh -w foo echo test_command) &&
+	test "$OUTPUT" = "foo: test_command"
+    '
+    test_expect_success DYNAMIC_MODULES,NOTROOT "$engine engine many hosts" '
+	PDSH_ENGINE=$engine nbpdsh -w host[0-49] -f 7 echo %h | sort >output &&
+	for i in $(seq 0 49); do echo "host$i: host$i"; done | sort >expected &&
+	test_cmp expected output
+    '
+    test_expect_success DYNAMIC_MODULES,NOTROOT "$engine engine stderr" '
+	PDSH_ENGINE=$engine nbpdsh -w foo "echo err >&2" 2>&1 >/dev/null \
+		| grep "^foo: err"
+    '
+    test_expect_success DYNAMIC_MODULES,NOTROOT "$engine engine module timer" '
+	OUTPUT=$(PDSH_ENGINE=$engine nbpdsh -w timer[100-102] echo ok | sort) &&
+	test "$OUTPUT" = "$(printf "timer100: ok\ntimer101: ok\ntimer102: ok")"
+    '
+    test_expect_success DYNAMIC_MODULES,NOTROOT "$engine engine connect timeout" '
+	test_must_fail env PDSH_ENGINE=$engine PDSH_MODULE_DIR=$T \
+		pdsh -S -t 1 -Rnbtest -w slow10,foo echo ok >output 2>err &&
+	grep "slow10: connect: timed out" err &&
+	grep "^foo: ok" output
+    '
+done
+test_done
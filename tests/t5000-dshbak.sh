@@ -218,5 +218,26 @@ test_expect_success 'Issue 132: dshbak handles empty input' '
   touch empty.expected &&
   test_cmp empty.expected empty.output
 '
+test_expect_success 'dshbak -c coalesces interleaved output from many hosts' '
+  i=0
+  while [ $i -lt 200 ]; do
+      for h in 1 2 3 4 5 6 7 8 9 10; do
+          echo "foo$h: line $i"
+      done
+      echo "bar$((i % 2)): line $i"
+      i=$((i+1))
+  done >input &&
+  dshbak -c <input >output &&
+  test $(grep -c "^line" output) -eq 400 &&
+  grep "^foo\[1-10\]$" output &&
+  grep "^bar0$" output && grep "^bar1$" output
+'
+test_expect_success 'dshbak -d writes identical files for identical output' '
+  mkdir dir_output &&
+  dshbak -d dir_output <input &&
+  cmp dir_output/foo1 dir_output/foo10 &&
+  test $(wc -l <dir_output/foo10) -eq 200 &&
+  test $(wc -l <dir_output/bar0) -eq 100
+'
 
 test_done
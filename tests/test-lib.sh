@@ -820,7 +820,7 @@ elif test -n "$PDSH_TEST_INSTALLED" ; then
 	GIT_EXEC_PATH=${GIT_TEST_EXEC_PATH:-$GIT_EXEC_PATH}
 else # normal case, use ../bin-wrappers only unless $with_dashes:
 	pdsh_path=$PDSH_BUILD_DIR/src/pdsh
-	dshbak_path=$PDSH_SRC_DIR/scripts
+	dshbak_path=$PDSH_BUILD_DIR/src/dshbak
 	test -n "$dshbak_path" && PATH="$dshbak_path:$PATH"
 	test -n "$pdsh_path" && PATH="$pdsh_path:$PATH"
 fi
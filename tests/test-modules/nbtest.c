@@ -0,0 +1,255 @@
+/*****************************************************************************\
+ *  $Id$
+ *****************************************************************************
+ *  Copyright (C) 2007-2011 Lawrence Livermore National Security, LLC.
+ *  Copyright (C) 2001-2006 The Regents of the University of California.
+ *  Produced at Lawrence Livermore National Laboratory (cf, DISCLAIMER).
+ *  UCRL-CODE-2003-005.
+ *
+ *  This file is part of Pdsh, a parallel remote shell program.
+ *  For details, see <http://www.llnl.gov/linux/pdsh/>.
+ *
+ *  Pdsh is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 2 of the License, or (at your option)
+ *  any later version.
+ *
+ *  Pdsh is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ *  FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ *  details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with Pdsh; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA  02111-1307  USA.
+\*****************************************************************************/
+
+/*
+ *  This module uses the "pipecmd" interface to execute a local
+ *   process through the non-blocking rcmd connect interface. The
+ *   connection is complete once the process writes a handshake byte.
+ *   Used for testing rcmd_start/continue/finish.
+ *
+ *   Hosts named "slowN" delay the handshake by N seconds, and hosts
+ *   named "timerN" first wait on a module timer for N msecs.
+ */
+
+#if     HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "src/pdsh/opt.h"
+#include "src/pdsh/mod.h"
+#include "src/pdsh/rcmd.h"
+#include "src/common/pipecmd.h"
+#include "src/common/xpoll.h"
+#include "src/common/err.h"
+#include "src/common/xmalloc.h"
+#include "src/common/xstring.h"
+
+int pdsh_module_priority = DEFAULT_MODULE_PRIORITY;
+
+static int nbtest_init(opt_t *);
+static int nbtest_signal(int, void *arg, int);
+static int nbtest_destroy (pipecmd_t p);
+static int nbtest_start(char *, char *, char *, char *, char *, int, bool,
+                        struct rcmd_nbconn *);
+static int nbtest_continue(struct rcmd_nbconn *);
+static int nbtest_finish(struct rcmd_nbconn *, int *, void **);
+
+/*
+ *  Export generic pdsh module operations:
+ */
+struct pdsh_module_operations nbtest_module_ops = {
+    (ModInitF)       NULL,
+    (ModExitF)       NULL,
+    (ModReadWcollF)  NULL,
+    (ModPostOpF)     NULL
+};
+
+/*
+ *  Export rcmd module operations
+ */
+struct pdsh_rcmd_operations nbtest_rcmd_ops = {
+    (RcmdInitF)     nbtest_init,
+    (RcmdSigF)      nbtest_signal,
+    (RcmdF)         NULL,
+    (RcmdDestroyF)  nbtest_destroy,
+    (RcmdStartF)    nbtest_start,
+    (RcmdContinueF) nbtest_continue,
+    (RcmdFinishF)   nbtest_finish,
+};
+
+/*
+ * Export module options
+ */
+struct pdsh_module_option nbtest_module_options[] =
+ {
+   PDSH_OPT_TABLE_END
+ };
+
+/*
+ * Nbtest module info
+ */
+struct pdsh_module pdsh_module_info = {
+  "rcmd",
+  "nbtest",
+  "Mark Grondona <mgrondona@llnl.gov>",
+  "Non-blocking rcmd connect module used for testing",
+  DSH,
+  &nbtest_module_ops,
+  &nbtest_rcmd_ops,
+  &nbtest_module_options[0],
+};
+
+struct nbtest_conn {
+    char *       host;
+    char *       ruser;
+    char *       cmd;
+    int          rank;
+    pipecmd_t    p;
+    bool         done;
+};
+
+static int nbtest_init(opt_t * opt)
+{
+    /*
+     *  Do not resolve hostnames in pdsh when using nbtest
+     */
+    if (rcmd_opt_set (RCMD_OPT_RESOLVE_HOSTS, 0) < 0)
+        errx ("%p: nbtest_init: rcmd_opt_set: %m\n");
+
+    return 0;
+}
+
+static int nbtest_signal(int fd, void *arg, int signum)
+{
+    return (pipecmd_signal ((pipecmd_t) arg, signum));
+}
+
+static int nbtest_destroy (pipecmd_t p)
+{
+    int status;
+
+    if (pipecmd_wait (p, &status) < 0)
+        return (1);
+
+    pipecmd_destroy (p);
+
+    return (WEXITSTATUS (status));
+}
+
+/*
+ *  Run remote command after writing a handshake byte (after a delay
+ *   for "slow" hosts), and wait for the handshake.
+ */
+static int nbtest_exec (struct rcmd_nbconn *nb)
+{
+    struct nbtest_conn *c = nb->data;
+    const char *argv[3];
+    char *cmd = NULL;
+    char buf[64];
+
+    if (strncmp (c->host, "slow", 4) == 0) {
+        snprintf (buf, sizeof (buf), "sleep %d; ", atoi (c->host + 4));
+        xstrcat (&cmd, buf);
+    }
+    xstrcat (&cmd, "printf x; ");
+    xstrcat (&cmd, c->cmd);
+
+    argv[0] = "-c";
+    argv[1] = cmd;
+    argv[2] = NULL;
+
+    c->p = pipecmd ("/bin/sh", argv, c->host, c->ruser, c->rank);
+    Free ((void **) &cmd);
+    if (c->p == NULL)
+        return (RCMD_NB_ERROR);
+
+    nb->fd[0] = pipecmd_stdoutfd (c->p);
+    nb->events[0] = XPOLLREAD;
+    nb->fd[1] = -1;
+    nb->timeout = -1;
+    return (RCMD_NB_WAIT);
+}
+
+static int
+nbtest_start(char *ahost, char *addr, char *luser, char *ruser, char *cmd,
+             int rank, bool want_err, struct rcmd_nbconn *nb)
+{
+    struct nbtest_conn *c = Malloc (sizeof (*c));
+
+    memset (c, 0, sizeof (*c));
+    c->host = Strdup (ahost);
+    c->ruser = Strdup (ruser);
+    c->cmd = Strdup (cmd);
+    c->rank = rank;
+    nb->data = c;
+
+    if (strncmp (ahost, "timer", 5) == 0) {
+        nb->fd[0] = nb->fd[1] = -1;
+        nb->timeout = atoi (ahost + 5);
+        return (RCMD_NB_WAIT);
+    }
+
+    return (nbtest_exec (nb));
+}
+
+static int
+nbtest_continue(struct rcmd_nbconn *nb)
+{
+    struct nbtest_conn *c = nb->data;
+    char ch;
+
+    if (c->p == NULL)
+        return (nbtest_exec (nb));
+
+    if (!nb->revents[0])
+        return (RCMD_NB_WAIT);
+
+    if (read (pipecmd_stdoutfd (c->p), &ch, 1) != 1 || ch != 'x') {
+        err ("%p: %S: nbtest: bad handshake\n", c->host);
+        return (RCMD_NB_ERROR);
+    }
+
+    nb->fd[0] = -1;
+    c->done = true;
+    return (RCMD_NB_DONE);
+}
+
+static int
+nbtest_finish(struct rcmd_nbconn *nb, int *fd2p, void **arg)
+{
+    struct nbtest_conn *c = nb->data;
+    int fd = -1;
+
+    if (c->done) {
+        fd = pipecmd_stdoutfd (c->p);
+        if (fd2p)
+            *fd2p = pipecmd_stderrfd (c->p);
+        *arg = c->p;
+    }
+    else if (c->p) {
+        pipecmd_signal (c->p, SIGKILL);
+        nbtest_destroy (c->p);
+    }
+
+    Free ((void **) &c->host);
+    Free ((void **) &c->ruser);
+    Free ((void **) &c->cmd);
+    Free ((void **) &c);
+    nb->data = NULL;
+
+    return (fd);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */